@@ -13,18 +13,35 @@ baseline=0
 ncqprio=0
 cdlsingle=0
 cdlmulti=0
+cdlmix=0
 
+rw="randread"
+rwmixread=70
 bs="$(( 128 * 1024 ))"
 ramptime=60
 runtime=300
 perc=0
 dld=0
 dldsplit=""
+wperc=0
+wdld=0
+wdldsplit=""
+wcache=""
+fua=0
 outdir=""
 qds=(1 2 4 8 16 24 32)
 t2a="${scriptdir}/T2A.cdl"
 t2b="${scriptdir}/T2B.cdl"
 load_cdl_pages=0
+steadystate=0
+sswindow=10
+ssinterval=5
+sstol=5
+citol=5
+chunktime=30
+bgbs="$(( 1024 * 1024 ))"
+bgqd=32
+admit=5
 
 function usage()
 {
@@ -34,7 +51,11 @@ function usage()
 	echo "Options:"
 	echo "  -h | --help      : Print this help message"
 	echo "  --dev <file>     : Specify the target device"
-	echo "  --bs <size>      : Random read IO size (default: ${bs})"
+	echo "  --rw <type>      : I/O pattern: randread, randwrite or randrw"
+	echo "                     (default: ${rw}). WARNING: randwrite and randrw"
+	echo "                     destroy the data stored on the device."
+	echo "  --rwmixread <p>  : Percentage of reads for randrw (default: ${rwmixread})"
+	echo "  --bs <size>      : Random IO size (default: ${bs})"
 	echo "  --ramptime <sec> : Specify the ramp time (seconds) for each run"
 	echo "                     (default: ${ramptime})"
 	echo "  --runtime <sec>  : Specify the run time (seconds) for each run"
@@ -48,22 +69,58 @@ function usage()
 	echo "  --ncq-prio       : Use NCQ priority workload"
 	echo "  --cdl-single     : Run CDL workload with a single limit"
 	echo "  --cdl-multi      : Run CDL workload with multiple limits"
+	echo "  --cdl-mix        : Run CDL random reads mixed with a saturating"
+	echo "                     background sequential read stream, without and"
+	echo "                     with admission control of the background reads"
 
 	echo "  --percentage <p> : For ncq-prio and cdl-single runs, specify the"
 	echo "                     percentage of commands with a high-priority/limit"
-	echo "  --dld <index>    : For a cdl-single run, specify the descriptor index"
-	echo "                     to use"
+	echo "  --dld <index>    : For cdl-single and cdl-mix runs, specify the"
+	echo "                     descriptor index to use"
 	echo "  --dldsplit <str> : For a cdl-multi run, comma separated list of the"
 	echo "                     CDL descriptors to use with the percentage of I/Os"
 	echo "                     E.g. \"1/10,2/20\" for 10% of I/Os with CDL 1,"
 	echo "                     20% of I/Os with CDL 2 and the remaining I/Os"
 	echo "                     (70%) with no limit".
+	echo "  --wpercentage <p>: For cdl-single runs with writes, specify the"
+	echo "                     percentage of writes with a limit"
+	echo "                     (default: same as --percentage)"
+	echo "  --wdld <index>   : For cdl-single runs with writes, specify the write"
+	echo "                     descriptor index to use"
+	echo "  --wdldsplit <str>: For cdl-multi runs with writes, same as --dldsplit"
+	echo "                     for write descriptors"
+	echo "  --wcache <on|off>: Enable or disable the device write cache for the"
+	echo "                     runs (default: unchanged)"
+	echo "  --fua            : Use FUA writes"
 	echo "  --t2a <file>     : For cdl-single and cdl-multi runs, specify the"
 	echo "                     T2A CDL descriptor page to use."
 	echo "                     (default ${t2a})"
 	echo "  --t2b <file>     : For cdl-single and cdl-multi runs, specify the"
 	echo "                     T2B CDL descriptor page to use."
 	echo "                     (default ${t2b})"
+	echo "  --bg-bs <size>   : For cdl-mix runs, background read size"
+	echo "                     (default: ${bgbs})"
+	echo "  --bg-qd <n>      : For cdl-mix runs, maximum background queue depth"
+	echo "                     (default: ${bgqd})"
+	echo "  --admit <p>      : For cdl-mix runs, maximum descriptor miss rate"
+	echo "                     (percentage) of the admission control"
+	echo "                     (default: ${admit})"
+
+	echo "  --steady-state   : Ramp until steady state is reached and run until"
+	echo "                     the 99th percentile latency is known with enough"
+	echo "                     confidence. With this option, the ramp and run"
+	echo "                     times become upper bounds."
+	echo "  --ss-window <sec>: Steady state detection window (default: ${sswindow})"
+	echo "  --ss-interval <sec> : Steady state sampling interval"
+	echo "                     (default: ${ssinterval})"
+	echo "  --ss-tolerance <p> : Maximum IOPS and latency variation (percentage)"
+	echo "                     within the window to declare steady state"
+	echo "                     (default: ${sstol})"
+	echo "  --chunk <sec>    : Duration of the measured phase chunks"
+	echo "                     (default: ${chunktime})"
+	echo "  --ci-tolerance <p> : Target relative half-width (percentage) of the"
+	echo "                     95% confidence interval of the 99th percentile"
+	echo "                     latency of each priority (default: ${citol})"
 }
 
 # Parse command line
@@ -83,6 +140,24 @@ while [[ $# -gt 0 ]]; do
 		dev="$2"
 		shift
 		;;
+	--rw)
+		rw="$2"
+		if [ "${rw}" != "randread" ] &&
+		   [ "${rw}" != "randwrite" ] &&
+		   [ "${rw}" != "randrw" ]; then
+			echo "Invalid I/O pattern"
+			exit 1
+		fi
+		shift
+		;;
+	--rwmixread)
+		rwmixread="$2"
+		if [ ${rwmixread} -lt 0 ] || [ ${rwmixread} -gt 100 ]; then
+			echo "Invalid read percentage"
+			exit 1
+		fi
+		shift
+		;;
 	--bs)
 		bs="$2"
 		shift
@@ -118,6 +193,10 @@ while [[ $# -gt 0 ]]; do
 		cdlmulti=1
 		load_cdl_pages=1
 		;;
+	--cdl-mix)
+		cdlmix=1
+		load_cdl_pages=1
+		;;
 
 	--percentage)
 		perc="$2"
@@ -139,6 +218,37 @@ while [[ $# -gt 0 ]]; do
 		dldsplit="$2"
 		shift
 		;;
+	--wpercentage)
+		wperc="$2"
+		if [ ${wperc} -lt 1 ] || [ ${wperc} -gt 100 ]; then
+			echo "Invalid write percentage"
+			exit 1
+		fi
+		shift
+		;;
+	--wdld)
+		wdld="$2"
+		if [ ${wdld} -lt 1 ] || [ ${wdld} -gt 7 ]; then
+			echo "Invalid write limit index"
+			exit 1
+		fi
+		shift
+		;;
+	--wdldsplit)
+		wdldsplit="$2"
+		shift
+		;;
+	--wcache)
+		wcache="$2"
+		if [ "${wcache}" != "on" ] && [ "${wcache}" != "off" ]; then
+			echo "Invalid write cache setting"
+			exit 1
+		fi
+		shift
+		;;
+	--fua)
+		fua=1
+		;;
 	--t2a)
 		t2a="$2"
 		shift
@@ -147,6 +257,46 @@ while [[ $# -gt 0 ]]; do
 		t2b="$2"
 		shift
 		;;
+	--bg-bs)
+		bgbs="$2"
+		shift
+		;;
+	--bg-qd)
+		bgqd="$2"
+		shift
+		;;
+	--admit)
+		admit="$2"
+		if [ ${admit} -lt 1 ] || [ ${admit} -gt 99 ]; then
+			echo "Invalid miss rate percentage"
+			exit 1
+		fi
+		shift
+		;;
+
+	--steady-state)
+		steadystate=1
+		;;
+	--ss-window)
+		sswindow="$2"
+		shift
+		;;
+	--ss-interval)
+		ssinterval="$2"
+		shift
+		;;
+	--ss-tolerance)
+		sstol="$2"
+		shift
+		;;
+	--chunk)
+		chunktime="$2"
+		shift
+		;;
+	--ci-tolerance)
+		citol="$2"
+		shift
+		;;
 
 	-*)
 		echo "unknow option $1"
@@ -161,7 +311,7 @@ if [ "${dev}" == "" ]; then
 	exit 1
 fi
 
-runs=$(( baseline + ncqprio + cdlsingle + cdlmulti ))
+runs=$(( baseline + ncqprio + cdlsingle + cdlmulti + cdlmix ))
 if [ ${runs} -eq 0 ]; then
 	echo "Nothing to run"
 	exit 1
@@ -190,10 +340,19 @@ if [ ${cdlsingle} -eq 1 ]; then
 		exit 1
 	fi
 
-	if [ ${dld} -eq 0 ]; then
+	if [ ${dld} -eq 0 ] && [ "${rw}" != "randwrite" ]; then
 		echo "No CDL descriptor specified"
 		exit 1
 	fi
+
+	if [ ${wdld} -eq 0 ] && [ "${rw}" == "randwrite" ]; then
+		echo "No write CDL descriptor specified"
+		exit 1
+	fi
+
+	if [ ${wperc} -eq 0 ]; then
+		wperc=${perc}
+	fi
 fi
 
 if [ ${cdlmulti} -eq 1 ]; then
@@ -202,10 +361,33 @@ if [ ${cdlmulti} -eq 1 ]; then
 		exit 1
 	fi
 
-	if [ "${dldsplit}" == "" ]; then
+	if [ "${dldsplit}" == "" ] && [ "${rw}" != "randwrite" ]; then
 		echo "No CDL specified"
 		exit 1
 	fi
+
+	if [ "${wdldsplit}" == "" ] && [ "${rw}" != "randread" ]; then
+		echo "No write CDL specified"
+		exit 1
+	fi
+fi
+
+if [ ${cdlmix} -eq 1 ]; then
+	if [ "$(cdl_supported ${dev})" == "0" ]; then
+		echo "${dev} does not support CDL"
+		exit 1
+	fi
+
+	if [ ${dld} -eq 0 ]; then
+		echo "No CDL descriptor specified"
+		exit 1
+	fi
+
+	require_program cdlmix
+fi
+
+if [ "${rw}" != "randread" ]; then
+	echo "WARNING: ${rw} workloads overwrite the data stored on ${dev}"
 fi
 
 if [ "${outdir}" == "" ]; then
@@ -215,10 +397,45 @@ fi
 [ -d "${outdir}" ] && exit_failed "Output directory ${outdir} exists. Move it out of the way"
 mkdir -p "${outdir}" || exit_failed "Create output directory failed"
 
+if [ ${steadystate} -eq 1 ]; then
+	if [ ${ssinterval} -lt 1 ] || [ ${sswindow} -lt ${ssinterval} ]; then
+		echo "Invalid steady state window or interval"
+		exit 1
+	fi
+	if [ ${chunktime} -lt 1 ]; then
+		echo "Invalid chunk duration"
+		exit 1
+	fi
+	require_program bc
+fi
+
 echo "Run on ${dev}, ramp time: ${ramptime}s, run time: ${runtime}s"
+if [ "${rw}" == "randrw" ]; then
+	echo "  I/O pattern: ${rw}, ${rwmixread}% reads"
+else
+	echo "  I/O pattern: ${rw}"
+fi
+if [ ${fua} -eq 1 ]; then
+	echo "  Using FUA writes"
+fi
+if [ ${steadystate} -eq 1 ]; then
+	echo "  Steady state: window ${sswindow}s, interval ${ssinterval}s, tolerance ${sstol}%"
+	echo "  Measured chunks: ${chunktime}s, 99th percentile CI tolerance ${citol}%"
+fi
 echo "  Output directory: ${outdir}"
 echo ""
-cdladm info ${dev}
+cdladm info ${dev} | tee "${outdir}/device_info"
+
+orig_wcache=""
+if [ "${wcache}" != "" ]; then
+	orig_wcache="$(write_cache_get "${dev}")"
+	if [ "${wcache}" == "on" ]; then
+		write_cache_set "${dev}" "write back"
+	else
+		write_cache_set "${dev}" "write through"
+	fi
+	echo "Write cache: $(write_cache_get "${dev}")"
+fi
 
 if [ ${load_cdl_pages} -eq 1 ]; then
 	ncqprio_enable "${dev}" 0
@@ -263,5 +480,58 @@ if [ ${cdlmulti} == 1 ]; then
 	fiorun "cdlmulti"
 fi
 
+#
+# Run cdlmix and get the results line: foreground reads, iops, limit, errors,
+# avg, p50, p99, p99.9 and max latencies, background throughput, average and
+# minimum background budget.
+# $1: run directory
+# remaining arguments: cdlmix options
+#
+function mixrun()
+{
+	local rundir="$1"
+	shift
+
+	mkdir -p "${rundir}"
+	cdlmix --bs "${bs}" --dld "${dld}" --bg-bs "${bgbs}" \
+		--bg-qd "${bgqd}" --runtime "${runtime}" \
+		"$@" "${dev}" > "${rundir}/cdlmix.log" 2>&1 || \
+		exit_failed "cdlmix failed (see ${rundir}/cdlmix.log)"
+
+	grep -A1 "fg reads" "${rundir}/cdlmix.log" | tail -1 | \
+		awk '{printf "%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s",
+		      $1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12}'
+}
+
+if [ ${cdlmix} == 1 ]; then
+	echo "Running CDL workload, mixed with background reads"
+
+	ncqprio_enable "${dev}" 0
+	cdl_enable "${dev}" 1
+
+	summary="${outdir}/cdlmix/summary.csv"
+	mkdir -p "${outdir}/cdlmix"
+	echo "qd,admit_pct,reads,iops,limit,errors,avg_ms,p50_ms,p99_ms,p99.9_ms,max_ms,bg_mbps,avg_budget,min_budget" > "${summary}"
+
+	for qd in ${qds[*]}; do
+		res="$(mixrun "${outdir}/cdlmix/qd${qd}/noadmit" --qd "${qd}")"
+		echo "${qd},-,${res}" >> "${summary}"
+		echo "${res}" | awk -F',' -v qd="${qd}" \
+			'{ printf "  QD %s, no admission: %s limit, p99 %s ms, bg %s MB/s\n",
+				qd, $3, $7, $10 }'
+
+		res="$(mixrun "${outdir}/cdlmix/qd${qd}/admit" --qd "${qd}" \
+			--admit "${admit}")"
+		echo "${qd},${admit},${res}" >> "${summary}"
+		echo "${res}" | awk -F',' -v qd="${qd}" -v p="${admit}" \
+			'{ printf "  QD %s, admission %s%%: %s limit, p99 %s ms, bg %s MB/s, budget %s\n",
+				qd, p, $3, $7, $10, $11 }'
+	done
+fi
+
 cdl_enable "${dev}" 0
 ncqprio_enable "${dev}" 0
+
+if [ "${orig_wcache}" != "" ]; then
+	write_cache_set "${dev}" "${orig_wcache}"
+fi
@@ -0,0 +1,662 @@
+#!/bin/bash
+
+basedir="$(cd "$(dirname "$0")" && pwd)"
+scriptdir="${basedir}/scripts"
+
+. "${scriptdir}/bench_lib.sh"
+
+require_fio_cmdprio_hint
+
+# Defaults
+devs=()
+baseline=0
+ncqprio=0
+cdlsingle=0
+cdlmulti=0
+
+rw="randread"
+rwmixread=70
+bs="$(( 128 * 1024 ))"
+ramptime=60
+runtime=300
+perc=0
+dld=0
+dldsplit=""
+wperc=0
+wdld=0
+wdldsplit=""
+fua=0
+outdir=""
+qds=(1 2 4 8 16 24 32)
+t2a="${scriptdir}/T2A.cdl"
+t2b="${scriptdir}/T2B.cdl"
+load_cdl_pages=0
+cpu_busy=90
+
+declare -A devt2a
+declare -A devt2b
+
+function usage()
+{
+	local cmd="$(basename $0)"
+
+	echo "Usage: ${cmd} [Options]"
+	echo "Options:"
+	echo "  -h | --help      : Print this help message"
+	echo "  --dev <file>[,<t2a>,<t2b>]"
+	echo "                   : Add a target device, optionally with the T2A and"
+	echo "                     T2B CDL descriptor pages to use for the device."
+	echo "                     This option can be specified multiple times."
+	echo "  --rw <type>      : I/O pattern: randread, randwrite or randrw"
+	echo "                     (default: ${rw}). WARNING: randwrite and randrw"
+	echo "                     destroy the data stored on the devices."
+	echo "  --rwmixread <p>  : Percentage of reads for randrw (default: ${rwmixread})"
+	echo "  --bs <size>      : Random IO size (default: ${bs})"
+	echo "  --ramptime <sec> : Specify the ramp time (seconds) for each run"
+	echo "                     (default: ${ramptime})"
+	echo "  --runtime <sec>  : Specify the run time (seconds) for each run"
+	echo "                     (default: ${runtime})"
+	echo "  --qds <list>     : Specify the list of per device queue depths to use,"
+	echo "                     E.g. \"1 2 4 8 16 32\" (default: \"1 2 4 8 16 24 32\")"
+	echo "  --outdir <dir>   : Save the run results in <dir>. <dir> must not exist."
+	echo "                     (default: ${HOME}/multi_cdl_bench)"
+
+	echo "  --baseline       : Run baseline workload"
+	echo "  --ncq-prio       : Use NCQ priority workload"
+	echo "  --cdl-single     : Run CDL workload with a single limit"
+	echo "  --cdl-multi      : Run CDL workload with multiple limits"
+
+	echo "  --percentage <p> : For ncq-prio and cdl-single runs, specify the"
+	echo "                     percentage of commands with a high-priority/limit"
+	echo "  --dld <index>    : For a cdl-single run, specify the descriptor index"
+	echo "                     to use"
+	echo "  --dldsplit <str> : For a cdl-multi run, comma separated list of the"
+	echo "                     CDL descriptors to use with the percentage of I/Os"
+	echo "  --wpercentage <p>: For cdl-single runs with writes, specify the"
+	echo "                     percentage of writes with a limit"
+	echo "                     (default: same as --percentage)"
+	echo "  --wdld <index>   : For cdl-single runs with writes, specify the write"
+	echo "                     descriptor index to use"
+	echo "  --wdldsplit <str>: For cdl-multi runs with writes, same as --dldsplit"
+	echo "                     for write descriptors"
+	echo "  --fua            : Use FUA writes"
+	echo "  --t2a <file>     : Default T2A CDL descriptor page to use for devices"
+	echo "                     specified without pages (default ${t2a})"
+	echo "  --t2b <file>     : Default T2B CDL descriptor page to use for devices"
+	echo "                     specified without pages (default ${t2b})"
+	echo "  --cpu-busy <p>   : CPU load percentage above which a CPU is reported"
+	echo "                     as saturated (default: ${cpu_busy})"
+}
+
+# Parse command line
+if [ $# -le 1 ]; then
+	usage "$0"
+	exit 1
+fi
+
+while [[ $# -gt 0 ]]; do
+	case "$1" in
+	-h | --help)
+		usage "$0"
+		exit 0
+		;;
+
+	--dev)
+		d="$(echo "$2" | cut -d',' -f1)"
+		devs+=("${d}")
+		devt2a["${d}"]="$(echo "$2" | cut -s -d',' -f2)"
+		devt2b["${d}"]="$(echo "$2" | cut -s -d',' -f3)"
+		shift
+		;;
+	--rw)
+		rw="$2"
+		if [ "${rw}" != "randread" ] &&
+		   [ "${rw}" != "randwrite" ] &&
+		   [ "${rw}" != "randrw" ]; then
+			echo "Invalid I/O pattern"
+			exit 1
+		fi
+		shift
+		;;
+	--rwmixread)
+		rwmixread="$2"
+		shift
+		;;
+	--bs)
+		bs="$2"
+		shift
+		;;
+	--ramptime)
+		ramptime="$2"
+		shift
+		;;
+	--runtime)
+		runtime="$2"
+		shift
+		;;
+	--qds)
+		qds=($2)
+		shift
+		;;
+	--outdir)
+		outdir="$2"
+		shift
+		;;
+
+	--baseline)
+		baseline=1
+		;;
+	--ncq-prio)
+		ncqprio=1
+		;;
+	--cdl-single)
+		cdlsingle=1
+		load_cdl_pages=1
+		;;
+	--cdl-multi)
+		cdlmulti=1
+		load_cdl_pages=1
+		;;
+
+	--percentage)
+		perc="$2"
+		if [ ${perc} -lt 1 ] || [ ${perc} -gt 100 ]; then
+			echo "Invalid percentage"
+			exit 1
+		fi
+		shift
+		;;
+	--dld)
+		dld="$2"
+		if [ ${dld} -lt 1 ] || [ ${dld} -gt 7 ]; then
+			echo "Invalid limit index"
+			exit 1
+		fi
+		shift
+		;;
+	--dldsplit)
+		dldsplit="$2"
+		shift
+		;;
+	--wpercentage)
+		wperc="$2"
+		shift
+		;;
+	--wdld)
+		wdld="$2"
+		shift
+		;;
+	--wdldsplit)
+		wdldsplit="$2"
+		shift
+		;;
+	--fua)
+		fua=1
+		;;
+	--t2a)
+		t2a="$2"
+		shift
+		;;
+	--t2b)
+		t2b="$2"
+		shift
+		;;
+	--cpu-busy)
+		cpu_busy="$2"
+		shift
+		;;
+
+	-*)
+		echo "unknow option $1"
+		exit 1
+		;;
+	esac
+	shift
+done
+
+if [ ${#devs[@]} -eq 0 ]; then
+	echo "No device specified"
+	exit 1
+fi
+
+runs=$(( baseline + ncqprio + cdlsingle + cdlmulti ))
+if [ ${runs} -eq 0 ]; then
+	echo "Nothing to run"
+	exit 1
+fi
+
+for dev in ${devs[*]}; do
+	if [ ! -b "${dev}" ]; then
+		echo "${dev} is not a block device"
+		exit 1
+	fi
+
+	if [ ${ncqprio} -eq 1 ] &&
+	   [ "$(ncqprio_supported ${dev})" == "0" ]; then
+		echo "${dev} does not support NCQ priority"
+		exit 1
+	fi
+
+	if [ ${load_cdl_pages} -eq 1 ] &&
+	   [ "$(cdl_supported ${dev})" == "0" ]; then
+		echo "${dev} does not support CDL"
+		exit 1
+	fi
+
+	[ "${devt2a[${dev}]}" == "" ] && devt2a["${dev}"]="${t2a}"
+	[ "${devt2b[${dev}]}" == "" ] && devt2b["${dev}"]="${t2b}"
+done
+
+if [ ${ncqprio} -eq 1 ] || [ ${cdlsingle} -eq 1 ]; then
+	if [ ${perc} -eq 0 ]; then
+		echo "No percentage specified"
+		exit 1
+	fi
+fi
+
+if [ ${cdlsingle} -eq 1 ]; then
+	if [ ${dld} -eq 0 ] && [ "${rw}" != "randwrite" ]; then
+		echo "No CDL descriptor specified"
+		exit 1
+	fi
+	if [ ${wdld} -eq 0 ] && [ "${rw}" == "randwrite" ]; then
+		echo "No write CDL descriptor specified"
+		exit 1
+	fi
+	if [ ${wperc} -eq 0 ]; then
+		wperc=${perc}
+	fi
+fi
+
+if [ ${cdlmulti} -eq 1 ]; then
+	if [ "${dldsplit}" == "" ] && [ "${rw}" != "randwrite" ]; then
+		echo "No CDL specified"
+		exit 1
+	fi
+	if [ "${wdldsplit}" == "" ] && [ "${rw}" != "randread" ]; then
+		echo "No write CDL specified"
+		exit 1
+	fi
+fi
+
+if [ "${rw}" != "randread" ]; then
+	echo "WARNING: ${rw} workloads overwrite the data stored on the devices"
+fi
+
+if [ "${outdir}" == "" ]; then
+	outdir="${HOME}/multi_cdl_bench"
+fi
+[ -d "${outdir}" ] && exit_failed "Output directory ${outdir} exists. Move it out of the way"
+mkdir -p "${outdir}" || exit_failed "Create output directory failed"
+outdir="$(cd "${outdir}" && pwd)"
+
+function bdev_name()
+{
+	basename $(realpath "$1")
+}
+
+#
+# Get the name of the SCSI host of a device
+# $1: device file
+#
+function scsi_host()
+{
+	realpath /sys/block/$(bdev_name "$1")/device | \
+		grep -o "host[0-9]*" | tail -n 1
+}
+
+hosts=($(for dev in ${devs[*]}; do scsi_host "${dev}"; done | sort -u))
+
+#
+# Sample every second the host adapters and devices queue usage and the CPU
+# usage until killed.
+# $1: sample file
+#
+function host_sampler()
+{
+	local samplef="$1"
+	local bdev
+
+	while true; do
+		{
+			echo "T $(date +%s)"
+			for h in ${hosts[*]}; do
+				echo "H ${h}" \
+				     "$(cat /sys/class/scsi_host/${h}/host_busy 2> /dev/null || echo 0)" \
+				     "$(cat /sys/class/scsi_host/${h}/can_queue 2> /dev/null || echo 0)"
+			done
+			for dev in ${devs[*]}; do
+				bdev="$(bdev_name ${dev})"
+				echo "D ${bdev}" \
+				     "$(cat /sys/block/${bdev}/inflight)" \
+				     "$(cat /sys/block/${bdev}/device/queue_depth 2> /dev/null || echo 0)"
+			done
+			grep "^cpu[0-9]" /proc/stat
+		} >> "${samplef}"
+		sleep 1
+	done
+}
+
+#
+# Report the host side resources saturation from the samples.
+# $1: sample file
+#
+function host_report()
+{
+	local samplef="$1"
+
+	awk -v cpu_busy="${cpu_busy}" '
+		$1 == "T" {
+			nsamples++
+			if (nsamples > 1)
+				cpu_sample()
+			ncpus = 0
+			next
+		}
+		$1 == "H" {
+			h = $2
+			hosts[h] = 1
+			busy[h] += $3
+			if ($3 > maxbusy[h])
+				maxbusy[h] = $3
+			canq[h] = $4
+			if ($4 > 0 && $3 >= $4)
+				hfull[h]++
+			next
+		}
+		$1 == "D" {
+			d = $2
+			devs[d] = 1
+			qd[d] = $5
+			infl = $3 + $4
+			if (infl > maxinfl[d])
+				maxinfl[d] = infl
+			if ($5 > 0 && infl >= $5)
+				dfull[d]++
+			next
+		}
+		/^cpu[0-9]/ {
+			# user nice system idle iowait irq softirq steal
+			c = $1
+			tot = 0
+			for (i = 2; i <= 9; i++)
+				tot += $i
+			idle = $5 + $6
+			irq = $7 + $8
+			if (c in ptot) {
+				dt = tot - ptot[c]
+				if (dt > 0) {
+					load[c] = (dt - (idle - pidle[c])) * 100 / dt
+					irqload[c] = (irq - pirq[c]) * 100 / dt
+				}
+			}
+			ptot[c] = tot
+			pidle[c] = idle
+			pirq[c] = irq
+			cpus[c] = 1
+			next
+		}
+		function cpu_sample(	c, sum, n, sat) {
+			sum = 0
+			n = 0
+			sat = 0
+			for (c in load) {
+				sum += load[c]
+				n++
+				if (load[c] > maxload[c])
+					maxload[c] = load[c]
+				if (irqload[c] > maxirq[c])
+					maxirq[c] = irqload[c]
+				if (load[c] >= cpu_busy) {
+					cpusat[c]++
+					sat = 1
+				}
+			}
+			if (n) {
+				totload += sum / n
+				ncpusamples++
+			}
+			if (sat)
+				nsat++
+		}
+		END {
+			cpu_sample()
+			if (!nsamples) {
+				print "No host samples"
+				exit
+			}
+
+			bottleneck = 0
+			for (h in hosts) {
+				printf "Host %s: can_queue %d, busy avg %.1f, max %d, full %.1f%% of the time\n",
+					h, canq[h], busy[h] / nsamples, maxbusy[h],
+					hfull[h] * 100 / nsamples
+				if (hfull[h] * 100 / nsamples >= 10) {
+					printf "  -> Host adapter %s queue is a bottleneck\n", h
+					bottleneck = 1
+				}
+			}
+			for (d in devs)
+				printf "Device %s: queue_depth %d, in flight max %d, full %.1f%% of the time\n",
+					d, qd[d], maxinfl[d], dfull[d] * 100 / nsamples
+
+			if (ncpusamples)
+				printf "CPU: average load %.1f%%, CPU saturated %.1f%% of the time\n",
+					totload / ncpusamples, nsat * 100 / ncpusamples
+			for (c in cpusat) {
+				printf "  %s: saturated %.1f%% of the time, max load %.1f%%, max irq load %.1f%%\n",
+					c, cpusat[c] * 100 / ncpusamples, maxload[c], maxirq[c]
+			}
+			if (ncpusamples && nsat * 100 / ncpusamples >= 10) {
+				print "  -> CPU load is a bottleneck"
+				bottleneck = 1
+			}
+
+			if (!bottleneck)
+				print "No host side bottleneck detected"
+		}' "${samplef}"
+}
+
+#
+# Compute per device and aggregate IOPS and latency statistics.
+# $1: run name
+# $2: QD
+#
+function multi_stats()
+{
+	local run="$1"
+	local qd="$2"
+	local latlogs=()
+
+	for dev in ${devs[*]}; do
+		latlogs+=("${outdir}/$(bdev_name ${dev})/${run}/${qd}/${rw}.log_lat.log")
+	done
+
+	awk -v run="${run}" -v qd="${qd}" '
+		function pct(k, n, p,	target, c, b) {
+			target = int(n * p)
+			if (target < 1)
+				target = 1
+			c = 0
+			for (b = 0; b <= hmax[k]; b++) {
+				c += hist[k, b]
+				if (c >= target)
+					return b
+			}
+			return hmax[k]
+		}
+		function stat(k, ms) {
+			printf "%s,%d,%s,%.1f,%.2f,%d,%d\n", run, qd, k,
+				ms ? nio[k] * 1000 / ms : 0,
+				nio[k] ? lat[k] / nio[k] : 0,
+				pct(k, nio[k], 0.99), pct(k, nio[k], 0.999)
+		}
+		FNR == 1 {
+			n = split(FILENAME, path, "/")
+			d = path[n - 3]
+			devs[nd++] = d
+		}
+		{
+			l = $2 / 1000000
+			b = int(l)
+			for (i = 0; i < 2; i++) {
+				k = i ? "ALL" : d
+				nio[k]++
+				lat[k] += l
+				hist[k, b]++
+				if (b > hmax[k])
+					hmax[k] = b
+			}
+			if ($1 > tend[d])
+				tend[d] = $1
+		}
+		END {
+			maxt = 0
+			for (i = 0; i < nd; i++) {
+				stat(devs[i], tend[devs[i]])
+				if (tend[devs[i]] > maxt)
+					maxt = tend[devs[i]]
+			}
+			stat("ALL", maxt)
+		}' FS=", *" "${latlogs[@]}"
+}
+
+function multi_fiorun()
+{
+	local run="$1"
+	local rundir
+	local bdev
+
+	for dev in ${devs[*]}; do
+		bdev="$(bdev_name ${dev})"
+		mkdir -p "${outdir}/${bdev}/${run}"
+		if [ "${run}" == "cdlsingle" ] || [ "${run}" == "cdlmulti" ]; then
+			cdladm show "${dev}" > "${outdir}/${bdev}/${run}/cdl_descriptors"
+		fi
+	done
+
+	for qd in ${qds[*]}; do
+
+		rundir="${outdir}/${run}/${qd}"
+		mkdir -p "${rundir}"
+		cd "${rundir}"
+
+		echo "  QD=${qd}..."
+
+		# Global options
+		fioopts="--random_generator=tausworthe64"
+		fioopts+=" --continue_on_error=io"
+		fioopts+=" --ignore_error=62,62"
+		fioopts+=" --error_dump=1"
+		fioopts+=" --ioscheduler=none"
+		fioopts+=" --per_job_logs=0"
+		fioopts+=" --log_prio=1"
+		fioopts+=" --numjobs=1"
+		fioopts+=" --rw=${rw}"
+		if [ "${rw}" == "randrw" ]; then
+			fioopts+=" --rwmixread=${rwmixread}"
+		fi
+		if [ ${fua} -eq 1 ]; then
+			fioopts+=" --sync=dsync"
+		fi
+		fioopts+=" --bs=${bs}"
+		fioopts+=" --ioengine=libaio"
+		fioopts+=" --iodepth=${qd}"
+		fioopts+=" --direct=1"
+		if [ ${ramptime} -ne 0 ]; then
+			fioopts+=" --ramp_time=${ramptime}"
+		fi
+		fioopts+=" --runtime=${runtime}"
+		fioopts+="$(fio_cmdprio_opts ${run})"
+
+		# One job per device
+		for dev in ${devs[*]}; do
+			bdev="$(bdev_name ${dev})"
+			mkdir -p "${outdir}/${bdev}/${run}/${qd}"
+			fioopts+=" --name=${bdev}"
+			fioopts+=" --filename=${dev}"
+			fioopts+=" --write_lat_log=${outdir}/${bdev}/${run}/${qd}/${rw}.log"
+		done
+
+		rm -f host.samples
+		host_sampler host.samples &
+		sampler=$!
+
+		echo "fio ${fioopts}" > fio.log 2>&1
+		echo "" >> fio.log 2>&1
+		fio ${fioopts} >> fio.log 2>&1
+
+		kill ${sampler}
+		wait ${sampler} 2> /dev/null
+
+		for dev in ${devs[*]}; do
+			bdev="$(bdev_name ${dev})"
+			echo "read $(grep -c "${dev}: Timer expired: read" fio.log)" > \
+				"${outdir}/${bdev}/${run}/${qd}/aborts"
+			echo "write $(grep -c "${dev}: Timer expired: write" fio.log)" >> \
+				"${outdir}/${bdev}/${run}/${qd}/aborts"
+		done
+
+		host_report host.samples > host.report
+		multi_stats "${run}" "${qd}" >> "${outdir}/summary.csv"
+
+		grep -- "->" host.report | sed -e 's/^ */    /'
+	done
+
+	cd "${outdir}"
+}
+
+echo "run,qd,dev,iops,lat_avg_ms,lat_p99_ms,lat_p99.9_ms" > "${outdir}/summary.csv"
+
+echo "Run on ${devs[*]}, ramp time: ${ramptime}s, run time: ${runtime}s"
+echo "  Host adapters: ${hosts[*]}"
+echo "  Output directory: ${outdir}"
+echo ""
+
+for dev in ${devs[*]}; do
+	bdev="$(bdev_name ${dev})"
+	mkdir -p "${outdir}/${bdev}"
+	cdladm info ${dev} > "${outdir}/${bdev}/device_info"
+
+	if [ ${load_cdl_pages} -eq 1 ]; then
+		echo "${dev}:"
+		ncqprio_enable "${dev}" 0
+		set_cdl_pages "${dev}" "${devt2a[${dev}]}" "${devt2b[${dev}]}"
+	fi
+done
+
+echo ""
+
+function devs_setup()
+{
+	for dev in ${devs[*]}; do
+		cdl_enable "${dev}" $1
+		ncqprio_enable "${dev}" $2
+	done
+}
+
+if [ ${baseline} == 1 ]; then
+	echo "Running baseline workload"
+	devs_setup 0 0
+	multi_fiorun "baseline"
+fi
+
+if [ ${ncqprio} == 1 ]; then
+	echo "Running NCQ priority workload"
+	devs_setup 0 1
+	multi_fiorun "ncqprio"
+fi
+
+if [ ${cdlsingle} == 1 ]; then
+	echo "Running CDL workload, single limit"
+	devs_setup 1 0
+	multi_fiorun "cdlsingle"
+fi
+
+if [ ${cdlmulti} == 1 ]; then
+	echo "Running CDL workload, multiple limits"
+	devs_setup 1 0
+	multi_fiorun "cdlmulti"
+fi
+
+devs_setup 0 0
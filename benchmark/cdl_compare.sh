@@ -0,0 +1,162 @@
+#!/bin/bash
+
+basedir="$(cd "$(dirname "$0")" && pwd)"
+scriptdir="${basedir}/scripts"
+
+. "${scriptdir}/bench_lib.sh"
+
+# defaults
+percentiles="50,99,99.9"
+threshold=5
+nsamples=5000
+nresamples=200
+seed=1
+csv=""
+
+function usage()
+{
+	local cmd="$(basename $0)"
+
+	echo "Usage: ${cmd} [Options] <reference dir> <dir> [<dir> ...]"
+	echo "Options:"
+	echo "  -h | --help          : Print this help message"
+	echo "  --percentiles <list> : Comma separated list of the latency"
+	echo "                         percentiles to compare"
+	echo "                         (default: ${percentiles})"
+	echo "  --threshold <p>      : Minimum difference (percentage) of a"
+	echo "                         significant change to be reported as a"
+	echo "                         regression (default: ${threshold})"
+	echo "  --samples <n>        : Number of latency samples per workload,"
+	echo "                         QD and priority used for resampling"
+	echo "                         (default: ${nsamples})"
+	echo "  --resamples <n>      : Number of bootstrap resamples"
+	echo "                         (default: ${nresamples})"
+	echo "  --seed <n>           : Random number generator seed"
+	echo "                         (default: ${seed})"
+	echo "  --csv <file>         : Also save the results in csv format"
+	echo "Exit status:"
+	echo "  0: No regression, 1: Error, 2: Regression(s) detected"
+}
+
+# Parse command line
+if [ $# -lt 1 ]; then
+	usage "$0"
+	exit 1
+fi
+
+while [ "${1#-}" != "$1" ]; do
+	case "$1" in
+	-h | --help)
+		usage "$0"
+		exit 0
+		;;
+	--percentiles)
+		percentiles="$2"
+		shift
+		;;
+	--threshold)
+		threshold="$2"
+		shift
+		;;
+	--samples)
+		nsamples="$2"
+		shift
+		;;
+	--resamples)
+		nresamples="$2"
+		shift
+		;;
+	--seed)
+		seed="$2"
+		shift
+		;;
+	--csv)
+		csv="$2"
+		shift
+		;;
+
+	-*)
+		echo "unknow option $1"
+		exit 1
+		;;
+	esac
+	shift
+done
+
+if [ $# -lt 2 ]; then
+	usage "$0"
+	exit 1
+fi
+
+if [ ${nsamples} -lt 100 ] || [ ${nresamples} -lt 20 ]; then
+	echo "At least 100 samples and 20 resamples are needed"
+	exit 1
+fi
+
+dirs=""
+latlogs=()
+for d in "$@"; do
+	if [ ! -d "${d}" ]; then
+		echo "${d}: not a directory"
+		exit 1
+	fi
+
+	d="$(cd "${d}" && pwd)"
+	if [[ "|${dirs}|" == *"|${d}|"* ]]; then
+		echo "${d}: directory specified multiple times"
+		exit 1
+	fi
+	if [ "${dirs}" != "" ]; then
+		dirs+="|"
+	fi
+	dirs+="${d}"
+
+	n=${#latlogs[@]}
+	for run in baseline ncqprio cdlsingle cdlmulti; do
+		if [ ! -d "${d}/${run}" ]; then
+			continue
+		fi
+		for qd in $(ls "${d}/${run}" | grep -E '^[0-9]+$' | sort -n); do
+			f="$(qd_lat_log "${d}/${run}/${qd}")"
+			if [ "${f}" != "" ] && [ -s "${f}" ]; then
+				latlogs+=("${f}")
+			fi
+		done
+	done
+
+	if [ ${#latlogs[@]} -eq ${n} ]; then
+		echo "${d}: no fio latency log found"
+		exit 1
+	fi
+done
+
+tmpf="$(mktemp)"
+
+awk -v dirs="${dirs}" \
+	-v percentiles="${percentiles}" \
+	-v threshold="${threshold}" \
+	-v nsamples="${nsamples}" \
+	-v nresamples="${nresamples}" \
+	-v seed="${seed}" \
+	-v csv="${csv}" \
+	-f "${scriptdir}/cdl_compare.awk" "${latlogs[@]}" > "${tmpf}"
+if [ $? -ne 0 ]; then
+	rm -f "${tmpf}"
+	exit_failed "Processing latency logs failed"
+fi
+
+nreg=$(grep "^REGRESSIONS=" "${tmpf}" | cut -d'=' -f2)
+grep -v "^REGRESSIONS=" "${tmpf}"
+rm -f "${tmpf}"
+
+if [ "${nreg}" == "" ]; then
+	exit 1
+fi
+
+if [ ${nreg} -ne 0 ]; then
+	echo "${nreg} regression(s) detected"
+	exit 2
+fi
+
+echo "No regression detected"
+exit 0
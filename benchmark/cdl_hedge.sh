@@ -0,0 +1,191 @@
+#!/bin/bash
+
+basedir="$(cd "$(dirname "$0")" && pwd)"
+scriptdir="${basedir}/scripts"
+
+. "${scriptdir}/bench_lib.sh"
+
+require_program "cdladm"
+require_program "cdlhedge"
+
+# Defaults
+devs=()
+dld=1
+deadlines="0"
+bs="$(( 128 * 1024 ))"
+runtime=60
+qds=(1 2 4 8 16 32)
+seed=1
+outdir=""
+
+function usage()
+{
+	local cmd="$(basename $0)"
+
+	echo "Usage: ${cmd} [Options]"
+	echo "Options:"
+	echo "  -h | --help       : Print this help message"
+	echo "  --dev <file>      : Add a replica device. This option must be"
+	echo "                      specified at least twice."
+	echo "  --dld <index>     : Descriptor index of primary reads"
+	echo "                      (default: ${dld})"
+	echo "  --deadlines <list>: List of the soft deadlines (microseconds) to"
+	echo "                      evaluate, E.g. \"0 20000 50000\". 0 hedges"
+	echo "                      only reads failed by the descriptor policy."
+	echo "                      (default: \"${deadlines}\")"
+	echo "  --bs <size>       : Random read I/O size (default: ${bs})"
+	echo "  --runtime <sec>   : Run time (seconds) for each run"
+	echo "                      (default: ${runtime})"
+	echo "  --qds <list>      : Specify the list of queue depths to use,"
+	echo "                      E.g. \"1 2 4 8 16 32\" (default: \"${qds[*]}\")"
+	echo "  --seed <n>        : Random number generator seed (default: ${seed})"
+	echo "  --outdir <dir>    : Save the run results in <dir>. <dir> must not"
+	echo "                      exist. (default: ${HOME}/cdl_hedge)"
+}
+
+# Parse command line
+if [ $# -le 1 ]; then
+	usage "$0"
+	exit 1
+fi
+
+while [[ $# -gt 0 ]]; do
+	case "$1" in
+	-h | --help)
+		usage "$0"
+		exit 0
+		;;
+
+	--dev)
+		devs+=("$2")
+		shift
+		;;
+	--dld)
+		dld="$2"
+		if [ ${dld} -lt 1 ] || [ ${dld} -gt 7 ]; then
+			echo "Invalid limit index"
+			exit 1
+		fi
+		shift
+		;;
+	--deadlines)
+		deadlines="$2"
+		shift
+		;;
+	--bs)
+		bs="$2"
+		shift
+		;;
+	--runtime)
+		runtime="$2"
+		shift
+		;;
+	--qds)
+		qds=($2)
+		shift
+		;;
+	--seed)
+		seed="$2"
+		shift
+		;;
+	--outdir)
+		outdir="$2"
+		shift
+		;;
+
+	-*)
+		echo "unknow option $1"
+		exit 1
+		;;
+	esac
+	shift
+done
+
+if [ ${#devs[@]} -lt 2 ]; then
+	echo "At least 2 replica devices must be specified"
+	exit 1
+fi
+
+for dev in ${devs[*]}; do
+	if [ ! -b "${dev}" ]; then
+		echo "${dev} is not a block device"
+		exit 1
+	fi
+
+	if [ "$(cdl_supported ${dev})" == "0" ]; then
+		echo "${dev} does not support CDL"
+		exit 1
+	fi
+done
+
+if [ "${outdir}" == "" ]; then
+	outdir="${HOME}/cdl_hedge"
+fi
+[ -d "${outdir}" ] && exit_failed "Output directory ${outdir} exists. Move it out of the way"
+mkdir -p "${outdir}" || exit_failed "Create output directory failed"
+outdir="$(cd "${outdir}" && pwd)"
+
+#
+# Run cdlhedge and get the results line: reads, iops, hedges, limit,
+# deadline, hedge-wins, errors, avg, p50, p99, p99.9 and max latencies.
+# $1: run directory
+# remaining arguments: cdlhedge options
+#
+function hedge_run()
+{
+	local rundir="$1"
+	shift
+
+	mkdir -p "${rundir}"
+	cdlhedge --bs "${bs}" --runtime "${runtime}" --seed "${seed}" \
+		"$@" ${devs[*]} > "${rundir}/cdlhedge.log" 2>&1 || \
+		exit_failed "cdlhedge failed (see ${rundir}/cdlhedge.log)"
+
+	grep -A1 "hedge-wins" "${rundir}/cdlhedge.log" | tail -1 | \
+		awk '{printf "%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s,%s",
+		      $1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12}'
+}
+
+summary="${outdir}/summary.csv"
+echo "qd,deadline_us,reads,iops,hedges,limit_hedges,deadline_hedges,hedge_wins,errors,avg_ms,p50_ms,p99_ms,p99.9_ms,max_ms" > "${summary}"
+
+echo "Running hedged read workloads:"
+echo "  Replicas: ${devs[*]}"
+echo "  Primary read descriptor: ${dld}"
+echo "  Output directory: ${outdir}"
+
+for dev in ${devs[*]}; do
+	bdev="$(basename $(realpath ${dev}))"
+	cdladm info "${dev}" > "${outdir}/${bdev}_device_info"
+	cdladm show "${dev}" > "${outdir}/${bdev}_cdl_descriptors"
+	cdl_enable "${dev}" 1
+done
+
+for qd in ${qds[*]}; do
+	echo "QD ${qd}:"
+
+	res="$(hedge_run "${outdir}/qd${qd}/baseline" --qd "${qd}" --no-hedge)"
+	echo "${qd},-,${res}" >> "${summary}"
+	base_p99="$(echo "${res}" | cut -d',' -f10)"
+	base_p999="$(echo "${res}" | cut -d',' -f11)"
+	echo "  No hedging: p99 ${base_p99} ms, p99.9 ${base_p999} ms"
+
+	for dl in ${deadlines}; do
+		res="$(hedge_run "${outdir}/qd${qd}/deadline${dl}" \
+			--qd "${qd}" --dld "${dld}" --deadline "${dl}")"
+		echo "${qd},${dl},${res}" >> "${summary}"
+		echo "${res}" | awk -F',' -v dl="${dl}" \
+			-v bp99="${base_p99}" -v bp999="${base_p999}" \
+			'{ hr = $1 ? $3 * 100 / $1 : 0
+			   g99 = bp99 > 0 ? (bp99 - $10) * 100 / bp99 : 0
+			   g999 = bp999 > 0 ? (bp999 - $11) * 100 / bp999 : 0
+			   printf "  Deadline %s us: p99 %s ms (%+.1f%%), p99.9 %s ms (%+.1f%%), %.2f%% hedged\n",
+				dl, $10, -g99, $11, -g999, hr }'
+	done
+done
+
+for dev in ${devs[*]}; do
+	cdl_enable "${dev}" 0
+done
+
+echo "Results saved in ${summary}"
@@ -0,0 +1,438 @@
+#!/bin/bash
+
+basedir="$(cd "$(dirname "$0")" && pwd)"
+scriptdir="${basedir}/scripts"
+
+. "${scriptdir}/bench_lib.sh"
+
+require_fio_cmdprio_hint
+require_program "cdladm"
+require_program "blockdev"
+require_program "bc"
+
+# Defaults
+dev=""
+dlds=""
+perc=20
+rates=""
+trace=""
+bs="$(( 128 * 1024 ))"
+runtime=60
+maxqd=256
+max_miss=1
+seed=1
+outdir=""
+
+function usage()
+{
+	local cmd="$(basename $0)"
+
+	echo "Usage: ${cmd} [Options]"
+	echo "Options:"
+	echo "  -h | --help       : Print this help message"
+	echo "  --dev <file>      : Specify the target device"
+	echo "  --dlds <list>     : Specify the list of the descriptors to evaluate,"
+	echo "                      E.g. \"1 2 3\". Each descriptor is evaluated"
+	echo "                      with a separate sweep of the offered load."
+	echo "  --percentage <p>  : Percentage of I/Os using the descriptor"
+	echo "                      (default: ${perc})"
+	echo "  --rates <list>    : List of the offered loads (IOPS) to use,"
+	echo "                      E.g. \"50 100 150 200\""
+	echo "  --trace <file>    : Use the I/O arrival times (milliseconds, one"
+	echo "                      per line) of <file>, scaled to the offered"
+	echo "                      loads, instead of a Poisson arrival process"
+	echo "  --bs <size>       : Random read I/O size (default: ${bs})"
+	echo "  --runtime <sec>   : Run time (seconds) for each offered load"
+	echo "                      (default: ${runtime})"
+	echo "  --max-qd <qd>     : Maximum number of I/Os in flight"
+	echo "                      (default: ${maxqd})"
+	echo "  --max-miss <p>    : Maximum percentage of descriptor I/Os missing"
+	echo "                      their limit (default: ${max_miss})"
+	echo "  --seed <n>        : Random number generator seed (default: ${seed})"
+	echo "  --outdir <dir>    : Save the run results in <dir>. <dir> must not"
+	echo "                      exist. (default: ${HOME}/<dev name>_cdl_openloop)"
+}
+
+# Parse command line
+if [ $# -le 1 ]; then
+	usage "$0"
+	exit 1
+fi
+
+while [[ $# -gt 0 ]]; do
+	case "$1" in
+	-h | --help)
+		usage "$0"
+		exit 0
+		;;
+
+	--dev)
+		dev="$2"
+		shift
+		;;
+	--dlds)
+		dlds="$2"
+		shift
+		;;
+	--percentage)
+		perc="$2"
+		if [ ${perc} -lt 1 ] || [ ${perc} -gt 100 ]; then
+			echo "Invalid percentage"
+			exit 1
+		fi
+		shift
+		;;
+	--rates)
+		rates="$2"
+		shift
+		;;
+	--trace)
+		trace="$2"
+		shift
+		;;
+	--bs)
+		bs="$2"
+		shift
+		;;
+	--runtime)
+		runtime="$2"
+		shift
+		;;
+	--max-qd)
+		maxqd="$2"
+		shift
+		;;
+	--max-miss)
+		max_miss="$2"
+		shift
+		;;
+	--seed)
+		seed="$2"
+		shift
+		;;
+	--outdir)
+		outdir="$2"
+		shift
+		;;
+
+	-*)
+		echo "unknow option $1"
+		exit 1
+		;;
+	esac
+	shift
+done
+
+if [ "${dev}" == "" ]; then
+	echo "No device specified"
+	exit 1
+fi
+
+if [ "$(cdl_supported ${dev})" == "0" ]; then
+	echo "${dev} does not support CDL"
+	exit 1
+fi
+
+if [ "${dlds}" == "" ]; then
+	echo "No CDL descriptor specified"
+	exit 1
+fi
+for dld in ${dlds}; do
+	if [ ${dld} -lt 1 ] || [ ${dld} -gt 7 ]; then
+		echo "Invalid limit index ${dld}"
+		exit 1
+	fi
+done
+
+if [ "${rates}" == "" ]; then
+	echo "No offered load specified"
+	exit 1
+fi
+
+if [ "${trace}" != "" ] && [ ! -s "${trace}" ]; then
+	echo "Invalid trace file ${trace}"
+	exit 1
+fi
+
+if [ "${outdir}" == "" ]; then
+	bdev="$(basename $(realpath ${dev}))"
+	outdir="${HOME}/${bdev}_cdl_openloop"
+fi
+[ -d "${outdir}" ] && exit_failed "Output directory ${outdir} exists. Move it out of the way"
+mkdir -p "${outdir}" || exit_failed "Create output directory failed"
+
+#
+# Get the limit (milliseconds) of a read descriptor: the duration guideline
+# if set, or the sum of the max inactive and max active times.
+# $1: descriptor index
+#
+function dld_limit_ms()
+{
+	local dld="$1"
+
+	cdladm show "${dev}" | awk -v dld="${dld}" '
+		function ms(v, u) {
+			if (u == "ms")
+				return v
+			if (u == "us")
+				return v / 1000
+			return v / 1000000
+		}
+		/descriptors/ { inpage = ($0 ~ /read/) }
+		inpage && $1 == "Descriptor" { indesc = ($2 == dld ":") }
+		inpage && indesc && /max inactive time/ && $NF != "limit" {
+			inactive = ms($(NF - 1), $NF)
+		}
+		inpage && indesc && /max active time/ && $NF != "limit" {
+			active = ms($(NF - 1), $NF)
+		}
+		inpage && indesc && /duration guideline  / && $NF != "limit" {
+			guideline = ms($(NF - 1), $NF)
+		}
+		END {
+			if (guideline)
+				print guideline
+			else
+				print inactive + active
+		}'
+}
+
+#
+# Generate a fio version 3 I/O log with the arrival times of I/Os.
+# $1: offered load (IOPS)
+# $2: I/O log file
+#
+function gen_iolog()
+{
+	local rate="$1"
+	local iolog="$2"
+	local nblocks=$(( $(blockdev --getsize64 "${dev}") / bs ))
+
+	awk -v rate="${rate}" -v runtime="${runtime}" -v dev="${dev}" \
+	    -v bs="${bs}" -v nblocks="${nblocks}" -v seed="${seed}" \
+	    -v trace="${trace}" '
+		function io(t) {
+			printf "%d %s read %.0f %d\n", t, dev,
+				int(rand() * nblocks) * bs, bs
+		}
+		BEGIN {
+			srand(seed)
+			end = runtime * 1000
+
+			print "fio version 3 iolog"
+			printf "0 %s add\n", dev
+			printf "0 %s open\n", dev
+
+			if (trace == "") {
+				# Poisson arrivals
+				t = 0
+				while (1) {
+					t += -log(1 - rand()) * 1000 / rate
+					if (t >= end)
+						break
+					io(t)
+				}
+			} else {
+				# Trace arrivals, scaled to the offered load
+				# and replayed in a loop if too short
+				n = 0
+				while ((getline l < trace) > 0) {
+					if (l ~ /^[ \t]*[0-9.]+/)
+						ts[n++] = l + 0
+				}
+				if (n < 2 || ts[n - 1] <= ts[0])
+					exit 1
+				span = ts[n - 1] - ts[0]
+				scale = (n * 1000 / span) / rate
+				base = 0
+				while (1) {
+					for (i = 0; i < n; i++) {
+						t = base + (ts[i] - ts[0]) * scale
+						if (t >= end)
+							break
+						io(t)
+					}
+					if (t >= end)
+						break
+					base += (span * scale) + 1000 / rate
+				}
+			}
+
+			printf "%d %s close\n", end, dev
+		}' > "${iolog}"
+}
+
+#
+# Run an open loop workload.
+# $1: run directory
+# $2: descriptor index
+#
+function run_openloop()
+{
+	local rundir="$1"
+	local dld="$2"
+
+	cd "${rundir}"
+
+	fioopts="--name=openloop"
+	fioopts+=" --filename=${dev}"
+	fioopts+=" --read_iolog=iolog"
+	fioopts+=" --continue_on_error=io"
+	fioopts+=" --ignore_error=62,62"
+	fioopts+=" --error_dump=1"
+	fioopts+=" --group_reporting=1"
+	fioopts+=" --ioscheduler=none"
+	fioopts+=" --write_lat_log=randread.log"
+	fioopts+=" --log_offset=1"
+	fioopts+=" --per_job_logs=0"
+	fioopts+=" --log_prio=1"
+	fioopts+=" --numjobs=1"
+	fioopts+=" --ioengine=libaio"
+	fioopts+=" --iodepth=${maxqd}"
+	fioopts+=" --direct=1"
+	fioopts+=" --cmdprio_percentage=${perc}"
+	fioopts+=" --cmdprio_class=2"
+	fioopts+=" --cmdprio_hint=${dld}"
+
+	echo "fio ${fioopts}" > fio.log 2>&1
+	echo "" >> fio.log 2>&1
+	fio ${fioopts} >> fio.log 2>&1
+
+	cd - > /dev/null
+}
+
+#
+# Compute the I/O latencies from the scheduled arrival time of the I/Os,
+# joining the I/O log and fio latency log on the I/O offsets. The fio log
+# time stamp is the completion time (ms) and the difference with the
+# latency gives the submission time, so the arrival based latency is the
+# latency plus the delay between arrival and submission, if any.
+# Outputs: iops, number of descriptor I/Os, aborted, missed, miss
+# percentage, arrival latency p50, p99 and p99.9 of the descriptor I/Os
+# and p99 of the other I/Os (ms).
+# $1: run directory
+# $2: descriptor index
+# $3: descriptor limit (ms)
+#
+function openloop_stats()
+{
+	local rundir="$1"
+	local dld="$2"
+	local limit="$3"
+	local prio="$(printf "0x%04x" $(( (2 << 13) | (dld << 3) )))"
+	local naborts=$(grep -c ": Timer expired:" "${rundir}/fio.log")
+
+	awk -v prio="${prio}" -v limit="${limit}" -v naborts="${naborts}" '
+		function pct(h, n, p,	target, c, b) {
+			target = int(n * p)
+			if (target < 1)
+				target = 1
+			c = 0
+			for (b = 0; b <= hmax; b++) {
+				c += h[b]
+				if (c >= target)
+					return b / 10
+			}
+			return hmax / 10
+		}
+		FNR == NR {
+			if ($3 == "read")
+				arr[$4, ++narr[$4]] = $1
+			next
+		}
+		{
+			# time, lat, ddir, bs, offset, prio
+			off = $5
+			lat = $2 / 1000000
+			a = arr[off, ++nmatch[off]]
+			delay = ($1 - lat) - a
+			if (delay > 0)
+				lat += delay
+
+			b = int(lat * 10)
+			if (b > hmax)
+				hmax = b
+			if ($NF == prio) {
+				hd[b]++
+				nd++
+				if (lat > limit)
+					late++
+			} else {
+				ho[b]++
+				no++
+			}
+			if ($1 > tend)
+				tend = $1
+		}
+		END {
+			iops = tend ? (nd + no) * 1000 / tend : 0
+			total = nd + naborts
+			miss = total ? (late + naborts) * 100 / total : 0
+			printf "%.1f,%d,%d,%d,%.2f,%.1f,%.1f,%.1f,%.1f\n",
+				iops, nd, naborts, late, miss,
+				pct(hd, nd, 0.5), pct(hd, nd, 0.99),
+				pct(hd, nd, 0.999), pct(ho, no, 0.99)
+		}' FS=" " "${rundir}/iolog" FS=", *" "${rundir}/randread.log_lat.log"
+}
+
+summary="${outdir}/summary.csv"
+echo "dld,limit_ms,offered_iops,iops,nio,aborted,late,miss_pct,p50_ms,p99_ms,p99.9_ms,nolimit_p99_ms" > "${summary}"
+
+echo "Open loop evaluation of ${dev}, ${runtime}s per offered load"
+if [ "${trace}" == "" ]; then
+	echo "  Poisson arrivals, offered loads: ${rates} IOPS"
+else
+	echo "  Arrivals from ${trace}, offered loads: ${rates} IOPS"
+fi
+echo "  ${perc}% of I/Os with a limit, maximum miss: ${max_miss}%"
+echo "  Output directory: ${outdir}"
+echo ""
+
+cdladm info "${dev}" > "${outdir}/device_info"
+cdladm show "${dev}" > "${outdir}/cdl_descriptors"
+ncqprio_enable "${dev}" 0
+cdl_enable "${dev}" 1
+
+for dld in ${dlds}; do
+
+	limit=$(dld_limit_ms ${dld})
+	if [ "${limit}" == "0" ]; then
+		echo "Descriptor ${dld} has no limit, skipping"
+		continue
+	fi
+
+	echo "Descriptor ${dld}, limit ${limit} ms"
+
+	knee=""
+	for rate in ${rates}; do
+		rundir="${outdir}/dld${dld}/${rate}"
+		mkdir -p "${rundir}"
+
+		gen_iolog "${rate}" "${rundir}/iolog" || \
+			exit_failed "Generate I/O log failed"
+		run_openloop "${rundir}" "${dld}"
+
+		res="$(openloop_stats "${rundir}" "${dld}" "${limit}")"
+		echo "${dld},${limit},${rate},${res}" >> "${summary}"
+
+		iops=$(echo "${res}" | cut -d',' -f1)
+		miss=$(echo "${res}" | cut -d',' -f5)
+		p99=$(echo "${res}" | cut -d',' -f7)
+		echo "  ${rate} IOPS offered: ${iops} IOPS, p99 ${p99} ms, ${miss}% missed"
+
+		if [ "${knee}" == "" ] &&
+		   [ $(echo "${miss} > ${max_miss}" | bc) -eq 1 ]; then
+			knee="${rate}"
+		fi
+	done
+
+	if [ "${knee}" == "" ]; then
+		echo "  Limit met up to ${rate} IOPS"
+		echo "dld${dld}: limit met at all offered loads" >> "${outdir}/knee"
+	else
+		echo "  Limit missed from ${knee} IOPS"
+		echo "dld${dld}: limit missed from ${knee} IOPS" >> "${outdir}/knee"
+	fi
+done
+
+cdl_enable "${dev}" 0
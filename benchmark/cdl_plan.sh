@@ -0,0 +1,441 @@
+#!/bin/bash
+
+basedir="$(cd "$(dirname "$0")" && pwd)"
+scriptdir="${basedir}/scripts"
+
+. "${scriptdir}/bench_lib.sh"
+
+# Defaults
+tenants=""
+benchdirs=()
+qd=0
+limit="active"
+policy="0xf"
+outdir=""
+
+function usage()
+{
+	local cmd="$(basename $0)"
+
+	echo "Usage: ${cmd} [Options]"
+	echo "Options:"
+	echo "  -h | --help           : Print this help message"
+	echo "  --tenants <file>      : Specify the tenant requirements file"
+	echo "  --bench <dir>         : Specify a cdl_bench.sh output directory"
+	echo "                          with baseline results. Can be specified"
+	echo "                          twice to use separate read and write"
+	echo "                          baseline runs."
+	echo "  --qd <qd>             : Queue depth of the workload of all tenants"
+	echo "                          (default: the largest baseline queue depth)"
+	echo "  --limit <type>        : Specify the limit to plan: \"guideline\","
+	echo "                          \"active\" or \"inactive\" (default: ${limit})"
+	echo "  --policy <hex>        : Specify the policy of the limits"
+	echo "                          (default: ${policy})"
+	echo "  --outdir <dir>        : Save the plan in <dir>. <dir> must not"
+	echo "                          exist. (default: ${HOME}/<dev name>_cdl_plan)"
+	echo "Tenant requirements file lines:"
+	echo "  <name> <read|write> <p99 target (ms)> <I/O share (%)> <max aborts (%)>"
+}
+
+# Parse command line
+if [ $# -le 1 ]; then
+	usage "$0"
+	exit 1
+fi
+
+while [[ $# -gt 0 ]]; do
+	case "$1" in
+	-h | --help)
+		usage "$0"
+		exit 0
+		;;
+
+	--tenants)
+		tenants="$2"
+		shift
+		;;
+	--bench)
+		benchdirs+=("$2")
+		shift
+		;;
+	--qd)
+		qd="$2"
+		shift
+		;;
+	--limit)
+		limit="$2"
+		if [ "${limit}" != "guideline" ] &&
+		   [ "${limit}" != "active" ] &&
+		   [ "${limit}" != "inactive" ]; then
+			echo "Invalid limit type"
+			exit 1
+		fi
+		shift
+		;;
+	--policy)
+		policy="$2"
+		shift
+		;;
+	--outdir)
+		outdir="$2"
+		shift
+		;;
+
+	-*)
+		echo "unknow option $1"
+		exit 1
+		;;
+	esac
+	shift
+done
+
+if [ "${tenants}" == "" ] || [ ! -f "${tenants}" ]; then
+	echo "No tenant requirements file specified"
+	exit 1
+fi
+
+if [ ${#benchdirs[@]} -eq 0 ]; then
+	echo "No benchmark directory specified"
+	exit 1
+fi
+
+for d in "${benchdirs[@]}"; do
+	if [ ! -d "${d}/baseline" ]; then
+		echo "No baseline results in ${d}"
+		exit 1
+	fi
+done
+
+# Device information saved by cdl_bench.sh
+devinfo="${benchdirs[0]}/device_info"
+if [ ! -f "${devinfo}" ]; then
+	echo "No device information in ${benchdirs[0]}"
+	exit 1
+fi
+
+bdev="$(grep "^Device:" "${devinfo}" | head -n 1 | awk '{print $2}')"
+bdev="$(basename "${bdev}")"
+minlimit="$(grep "Duration minimum limit" "${devinfo}" | awk '{print $4}')"
+maxlimit="$(grep "Duration maximum limit" "${devinfo}" | awk '{print $4}')"
+[ "${minlimit}" == "" ] && minlimit=0
+[ "${maxlimit}" == "" ] || [ "${maxlimit}" == "none" ] && maxlimit=0
+
+# Queue depths measured in all baseline runs
+bqds=($(for d in "${benchdirs[@]}"; do
+		ls "${d}/baseline" | grep -E "^[0-9]+$"
+	done | sort -n | uniq -c | \
+	awk -v n=${#benchdirs[@]} '$1 == n {print $2}'))
+if [ ${#bqds[@]} -eq 0 ]; then
+	echo "No baseline queue depth common to all benchmark directories"
+	exit 1
+fi
+
+if [ ${qd} -eq 0 ]; then
+	qd=${bqds[${#bqds[@]} - 1]}
+fi
+
+if [ "${outdir}" == "" ]; then
+	outdir="${HOME}/${bdev}_cdl_plan"
+fi
+[ -d "${outdir}" ] && exit_failed "Output directory ${outdir} exists. Move it out of the way"
+mkdir -p "${outdir}" || exit_failed "Create output directory failed"
+
+planlog="${outdir}/plan.log"
+
+function log()
+{
+	echo "$1" | tee -a "${planlog}"
+}
+
+#
+# Get the smallest baseline queue depth not lower than a queue depth,
+# or the largest baseline queue depth.
+# $1: queue depth
+#
+function baseline_qd()
+{
+	local q
+
+	for q in ${bqds[*]}; do
+		if [ ${q} -ge $1 ]; then
+			echo "${q}"
+			return
+		fi
+	done
+
+	echo "${bqds[${#bqds[@]} - 1]}"
+}
+
+#
+# Get the sorted baseline latencies (microseconds) of a direction for a queue
+# depth, extracting them from the fio latency logs on first use.
+# $1: direction ("read" or "write")
+# $2: baseline queue depth
+#
+function baseline_lat()
+{
+	local dir="$1"
+	local q="$2"
+	local latf="${outdir}/baseline-${dir}-${q}.lat"
+	local ddir=0
+	local d
+
+	[ "${dir}" == "write" ] && ddir=1
+
+	if [ ! -f "${latf}" ]; then
+		for d in "${benchdirs[@]}"; do
+			latlog="$(qd_lat_log "${d}/baseline/${q}")"
+			[ "${latlog}" == "" ] && continue
+			awk -v ddir=${ddir} 'BEGIN {FS = ","};
+				$3 + 0 == ddir {printf "%d\n", $2 / 1000}' "${latlog}"
+		done | sort -n > "${latf}"
+	fi
+
+	echo "${latf}"
+}
+
+#
+# $1: sorted latency file
+# $2: percentile (0 to 100)
+#
+function lat_percentile()
+{
+	awk -v p="$2" '{all[NR] = $1}
+		END {
+			i = int(NR * p / 100)
+			if (i < 1) i = 1
+			if (i > NR) i = NR
+			printf "%d", all[i]
+		}' "$1"
+}
+
+#
+# Percentage of latencies exceeding a limit.
+# $1: sorted latency file
+# $2: limit in microseconds
+#
+function lat_above()
+{
+	awk -v l="$2" '$1 > l {n++} END {printf "%.3f", NR ? n * 100 / NR : 0}' "$1"
+}
+
+# Limits failing commands when exceeded bound the aborts
+case "${policy}" in
+0xd | 0xe | 0xf)
+	aborting=1;;
+*)
+	aborting=0;;
+esac
+
+# Parse and check the tenant requirements
+tlist="${outdir}/tenants.req"
+grep -v -E "^[[:space:]]*(#|$)" "${tenants}" > "${tlist}"
+awk '
+	NF != 5 || ($2 != "read" && $2 != "write") ||
+	$3 + 0 <= 0 || $4 + 0 <= 0 || $4 + 0 > 100 || $5 + 0 < 0 {
+		printf "Invalid tenant requirement line \"%s\"\n", $0
+		err = 1
+	}
+	{ share += $4 }
+	END {
+		if (share > 100) {
+			printf "Total I/O share of tenants exceeds 100%%\n"
+			err = 1
+		}
+		exit err
+	}' "${tlist}" || exit 1
+
+log "Planning ${bdev} descriptors for $(wc -l < "${tlist}") tenants"
+log "  Queue depth: ${qd}, baseline queue depths: ${bqds[*]}"
+log "  Limit: ${limit}, policy: ${policy}"
+log "  Output directory: ${outdir}"
+log ""
+
+#
+# For each tenant, the I/Os of the tenants with the same or a tighter target
+# compete with the tenant I/Os: the tenant latency is estimated with the
+# baseline run at the queue depth of these I/Os. The tightest limit that can
+# be used for the tenant is the baseline latency percentile exceeded by at most
+# the tenant tolerable abort rate, and the loosest is the tenant target.
+#
+infeasible=0
+reqf="${outdir}/tenants.range"
+rm -f "${reqf}"
+
+while read name dir target share aborts; do
+	tshare=$(awk -v t="${target}" '$3 + 0 <= t + 0 {s += $4} END {print s}' "${tlist}")
+	eqd=$(awk -v qd=${qd} -v s="${tshare}" \
+		'BEGIN {q = qd * s / 100; if (q > int(q)) q = int(q) + 1;
+			if (q < 1) q = 1; print q}')
+	bqd=$(baseline_qd ${eqd})
+	latf=$(baseline_lat "${dir}" ${bqd})
+	if [ ! -s "${latf}" ]; then
+		log "Tenant ${name}: no baseline ${dir} latencies"
+		infeasible=1
+		continue
+	fi
+
+	hi=$(awk -v t="${target}" 'BEGIN {printf "%d", t * 1000}')
+	p99=$(lat_percentile "${latf}" 99)
+	if [ ${aborting} -eq 1 ]; then
+		lo=$(lat_percentile "${latf}" \
+			$(awk -v a="${aborts}" 'BEGIN {print 100 - a}'))
+	else
+		lo=0
+	fi
+	[ ${lo} -lt $(( minlimit / 1000 )) ] && lo=$(( minlimit / 1000 ))
+	if [ ${maxlimit} -ne 0 ] && [ ${hi} -gt $(( maxlimit / 1000 )) ]; then
+		hi=$(( maxlimit / 1000 ))
+	fi
+
+	msg="Tenant ${name}: ${dir}, target ${target} ms, share ${share} %"
+	msg+=", QD ${eqd} (baseline QD ${bqd} p99 $(( p99 / 1000 )) ms)"
+	if [ ${lo} -gt ${hi} ]; then
+		if [ ${aborting} -eq 1 ]; then
+			msg+=" -> infeasible: $(( lo / 1000 )) ms needed for at most"
+			msg+=" ${aborts} % aborts"
+		else
+			msg+=" -> infeasible: device minimum limit is"
+			msg+=" $(( minlimit / 1000000 )) ms"
+		fi
+		log "${msg}"
+		infeasible=1
+		continue
+	fi
+
+	if [ ${aborting} -eq 0 ] && [ ${p99} -gt ${hi} ]; then
+		msg+=" -> WARNING: target relies on prioritization"
+	fi
+	log "${msg}"
+	log "  limit range: [${lo}..${hi}] us"
+
+	echo "${name} ${dir} ${lo} ${hi} ${share} ${bqd}" >> "${reqf}"
+
+done < "${tlist}"
+
+log ""
+
+if [ ${infeasible} -eq 1 ]; then
+	log "Requirements are infeasible on this drive"
+	exit 1
+fi
+
+#
+# Merge the tenants of each direction into the fewest descriptors: with the
+# tenants sorted by target, each descriptor uses the loosest limit satisfying
+# the first tenant not yet assigned, that is its target, and is shared with
+# all following tenants with a limit range including this limit.
+#
+mapf="${outdir}/tenants.map"
+echo "# <tenant> <direction> <page> <descriptor> <limit (us)>" > "${mapf}"
+
+#
+# $1: direction
+# $2: page name
+#
+function plan_page()
+{
+	local dir="$1"
+	local cdlp="$2"
+	local pagef="${outdir}/${cdlp}.cdl"
+	local descf="${outdir}/${cdlp}.desc"
+
+	awk -v dir="${dir}" '$2 == dir' "${reqf}" | sort -n -k4 | awk -v cdlp="${cdlp}" '
+		{
+			name[NR] = $1; lo[NR] = $3; hi[NR] = $4
+			share[NR] = $5; bqd[NR] = $6
+			done[NR] = 0
+		}
+		END {
+			d = 0
+			for (i = 1; i <= NR; i++) {
+				if (done[i])
+					continue
+				d++
+				l = hi[i]
+				s = 0; q = 0; t = ""
+				for (j = i; j <= NR; j++) {
+					if (done[j] || lo[j] > l)
+						continue
+					done[j] = 1
+					s += share[j]
+					if (bqd[j] > q) q = bqd[j]
+					t = t " " name[j]
+				}
+				printf "%d %d %s %d%s\n", d, l, s, q, t
+			}
+		}' > "${descf}"
+
+	ndesc=$(wc -l < "${descf}")
+	[ ${ndesc} -eq 0 ] && return 0
+
+	if [ ${ndesc} -gt 7 ]; then
+		log "${cdlp}: ${ndesc} ${dir} descriptors needed, 7 available"
+		return 1
+	fi
+
+	log "${cdlp} (${dir} descriptors):"
+	while read d l s q t; do
+		latf=$(baseline_lat "${dir}" ${q})
+		log "  Descriptor ${d}: limit ${l} us, share ${s} %, estimated aborts $(lat_above "${latf}" ${l}) %, tenants: ${t}"
+		for n in ${t}; do
+			echo "${n} ${dir} ${cdlp} ${d} ${l}" >> "${mapf}"
+		done
+	done < "${descf}"
+
+	gen_plan_page "${cdlp}" "${descf}" > "${pagef}"
+	log "  Page saved to ${pagef}"
+
+	return 0
+}
+
+#
+# Generate a page file with the planned descriptors. Limits are set in
+# microseconds (t2cdlunits 0x8) if they fit in 16-bits, and rounded down
+# to 10ms (t2cdlunits 0xa) otherwise.
+# $1: page name
+# $2: descriptors file
+#
+function gen_plan_page()
+{
+	awk -v cdlp="$1" -v limit="${limit}" -v policy="${policy}" '
+		{ lim[$1] = $2 }
+		END {
+			printf "# %s page planned by cdl_plan.sh\n\n", cdlp
+			printf "cdlp: %s\n\n", cdlp
+			if (cdlp == "T2A")
+				printf "perf-vs-duration-guideline: 0x0\n\n"
+			for (d = 1; d <= 7; d++) {
+				unit = "0x0"; val = 0
+				if (d in lim) {
+					if (lim[d] <= 65535) {
+						unit = "0x8"; val = lim[d]
+					} else {
+						unit = "0xa"; val = int(lim[d] / 10000)
+					}
+				}
+				printf "== descriptor: %d\n", d
+				printf "t2cdlunits: %s\n", unit
+				printf "max-inactive-time: %d\n", limit == "inactive" ? val : 0
+				printf "max-inactive-time-policy: %s\n", limit == "inactive" && val ? policy : "0x0"
+				printf "max-active-time: %d\n", limit == "active" ? val : 0
+				printf "max-active-time-policy: %s\n", limit == "active" && val ? policy : "0x0"
+				printf "duration-guideline: %d\n", limit == "guideline" ? val : 0
+				printf "duration-guideline-policy: %s\n", limit == "guideline" && val ? policy : "0x0"
+				printf "\n"
+			}
+		}' "$2"
+}
+
+# Reads use T2A and writes T2B, as with ATA devices
+plan_page "read" "T2A" || infeasible=1
+plan_page "write" "T2B" || infeasible=1
+
+log ""
+
+if [ ${infeasible} -eq 1 ]; then
+	log "Requirements are infeasible on this drive"
+	exit 1
+fi
+
+log "Tenant to descriptor mapping saved to ${mapf}"
@@ -85,7 +85,30 @@ function fio_iops()
 {
 	local fiolog="$1"
 
-	grep "  read: IOPS=" "${fiolog}" | cut -d'=' -f2 | cut -d',' -f1
+	# Steady state runs are made of several chunks: use the average.
+	# Workloads with reads and writes: use the sum of both directions.
+	grep -E "  (read|write): IOPS=" "${fiolog}" | \
+		awk '{
+			d = $1
+			v = $0
+			sub(/.*IOPS=/, "", v)
+			sub(/,.*/, "", v)
+			raw = v
+			x = v + 0
+			if (v ~ /k$/)
+				x *= 1000
+			sum += x
+			n[d]++
+		}
+		END {
+			if (NR == 1) {
+				print raw
+				exit
+			}
+			c = n["read:"] > n["write:"] ? n["read:"] : n["write:"]
+			if (c)
+				printf "%d\n", sum / c
+		}'
 }
 
 function cdl_limit()
@@ -222,7 +245,7 @@ function process_baseline()
 			--save-priolat \
 			--terse \
 			--head "${qd}" \
-			${qd}/randread.log_lat.log >> ${resf}
+			$(qd_lat_log ${qd}) >> ${resf}
 	done
 	echo ""
 
@@ -302,7 +325,7 @@ function process_cdl()
 			--save-priolat \
 			--terse \
 			--head "${qd}" \
-			${qd}/randread.log_lat.log >> ${tmpf}
+			$(qd_lat_log ${qd}) >> ${tmpf}
 
 		echo "${qd},ALL,0,0,$(fio_iops ${qd}/fio.log)" >> ${resf}
 	done
@@ -417,7 +440,7 @@ function process_ncq_prio()
 			--save-priolat \
 			--terse \
 			--head "${qd}" \
-			${qd}/randread.log_lat.log >> ${tmpf}
+			$(qd_lat_log ${qd}) >> ${tmpf}
 
 		echo "${qd},ALL,0,0,$(fio_iops ${qd}/fio.log)" >> ${resf}
 	done
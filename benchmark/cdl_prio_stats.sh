@@ -1,4 +1,4 @@
-#!/bin/sh
+#!/bin/bash
 
 basedir="$(cd "$(dirname "$0")" && pwd)"
 scriptdir="${basedir}/scripts"
@@ -11,6 +11,7 @@ cmd="$(basename $0)"
 terse=0
 tersehead=""
 savepriolat=0
+ddir=""
 
 function usage()
 {
@@ -28,6 +29,10 @@ function usage()
 	echo "                   with the same priority. The files are name"
 	echo "                   priolat.<class name>.<level>.<hint>.log, with class name"
 	echo "                   being NONE, RT, BE or IDLE"
+	echo "  --ddir <dir>   : Only process the I/Os of the direction <dir>"
+	echo "                   (read or write). With --save-priolat, the"
+	echo "                   direction is added to the file names as"
+	echo "                   priolat.<dir>.<class name>.<level>.<hint>.log"
 }
 
 # Pares the command line
@@ -48,6 +53,14 @@ while [ "${1#-}" != "$1" ]; do
 	--save-priolat)
 		savepriolat=1
 		;;
+	--ddir)
+		ddir="$2"
+		if [ "${ddir}" != "read" ] && [ "${ddir}" != "write" ]; then
+			echo "Invalid direction ${ddir}"
+			exit 1
+		fi
+		shift
+		;;
 	-*)
 		echo "unknow option $1"
 		exit 1
@@ -62,6 +75,23 @@ if [ $# != 1 ]; then
 fi
 
 fiolatlog="$1"
+latdir="$(cd "$(dirname "${fiolatlog}")" && pwd)"
+priolatname="priolat"
+
+# Extract the I/Os of the requested direction (fio ddir 0 is read, 1 write)
+ddirlatlog=""
+if [ "${ddir}" != "" ]; then
+	ddirlatlog="$(mktemp)"
+	awk -F', *' -v d=$([ "${ddir}" == "read" ] && echo 0 || echo 1) \
+		'$3 == d' "${fiolatlog}" > "${ddirlatlog}"
+	fiolatlog="${ddirlatlog}"
+	priolatname+=".${ddir}"
+	if [ ! -s "${fiolatlog}" ]; then
+		echo "No ${ddir} I/Os"
+		rm -f "${ddirlatlog}"
+		exit 0
+	fi
+fi
 
 percentiles=(0.01 0.05 \
 	0.10 0.20 0.30 0.40 0.50 0.60 0.70 0.80 0.90 \
@@ -164,10 +194,10 @@ for prio in ${prios[*]}; do
 		class=$(get_prio_class_name ${prio})
 		level=$(get_prio_level ${prio})
 		hint=$(get_prio_hint ${prio})
-		dir="$(cd "$(dirname "${fiolatlog}")" && pwd)"
-		mv "${priolat}" "${dir}/priolat.${class}.${level}.${hint}.log"
+		mv "${priolat}" "${latdir}/${priolatname}.${class}.${level}.${hint}.log"
 	else
 		rm -f "${priolat}"
 	fi
 done
 
+rm -f "${ddirlatlog}"
@@ -0,0 +1,144 @@
+#!/bin/bash
+
+basedir="$(cd "$(dirname "$0")" && pwd)"
+scriptdir="${basedir}/scripts"
+
+. "${scriptdir}/bench_lib.sh"
+
+# defaults
+output=""
+title=""
+
+function usage()
+{
+	local cmd="$(basename $0)"
+
+	echo "Usage: ${cmd} [Options] <data dir> [<data dir> ...]"
+	echo "Options:"
+	echo "  -h | --help       : Print this help message"
+	echo "  --output <file>   : Report file name. Valid only with a single"
+	echo "                      data directory."
+	echo "                      (default: <data dir>/report.html)"
+	echo "  --title <str>     : Report title (default: the data directory name)"
+}
+
+# Parse command line
+if [ $# -lt 1 ]; then
+	usage "$0"
+	exit 1
+fi
+
+while [ "${1#-}" != "$1" ]; do
+	case "$1" in
+	-h | --help)
+		usage "$0"
+		exit 0
+		;;
+	--output)
+		output="$2"
+		shift
+		;;
+	--title)
+		title="$2"
+		shift
+		;;
+
+	-*)
+		echo "unknow option $1"
+		exit 1
+		;;
+	esac
+	shift
+done
+
+if [ $# -lt 1 ]; then
+	usage "$0"
+	exit 1
+fi
+
+if [ "${output}" != "" ] && [ $# -gt 1 ]; then
+	echo "--output cannot be used with multiple data directories"
+	exit 1
+fi
+
+function html_escape()
+{
+	sed -e 's/&/\&amp;/g' -e 's/</\&lt;/g' -e 's/>/\&gt;/g'
+}
+
+function gen_report()
+{
+	local datadir="$1"
+	local report="$2"
+	local rtitle="$3"
+	local latlogs=()
+
+	for run in baseline ncqprio cdlsingle cdlmulti; do
+		if [ ! -d "${datadir}/${run}" ]; then
+			continue
+		fi
+		for qd in $(ls "${datadir}/${run}" | grep -E '^[0-9]+$' | sort -n); do
+			f="$(qd_lat_log "${datadir}/${run}/${qd}")"
+			if [ "${f}" != "" ] && [ -s "${f}" ]; then
+				latlogs+=("${f}")
+			fi
+		done
+	done
+
+	if [ ${#latlogs[@]} -eq 0 ]; then
+		echo "${datadir}: no fio latency log found"
+		return 1
+	fi
+
+	{
+		echo "<!DOCTYPE html>"
+		echo "<html><head><meta charset=\"utf-8\">"
+		echo "<title>${rtitle}</title>"
+		echo "<style>"
+		echo "body { font-family: sans-serif; margin: 2em; }"
+		echo "table { border-collapse: collapse; margin-bottom: 1em; }"
+		echo "th, td { border: 1px solid #ccc; padding: 2px 8px; text-align: right; }"
+		echo "pre { background: #f4f4f4; padding: 1em; }"
+		echo ".plots svg { margin: 0.5em; }"
+		echo "</style></head><body>"
+		echo "<h1>${rtitle}</h1>"
+
+		echo "<h2>Device</h2>"
+		if [ -f "${datadir}/device_info" ]; then
+			echo "<pre>"
+			html_escape < "${datadir}/device_info"
+			echo "</pre>"
+		else
+			echo "<p>No device information saved</p>"
+		fi
+
+		awk -v datadir="${datadir}" -f "${scriptdir}/cdl_report.awk" \
+			"${latlogs[@]}"
+
+		echo "</body></html>"
+	} > "${report}"
+}
+
+ret=0
+for d in "$@"; do
+	if [ ! -d "${d}" ]; then
+		echo "${d}: not a directory"
+		ret=1
+		continue
+	fi
+
+	datadir="$(cd "${d}" && pwd)"
+	report="${output}"
+	if [ "${report}" == "" ]; then
+		report="${datadir}/report.html"
+	fi
+	rtitle="${title}"
+	if [ "${rtitle}" == "" ]; then
+		rtitle="CDL Benchmark Report: $(basename "${datadir}")"
+	fi
+
+	echo "Generating ${report}"
+	gen_report "${datadir}" "${report}" "${rtitle}" || ret=1
+done
+
+exit ${ret}
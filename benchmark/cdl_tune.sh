@@ -0,0 +1,475 @@
+#!/bin/bash
+
+basedir="$(cd "$(dirname "$0")" && pwd)"
+scriptdir="${basedir}/scripts"
+
+. "${scriptdir}/bench_lib.sh"
+
+require_fio_cmdprio_hint
+require_program "cdladm"
+require_program "bc"
+
+# Defaults
+dev=""
+dld=0
+page=""
+limit="guideline"
+policy="0x0"
+target_p99=0
+max_aborts="0.1"
+max_iops_drop="5"
+perc=20
+qd=32
+bs="$(( 128 * 1024 ))"
+ramptime=10
+runtime=30
+max_trials=8
+lo=0
+hi=0
+outdir=""
+terse=1
+
+function usage()
+{
+	local cmd="$(basename $0)"
+
+	echo "Usage: ${cmd} [Options]"
+	echo "Options:"
+	echo "  -h | --help           : Print this help message"
+	echo "  --dev <file>          : Specify the target device"
+	echo "  --dld <index>         : Specify the index of the descriptor to tune"
+	echo "  --write               : Tune a write descriptor instead of a read"
+	echo "                          descriptor"
+	echo "  --limit <type>        : Specify the limit to tune: \"guideline\","
+	echo "                          \"active\" or \"inactive\" (default: ${limit})"
+	echo "  --policy <hex>        : Specify the policy of the tuned limit"
+	echo "                          (default: ${policy})"
+	echo "  --target-p99 <ms>     : Specify the 99th percentile latency target"
+	echo "                          (milliseconds) of the descriptor I/Os"
+	echo "  --max-aborts <p>      : Specify the maximum percentage of descriptor"
+	echo "                          I/Os that can be aborted (default: ${max_aborts})"
+	echo "  --max-iops-drop <p>   : Specify the maximum percentage of total IOPS"
+	echo "                          loss compared to the baseline"
+	echo "                          (default: ${max_iops_drop})"
+	echo "  --percentage <p>      : Percentage of I/Os using the descriptor"
+	echo "                          (default: ${perc})"
+	echo "  --qd <qd>             : Queue depth of the trial workload"
+	echo "                          (default: ${qd})"
+	echo "  --bs <size>           : I/O size (default: ${bs})"
+	echo "  --ramptime <sec>      : Ramp time (seconds) of each trial"
+	echo "                          (default: ${ramptime})"
+	echo "  --runtime <sec>       : Run time (seconds) of each trial"
+	echo "                          (default: ${runtime})"
+	echo "  --max-trials <n>      : Maximum number of limit trials"
+	echo "                          (default: ${max_trials})"
+	echo "  --range <lo> <hi>     : Limit search range in milliseconds"
+	echo "                          (default: device minimum limit to the target)"
+	echo "  --outdir <dir>        : Save the trial results in <dir>. <dir> must not"
+	echo "                          exist. (default: ${HOME}/<dev name>_cdl_tune)"
+}
+
+# Parse command line
+if [ $# -le 1 ]; then
+	usage "$0"
+	exit 1
+fi
+
+while [[ $# -gt 0 ]]; do
+	case "$1" in
+	-h | --help)
+		usage "$0"
+		exit 0
+		;;
+
+	--dev)
+		dev="$2"
+		shift
+		;;
+	--dld)
+		dld="$2"
+		if [ ${dld} -lt 1 ] || [ ${dld} -gt 7 ]; then
+			echo "Invalid limit index"
+			exit 1
+		fi
+		shift
+		;;
+	--write)
+		page="write"
+		;;
+	--limit)
+		limit="$2"
+		if [ "${limit}" != "guideline" ] &&
+		   [ "${limit}" != "active" ] &&
+		   [ "${limit}" != "inactive" ]; then
+			echo "Invalid limit type"
+			exit 1
+		fi
+		shift
+		;;
+	--policy)
+		policy="$2"
+		shift
+		;;
+	--target-p99)
+		target_p99="$2"
+		shift
+		;;
+	--max-aborts)
+		max_aborts="$2"
+		shift
+		;;
+	--max-iops-drop)
+		max_iops_drop="$2"
+		shift
+		;;
+	--percentage)
+		perc="$2"
+		if [ ${perc} -lt 1 ] || [ ${perc} -gt 100 ]; then
+			echo "Invalid percentage"
+			exit 1
+		fi
+		shift
+		;;
+	--qd)
+		qd="$2"
+		shift
+		;;
+	--bs)
+		bs="$2"
+		shift
+		;;
+	--ramptime)
+		ramptime="$2"
+		shift
+		;;
+	--runtime)
+		runtime="$2"
+		shift
+		;;
+	--max-trials)
+		max_trials="$2"
+		shift
+		;;
+	--range)
+		lo="$2"
+		hi="$3"
+		shift
+		shift
+		;;
+	--outdir)
+		outdir="$2"
+		shift
+		;;
+
+	-*)
+		echo "unknow option $1"
+		exit 1
+		;;
+	esac
+	shift
+done
+
+if [ "${dev}" == "" ]; then
+	echo "No device specified"
+	exit 1
+fi
+
+if [ "$(cdl_supported ${dev})" == "0" ]; then
+	echo "${dev} does not support CDL"
+	exit 1
+fi
+
+if [ ${dld} -eq 0 ]; then
+	echo "No CDL descriptor specified"
+	exit 1
+fi
+
+if [ ${target_p99} -eq 0 ]; then
+	echo "No latency target specified"
+	exit 1
+fi
+
+if [ "${page}" == "" ]; then
+	page="read"
+	rw="randread"
+else
+	rw="randwrite"
+fi
+
+# Get the name of the page used for the descriptor direction
+cdlp="$(cdladm show ${dev} | grep "descriptors" | grep "${page}" | \
+	cut -f2 -d' ' | cut -f1 -d':')"
+if [ "${cdlp}" != "T2A" ] && [ "${cdlp}" != "T2B" ]; then
+	echo "Could not determine the CDL page for ${page} commands"
+	exit 1
+fi
+
+# Limits are set with a 10ms unit: use the device minimum limit as the
+# search lower bound, and the target as the upper bound, unless specified.
+if [ ${lo} -eq 0 ]; then
+	minlimit="$(cdladm info ${dev} | grep "Duration minimum limit" | \
+		awk '{print $4}')"
+	lo=$(( (minlimit + 9999999) / 10000000 * 10 ))
+	[ ${lo} -lt 10 ] && lo=10
+fi
+if [ ${hi} -eq 0 ]; then
+	hi=${target_p99}
+fi
+if [ ${lo} -gt ${hi} ]; then
+	echo "Invalid limit search range [${lo}..${hi}] ms"
+	exit 1
+fi
+
+if [ "${outdir}" == "" ]; then
+	bdev="$(basename $(realpath ${dev}))"
+	outdir="${HOME}/${bdev}_cdl_tune"
+fi
+[ -d "${outdir}" ] && exit_failed "Output directory ${outdir} exists. Move it out of the way"
+mkdir -p "${outdir}" || exit_failed "Create output directory failed"
+
+tunelog="${outdir}/tune.log"
+
+function log()
+{
+	echo "$1" | tee -a "${tunelog}"
+}
+
+#
+# $1: page file template
+# $2: limit in milliseconds (multiple of 10)
+# $3: new page file
+#
+function gen_page()
+{
+	local tmpl="$1"
+	local ms="$2"
+	local pagef="$3"
+	local field
+
+	case "${limit}" in
+	guideline)
+		field="duration-guideline";;
+	active)
+		field="max-active-time";;
+	inactive)
+		field="max-inactive-time";;
+	esac
+
+	# The descriptor is switched to a 10ms unit: convert its other limits
+	awk -v dld="${dld}" -v field="${field}" \
+	    -v val="$(( ms / 10 ))" -v policy="${policy}" '
+		BEGIN {
+			unit_ns["0x6"] = 500
+			unit_ns["0x8"] = 1000
+			unit_ns["0xa"] = 10000000
+			unit_ns["0xe"] = 500000000
+		}
+		/^== descriptor:/ { indesc = ($3 == dld) }
+		indesc && $1 == "t2cdlunits:" {
+			ns = unit_ns[$2]
+			print "t2cdlunits: 0xa"
+			next
+		}
+		indesc && $1 == field ":" { print field ": " val; next }
+		indesc && $1 == field "-policy:" { print field "-policy: " policy; next }
+		indesc && ($1 == "max-inactive-time:" ||
+			   $1 == "max-active-time:" ||
+			   $1 == "duration-guideline:") {
+			t = $2 * ns
+			printf "%s %d\n", $1, int((t + 9999999) / 10000000)
+			next
+		}
+		{ print }' "${tmpl}" > "${pagef}"
+}
+
+#
+# Run a trial workload, with or without CDL.
+# $1: trial directory
+# $2: 1 to use the descriptor, 0 for a baseline run
+#
+function run_trial()
+{
+	local trialdir="$1"
+	local use_cdl="$2"
+
+	mkdir -p "${trialdir}"
+	cd "${trialdir}"
+
+	fioopts="--name=tune_qd${qd}"
+	fioopts+=" --filename=${dev}"
+	fioopts+=" --random_generator=tausworthe64"
+	fioopts+=" --continue_on_error=io"
+	fioopts+=" --ignore_error=62,62"
+	fioopts+=" --error_dump=1"
+	fioopts+=" --group_reporting=1"
+	fioopts+=" --ioscheduler=none"
+	fioopts+=" --write_lat_log=${rw}.log"
+	fioopts+=" --per_job_logs=0"
+	fioopts+=" --log_prio=1"
+	fioopts+=" --numjobs=1"
+	fioopts+=" --rw=${rw}"
+	fioopts+=" --bs=${bs}"
+	fioopts+=" --ioengine=libaio"
+	fioopts+=" --iodepth=${qd}"
+	fioopts+=" --direct=1"
+	if [ ${ramptime} -ne 0 ]; then
+		fioopts+=" --ramp_time=${ramptime}"
+	fi
+	fioopts+=" --runtime=${runtime}"
+
+	if [ ${use_cdl} -eq 1 ]; then
+		fioopts+=" --cmdprio_percentage=${perc}"
+		fioopts+=" --cmdprio_class=2"
+		fioopts+=" --cmdprio_hint=${dld}"
+	fi
+
+	if [ ${stats} -eq 1 ]; then
+		cdladm stats-show --page "${cdlp}" "${dev}" > stats.before 2>&1
+	fi
+
+	echo "fio ${fioopts}" > fio.log 2>&1
+	echo "" >> fio.log 2>&1
+	fio ${fioopts} >> fio.log 2>&1
+
+	if [ ${stats} -eq 1 ]; then
+		cdladm stats-show --page "${cdlp}" "${dev}" > stats.after 2>&1
+	fi
+
+	cd - > /dev/null
+}
+
+#
+# $1: trial directory
+#
+function trial_iops()
+{
+	local latlog="$1/${rw}.log_lat.log"
+	local nio=$(wc -l < "${latlog}")
+	local duration=$(get_runtime "${latlog}")
+
+	echo "scale=1; ${nio}*1000/${duration}" | bc
+}
+
+#
+# $1: trial directory
+#
+function trial_p99()
+{
+	local latlog="$1/${rw}.log_lat.log"
+	local prio="$(printf "0x%04x" $(( (2 << 13) | (dld << 3) )))"
+	local priolat
+
+	priolat=$(gen_priolat "${latlog}" "${prio}")
+	if [ $(wc -l < "${priolat}") -eq 0 ]; then
+		echo "0"
+	else
+		get_lat_percentile "${priolat}" "0.99"
+	fi
+	rm -f "${priolat}"
+}
+
+#
+# $1: trial directory
+#
+function trial_aborts()
+{
+	local latlog="$1/${rw}.log_lat.log"
+	local prio="$(printf "0x%04x" $(( (2 << 13) | (dld << 3) )))"
+	local naborts=$(grep -c ": Timer expired:" "$1/fio.log")
+	local nio=$(grep -c "${prio}" "${latlog}")
+
+	if [ $(( nio + naborts )) -eq 0 ]; then
+		echo "0"
+		return
+	fi
+
+	echo "scale=3; ${naborts}*100/(${nio} + ${naborts})" | bc
+}
+
+stats=0
+if [ "$(cdladm info ${dev} | grep -c "Statistics: supported")" != "0" ]; then
+	stats=1
+fi
+
+echo "Tuning ${dev} ${cdlp} descriptor ${dld} ${limit} limit"
+echo "  Target: p99 <= ${target_p99} ms, aborts <= ${max_aborts} %, IOPS drop <= ${max_iops_drop} %"
+echo "  Search range: [${lo}..${hi}] ms, ${max_trials} trials max"
+echo "  Output directory: ${outdir}"
+echo ""
+
+tmpl="${outdir}/${cdlp}-orig.cdl"
+cdladm save --page "${cdlp}" --file "${tmpl}" "${dev}" > /dev/null 2>&1 || \
+	exit_failed "Save ${cdlp} page failed"
+
+ncqprio_enable "${dev}" 0
+
+# Baseline run to get the reference IOPS
+log "Baseline trial (CDL disabled)"
+cdl_enable "${dev}" 0
+run_trial "${outdir}/baseline" 0
+base_iops=$(trial_iops "${outdir}/baseline")
+log "  IOPS=${base_iops}"
+
+cdl_enable "${dev}" 1
+
+#
+# Bisect the limit: a tighter limit lowers the descriptor I/Os latency
+# but increases aborts and the total IOPS loss. Search for the loosest
+# limit that still meets the latency target, which is the one with the
+# least impact on the other I/Os.
+#
+best=0
+trial=0
+while [ ${trial} -lt ${max_trials} ] && [ ${lo} -le ${hi} ]; do
+
+	trial=$(( trial + 1 ))
+	ms=$(( (lo + hi) / 20 * 10 ))
+	[ ${ms} -lt ${lo} ] && ms=${lo}
+
+	trialdir="${outdir}/trial-${trial}"
+	mkdir -p "${trialdir}"
+	gen_page "${tmpl}" "${ms}" "${trialdir}/${cdlp}.cdl"
+
+	cdladm upload --file "${trialdir}/${cdlp}.cdl" "${dev}" > \
+		"${trialdir}/upload.log" 2>&1 || \
+		exit_failed "Upload trial ${cdlp} page failed"
+
+	run_trial "${trialdir}" 1
+
+	p99=$(trial_p99 "${trialdir}")
+	aborts=$(trial_aborts "${trialdir}")
+	iops=$(trial_iops "${trialdir}")
+	drop=$(echo "scale=2; (${base_iops} - ${iops})*100/${base_iops}" | bc)
+
+	msg="Trial ${trial}: limit ${ms} ms, p99=${p99} ms, aborts=${aborts} %"
+	msg+=", IOPS=${iops} (${drop} % drop)"
+
+	if [ ${p99} -gt ${target_p99} ]; then
+		log "${msg} -> latency target missed"
+		hi=$(( ms - 10 ))
+	elif [ $(echo "${aborts} > ${max_aborts}" | bc) -eq 1 ] ||
+	     [ $(echo "${drop} > ${max_iops_drop}" | bc) -eq 1 ]; then
+		log "${msg} -> limit too tight"
+		lo=$(( ms + 10 ))
+	else
+		log "${msg} -> OK"
+		best=${ms}
+		cp "${trialdir}/${cdlp}.cdl" "${outdir}/${cdlp}-tuned.cdl"
+		lo=$(( ms + 10 ))
+	fi
+done
+
+cdl_enable "${dev}" 0
+
+# Restore the original page
+cdladm upload --file "${tmpl}" "${dev}" > /dev/null 2>&1 || \
+	echo "Restore original ${cdlp} page failed"
+
+echo ""
+if [ ${best} -eq 0 ]; then
+	log "No limit satisfying all constraints found in ${trial} trials"
+	exit 1
+fi
+
+log "Best limit: ${best} ms"
+log "Tuned page saved to ${outdir}/${cdlp}-tuned.cdl"
@@ -106,6 +106,36 @@ function cdl_enable()
 	sync
 }
 
+function write_cache_get()
+{
+	local dev="$1"
+	local bdev="$(basename $(realpath ${dev}))"
+
+	cat /sys/block/${bdev}/device/scsi_disk/*/cache_type
+}
+
+function write_cache_set()
+{
+	local dev="$1"
+	local cache_type="$2"
+	local bdev="$(basename $(realpath ${dev}))"
+
+	echo "${cache_type}" > /sys/block/${bdev}/device/scsi_disk/*/cache_type || \
+		exit_failed "Set write cache to \"${cache_type}\" failed"
+	sync
+}
+
+#
+# Get the fio lat log file of a run directory
+# $1: run directory
+#
+function qd_lat_log()
+{
+	local d="$1"
+
+	ls "${d}"/rand*.log_lat.log 2> /dev/null | head -n 1
+}
+
 #
 # $1: fio lat log file
 #
@@ -332,6 +362,287 @@ function gen_fio_bssplit()
 	echo "${bssplit}"
 }
 
+#
+# Student t distribution 97.5% quantiles, for 95% confidence intervals.
+# $1: degrees of freedom
+#
+function t_quantile()
+{
+	local t=(0 12.71 4.30 3.18 2.78 2.57 2.45 2.36 2.31 2.26 2.23 \
+		 2.20 2.18 2.16 2.14 2.13 2.12 2.11 2.10 2.09 2.09 \
+		 2.08 2.07 2.07 2.06 2.06 2.06 2.05 2.05 2.05 2.04)
+
+	if [ $1 -le 30 ]; then
+		echo "${t[$1]}"
+	else
+		echo "1.96"
+	fi
+}
+
+#
+# Get the IOPS and the average completion latency (usec) of a run
+# from the fio terse output.
+# $1: fio terse output file
+#
+function fio_terse_iops_clat()
+{
+	awk -F';' '/^3;/ {printf "%d %d\n", $8 + $49, ($16 * $8 + $57 * $49) / ($8 + $49 + 0.0001)}' "$1"
+}
+
+#
+# Check if the last samples of a list of values are within a tolerance
+# of their mean.
+# $1: number of samples in the window
+# $2: tolerance (percentage)
+# $3...: values
+#
+function is_steady()
+{
+	local w="$1"
+	local tol="$2"
+
+	shift 2
+	if [ $# -lt ${w} ]; then
+		echo "0"
+		return
+	fi
+
+	echo "${@: -${w}}" | awk -v tol="${tol}" '{
+		min = $1; max = $1; sum = 0
+		for (i = 1; i <= NF; i++) {
+			if ($i < min) min = $i
+			if ($i > max) max = $i
+			sum += $i
+		}
+		mean = sum / NF
+		if (mean == 0 || (max - min) * 100 / mean <= tol)
+			print "1"
+		else
+			print "0"
+	}'
+}
+
+#
+# Ramp the workload up until the IOPS and average latency measured over a
+# rolling window are stable, or until the maximum ramp time is reached.
+# $1: fio options
+#
+function fio_ramp_steadystate()
+{
+	local fioopts="$1"
+	local nwin=$(( (sswindow + ssinterval - 1) / ssinterval ))
+	local t=0
+	local iops=()
+	local clat=()
+	local steady=0
+	local v
+
+	while [ ${t} -lt ${ramptime} ]; do
+		fio ${fioopts} --runtime=${ssinterval} --time_based \
+			--output-format=terse --terse-version=3 > ramp.terse 2>&1
+		t=$(( t + ssinterval ))
+
+		v=($(fio_terse_iops_clat ramp.terse))
+		iops+=(${v[0]})
+		clat+=(${v[1]})
+
+		if [ "$(is_steady ${nwin} ${sstol} ${iops[*]})" == "1" ] &&
+		   [ "$(is_steady ${nwin} ${sstol} ${clat[*]})" == "1" ]; then
+			steady=1
+			break
+		fi
+	done
+
+	rm -f ramp.terse
+
+	echo "ramp_time=${t}" >> confidence
+	echo "ramp_steady=${steady}" >> confidence
+	echo "ramp_iops=${iops[*]}" >> confidence
+	echo "ramp_clat_usec=${clat[*]}" >> confidence
+}
+
+#
+# Get the per priority 99th percentile latency (msec) of a fio lat log.
+# $1: fio lat log
+#
+function lat_log_p99()
+{
+	awk -F', ' '{printf "%s %d\n", $NF, $2 / 1000000}' "$1" | \
+		sort -k1,1 -k2,2n | \
+		awk 'function p99() {
+			if (n) printf "%s %d\n", prio, lat[int(n * 0.99) + 1]
+		}
+		$1 != prio { p99(); prio = $1; n = 0 }
+		{ lat[++n] = $2 }
+		END { p99() }'
+}
+
+#
+# Compute the 95% confidence interval of the per priority 99th percentile
+# latency using the per chunk 99th percentiles as batch means. Outputs one
+# line per priority with the mean, the half width and the relative half
+# width (percentage) of the interval.
+# $1: file with one "<chunk> <prio> <p99>" line per chunk and priority
+#
+function p99_confidence()
+{
+	local nchunks=$(awk '{print $1}' "$1" | sort -u | wc -l)
+	local t=$(t_quantile $(( nchunks - 1 )))
+
+	awk -v t="${t}" '{
+		n[$2]++; sum[$2] += $3; sq[$2] += $3 * $3
+	}
+	END {
+		for (p in n) {
+			m = sum[p] / n[p]
+			if (n[p] < 2) {
+				printf "%s %.2f 0 100\n", p, m
+				continue
+			}
+			v = (sq[p] - n[p] * m * m) / (n[p] - 1)
+			if (v < 0) v = 0
+			hw = t * sqrt(v / n[p])
+			printf "%s %.2f %.2f %.2f\n", p, m, hw,
+				m ? hw * 100 / m : 0
+		}
+	}' "$1"
+}
+
+#
+# Execute the measured phase of a run as a series of chunks, stopping once
+# the 95% confidence interval of the 99th percentile latency of all
+# priorities is within the target tolerance, or once the maximum run time
+# is reached. The chunks latency logs are merged into a single log.
+# $1: fio options
+# $2: lat log name
+#
+function fio_run_steadystate()
+{
+	local fioopts="$1"
+	local latlog="$2"
+	local p99f="$(mktemp)"
+	local cif="$(mktemp)"
+	local t=0
+	local n=0
+	local offset=0
+	local maxrel
+
+	rm -f "${latlog}_lat.log"
+
+	while [ ${t} -lt ${runtime} ]; do
+		n=$(( n + 1 ))
+		fio ${fioopts} --runtime=${chunktime} --time_based \
+			--write_lat_log=chunk.log >> fio.log 2>&1
+		t=$(( t + chunktime ))
+
+		lat_log_p99 chunk.log_lat.log | \
+			awk -v n=${n} '{print n, $0}' >> "${p99f}"
+
+		# Append the chunk log, shifting its time stamps
+		awk -F', ' -v off=${offset} 'BEGIN {OFS = ", "}
+			{$1 = $1 + off; print}' chunk.log_lat.log >> "${latlog}_lat.log"
+		offset=$(get_runtime "${latlog}_lat.log")
+		rm -f chunk.log_lat.log
+
+		if [ ${n} -lt 3 ]; then
+			continue
+		fi
+
+		p99_confidence "${p99f}" > "${cif}"
+		maxrel=$(awk 'BEGIN {m = 0} {if ($4 > m) m = $4} END {print m}' "${cif}")
+		if [ $(echo "${maxrel} <= ${citol}" | bc) -eq 1 ]; then
+			break
+		fi
+	done
+
+	if [ ${n} -lt 3 ]; then
+		p99_confidence "${p99f}" > "${cif}"
+	fi
+
+	echo "run_time=${t}" >> confidence
+	echo "chunks=${n}" >> confidence
+	echo "# prio, p99 mean (ms), 95% CI half width (ms), relative half width (%)" >> confidence
+	sort "${cif}" >> confidence
+
+	rm -f "${p99f}" "${cif}"
+}
+
+#
+# Save the number of aborted I/Os per direction and, for workloads with
+# writes, the statistics of each direction.
+# $1: fio lat log name
+#
+function save_run_stats()
+{
+	local latlog="$1_lat.log"
+
+	echo "read $(grep -c ': Timer expired: read' fio.log)" > aborts
+	echo "write $(grep -c ': Timer expired: write' fio.log)" >> aborts
+
+	if [ "${rw}" == "randread" ]; then
+		return
+	fi
+
+	for d in read write; do
+		${scriptdir}/../cdl_prio_stats.sh --ddir "${d}" "${latlog}" \
+			> "stats.${d}" 2>&1
+	done
+}
+
+#
+# Get the fio command priority options of a run for the read and write
+# directions.
+# $1: run type
+#
+function fio_cmdprio_opts()
+{
+	local run="$1"
+	local opts=""
+
+	if [ "${run}" == "ncqprio" ]; then
+		opts+=" --cmdprio_percentage=${perc}"
+		opts+=" --cmdprio_class=1"
+	elif [ "${run}" == "cdlsingle" ]; then
+		case "${rw}" in
+		randread)
+			opts+=" --cmdprio_percentage=${perc}"
+			opts+=" --cmdprio_class=2"
+			opts+=" --cmdprio_hint=${dld}"
+			;;
+		randwrite)
+			opts+=" --cmdprio_percentage=${wperc}"
+			opts+=" --cmdprio_class=2"
+			opts+=" --cmdprio_hint=${wdld}"
+			;;
+		randrw)
+			if [ ${wdld} -eq 0 ]; then
+				opts+=" --cmdprio_percentage=${perc},0"
+			else
+				opts+=" --cmdprio_percentage=${perc},${wperc}"
+			fi
+			opts+=" --cmdprio_class=2,2"
+			opts+=" --cmdprio_hint=${dld},${wdld}"
+			;;
+		esac
+	elif [ "${run}" == "cdlmulti" ]; then
+		opts+=" --cmdprio_bssplit="
+		case "${rw}" in
+		randread)
+			opts+="$(gen_fio_bssplit ${bs} 2 ${dldsplit})"
+			;;
+		randwrite)
+			opts+="$(gen_fio_bssplit ${bs} 2 ${wdldsplit})"
+			;;
+		randrw)
+			opts+="$(gen_fio_bssplit ${bs} 2 ${dldsplit}),"
+			opts+="$(gen_fio_bssplit ${bs} 2 ${wdldsplit})"
+			;;
+		esac
+	fi
+
+	echo "${opts}"
+}
+
 function fiorun()
 {
 	local run="$1"
@@ -351,40 +662,52 @@ function fiorun()
 
 		echo "  QD=${qd}..."
 
-		fioopts="--name=rndrd_qd${qd}"
+		fioopts="--name=${rw}_qd${qd}"
 		fioopts+=" --filename=${dev}"
 		fioopts+=" --random_generator=tausworthe64"
-		fioopts+=" --continue_on_error=none"
+		fioopts+=" --continue_on_error=io"
+		fioopts+=" --ignore_error=62,62"
+		fioopts+=" --error_dump=1"
 		fioopts+=" --group_reporting=1"
 		fioopts+=" --ioscheduler=none"
-		fioopts+=" --write_lat_log=randread.log"
 		fioopts+=" --per_job_logs=0"
 		fioopts+=" --log_prio=1"
 		fioopts+=" --numjobs=1"
-		fioopts+=" --rw=randread"
+		fioopts+=" --rw=${rw}"
+		if [ "${rw}" == "randrw" ]; then
+			fioopts+=" --rwmixread=${rwmixread}"
+		fi
+		if [ ${fua} -eq 1 ]; then
+			fioopts+=" --sync=dsync"
+		fi
 		fioopts+=" --bs=${bs}"
 		fioopts+=" --ioengine=libaio"
 		fioopts+=" --iodepth=${qd}"
 		fioopts+=" --direct=1"
+		fioopts+="$(fio_cmdprio_opts ${run})"
+
+		if [ ${steadystate} -eq 1 ]; then
+			rm -f confidence
+			echo "fio ${fioopts}" > fio.log 2>&1
+			echo "" >> fio.log 2>&1
+			if [ ${ramptime} -ne 0 ]; then
+				fio_ramp_steadystate "${fioopts}"
+			fi
+			fio_run_steadystate "${fioopts}" "${rw}.log"
+			save_run_stats "${rw}.log"
+			continue
+		fi
+
+		fioopts+=" --write_lat_log=${rw}.log"
 		if [ ${ramptime} -ne 0 ]; then
 			fioopts+=" --ramp_time=${ramptime}"
 		fi
 		fioopts+=" --runtime=${runtime}"
 
-		if [ "${run}" == "ncqprio" ]; then
-			fioopts+=" --cmdprio_percentage=${perc}"
-			fioopts+=" --cmdprio_class=1"
-		elif [ "${run}" == "cdlsingle" ]; then
-			fioopts+=" --cmdprio_percentage=${perc}"
-			fioopts+=" --cmdprio_class=2"
-			fioopts+=" --cmdprio_hint=${dld}"
-		elif [ "${run}" == "cdlmulti" ]; then
-			fioopts+=" --cmdprio_bssplit="
-			fioopts+="$(gen_fio_bssplit ${bs} 2 ${dldsplit})"
-		fi
-
 		echo "fio ${fioopts}" > fio.log 2>&1
 		echo "" >> fio.log 2>&1
 		fio ${fioopts} >> fio.log 2>&1
+
+		save_run_stats "${rw}.log"
 	done
 }
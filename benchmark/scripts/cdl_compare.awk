@@ -0,0 +1,334 @@
+#
+# Copyright (C) 2021 Western Digital Corporation or its affiliates.
+#
+# Compare the fio latency logs of cdl_bench.sh output directories against
+# the logs of a reference output directory. All input files must be named
+# <dir>/<run>/<qd>/<rw>.log_lat.log.
+#
+# For each workload, QD and I/O priority found in both the reference and
+# a compared directory, the IOPS and latency percentiles are compared and
+# a 95% confidence interval of the relative difference is computed using
+# bootstrap resampling: the per second I/O counts are resampled for the
+# IOPS and a uniform random sample (reservoir) of the I/O latencies is
+# resampled for the latency percentiles. A difference is significant if
+# its confidence interval does not include 0 and its estimate exceeds the
+# threshold.
+#
+# Variables:
+#   dirs: "|" separated list of the output directories, reference first
+#   percentiles: comma separated list of the latency percentiles to compare
+#   threshold: minimum relative difference (percentage) of a regression
+#   nsamples: latency reservoir size
+#   nresamples: number of bootstrap resamples
+#   seed: random number generator seed
+#   csv: if not empty, save the comparison results to this file
+#
+# Output: one line per comparison, and a last line "REGRESSIONS=<n>".
+#
+
+# Priorities are keyed as "<r|w>:<prio>", or "ALL" for all I/Os
+function prio_label(run, key,	kp, p, class, hint, l)
+{
+	if (key == "ALL")
+		return "all"
+
+	split(key, kp, ":")
+	p = hex2num(kp[2])
+	class = int(p / 8192)
+	hint = int(p / 8) % 1024
+	if (class == 0)
+		l = "none"
+	else if (class == 1)
+		l = "rt"
+	else if (class == 2 && hint)
+		l = "cdl" hint
+	else if (class == 2)
+		l = "be"
+	else
+		l = "idle"
+
+	if (haswrite[run])
+		l = kp[1] "-" l
+	return l
+}
+
+function hex2num(s,	i, v)
+{
+	s = tolower(s)
+	sub(/^0x/, "", s)
+	v = 0
+	for (i = 1; i <= length(s); i++)
+		v = v * 16 + index("0123456789abcdef", substr(s, i, 1)) - 1
+	return v
+}
+
+function add_io(k, t, lat,	r)
+{
+	if (!(k in nio)) {
+		nio[k] = 0
+		hmax[k] = 0
+		tmin[k] = t
+	}
+	nio[k]++
+
+	# 0.1 ms latency histogram
+	hist[k, lat]++
+	if (lat > hmax[k])
+		hmax[k] = lat
+
+	# Per second I/O count
+	persec[k, t]++
+	tmax[k] = t
+
+	# Reservoir sampling of the latencies
+	if (nio[k] <= nsamples) {
+		res[k, nio[k]] = lat
+	} else {
+		r = int(rand() * nio[k]) + 1
+		if (r <= nsamples)
+			res[k, r] = lat
+	}
+}
+
+function hist_percentile(k, p,	target, c, b)
+{
+	target = int(nio[k] * p)
+	if (target < 1)
+		target = 1
+	c = 0
+	for (b = 0; b <= hmax[k]; b++) {
+		c += hist[k, b]
+		if (c >= target)
+			return b
+	}
+	return hmax[k]
+}
+
+# Sort the reservoir of a key (shell sort)
+function sort_res(k,	n, gap, i, j, v)
+{
+	n = nio[k] < nsamples ? nio[k] : nsamples
+	for (gap = int(n / 2); gap > 0; gap = int(gap / 2)) {
+		for (i = gap + 1; i <= n; i++) {
+			v = res[k, i]
+			for (j = i; j > gap && res[k, j - gap] > v; j -= gap)
+				res[k, j] = res[k, j - gap]
+			res[k, j] = v
+		}
+	}
+	return n
+}
+
+# Full run seconds, that is, excluding the first and last partial seconds
+function iops(k,	t, n, sum)
+{
+	n = 0
+	sum = 0
+	for (t = tmin[k] + 1; t < tmax[k]; t++) {
+		sum += persec[k, t]
+		n++
+	}
+	if (!n)
+		return nio[k]
+	return sum / n
+}
+
+# Bootstrap replicates of the IOPS of a key
+function boot_iops(k, rep,	b, i, n, sum)
+{
+	n = tmax[k] - tmin[k] - 1
+	for (b = 1; b <= nresamples; b++) {
+		if (n <= 0) {
+			rep[b] = nio[k]
+			continue
+		}
+		sum = 0
+		for (i = 0; i < n; i++)
+			sum += persec[k, tmin[k] + 1 + int(rand() * n)]
+		rep[b] = sum / n
+	}
+}
+
+# Bootstrap replicates of a latency percentile of a key
+function boot_pct(k, p, rep,	n, b, i, c, target, cnt)
+{
+	n = sorted[k]
+	target = int(n * p)
+	if (target < 1)
+		target = 1
+	for (b = 1; b <= nresamples; b++) {
+		split("", cnt)
+		for (i = 0; i < n; i++)
+			cnt[int(rand() * n) + 1]++
+		c = 0
+		for (i = 1; i <= n; i++) {
+			c += cnt[i]
+			if (c >= target)
+				break
+		}
+		rep[b] = res[k, i]
+	}
+}
+
+# Quantile of an array of nresamples values (sorts the array)
+function rep_quantile(d, q,	i, j, v)
+{
+	for (i = 2; i <= nresamples; i++) {
+		v = d[i]
+		for (j = i; j > 1 && d[j - 1] > v; j--)
+			d[j] = d[j - 1]
+		d[j] = v
+	}
+	i = int(nresamples * q)
+	if (i < 1)
+		i = 1
+	return d[i]
+}
+
+#
+# Compare a metric and print the result. "worse" is 1 if an increase of
+# the metric is a regression and -1 if a decrease is a regression.
+#
+function compare(name, metric, unit, vref, vcmp, rref, rcmp, worse,
+		 b, d, diff, lo, hi, status)
+{
+	for (b = 1; b <= nresamples; b++) {
+		if (rref[b] > 0)
+			d[b] = (rcmp[b] - rref[b]) * 100 / rref[b]
+		else
+			d[b] = 0
+	}
+	lo = rep_quantile(d, 0.025)
+	hi = rep_quantile(d, 0.975)
+	diff = vref > 0 ? (vcmp - vref) * 100 / vref : 0
+
+	status = "same"
+	if (lo > 0 || hi < 0) {
+		if (diff * worse > threshold) {
+			status = "REGRESSION"
+			nregressions++
+		} else if (diff * worse < -threshold) {
+			status = "improvement"
+		}
+	}
+
+	printf "  %-24s %-8s: %10.1f %s -> %10.1f %s, %+7.1f %% [%+7.1f %%, %+7.1f %%] %s\n",
+		name, metric, vref, unit, vcmp, unit, diff, lo, hi, status
+	if (csv != "")
+		printf "%s,%s,%s,%.1f,%.1f,%.2f,%.2f,%.2f,%s\n",
+			cmpdir, name, metric, vref, vcmp, diff, lo, hi, status > csv
+}
+
+BEGIN {
+	FS = ", *"
+	srand(seed)
+
+	ndirs = split(dirs, dir, "|")
+	np = split(percentiles, pct, ",")
+	nregressions = 0
+
+	if (csv != "")
+		print "dir,workload,metric,reference,value,diff,ci_low,ci_high,status" > csv
+}
+
+FNR == 1 {
+	set = 0
+	for (i = 1; i <= ndirs; i++) {
+		if (index(FILENAME, dir[i] "/") == 1) {
+			set = i
+			break
+		}
+	}
+
+	rel = substr(FILENAME, length(dir[set]) + 2)
+	split(rel, path, "/")
+	run = path[1]
+	qd = path[2] + 0
+
+	if (!((run, qd) in qdseen)) {
+		qdseen[run, qd] = 1
+		nqds[run]++
+		qds[run, nqds[run]] = qd
+	}
+}
+
+{
+	# fio ddir 1 is write
+	if ($3 == 1) {
+		p = "w:" $NF
+		haswrite[run] = 1
+	} else {
+		p = "r:" $NF
+	}
+	t = int($1 / 1000)
+	lat = int($2 / 100000)
+
+	if (!((run, qd, p) in prioseen)) {
+		prioseen[run, qd, p] = 1
+		nprios[run, qd]++
+		prios[run, qd, nprios[run, qd]] = p
+	}
+
+	add_io(set SUBSEP run SUBSEP qd SUBSEP p, t, lat)
+	add_io(set SUBSEP run SUBSEP qd SUBSEP "ALL", t, lat)
+}
+
+END {
+	nr = split("baseline ncqprio cdlsingle cdlmulti", order, " ")
+
+	for (s = 2; s <= ndirs; s++) {
+		cmpdir = dir[s]
+		printf "%s vs %s\n", dir[s], dir[1]
+
+		for (r = 1; r <= nr; r++) {
+			run = order[r]
+
+			# Sort QDs
+			for (i = 2; i <= nqds[run]; i++)
+				for (j = i; j > 1 && qds[run, j - 1] > qds[run, j]; j--) {
+					v = qds[run, j]
+					qds[run, j] = qds[run, j - 1]
+					qds[run, j - 1] = v
+				}
+
+			for (q = 1; q <= nqds[run]; q++) {
+				qd = qds[run, q]
+
+				# With a single priority, ALL is the same
+				if (nprios[run, qd] > 1)
+					prios[run, qd, 0] = "ALL"
+				for (j = (nprios[run, qd] > 1 ? 0 : 1); j <= nprios[run, qd]; j++) {
+					p = prios[run, qd, j]
+					kref = 1 SUBSEP run SUBSEP qd SUBSEP p
+					kcmp = s SUBSEP run SUBSEP qd SUBSEP p
+					name = run "/qd" qd "/" prio_label(run, p)
+					if (!(kref in nio) || !(kcmp in nio)) {
+						printf "  %-24s: missing\n", name
+						continue
+					}
+
+					if (!(kref in sorted))
+						sorted[kref] = sort_res(kref)
+					if (!(kcmp in sorted))
+						sorted[kcmp] = sort_res(kcmp)
+
+					boot_iops(kref, rref)
+					boot_iops(kcmp, rcmp)
+					compare(name, "iops", "  ", iops(kref), iops(kcmp),
+						rref, rcmp, -1)
+
+					for (i = 1; i <= np; i++) {
+						boot_pct(kref, pct[i] / 100, rref)
+						boot_pct(kcmp, pct[i] / 100, rcmp)
+						compare(name, "p" pct[i], "ms",
+							hist_percentile(kref, pct[i] / 100) / 10,
+							hist_percentile(kcmp, pct[i] / 100) / 10,
+							rref, rcmp, 1)
+					}
+				}
+			}
+		}
+	}
+
+	printf "REGRESSIONS=%d\n", nregressions
+}
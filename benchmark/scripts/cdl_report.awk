@@ -0,0 +1,473 @@
+#
+# Copyright (C) 2021 Western Digital Corporation or its affiliates.
+#
+# Single pass processing of the fio latency logs of a cdl_bench.sh output
+# directory. All input files must be named <run>/<qd>/<rw>.log_lat.log.
+# All statistics are computed from per run, per QD, per direction and per
+# priority histograms of the I/O latencies with a 1 ms granularity. The output is
+# the HTML body of the report, with the plots as inline SVG images.
+#
+# Variables:
+#   datadir: the cdl_bench.sh output directory
+#
+
+function hex2num(s,	i, v)
+{
+	s = tolower(s)
+	sub(/^0x/, "", s)
+	v = 0
+	for (i = 1; i <= length(s); i++)
+		v = v * 16 + index("0123456789abcdef", substr(s, i, 1)) - 1
+	return v
+}
+
+function html_escape(s)
+{
+	gsub(/&/, "\\&amp;", s)
+	gsub(/</, "\\&lt;", s)
+	gsub(/>/, "\\&gt;", s)
+	return s
+}
+
+#
+# Load the CDL descriptors used for a run, as saved by cdl_bench.sh,
+# and get the duration guideline limit of each read and write descriptor.
+#
+function load_descriptors(run,	f, line, n, v, d)
+{
+	f = datadir "/" run "/cdl_descriptors"
+	descs[run] = ""
+	while ((getline line < f) > 0) {
+		descs[run] = descs[run] html_escape(line) "\n"
+		if (line ~ /descriptors/) {
+			d = (line ~ /write/) ? "w" : "r"
+			n = 0
+		}
+		if (line ~ /^ *duration guideline *:/) {
+			n++
+			v = line
+			sub(/^[^:]*: */, "", v)
+			sub(/ .*/, "", v)
+			limit[run "." d "." n] = v
+		}
+	}
+	close(f)
+}
+
+#
+# Load the number of aborted I/Os of each direction of a run and QD,
+# as saved by cdl_bench.sh.
+#
+function load_aborts(run, qd,	f, line, a)
+{
+	f = datadir "/" run "/" qd "/aborts"
+	while ((getline line < f) > 0) {
+		split(line, a, " ")
+		aborts[run, qd, a[1]] = a[2]
+		hasaborts[run] = 1
+	}
+	close(f)
+}
+
+# Priorities are keyed as "<r|w>:<prio>"
+function prio_label(run, key,	kp, d, p, class, hint, l)
+{
+	split(key, kp, ":")
+	d = kp[1]
+	p = hex2num(kp[2])
+	class = int(p / 8192)
+	hint = int(p / 8) % 1024
+
+	if (run == "baseline")
+		l = "All I/Os"
+	else if (run == "ncqprio")
+		l = class == 1 ? "High priority I/Os" : "Low priority I/Os"
+	else if (class == 0)
+		l = "No limit I/Os"
+	else if ((run "." d "." hint) in limit)
+		l = limit[run "." d "." hint] "ms limit I/Os"
+	else
+		l = "CDL " hint " I/Os"
+
+	if (haswrite[run])
+		l = (d == "w" ? "Write: " : "Read: ") l
+	return l
+}
+
+function run_title(run)
+{
+	if (run == "baseline")
+		return "Baseline"
+	if (run == "ncqprio")
+		return "NCQ Priority"
+	if (run == "cdlsingle")
+		return "Command Duration Limits, Single Limit"
+	if (run == "cdlmulti")
+		return "Command Duration Limits, Multiple Limits"
+	return run
+}
+
+# Latency percentile (ms) from the histogram of a run, QD and priority
+function percentile(k, p,	target, c, b)
+{
+	target = int(nio[k] * p)
+	if (target < 1)
+		target = 1
+	c = 0
+	for (b = 0; b <= hmax[k]; b++) {
+		c += hist[k, b]
+		if (c >= target)
+			return b
+	}
+	return hmax[k]
+}
+
+function nice_max(v,	e, m)
+{
+	if (v <= 0)
+		return 1
+	e = 1
+	while (e * 10 <= v)
+		e *= 10
+	while (e > v)
+		e /= 10
+	m = v / e
+	if (m <= 1)
+		return e
+	if (m <= 2)
+		return 2 * e
+	if (m <= 5)
+		return 5 * e
+	return 10 * e
+}
+
+function fmt_num(v)
+{
+	if (v == int(v))
+		return sprintf("%d", v)
+	return sprintf("%.1f", v)
+}
+
+#
+# Draw a line chart of the series S[0..ns-1] with names sname[s], npts[s]
+# points and coordinates sx[s, i], sy[s, i]. Series with sdash[s] set are
+# drawn with a dashed line.
+#
+function svg_chart(title, xlabel, ylabel, ns, sname, npts, sx, sy, sdash,
+		   xlim,
+		   W, H, L, R, T, B, pw, ph, xmax, ymax, s, i, t, x, y,
+		   pts, ly)
+{
+	W = 760; H = 420; L = 70; R = 200; T = 40; B = 50
+	pw = W - L - R
+	ph = H - T - B
+
+	xmax = 0
+	ymax = 0
+	for (s = 0; s < ns; s++) {
+		for (i = 0; i < npts[s]; i++) {
+			if (sx[s, i] > xmax)
+				xmax = sx[s, i]
+			if (sy[s, i] > ymax)
+				ymax = sy[s, i]
+		}
+	}
+	if (xlim > 0)
+		xmax = xlim
+	xmax = nice_max(xmax)
+	ymax = nice_max(ymax * 1.05)
+
+	printf "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%d\" height=\"%d\" " \
+	       "font-family=\"sans-serif\" font-size=\"12\">\n", W, H
+	printf "<text x=\"%d\" y=\"20\" text-anchor=\"middle\" font-size=\"14\" " \
+	       "font-weight=\"bold\">%s</text>\n", L + pw / 2, title
+
+	# Grid and axes
+	for (t = 0; t <= 5; t++) {
+		x = L + pw * t / 5
+		y = T + ph - ph * t / 5
+		printf "<line x1=\"%.1f\" y1=\"%d\" x2=\"%.1f\" y2=\"%d\" stroke=\"#ddd\"/>\n",
+			x, T, x, T + ph
+		printf "<line x1=\"%d\" y1=\"%.1f\" x2=\"%d\" y2=\"%.1f\" stroke=\"#ddd\"/>\n",
+			L, y, L + pw, y
+		printf "<text x=\"%.1f\" y=\"%d\" text-anchor=\"middle\">%s</text>\n",
+			x, T + ph + 16, fmt_num(xmax * t / 5)
+		printf "<text x=\"%d\" y=\"%.1f\" text-anchor=\"end\">%s</text>\n",
+			L - 6, y + 4, fmt_num(ymax * t / 5)
+	}
+	printf "<line x1=\"%d\" y1=\"%d\" x2=\"%d\" y2=\"%d\" stroke=\"black\"/>\n",
+		L, T + ph, L + pw, T + ph
+	printf "<line x1=\"%d\" y1=\"%d\" x2=\"%d\" y2=\"%d\" stroke=\"black\"/>\n",
+		L, T, L, T + ph
+	printf "<text x=\"%d\" y=\"%d\" text-anchor=\"middle\">%s</text>\n",
+		L + pw / 2, H - 10, xlabel
+	printf "<text x=\"16\" y=\"%d\" text-anchor=\"middle\" " \
+	       "transform=\"rotate(-90 16 %d)\">%s</text>\n",
+		T + ph / 2, T + ph / 2, ylabel
+
+	# Series and legend
+	ly = T + 10
+	for (s = 0; s < ns; s++) {
+		pts = ""
+		for (i = 0; i < npts[s]; i++) {
+			if (sx[s, i] > xmax)
+				break
+			pts = pts sprintf("%.1f,%.1f ",
+				L + pw * sx[s, i] / xmax,
+				T + ph - ph * sy[s, i] / ymax)
+		}
+		printf "<polyline fill=\"none\" stroke=\"%s\" stroke-width=\"1.5\"%s points=\"%s\"/>\n",
+			color[s % ncolors],
+			sdash[s] ? " stroke-dasharray=\"6,3\"" : "", pts
+		printf "<line x1=\"%d\" y1=\"%d\" x2=\"%d\" y2=\"%d\" stroke=\"%s\" stroke-width=\"2\"%s/>\n",
+			L + pw + 10, ly, L + pw + 30, ly, color[s % ncolors],
+			sdash[s] ? " stroke-dasharray=\"6,3\"" : ""
+		printf "<text x=\"%d\" y=\"%d\">%s</text>\n",
+			L + pw + 36, ly + 4, sname[s]
+		ly += 18
+	}
+
+	print "</svg>"
+}
+
+#
+# Plot a metric as a function of the QD for all priorities of a run. For
+# runs other than the baseline, the baseline result is also plotted.
+#
+function plot_metric(run, metric, title, ylabel,
+		     ns, sname, npts, sx, sy, sdash, j, q, k, n, p)
+{
+	ns = 0
+
+	if (metric == "iops" && run != "baseline") {
+		sname[ns] = "Total"
+		n = 0
+		for (q = 0; q < nqds; q++) {
+			if (!((run, qds[q]) in runtime))
+				continue
+			sx[ns, n] = qds[q]
+			sy[ns, n] = qdio[run, qds[q]] * 1000 / runtime[run, qds[q]]
+			n++
+		}
+		npts[ns] = n
+		sdash[ns] = 0
+		ns++
+	}
+
+	if (run != "baseline" && ("baseline" in runs)) {
+		for (j = 0; j < nprios["baseline"]; j++) {
+			sname[ns] = "Baseline"
+			if (haswrite["baseline"])
+				sname[ns] = sname[ns] " " \
+					prio_label("baseline", prios["baseline", j])
+			sdash[ns] = 1
+			n = 0
+			for (q = 0; q < nqds; q++) {
+				k = "baseline" SUBSEP qds[q] SUBSEP prios["baseline", j]
+				if (!(k in nio))
+					continue
+				sx[ns, n] = qds[q]
+				sy[ns, n] = stat_value(k, metric)
+				n++
+			}
+			npts[ns] = n
+			ns++
+		}
+	}
+
+	for (j = 0; j < nprios[run]; j++) {
+		p = prios[run, j]
+		sname[ns] = prio_label(run, p)
+		sdash[ns] = 0
+		n = 0
+		for (q = 0; q < nqds; q++) {
+			k = run SUBSEP qds[q] SUBSEP p
+			if (!(k in nio))
+				continue
+			sx[ns, n] = qds[q]
+			sy[ns, n] = stat_value(k, metric)
+			n++
+		}
+		npts[ns] = n
+		ns++
+	}
+
+	svg_chart(title, "I/O Queue Depth", ylabel, ns, sname, npts, sx, sy,
+		  sdash, 0)
+}
+
+function stat_value(k, metric,	split_k)
+{
+	if (metric == "iops") {
+		split(k, split_k, SUBSEP)
+		return nio[k] * 1000 / runtime[split_k[1], split_k[2]]
+	}
+	if (metric == "avg")
+		return latsum[k] / nio[k]
+	return percentile(k, 0.99)
+}
+
+#
+# Plot the latency distribution of the I/Os of a priority for all QDs,
+# using 2 ms bins.
+#
+function plot_pdf(run, p,
+		  ns, sname, npts, sx, sy, sdash, q, k, b, n, xlim, v)
+{
+	ns = 0
+	xlim = 0
+	for (q = 0; q < nqds; q++) {
+		k = run SUBSEP qds[q] SUBSEP p
+		if (!(k in nio))
+			continue
+		v = percentile(k, 0.999)
+		if (v > xlim)
+			xlim = v
+		sname[ns] = "I/O depth=" qds[q]
+		sdash[ns] = 0
+		n = 0
+		for (b = 0; b <= hmax[k]; b += 2) {
+			sx[ns, n] = b + 1
+			sy[ns, n] = (hist[k, b] + hist[k, b + 1]) * 100 / nio[k]
+			n++
+		}
+		npts[ns] = n
+		ns++
+	}
+
+	svg_chart(run_title(run) " I/O Latency Distribution, " prio_label(run, p),
+		  "Latency (ms)", "Percentage", ns, sname, npts, sx, sy, sdash,
+		  xlim * 1.1)
+}
+
+function print_table(run,	q, j, k)
+{
+	print "<table>"
+	print "<tr><th>QD</th><th>I/Os</th><th>IOPS</th><th>Avg (ms)</th>" \
+	      "<th>p50 (ms)</th><th>p99 (ms)</th><th>p99.9 (ms)</th><th>Max (ms)</th></tr>"
+	for (q = 0; q < nqds; q++) {
+		for (j = 0; j < nprios[run]; j++) {
+			k = run SUBSEP qds[q] SUBSEP prios[run, j]
+			if (!(k in nio))
+				continue
+			printf "<tr><td>%d</td><td>%s</td><td>%.1f</td><td>%.2f</td>" \
+			       "<td>%d</td><td>%d</td><td>%d</td><td>%d</td></tr>\n",
+				qds[q], prio_label(run, prios[run, j]),
+				stat_value(k, "iops"), stat_value(k, "avg"),
+				percentile(k, 0.5), percentile(k, 0.99),
+				percentile(k, 0.999), hmax[k]
+		}
+	}
+	print "</table>"
+}
+
+BEGIN {
+	FS = ", *"
+
+	ncolors = split("#1f77b4 #d62728 #2ca02c #9467bd #ff7f0e #17becf " \
+			"#8c564b #e377c2 #7f7f7f", c, " ")
+	for (i = 1; i <= ncolors; i++)
+		color[i - 1] = c[i]
+}
+
+FNR == 1 {
+	n = split(FILENAME, path, "/")
+	run = path[n - 2]
+	qd = path[n - 1] + 0
+
+	if (!(run in runs)) {
+		runs[run] = 1
+		nprios[run] = 0
+	}
+	if (!(qd in qdseen)) {
+		qdseen[qd] = 1
+		qds[nqds++] = qd
+	}
+}
+
+{
+	# fio ddir 1 is write
+	if ($3 == 1) {
+		p = "w:" $NF
+		haswrite[run] = 1
+	} else {
+		p = "r:" $NF
+	}
+	k = run SUBSEP qd SUBSEP p
+	if (!((run, p) in prioseen)) {
+		prioseen[run, p] = 1
+		prios[run, nprios[run]++] = p
+	}
+	if (!(k in nio))
+		hmax[k] = 0
+
+	lat = $2 / 1000000
+	b = int(lat)
+	hist[k, b]++
+	if (b > hmax[k])
+		hmax[k] = b
+	nio[k]++
+	latsum[k] += lat
+	qdio[run, qd]++
+
+	# Run time in milliseconds
+	runtime[run, qd] = $1
+}
+
+END {
+	# Sort QDs and priorities
+	for (i = 1; i < nqds; i++)
+		for (j = i; j > 0 && qds[j - 1] > qds[j]; j--) {
+			t = qds[j]; qds[j] = qds[j - 1]; qds[j - 1] = t
+		}
+	for (run in runs)
+		for (i = 1; i < nprios[run]; i++)
+			for (j = i; j > 0 && prios[run, j - 1] > prios[run, j]; j--) {
+				t = prios[run, j]
+				prios[run, j] = prios[run, j - 1]
+				prios[run, j - 1] = t
+			}
+
+	nr = split("baseline ncqprio cdlsingle cdlmulti", order, " ")
+	for (r = 1; r <= nr; r++) {
+		run = order[r]
+		if (!(run in runs))
+			continue
+
+		if (run == "cdlsingle" || run == "cdlmulti")
+			load_descriptors(run)
+
+		printf "<h2 id=\"%s\">%s</h2>\n", run, run_title(run)
+		print_table(run)
+
+		for (q = 0; q < nqds; q++)
+			load_aborts(run, qds[q])
+		if (hasaborts[run]) {
+			print "<table>"
+			print "<tr><th>QD</th><th>Aborted reads</th><th>Aborted writes</th></tr>"
+			for (q = 0; q < nqds; q++) {
+				if (!((run, qds[q], "read") in aborts))
+					continue
+				printf "<tr><td>%d</td><td>%d</td><td>%d</td></tr>\n",
+					qds[q], aborts[run, qds[q], "read"],
+					aborts[run, qds[q], "write"]
+			}
+			print "</table>"
+		}
+
+		print "<div class=\"plots\">"
+		plot_metric(run, "iops", run_title(run) " IOPS", "IOPS")
+		plot_metric(run, "avg", run_title(run) " I/O Latency Average",
+			    "Latency (ms)")
+		plot_metric(run, "p99", run_title(run) " I/O Latency 99th Percentile",
+			    "Latency (ms)")
+		for (j = 0; j < nprios[run]; j++)
+			plot_pdf(run, prios[run, j])
+		print "</div>"
+
+		if (descs[run] != "") {
+			print "<h3>CDL Descriptors</h3>"
+			printf "<pre>%s</pre>\n", descs[run]
+		}
+	}
+}
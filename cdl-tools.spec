@@ -15,7 +15,11 @@ BuildRequires:	gcc
 
 %description
 This package provides the cdladm user utility to inspect and modify
-command duration limits of SCSI and ATA disks supporting this feature.
+command duration limits of SCSI and ATA disks supporting this feature, the
+cdlbench, cdlhedge and cdlmix utilities to measure command duration limits
+effects, the cdlclassd daemon and the cdlpreload utility to assign command
+duration limits to processes and applications, and the libcdlio library to
+issue I/Os using command duration limits.
 
 # Tests package
 %package tests
@@ -38,9 +42,14 @@ sh autogen.sh
 %install
 %make_install
 %make_install install-tests
+rm -f %{buildroot}%{_libdir}/libcdlio.la %{buildroot}%{_libdir}/libcdlio.a
+rm -f %{buildroot}%{_libdir}/libcdlpreload.la
 
 %files
 %{_bindir}/*
+%{_libdir}/libcdlio.so*
+%{_libdir}/libcdlpreload.so
+%{_includedir}/cdlio.h
 %{_mandir}/man8/*
 %license COPYING.GPL
 %doc README.md CONTRIBUTING
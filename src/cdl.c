@@ -109,7 +109,7 @@ static char *cdl_simple_time_str(char *str, uint64_t time, uint8_t cdlunit)
 {
 	uint64_t t = cdl_simple_time(time, cdlunit);
 
-	if (t >= 1000000)
+	if (t >= 1000000 && t % 1000000 == 0)
 		sprintf(str, "%" PRIu64 " ms", t / 1000000);
 	else
 		sprintf(str, "%" PRIu64 " us", t / 1000);
@@ -142,11 +142,103 @@ uint64_t cdl_t2time(uint64_t val, uint8_t t2cdlunit)
 	}
 }
 
+/*
+ * SCSI pages time units, from the finest to the coarsest.
+ */
+struct cdl_unit {
+	uint8_t		unit;
+	uint64_t	ns;
+};
+
+static const struct cdl_unit cdl_simple_units[] = {
+	{ 0x04, 1000ULL },
+	{ 0x05, 10000000ULL },
+	{ 0x06, 500000000ULL },
+};
+
+static const struct cdl_unit cdl_t2_units[] = {
+	{ 0x06, 500ULL },
+	{ 0x08, 1000ULL },
+	{ 0x0a, 10000000ULL },
+	{ 0x0e, 500000000ULL },
+};
+
+static bool cdl_limits_fit(uint64_t *t, uint64_t ns, bool round)
+{
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (!round && t[i] % ns)
+			return false;
+		if ((t[i] + ns - 1) / ns > 65535)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * SCSI pages limits are 16-bits: if a descriptor limits do not fit, change
+ * the descriptor unit to the finest unit encoding all limits exactly or, if
+ * there is none, to the finest unit in which all limits fit once rounded up.
+ * Return true if the limits were rounded.
+ */
+bool cdl_desc_scsi_encode(enum cdl_p cdlp, struct cdl_desc *desc)
+{
+	uint32_t *lim[3] = {
+		&desc->max_inactive_time,
+		&desc->max_active_time,
+		&desc->duration,
+	};
+	const struct cdl_unit *units;
+	int i, u, nr_units;
+	bool round;
+	uint64_t t[3];
+
+	if (desc->max_inactive_time <= 65535 &&
+	    desc->max_active_time <= 65535 &&
+	    desc->duration <= 65535)
+		return false;
+
+	if (cdlp == CDLP_A || cdlp == CDLP_B) {
+		units = cdl_simple_units;
+		nr_units = sizeof(cdl_simple_units) / sizeof(cdl_simple_units[0]);
+		for (i = 0; i < 3; i++)
+			t[i] = cdl_simple_time(*lim[i], desc->cdltunit);
+	} else {
+		units = cdl_t2_units;
+		nr_units = sizeof(cdl_t2_units) / sizeof(cdl_t2_units[0]);
+		for (i = 0; i < 3; i++)
+			t[i] = cdl_t2time(*lim[i], desc->cdltunit);
+	}
+
+	for (round = false; ; round = true) {
+		for (u = 0; u < nr_units; u++) {
+			if (cdl_limits_fit(t, units[u].ns, round))
+				goto set;
+		}
+		if (round)
+			break;
+	}
+
+	/* Too large: use the maximum limits of the coarsest unit */
+	u = nr_units - 1;
+
+set:
+	desc->cdltunit = units[u].unit;
+	for (i = 0; i < 3; i++) {
+		t[i] = (t[i] + units[u].ns - 1) / units[u].ns;
+		*lim[i] = t[i] > 65535 ? 65535 : t[i];
+	}
+
+	return round;
+}
+
 static char *cdl_t2time_str(char *str, uint64_t time, uint8_t t2cdlunit)
 {
 	uint64_t t = cdl_t2time(time, t2cdlunit);
 
-	if (t >= 1000000)
+	if (t >= 1000000 && t % 1000000 == 0)
 		sprintf(str, "%" PRIu64 " ms", t / 1000000);
 	else if (t >= 1000 && t % 1000 == 0)
 		sprintf(str, "%" PRIu64 " us", t / 1000);
@@ -781,12 +873,26 @@ static int cdl_check_t2desc(struct cdl_dev *dev, struct cdl_desc *desc, int i)
 static int cdl_check_desc(struct cdl_dev *dev, struct cdl_page *page,
 			  struct cdl_desc *desc, int i)
 {
+	struct cdl_desc d = *desc;
+
+	/* Check that the limits can be written without rounding */
+	if (cdl_dev_use_ata(dev)) {
+		if (cdl_t2time(d.max_inactive_time, d.cdltunit) % 1000 ||
+		    cdl_t2time(d.max_active_time, d.cdltunit) % 1000 ||
+		    cdl_t2time(d.duration, d.cdltunit) % 1000)
+			printf("[WARNING] descriptor %d: limits rounded up "
+			       "to the microsecond\n", i + 1);
+	} else if (cdl_desc_scsi_encode(page->cdlp, &d)) {
+		printf("[WARNING] descriptor %d: limits rounded up to "
+		       "t2cdlunits 0x%x\n", i + 1, (unsigned int)d.cdltunit);
+	}
+
 	if (page->cdlp == CDLP_A || page->cdlp == CDLP_B)
 		return cdl_check_simple_desc(dev, desc, i);
 	return cdl_check_t2desc(dev, desc, i);
 }
 
-static int cdl_check_page(struct cdl_dev *dev, struct cdl_page *page)
+int cdl_page_check(struct cdl_dev *dev, struct cdl_page *page)
 {
 	struct cdl_desc *desc;
 	int i, err, ret = 0;
@@ -804,19 +910,58 @@ static int cdl_check_page(struct cdl_dev *dev, struct cdl_page *page)
 	return ret;
 }
 
-int cdl_page_parse_file(FILE *f, struct cdl_dev *dev, struct cdl_page *page)
+/*
+ * Get the longest time in nanoseconds that a command using one of the
+ * descriptors of the device pages can take before the device completes or
+ * aborts it: the sum of the max inactive and max active times or the
+ * duration guideline, whichever is longer. T2 page limits with a 0h policy
+ * do not abort commands and are ignored.
+ */
+uint64_t cdl_longest_limit(struct cdl_dev *dev)
 {
-	char line[CDL_LINE_MAX_LEN];
-	int i, ret = 0;
+	struct cdl_desc *desc;
+	uint64_t t, g, longest = 0;
+	int i, d;
 
-	/* Initialize the page as completely empty */
-	memset(page, 0, sizeof(struct cdl_page));
-	page->cdlp = CDLP_NONE;
+	for (i = 0; i < CDL_MAX_PAGES; i++) {
+		if (!cdl_page_supported(dev, i))
+			continue;
 
-	/* cdlp must be first */
-	ret = cdl_parse_cdlp(page, f, line);
-	if (ret)
-		return ret;
+		for (d = 0; d < CDL_MAX_DESC; d++) {
+			desc = &dev->cdl_pages[i].descs[d];
+			if (i == CDLP_A || i == CDLP_B) {
+				t = cdl_simple_time(desc->duration,
+						    desc->cdltunit);
+			} else {
+				t = 0;
+				if (desc->max_inactive_policy)
+					t += cdl_t2time(desc->max_inactive_time,
+							desc->cdltunit);
+				if (desc->max_active_policy)
+					t += cdl_t2time(desc->max_active_time,
+							desc->cdltunit);
+				g = 0;
+				if (desc->duration_policy)
+					g = cdl_t2time(desc->duration,
+						       desc->cdltunit);
+				if (g > t)
+					t = g;
+			}
+			if (t > longest)
+				longest = t;
+		}
+	}
+
+	return longest;
+}
+
+/*
+ * Parse the fields of a page following the cdlp field.
+ */
+int cdl_page_parse_descs(FILE *f, struct cdl_page *page)
+{
+	char line[CDL_LINE_MAX_LEN];
+	int i, ret;
 
 	/*
 	 * For the T2A page, we must have the perf-vs-duration-guideline
@@ -835,8 +980,29 @@ int cdl_page_parse_file(FILE *f, struct cdl_dev *dev, struct cdl_page *page)
 			return ret;
 	}
 
+	return 0;
+}
+
+int cdl_page_parse_file(FILE *f, struct cdl_dev *dev, struct cdl_page *page)
+{
+	char line[CDL_LINE_MAX_LEN];
+	int ret = 0;
+
+	/* Initialize the page as completely empty */
+	memset(page, 0, sizeof(struct cdl_page));
+	page->cdlp = CDLP_NONE;
+
+	/* cdlp must be first */
+	ret = cdl_parse_cdlp(page, f, line);
+	if (ret)
+		return ret;
+
+	ret = cdl_page_parse_descs(f, page);
+	if (ret)
+		return ret;
+
 	/* Do some final checks on the page, warning about invalid values */
-	return cdl_check_page(dev, page);
+	return cdl_page_check(dev, page);
 }
 
 /*
@@ -895,6 +1061,143 @@ int cdl_read_pages(struct cdl_dev *dev)
 	return 0;
 }
 
+/*
+ * Get the page defining the descriptors selected with the I/O priority hint
+ * of read or write commands. Return CDLP_NONE if the commands do not use
+ * the T2A or T2B page.
+ */
+enum cdl_p cdl_hint_page(struct cdl_dev *dev, enum cdl_rw rw)
+{
+	enum cdl_cmd c16 = rw == CDL_READ ? CDL_READ_16 : CDL_WRITE_16;
+	enum cdl_cmd c32 = rw == CDL_READ ? CDL_READ_32 : CDL_WRITE_32;
+	enum cdl_p cdlp;
+
+	cdlp = dev->cmd_cdlp[c16];
+	if (cdlp == CDLP_NONE)
+		cdlp = dev->cmd_cdlp[c32];
+
+	if (cdlp != CDLP_T2A && cdlp != CDLP_T2B)
+		return CDLP_NONE;
+
+	return cdlp;
+}
+
+/*
+ * Check that the descriptor dld (1 to 7) used with the I/O priority hint of
+ * read or write commands defines a limit in the pages read from the device.
+ * Return -EINVAL if dld is out of range, -ENOENT if the commands do not
+ * use duration limits and -ENODATA if the descriptor has no limit.
+ */
+int cdl_check_dld(struct cdl_dev *dev, enum cdl_rw rw, int dld)
+{
+	struct cdl_desc *desc;
+	enum cdl_p cdlp;
+
+	if (dld < 1 || dld > CDL_MAX_DESC)
+		return -EINVAL;
+
+	cdlp = cdl_hint_page(dev, rw);
+	if (cdlp == CDLP_NONE || dev->cdl_pages[cdlp].cdlp != cdlp)
+		return -ENOENT;
+
+	desc = &dev->cdl_pages[cdlp].descs[dld - 1];
+	if (!desc->max_inactive_time && !desc->max_active_time &&
+	    !desc->duration)
+		return -ENODATA;
+
+	return 0;
+}
+
+/*
+ * Read again all the supported pages, using a single command if possible.
+ */
+int cdl_reread_pages(struct cdl_dev *dev)
+{
+	if (cdl_dev_use_ata(dev))
+		return cdl_ata_read_all_pages(dev);
+
+	return cdl_scsi_read_all_pages(dev);
+}
+
+static uint64_t cdl_fnv1a(uint64_t fp, uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		fp ^= buf[i];
+		fp *= 0x100000001b3ULL;
+	}
+
+	return fp;
+}
+
+/*
+ * Get a fingerprint (FNV-1a hash) of the raw data of the pages last read
+ * from the device.
+ */
+uint64_t cdl_pages_fingerprint(struct cdl_dev *dev)
+{
+	uint64_t fp = 0xcbf29ce484222325ULL;
+	struct cdl_page *page;
+	int cdlp;
+
+	/* The ATA log holds all the pages */
+	if (cdl_dev_use_ata(dev))
+		return cdl_fnv1a(fp, dev->ata_cdl_log, CDL_ATA_LOG_SIZE);
+
+	for (cdlp = 0; cdlp < CDL_MAX_PAGES; cdlp++) {
+		if (!cdl_page_supported(dev, cdlp))
+			continue;
+		page = &dev->cdl_pages[cdlp];
+		fp = cdl_fnv1a(fp, page->msbuf, page->msbufsz);
+	}
+
+	return fp;
+}
+
+/*
+ * Compare a page with the device current page, using the data that writing
+ * each page would send to the device. Return a mask of the differences:
+ * bit 0 for the page parameters and bit n for descriptor n.
+ */
+unsigned int cdl_page_diff(struct cdl_dev *dev, struct cdl_page *page)
+{
+	uint8_t cur[CDL_SG_BUF_MAX_SIZE], new[CDL_SG_BUF_MAX_SIZE];
+	size_t hdr, hdrsz, desc, descsz;
+	unsigned int changed = 0;
+	int i;
+
+	if (cdl_dev_use_ata(dev)) {
+		memcpy(cur, dev->ata_cdl_log, CDL_ATA_LOG_SIZE);
+		memcpy(new, dev->ata_cdl_log, CDL_ATA_LOG_SIZE);
+		cdl_ata_page_buf(dev, page, new);
+		hdr = 0;
+		hdrsz = 1;
+		desc = page->cdlp == CDLP_T2A ? 64 : 288;
+		descsz = 32;
+	} else {
+		cdl_scsi_page_buf(dev, &dev->cdl_pages[page->cdlp], cur);
+		cdl_scsi_page_buf(dev, page, new);
+		hdr = 8;
+		hdrsz = 8;
+		desc = 16;
+		if (page->cdlp == CDLP_A || page->cdlp == CDLP_B)
+			descsz = 4;
+		else
+			descsz = 32;
+	}
+
+	if (memcmp(&cur[hdr], &new[hdr], hdrsz) != 0)
+		changed |= 1;
+
+	for (i = 0; i < CDL_MAX_DESC; i++, desc += descsz) {
+		if (memcmp(&cur[desc], &new[desc], descsz) != 0)
+			changed |= 1 << (i + 1);
+	}
+
+	return changed;
+}
+
 /*
  * Write a CDL page.
  */
@@ -912,6 +1215,164 @@ int cdl_write_page(struct cdl_dev *dev, struct cdl_page *page)
 	return ret;
 }
 
+/*
+ * Write several pages with a single device revalidation. For ATA devices,
+ * all pages are written with a single write of the command duration limits
+ * log.
+ */
+int cdl_write_pages(struct cdl_dev *dev, struct cdl_page **pages,
+		    int nr_pages)
+{
+	int i, ret = 0;
+
+	if (!nr_pages)
+		return 0;
+
+	if (cdl_dev_use_ata(dev)) {
+		ret = cdl_ata_write_pages(dev, pages, nr_pages);
+	} else {
+		for (i = 0; i < nr_pages && !ret; i++)
+			ret = cdl_scsi_write_page(dev, pages[i]);
+	}
+
+	cdl_revalidate_dev(dev);
+
+	return ret;
+}
+
+/*
+ * Save the binary blob of a page: the MODE SELECT 10 parameter list of the
+ * page, or the ATA command duration limits log, which holds both the T2A
+ * and T2B pages.
+ */
+int cdl_blob_save(struct cdl_dev *dev, enum cdl_p cdlp, FILE *f)
+{
+	struct cdl_blob blob;
+	size_t len;
+
+	memset(&blob, 0, sizeof(blob));
+	memcpy(blob.magic, CDL_BLOB_MAGIC, sizeof(CDL_BLOB_MAGIC));
+	blob.version = CDL_BLOB_VERSION;
+	blob.cdlp = cdlp;
+	memcpy(blob.vendor, dev->vendor, CDL_VENDOR_LEN);
+	memcpy(blob.id, dev->id, CDL_ID_LEN);
+	memcpy(blob.rev, dev->rev, CDL_REV_LEN);
+
+	if (cdl_dev_use_ata(dev)) {
+		blob.type = CDL_BLOB_ATA_LOG;
+		len = CDL_ATA_LOG_SIZE;
+		memcpy(blob.buf, dev->ata_cdl_log, len);
+	} else {
+		blob.type = CDL_BLOB_MODE_SELECT;
+		len = cdl_scsi_page_buf(dev, &dev->cdl_pages[cdlp], blob.buf);
+	}
+	cdl_sg_set_le32(blob.len, len);
+
+	if (fwrite(&blob, CDL_BLOB_HDR_SIZE + len, 1, f) != 1)
+		return -EIO;
+
+	return 0;
+}
+
+/*
+ * Load a page blob and check that it can be uploaded to the device.
+ */
+int cdl_blob_load(struct cdl_dev *dev, FILE *f, struct cdl_blob *blob)
+{
+	enum cdl_blob_type type;
+	size_t len;
+
+	if (fread(blob, CDL_BLOB_HDR_SIZE, 1, f) != 1 ||
+	    memcmp(blob->magic, CDL_BLOB_MAGIC, sizeof(CDL_BLOB_MAGIC)) != 0 ||
+	    blob->version != CDL_BLOB_VERSION) {
+		fprintf(stderr, "Invalid blob file\n");
+		return -EINVAL;
+	}
+
+	len = cdl_sg_get_le32(blob->len);
+	if (blob->type == CDL_BLOB_ATA_LOG) {
+		if (len != CDL_ATA_LOG_SIZE ||
+		    (blob->cdlp != CDLP_T2A && blob->cdlp != CDLP_T2B)) {
+			fprintf(stderr, "Invalid ATA log blob\n");
+			return -EINVAL;
+		}
+	} else if (blob->type != CDL_BLOB_MODE_SELECT ||
+		   len < 16 || len > CDL_SG_BUF_MAX_SIZE ||
+		   blob->cdlp >= CDL_MAX_PAGES) {
+		fprintf(stderr, "Invalid mode select blob\n");
+		return -EINVAL;
+	}
+
+	if (fread(blob->buf, len, 1, f) != 1 || fgetc(f) != EOF) {
+		fprintf(stderr, "Invalid blob file size\n");
+		return -EINVAL;
+	}
+
+	blob->vendor[CDL_VENDOR_LEN - 1] = '\0';
+	blob->id[CDL_ID_LEN - 1] = '\0';
+	blob->rev[CDL_REV_LEN - 1] = '\0';
+
+	/* The blob is only valid for the same model and firmware */
+	if (strcmp(blob->vendor, dev->vendor) != 0 ||
+	    strcmp(blob->id, dev->id) != 0 ||
+	    strcmp(blob->rev, dev->rev) != 0) {
+		fprintf(stderr,
+			"Blob saved from a different device (%s %s, revision %s)\n",
+			blob->vendor, blob->id, blob->rev);
+		return -EINVAL;
+	}
+
+	type = cdl_dev_use_ata(dev) ? CDL_BLOB_ATA_LOG : CDL_BLOB_MODE_SELECT;
+	if (blob->type != type) {
+		fprintf(stderr, "Blob saved %s ATA passthrough commands\n",
+			type == CDL_BLOB_ATA_LOG ? "without" : "using");
+		return -EINVAL;
+	}
+
+	if (!cdl_page_supported(dev, blob->cdlp)) {
+		fprintf(stderr, "Page %s is not supported\n",
+			cdl_page_name(blob->cdlp));
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Upload a page blob with a single write command.
+ */
+int cdl_blob_upload(struct cdl_dev *dev, struct cdl_blob *blob)
+{
+	size_t len = cdl_sg_get_le32(blob->len);
+	int ret;
+
+	if (blob->type == CDL_BLOB_ATA_LOG) {
+		memcpy(dev->ata_cdl_log, blob->buf, CDL_ATA_LOG_SIZE);
+		ret = cdl_ata_write_cdl_log(dev);
+	} else {
+		ret = cdl_scsi_mode_select(dev, blob->buf, len);
+	}
+
+	cdl_revalidate_dev(dev);
+
+	if (ret)
+		return ret;
+
+	/* Update the cached pages with the data written */
+	if (blob->type == CDL_BLOB_ATA_LOG) {
+		cdl_ata_parse_page(dev, CDLP_T2A, &dev->cdl_pages[CDLP_T2A]);
+		cdl_ata_parse_page(dev, CDLP_T2B, &dev->cdl_pages[CDLP_T2B]);
+		return 0;
+	}
+
+	/* Restore the mode data length cleared for the mode select */
+	cdl_sg_set_be16(&blob->buf[0], len - 2);
+
+	return cdl_scsi_parse_page(dev, blob->cdlp,
+				   &dev->cdl_pages[blob->cdlp],
+				   blob->buf, len);
+}
+
 /*
  * Check the device CDL enable status.
  */
@@ -971,6 +1432,23 @@ int cdl_statistics_upload(struct cdl_dev *dev, FILE *f)
 	return cdl_scsi_statistics_upload(dev, f);
 }
 
+/*
+ * Get the device statistics counters of the read (T2A) and write (T2B)
+ * descriptors. This is only supported with ATA devices: the statistics of
+ * SCSI devices are not read. A descriptor counters are valid only if one of
+ * its statistics counts commands and the other one counts limits met.
+ */
+int cdl_statistics_get_counters(struct cdl_dev *dev,
+				struct cdl_stats_counters c[2])
+{
+	memset(c, 0, sizeof(struct cdl_stats_counters) * 2);
+
+	if (!cdl_dev_statistics_supported(dev) || !cdl_dev_is_ata(dev))
+		return -ENOTSUP;
+
+	return cdl_ata_statistics_get_counters(dev, c);
+}
+
 /*
  * Test if a sysfs attribute file exists.
  */
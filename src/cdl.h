@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <limits.h>
@@ -62,11 +63,15 @@ enum cdl_limit {
 	CDLP_DURATION_GUIDELINE,
 };
 
+/*
+ * Descriptor limits are in units of cdltunit. SCSI pages limits are 16-bits,
+ * while ATA limits are 32-bits microseconds, used with cdltunit 0x8 (1 us).
+ */
 struct cdl_desc {
 	uint8_t		cdltunit;
-	uint16_t	max_inactive_time;
-	uint16_t	max_active_time;
-	uint16_t	duration;
+	uint32_t	max_inactive_time;
+	uint32_t	max_active_time;
+	uint32_t	duration;
 	uint8_t		max_inactive_policy;
 	uint8_t		max_active_policy;
 	uint8_t		duration_policy;
@@ -98,6 +103,8 @@ struct cdl_page {
 #define CDL_USE_ATA			(1 << 9)
 #define CDL_FORCE_DEV			(1 << 10)
 #define CDL_STATISTICS_SUPPORTED	(1 << 11)
+#define CDL_DEFER_REVALIDATE		(1 << 12)
+#define CDL_NEED_REVALIDATE		(1 << 13)
 
 #define CDL_SYS_SUPPORTED		(1 << 16)
 #define CDL_SYS_DEV_SUPPORTED		(1 << 17)
@@ -142,6 +149,16 @@ struct cdl_scsi_stats {
 	struct cdl_scsi_stats_desc t2b[CDL_MAX_DESC];
 };
 
+/*
+ * Number of commands and number of commands that missed their limits for
+ * the descriptors of a page, from the device statistics.
+ */
+struct cdl_stats_counters {
+	bool		valid[CDL_MAX_DESC];
+	uint64_t	nr_cmds[CDL_MAX_DESC];
+	uint64_t	nr_misses[CDL_MAX_DESC];
+};
+
 struct cdl_dev {
 	/* Device file path and basename */
 	char			*path;
@@ -160,6 +177,7 @@ struct cdl_dev {
 	char			sat_product[CDL_SAT_PRODUCT_LEN];
 	char			sat_rev[CDL_SAT_REV_LEN];
 	unsigned long long	capacity;
+	uint32_t		lba_size;
 	bool			cdl_supported;
 	enum cdl_p		cmd_cdlp[CDL_CMD_MAX];
 	enum cdl_rw		cdlrw[CDL_MAX_PAGES];
@@ -204,13 +222,231 @@ struct cdl_sg_cmd {
 
 #define CDL_LINE_MAX_LEN	512
 
+/*
+ * Binary page blob: the MODE SELECT 10 parameter list of a page, or the ATA
+ * command duration limits log, as written to the device, together with the
+ * vendor, model and firmware revision of the device it was saved from.
+ * Uploading a blob is a single write command, without parsing a page file
+ * and without reading the page from the device first.
+ */
+#define CDL_BLOB_MAGIC		"CDLBLOB"
+#define CDL_BLOB_VERSION	1
+
+enum cdl_blob_type {
+	CDL_BLOB_MODE_SELECT,
+	CDL_BLOB_ATA_LOG,
+};
+
+struct cdl_blob {
+	char		magic[8];
+	uint8_t		version;
+	uint8_t		type;
+	uint8_t		cdlp;
+	uint8_t		reserved;
+	uint8_t		len[4];	/* Little endian */
+	char		vendor[CDL_VENDOR_LEN];
+	char		id[CDL_ID_LEN];
+	char		rev[CDL_REV_LEN];
+	uint8_t		buf[CDL_SG_BUF_MAX_SIZE];
+};
+
+#define CDL_BLOB_HDR_SIZE	offsetof(struct cdl_blob, buf)
+
+/*
+ * Configuration bundle: device sections, each defining the pages, the
+ * statistics selectors and the CDL and high priority enhancement states
+ * for the devices matching all the section match fields.
+ */
+enum cdl_bundle_match {
+	CDL_BUNDLE_MATCH_WWN,
+	CDL_BUNDLE_MATCH_VENDOR,
+	CDL_BUNDLE_MATCH_MODEL,
+	CDL_BUNDLE_MATCH_FIRMWARE,
+	CDL_BUNDLE_MATCH_SLOT,
+
+	CDL_BUNDLE_MATCH_MAX,
+};
+
+struct cdl_bundle_dev {
+	char		*match[CDL_BUNDLE_MATCH_MAX];
+
+	/* 0 or 1, -1 if not specified */
+	int		enable;
+	int		highpri;
+
+	/* Pages to set, cdlp is CDLP_NONE if not specified */
+	struct cdl_page	pages[CDL_MAX_PAGES];
+
+	/* Selectors A and B per direction and descriptor, -1 if not set */
+	bool		has_selectors;
+	int8_t		selectors[2][CDL_MAX_DESC][2];
+};
+
+struct cdl_bundle {
+	int			nr_devs;
+	struct cdl_bundle_dev	*devs;
+};
+
+/*
+ * Profile schedule: named profiles, each defining pages, and the rules
+ * selecting the profile to use, either at a time of the day or while an
+ * event file exists.
+ */
+#define CDL_PROFILE_NAME_LEN	32
+
+struct cdl_profile {
+	char		name[CDL_PROFILE_NAME_LEN];
+
+	/* Pages to set, cdlp is CDLP_NONE if not specified */
+	struct cdl_page	pages[CDL_MAX_PAGES];
+};
+
+enum cdl_rule_type {
+	CDL_RULE_AT,
+	CDL_RULE_WHEN,
+};
+
+struct cdl_rule {
+	enum cdl_rule_type	type;
+	int			profile;
+
+	/* Minutes since midnight for "at" rules */
+	int			minute;
+
+	/* Event file path for "when" rules */
+	char			*path;
+};
+
+struct cdl_schedule {
+	int			nr_profiles;
+	struct cdl_profile	*profiles;
+	int			nr_rules;
+	struct cdl_rule		*rules;
+};
+
+/*
+ * Log-linear latency histogram: values below CDL_HIST_SUB are counted
+ * exactly and each power of 2 range above is split into CDL_HIST_SUB
+ * buckets, for a relative error of at most 1 / CDL_HIST_SUB.
+ */
+#define CDL_HIST_SUB_BITS	5
+#define CDL_HIST_SUB		(1U << CDL_HIST_SUB_BITS)
+#define CDL_HIST_BUCKETS	((64 - CDL_HIST_SUB_BITS + 1) * CDL_HIST_SUB)
+
+struct cdl_hist {
+	uint64_t	count;
+	uint64_t	sum;
+	uint64_t	min;
+	uint64_t	max;
+	uint64_t	buckets[CDL_HIST_BUCKETS];
+};
+
+/*
+ * Host side command latency tracing using the block layer block_rq_issue
+ * and block_rq_complete tracepoints. Latencies are accounted per direction
+ * and per duration limit descriptor, as indicated by the I/O priority hint.
+ */
+struct cdl_trace_stats {
+	struct cdl_hist		lat;
+	uint64_t		nr_errors;
+	uint64_t		nr_etime;
+};
+
+struct cdl_trace_field {
+	unsigned int		offset;
+	unsigned int		size;
+};
+
+struct cdl_trace_event {
+	uint64_t		id;
+	struct cdl_trace_field	dev;
+	struct cdl_trace_field	sector;
+	struct cdl_trace_field	ioprio;
+	struct cdl_trace_field	rwbs;
+	struct cdl_trace_field	error;
+};
+
+struct cdl_trace_rec;
+struct cdl_trace_inflight;
+
+struct cdl_trace {
+	uint32_t			devt;
+	struct cdl_trace_event		issue;
+	struct cdl_trace_event		complete;
+
+	/* Per CPU perf events and ring buffers */
+	int				nr_cpus;
+	int				*fds;
+	void				**rings;
+	size_t				ring_size;
+
+	/* Records of a polling round, sorted by time */
+	struct cdl_trace_rec		*recs;
+	unsigned int			nr_recs;
+	unsigned int			max_recs;
+
+	/* Issued commands waiting for their completion */
+	struct cdl_trace_inflight	*inflight;
+
+	uint64_t			nr_lost;
+	uint64_t			nr_unmatched;
+	unsigned long long		start;
+	struct cdl_trace_stats		stats[2][CDL_MAX_DESC + 1];
+};
+
+/*
+ * Asynchronous commands executed through the device SG node.
+ * The sg driver limits the number of commands queued per file descriptor,
+ * so several file descriptors are used for higher queue depths.
+ */
+#define CDL_SGIO_FD_MAX_QD	16
+#define CDL_SGIO_MAX_QD		1024
+
+enum cdl_sgio_status {
+	CDL_SGIO_OK,
+	CDL_SGIO_LIMIT,
+	CDL_SGIO_ERROR,
+	CDL_SGIO_TIMEOUT,
+};
+
+struct cdl_sgio_cmd {
+	sg_io_hdr_t		io_hdr;
+	uint8_t			cdb[CDL_SG_CDB_MAX_SIZE];
+	uint8_t			sense_buf[CDL_SG_SENSE_MAX_LENGTH];
+	void			*buf;
+	size_t			bufsz;
+	enum cdl_rw		rw;
+	uint8_t			dld;
+	uint64_t		lba;
+	unsigned long long	start;
+	unsigned long long	lat;
+	int			fdi;
+	uint8_t			sense_key;
+	uint16_t		asc_ascq;
+};
+
+struct cdl_sgio {
+	char			path[PATH_MAX];
+	int			nr_fds;
+	int			*fds;
+	unsigned int		*fd_qd;
+	unsigned int		qd;
+	unsigned int		timeout;
+	bool			use_ata;
+	bool			use_32;
+	bool			fua;
+};
+
 /* In cdl_dev.c */
-int cdl_open_dev(struct cdl_dev *dev, mode_t mode);
+int cdl_open_dev(struct cdl_dev *dev, mode_t mode, bool excl);
 void cdl_close_dev(struct cdl_dev *dev);
 void cdl_revalidate_dev(struct cdl_dev *dev);
+void cdl_defer_revalidate(struct cdl_dev *dev, bool defer);
 void cdl_init_cmd(struct cdl_sg_cmd *cmd, int cdb_len,
 		  int direction, size_t bufsz);
 int cdl_exec_cmd(struct cdl_dev *dev, struct cdl_sg_cmd *cmd);
+void cdl_sg_get_sense_data(uint8_t *sense_buf, unsigned int sense_buf_len,
+			   uint8_t *sense_key, uint16_t *asc_ascq);
 void cdl_sg_get_str(char *dst, uint8_t *buf, int len);
 void cdl_sg_set_be16(uint8_t *buf, uint16_t val);
 void cdl_sg_set_be32(uint8_t *buf, uint32_t val);
@@ -230,6 +466,7 @@ const char *cdl_page_name(enum cdl_p cdlp);
 uint8_t cdl_page_code(enum cdl_p cdlp);
 int cdl_page_name2cdlp(char *page);
 uint64_t cdl_t2time(uint64_t val, uint8_t t2cdlunit);
+bool cdl_desc_scsi_encode(enum cdl_p cdlp, struct cdl_desc *desc);
 
 const char *cdl_cmd_str(enum cdl_cmd cmd);
 uint8_t cdl_cmd_opcode(enum cdl_cmd cmd);
@@ -237,16 +474,31 @@ uint16_t cdl_cmd_sa(enum cdl_cmd cmd);
 
 int cdl_page_show(struct cdl_page *page, unsigned int flags);
 void cdl_page_save(struct cdl_page *page, FILE *f);
+int cdl_page_parse_descs(FILE *f, struct cdl_page *page);
 int cdl_page_parse_file(FILE *f, struct cdl_dev *dev, struct cdl_page *page);
+int cdl_page_check(struct cdl_dev *dev, struct cdl_page *page);
+uint64_t cdl_longest_limit(struct cdl_dev *dev);
 
 int cdl_read_pages(struct cdl_dev *dev);
+int cdl_reread_pages(struct cdl_dev *dev);
+uint64_t cdl_pages_fingerprint(struct cdl_dev *dev);
 bool cdl_page_supported(struct cdl_dev *dev, enum cdl_p cdlp);
+enum cdl_p cdl_hint_page(struct cdl_dev *dev, enum cdl_rw rw);
+int cdl_check_dld(struct cdl_dev *dev, enum cdl_rw rw, int dld);
+unsigned int cdl_page_diff(struct cdl_dev *dev, struct cdl_page *page);
 int cdl_write_page(struct cdl_dev *dev, struct cdl_page *page);
+int cdl_write_pages(struct cdl_dev *dev, struct cdl_page **pages,
+		    int nr_pages);
+int cdl_blob_save(struct cdl_dev *dev, enum cdl_p cdlp, FILE *f);
+int cdl_blob_load(struct cdl_dev *dev, FILE *f, struct cdl_blob *blob);
+int cdl_blob_upload(struct cdl_dev *dev, struct cdl_blob *blob);
 int cdl_check_enabled(struct cdl_dev *dev, bool enabled);
 int cdl_statistics_show(struct cdl_dev *dev, int cdlp);
 int cdl_statistics_reset(struct cdl_dev *dev);
 int cdl_statistics_save(struct cdl_dev *dev, FILE *f);
 int cdl_statistics_upload(struct cdl_dev *dev, FILE *f);
+int cdl_statistics_get_counters(struct cdl_dev *dev,
+				struct cdl_stats_counters c[2]);
 
 bool cdl_sysfs_exists(struct cdl_dev *dev, const char *format, ...);
 unsigned long cdl_sysfs_get_ulong_attr(struct cdl_dev *dev,
@@ -257,11 +509,64 @@ int cdl_sysfs_set_attr(struct cdl_dev *dev, const char *val,
 char *cdl_get_line(FILE *f, char *line);
 char *cdl_skip_spaces(char *str, int skip);
 
+/* In cdl_bundle.c */
+int cdl_bundle_parse(FILE *f, struct cdl_bundle *b);
+void cdl_bundle_free(struct cdl_bundle *b);
+struct cdl_bundle_dev *cdl_bundle_match(struct cdl_bundle *b,
+					struct cdl_dev *dev);
+int cdl_bundle_check(struct cdl_dev *dev, struct cdl_bundle_dev *bd);
+
+/* In cdl_schedule.c */
+int cdl_schedule_parse(struct cdl_dev *dev, const char *path,
+		       struct cdl_schedule *s);
+void cdl_schedule_free(struct cdl_schedule *s);
+int cdl_schedule_find_profile(struct cdl_schedule *s, const char *name);
+int cdl_schedule_select(struct cdl_schedule *s, time_t now);
+
+/* In cdl_hist.c */
+void cdl_hist_init(struct cdl_hist *h);
+void cdl_hist_add(struct cdl_hist *h, uint64_t val);
+void cdl_hist_add_atomic(struct cdl_hist *h, uint64_t val);
+void cdl_hist_merge(struct cdl_hist *dst, struct cdl_hist *src);
+uint64_t cdl_hist_percentile(struct cdl_hist *h, double pct);
+uint64_t cdl_hist_avg(struct cdl_hist *h);
+uint64_t cdl_hist_bucket_val(unsigned int idx);
+
+/* In cdl_trace.c */
+int cdl_trace_start(struct cdl_dev *dev, struct cdl_trace *t);
+int cdl_trace_poll(struct cdl_dev *dev, struct cdl_trace *t, int timeout_ms);
+void cdl_trace_stop(struct cdl_trace *t);
+void cdl_trace_show(struct cdl_dev *dev, struct cdl_trace *t);
+void cdl_trace_save(struct cdl_dev *dev, struct cdl_trace *t, FILE *f);
+
+/* In cdl_sgio.c */
+int cdl_sgio_open(struct cdl_dev *dev, struct cdl_sgio *sgio,
+		  unsigned int qd);
+void cdl_sgio_close(struct cdl_sgio *sgio);
+int cdl_sgio_alloc_cmd(struct cdl_sgio_cmd *cmd, size_t bufsz);
+void cdl_sgio_free_cmd(struct cdl_sgio_cmd *cmd);
+void cdl_sgio_prep_cmd(struct cdl_dev *dev, struct cdl_sgio *sgio,
+		       struct cdl_sgio_cmd *cmd, enum cdl_rw rw,
+		       uint64_t lba, uint32_t nr_lbas, uint8_t dld);
+int cdl_sgio_submit(struct cdl_sgio *sgio, struct cdl_sgio_cmd *cmd);
+struct cdl_sgio_cmd *cdl_sgio_reap(struct cdl_sgio *sgio);
+enum cdl_sgio_status cdl_sgio_cmd_status(struct cdl_sgio *sgio,
+					 struct cdl_sgio_cmd *cmd);
+unsigned long long cdl_now_ns(void);
+
 /* In cdl_ata.c */
 int cdl_ata_init(struct cdl_dev *dev);
 int cdl_ata_read_page(struct cdl_dev *dev, enum cdl_p cdlp,
 		      struct cdl_page *page);
+void cdl_ata_page_buf(struct cdl_dev *dev, struct cdl_page *page,
+		      uint8_t *buf);
+int cdl_ata_read_all_pages(struct cdl_dev *dev);
+void cdl_ata_parse_page(struct cdl_dev *dev, enum cdl_p cdlp,
+			struct cdl_page *page);
 int cdl_ata_write_page(struct cdl_dev *dev, struct cdl_page *page);
+int cdl_ata_write_pages(struct cdl_dev *dev, struct cdl_page **pages,
+			int nr_pages);
+int cdl_ata_write_cdl_log(struct cdl_dev *dev);
 int cdl_ata_check_enabled(struct cdl_dev *dev, bool enabled);
 int cdl_ata_enable(struct cdl_dev *dev, bool enable, bool highpri);
 void cdl_ata_revalidate(struct cdl_dev *dev);
@@ -273,12 +578,23 @@ int cdl_ata_statistics_show(struct cdl_dev *dev, int cdlp);
 int cdl_ata_statistics_reset(struct cdl_dev *dev);
 int cdl_ata_statistics_save(struct cdl_dev *dev, FILE *f);
 int cdl_ata_statistics_upload(struct cdl_dev *dev, FILE *f);
+int cdl_ata_statistics_set_selectors(struct cdl_dev *dev,
+				     int8_t sel[2][CDL_MAX_DESC][2],
+				     bool write);
+int cdl_ata_statistics_get_counters(struct cdl_dev *dev,
+				    struct cdl_stats_counters c[2]);
 
 /* In cdl_scsi.c */
 void cdl_scsi_get_ata_information(struct cdl_dev *dev);
 int cdl_scsi_init(struct cdl_dev *dev);
 int cdl_scsi_read_page(struct cdl_dev *dev, enum cdl_p cdlp,
 		       struct cdl_page *page);
+int cdl_scsi_read_all_pages(struct cdl_dev *dev);
+int cdl_scsi_parse_page(struct cdl_dev *dev, enum cdl_p cdlp,
+			struct cdl_page *page, uint8_t *msbuf, size_t msbufsz);
+size_t cdl_scsi_page_buf(struct cdl_dev *dev, struct cdl_page *page,
+			 uint8_t *buf);
+int cdl_scsi_mode_select(struct cdl_dev *dev, uint8_t *buf, size_t bufsz);
 int cdl_scsi_write_page(struct cdl_dev *dev, struct cdl_page *page);
 int cdl_scsi_check_enabled(struct cdl_dev *dev, bool enabled);
 void cdl_scsi_revalidate(struct cdl_dev *dev);
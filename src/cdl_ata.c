@@ -418,16 +418,6 @@ int cdl_ata_init(struct cdl_dev *dev)
 	return 0;
 }
 
-static uint16_t cdl_ata_a2s_limit(uint8_t *buf)
-{
-	uint32_t limit = cdl_sg_get_le32(buf);
-
-	/* SCSI mode page limits are 2-bytes only, so take care of overflows */
-	if (limit / 10000 > 65535)
-		return 65535;
-	return limit / 10000;
-}
-
 /*
  * Read the device CDL descriptor log.
  */
@@ -451,20 +441,15 @@ static int cdl_ata_read_cdl_log(struct cdl_dev *dev)
 }
 
 /*
- * Read a CDL page from the device.
+ * Parse a CDL page from the cached command duration limits log.
  */
-int cdl_ata_read_page(struct cdl_dev *dev, enum cdl_p cdlp,
-		      struct cdl_page *page)
+void cdl_ata_parse_page(struct cdl_dev *dev, enum cdl_p cdlp,
+			struct cdl_page *page)
 {
 	struct cdl_desc *desc = &page->descs[0];
 	uint8_t *buf = dev->ata_cdl_log;
 	uint32_t policy;
-	int i, ret;
-
-	/* Command duration limits log */
-	ret = cdl_ata_read_cdl_log(dev);
-	if (ret)
-		return ret;
+	int i;
 
 	/* T2A and T2B limits page */
 	page->cdlp = cdlp;
@@ -484,15 +469,15 @@ int cdl_ata_read_page(struct cdl_dev *dev, enum cdl_p cdlp,
 		desc->max_inactive_policy = (policy >> 8) & 0x0f;
 		desc->max_active_policy = (policy >> 4) & 0x0f;
 		desc->duration_policy = policy & 0x0f;
-		desc->max_active_time = cdl_ata_a2s_limit(&buf[4]);
-		desc->max_inactive_time = cdl_ata_a2s_limit(&buf[8]);
-		desc->duration = cdl_ata_a2s_limit(&buf[16]);
+		desc->max_active_time = cdl_sg_get_le32(&buf[4]);
+		desc->max_inactive_time = cdl_sg_get_le32(&buf[8]);
+		desc->duration = cdl_sg_get_le32(&buf[16]);
 
 		/*
-		 * SATL defines t2cdlunits as fixed to 0xa, even for an empty
-		 * descriptor, so do the same here.
+		 * Keep the limits in microseconds, as defined by ATA, instead
+		 * of the SATL fixed 10ms t2cdlunits which truncates them.
 		 */
-		desc->cdltunit = 0x0a; /* 10ms */
+		desc->cdltunit = 0x08; /* 1us */
 
 		if (cdl_dev_statistics_supported(dev)) {
 			/* Save the satistics configuration (selectors) */
@@ -505,16 +490,55 @@ int cdl_ata_read_page(struct cdl_dev *dev, enum cdl_p cdlp,
 			}
 		}
 	}
+}
+
+/*
+ * Read a CDL page from the device.
+ */
+int cdl_ata_read_page(struct cdl_dev *dev, enum cdl_p cdlp,
+		      struct cdl_page *page)
+{
+	int ret;
+
+	/* Command duration limits log */
+	ret = cdl_ata_read_cdl_log(dev);
+	if (ret)
+		return ret;
+
+	cdl_ata_parse_page(dev, cdlp, page);
 
 	return 0;
 }
 
 /*
- * Convert SCSI limit to ATA microseconds.
+ * Read the T2A and T2B pages with a single read of the command duration
+ * limits log.
  */
-static uint32_t cdl_ata_s2a_limit(uint16_t limit, uint8_t t2cdlunit)
+int cdl_ata_read_all_pages(struct cdl_dev *dev)
 {
-	uint64_t l = cdl_t2time(limit, t2cdlunit) / 1000;
+	int ret;
+
+	ret = cdl_ata_read_cdl_log(dev);
+	if (ret)
+		return ret;
+
+	cdl_ata_parse_page(dev, CDLP_T2A, &dev->cdl_pages[CDLP_T2A]);
+	cdl_ata_parse_page(dev, CDLP_T2B, &dev->cdl_pages[CDLP_T2B]);
+
+	return 0;
+}
+
+/*
+ * Convert a limit to ATA microseconds, rounding up sub-microsecond limits.
+ */
+static uint32_t cdl_ata_s2a_limit(uint32_t limit, uint8_t t2cdlunit)
+{
+	uint64_t l;
+
+	if (t2cdlunit == 0x08)
+		return limit;
+
+	l = (cdl_t2time(limit, t2cdlunit) + 999) / 1000;
 
 	/* Take care of overflows */
 	if (l > (~0U))
@@ -524,13 +548,13 @@ static uint32_t cdl_ata_s2a_limit(uint16_t limit, uint8_t t2cdlunit)
 
 /*
  * Force device revalidation so that sysfs exposes updated command
- * duration limits.
+ * duration limits. Only the device channel, target and LUN are scanned,
+ * not all the devices of its host.
  */
 void cdl_ata_revalidate(struct cdl_dev *dev)
 {
-	const char *scan = "- - -";
 	char path[PATH_MAX];
-	char host[32], *h;
+	char host[NAME_MAX + 1], *h, *scan;
 	struct dirent *dirent;
 	FILE *f = NULL;
 	DIR *d;
@@ -551,7 +575,7 @@ void cdl_ata_revalidate(struct cdl_dev *dev)
 		goto close;
 	}
 
-	strcpy(host, dirent->d_name);
+	snprintf(host, sizeof(host), "%s", dirent->d_name);
 	h = strchr(host, ':');
 	if (!h) {
 		cdl_dev_err(dev, "Parse %s entry failed\n", path);
@@ -559,6 +583,13 @@ void cdl_ata_revalidate(struct cdl_dev *dev)
 	}
 	*h = '\0';
 
+	/* "host:channel:target:lun" -> "channel target lun" */
+	scan = h + 1;
+	for (h = scan; *h; h++) {
+		if (*h == ':')
+			*h = ' ';
+	}
+
 	sprintf(path, "/sys/class/scsi_host/host%s/scan", host);
 
 	f = fopen(path, "w");
@@ -580,7 +611,7 @@ close:
 /*
  * Write the device CDL descriptor log.
  */
-static int cdl_ata_write_cdl_log(struct cdl_dev *dev)
+int cdl_ata_write_cdl_log(struct cdl_dev *dev)
 {
 	int ret;
 
@@ -596,14 +627,14 @@ static int cdl_ata_write_cdl_log(struct cdl_dev *dev)
 }
 
 /*
- * Write a CDL page to the device.
+ * Set the descriptors of a CDL page in a command duration limits log buffer.
  */
-int cdl_ata_write_page(struct cdl_dev *dev, struct cdl_page *page)
+void cdl_ata_page_buf(struct cdl_dev *dev, struct cdl_page *page,
+		      uint8_t *buf)
 {
 	struct cdl_desc *desc = &page->descs[0];
-	uint8_t *buf = dev->ata_cdl_log;
 	uint8_t cdlp = page->cdlp;
-	int i, ret;
+	int i;
 
 	/* T2A and T2B limits page */
 	if (cdlp == CDLP_T2A) {
@@ -630,11 +661,37 @@ int cdl_ata_write_page(struct cdl_dev *dev, struct cdl_page *page)
 				cdl_ata_s2a_limit(desc->duration,
 						  desc->cdltunit));
 	}
+}
+
+/*
+ * Write a CDL page to the device.
+ */
+int cdl_ata_write_page(struct cdl_dev *dev, struct cdl_page *page)
+{
+	return cdl_ata_write_pages(dev, &page, 1);
+}
+
+/*
+ * Write the T2A and T2B pages with a single write of the command duration
+ * limits log.
+ */
+int cdl_ata_write_pages(struct cdl_dev *dev, struct cdl_page **pages,
+			int nr_pages)
+{
+	int i, ret;
+
+	for (i = 0; i < nr_pages; i++)
+		cdl_ata_page_buf(dev, pages[i], dev->ata_cdl_log);
 
 	ret = cdl_ata_write_cdl_log(dev);
 	if (ret)
 		return ret;
 
+	/* Update the cached pages with the values written */
+	for (i = 0; i < nr_pages; i++)
+		cdl_ata_parse_page(dev, pages[i]->cdlp,
+				   &dev->cdl_pages[pages[i]->cdlp]);
+
 	return 0;
 }
 
@@ -873,6 +930,57 @@ int cdl_ata_statistics_show(struct cdl_dev *dev, int cdlp)
 	return 0;
 }
 
+/*
+ * Get the number of commands and of commands that missed their limits of a
+ * descriptor: this requires one of the two descriptor statistics to count
+ * commands (selector 4h) and the other one to count the limits met
+ * (selector 1h, 2h or 3h).
+ */
+static void cdl_ata_get_desc_counters(struct cdl_ata_stats_desc *sa,
+				      struct cdl_ata_stats_desc *sb,
+				      struct cdl_stats_counters *c, int i)
+{
+	struct cdl_ata_stats_desc *cmds, *misses;
+
+	if (sa->selector == 0x4) {
+		cmds = sa;
+		misses = sb;
+	} else {
+		cmds = sb;
+		misses = sa;
+	}
+
+	if (cmds->selector != 0x4 ||
+	    misses->selector < 0x1 || misses->selector > 0x3 ||
+	    !cdl_ata_stat_supported(cmds) || !cdl_ata_stat_valid(cmds) ||
+	    !cdl_ata_stat_supported(misses) || !cdl_ata_stat_valid(misses))
+		return;
+
+	c->nr_cmds[i] = cmds->val;
+	c->nr_misses[i] = misses->val;
+	c->valid[i] = true;
+}
+
+int cdl_ata_statistics_get_counters(struct cdl_dev *dev,
+				    struct cdl_stats_counters c[2])
+{
+	struct cdl_ata_stats *st = &dev->cdl_stats.ata;
+	int ret, i;
+
+	ret = cdl_ata_get_stats(dev);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < CDL_MAX_DESC; i++) {
+		cdl_ata_get_desc_counters(&st->reads_a[i], &st->reads_b[i],
+					  &c[CDL_READ], i);
+		cdl_ata_get_desc_counters(&st->writes_a[i], &st->writes_b[i],
+					  &c[CDL_WRITE], i);
+	}
+
+	return 0;
+}
+
 int cdl_ata_statistics_reset(struct cdl_dev *dev)
 {
 	struct cdl_sg_cmd cmd;
@@ -1085,3 +1193,43 @@ int cdl_ata_statistics_upload(struct cdl_dev *dev, FILE *f)
 
 	return 0;
 }
+
+/*
+ * Set the statistics selectors A and B of the read and write descriptors.
+ * Selectors with a negative value are not changed. Return the number of
+ * selectors changed, updating the device log only if @write is true.
+ */
+int cdl_ata_statistics_set_selectors(struct cdl_dev *dev,
+				     int8_t sel[2][CDL_MAX_DESC][2],
+				     bool write)
+{
+	int rw, i, j, ret, nr_changes = 0;
+	uint8_t *buf;
+
+	/* Get the command duration limits log */
+	ret = cdl_ata_read_cdl_log(dev);
+	if (ret)
+		return ret;
+
+	for (rw = CDL_READ; rw <= CDL_WRITE; rw++) {
+		buf = dev->ata_cdl_log + (rw == CDL_READ ? 64 : 288);
+		for (i = 0; i < CDL_MAX_DESC; i++, buf += 32) {
+			for (j = 0; j < 2; j++) {
+				if (sel[rw][i][j] < 0 ||
+				    buf[12 + j] == sel[rw][i][j])
+					continue;
+				buf[12 + j] = sel[rw][i][j];
+				nr_changes++;
+			}
+		}
+	}
+
+	if (!nr_changes || !write)
+		return nr_changes;
+
+	ret = cdl_ata_write_cdl_log(dev);
+	if (ret)
+		return ret;
+
+	return nr_changes;
+}
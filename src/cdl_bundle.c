@@ -0,0 +1,417 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+#include "cdl.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <libgen.h>
+
+static const char *cdl_bundle_match_name[CDL_BUNDLE_MATCH_MAX] = {
+	"wwn",
+	"vendor",
+	"model",
+	"firmware",
+	"slot",
+};
+
+static struct cdl_bundle_dev *cdl_bundle_add_dev(struct cdl_bundle *b)
+{
+	struct cdl_bundle_dev *bd;
+	int i;
+
+	bd = realloc(b->devs, sizeof(*bd) * (b->nr_devs + 1));
+	if (!bd) {
+		fprintf(stderr, "No memory for bundle\n");
+		return NULL;
+	}
+	b->devs = bd;
+
+	bd = &b->devs[b->nr_devs];
+	memset(bd, 0, sizeof(*bd));
+	bd->enable = -1;
+	bd->highpri = -1;
+	for (i = 0; i < CDL_MAX_PAGES; i++)
+		bd->pages[i].cdlp = CDLP_NONE;
+	memset(bd->selectors, 0xff, sizeof(bd->selectors));
+	b->nr_devs++;
+
+	return bd;
+}
+
+static int cdl_bundle_parse_bool(char *str, int *val)
+{
+	if (strcmp(str, "1") == 0 || strcmp(str, "yes") == 0) {
+		*val = 1;
+		return 0;
+	}
+
+	if (strcmp(str, "0") == 0 || strcmp(str, "no") == 0) {
+		*val = 0;
+		return 0;
+	}
+
+	return -EINVAL;
+}
+
+static int cdl_bundle_parse_selectors(struct cdl_bundle_dev *bd, char *str)
+{
+	int rw, d, a, b;
+	char type[8];
+
+	if (sscanf(str, "%7s %d %d %d", type, &d, &a, &b) != 4 ||
+	    d < 1 || d > CDL_MAX_DESC ||
+	    a < 0 || a > 4 || b < 0 || b > 4)
+		return -EINVAL;
+
+	if (strcmp(type, "read") == 0)
+		rw = CDL_READ;
+	else if (strcmp(type, "write") == 0)
+		rw = CDL_WRITE;
+	else
+		return -EINVAL;
+
+	bd->selectors[rw][d - 1][0] = a;
+	bd->selectors[rw][d - 1][1] = b;
+	bd->has_selectors = true;
+
+	return 0;
+}
+
+/*
+ * Parse a bundle file line of a device section.
+ */
+static int cdl_bundle_parse_line(FILE *f, struct cdl_bundle_dev *bd,
+				 char *str)
+{
+	struct cdl_page *page;
+	char *val;
+	int i, cdlp;
+	size_t len;
+
+	val = strchr(str, ':');
+	if (!val)
+		return -EINVAL;
+	len = val - str;
+	val = cdl_skip_spaces(val, 1);
+	if (!val)
+		return -EINVAL;
+
+	for (i = 0; i < CDL_BUNDLE_MATCH_MAX; i++) {
+		if (strlen(cdl_bundle_match_name[i]) == len &&
+		    strncmp(str, cdl_bundle_match_name[i], len) == 0) {
+			free(bd->match[i]);
+			bd->match[i] = strdup(val);
+			if (!bd->match[i])
+				return -ENOMEM;
+			return 0;
+		}
+	}
+
+	if (strncmp(str, "enable:", 7) == 0)
+		return cdl_bundle_parse_bool(val, &bd->enable);
+
+	if (strncmp(str, "highpri:", 8) == 0)
+		return cdl_bundle_parse_bool(val, &bd->highpri);
+
+	if (strncmp(str, "selectors:", 10) == 0)
+		return cdl_bundle_parse_selectors(bd, val);
+
+	if (strncmp(str, "cdlp:", 5) == 0) {
+		cdlp = cdl_page_name2cdlp(val);
+		if (cdlp < 0)
+			return -EINVAL;
+		page = &bd->pages[cdlp];
+		if (page->cdlp != CDLP_NONE) {
+			fprintf(stderr, "Page %s specified several times\n",
+				val);
+			return -EINVAL;
+		}
+		memset(page, 0, sizeof(*page));
+		page->cdlp = cdlp;
+		return cdl_page_parse_descs(f, page);
+	}
+
+	return -EINVAL;
+}
+
+/*
+ * Parse a bundle file. A bundle is a list of device sections, each starting
+ * with a "== device" line, followed by the match fields selecting the
+ * devices the section applies to, the CDL and high priority enhancement
+ * states, the statistics selectors and the pages to set, in the same
+ * format as page files.
+ */
+int cdl_bundle_parse(FILE *f, struct cdl_bundle *b)
+{
+	char line[CDL_LINE_MAX_LEN];
+	struct cdl_bundle_dev *bd = NULL;
+	char *str;
+	int ret;
+
+	memset(b, 0, sizeof(*b));
+
+	while (1) {
+		str = cdl_get_line(f, line);
+		if (!str)
+			break;
+
+		if (strcmp(str, "== device") == 0) {
+			bd = cdl_bundle_add_dev(b);
+			if (!bd)
+				goto err;
+			continue;
+		}
+
+		if (!bd) {
+			fprintf(stderr, "No device section\n");
+			goto err;
+		}
+
+		ret = cdl_bundle_parse_line(f, bd, str);
+		if (ret) {
+			fprintf(stderr,
+				"Invalid line \"%s\" in device section %d\n",
+				str, b->nr_devs);
+			goto err;
+		}
+	}
+
+	if (!b->nr_devs) {
+		fprintf(stderr, "Empty bundle\n");
+		goto err;
+	}
+
+	for (bd = b->devs; bd < b->devs + b->nr_devs; bd++) {
+		if (bd->enable == 1 && bd->highpri == 1) {
+			fprintf(stderr,
+				"Device section %d: CDL and high priority "
+				"enhancement cannot be both enabled\n",
+				(int)(bd - b->devs) + 1);
+			goto err;
+		}
+	}
+
+	return 0;
+
+err:
+	cdl_bundle_free(b);
+	return -EINVAL;
+}
+
+void cdl_bundle_free(struct cdl_bundle *b)
+{
+	int i, j;
+
+	for (i = 0; i < b->nr_devs; i++)
+		for (j = 0; j < CDL_BUNDLE_MATCH_MAX; j++)
+			free(b->devs[i].match[j]);
+	free(b->devs);
+	b->devs = NULL;
+	b->nr_devs = 0;
+}
+
+/*
+ * Get the sysfs device directory of a block or SCSI generic device.
+ */
+static int cdl_bundle_sysfs_dev(struct cdl_dev *dev, char *path, size_t len)
+{
+	snprintf(path, len, "/sys/class/block/%s/device", dev->name);
+	if (access(path, F_OK) == 0)
+		return 0;
+
+	snprintf(path, len, "/sys/class/scsi_generic/%s/device", dev->name);
+	if (access(path, F_OK) == 0)
+		return 0;
+
+	return -ENOENT;
+}
+
+/*
+ * Get the device WWN, as shown by its wwid sysfs attribute.
+ */
+static int cdl_bundle_get_wwn(struct cdl_dev *dev, char *wwn, size_t len)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	char *s;
+
+	if (cdl_bundle_sysfs_dev(dev, path, sizeof(path) - 8))
+		return -ENOENT;
+	strcat(path, "/wwid");
+
+	f = fopen(path, "r");
+	if (!f)
+		return -ENOENT;
+	s = fgets(wwn, len, f);
+	fclose(f);
+	if (!s)
+		return -ENOENT;
+
+	wwn[strcspn(wwn, "\n")] = '\0';
+
+	return 0;
+}
+
+/*
+ * A slot matches the name of the device enclosure slot or the SCSI address
+ * (host:channel:target:lun) of the device.
+ */
+static bool cdl_bundle_match_slot(struct cdl_dev *dev, const char *pattern)
+{
+	char path[PATH_MAX], rpath[PATH_MAX];
+	struct dirent *dirent;
+	bool match = false;
+	DIR *d;
+
+	if (cdl_bundle_sysfs_dev(dev, path, sizeof(path)))
+		return false;
+
+	if (realpath(path, rpath) &&
+	    fnmatch(pattern, basename(rpath), 0) == 0)
+		return true;
+
+	d = opendir(path);
+	if (!d)
+		return false;
+
+	while ((dirent = readdir(d))) {
+		if (strncmp(dirent->d_name, "enclosure_device:", 17) == 0 &&
+		    fnmatch(pattern, dirent->d_name + 17, 0) == 0) {
+			match = true;
+			break;
+		}
+	}
+
+	closedir(d);
+
+	return match;
+}
+
+static bool cdl_bundle_dev_match(struct cdl_dev *dev,
+				 struct cdl_bundle_dev *bd)
+{
+	char wwn[128];
+
+	if (bd->match[CDL_BUNDLE_MATCH_WWN] &&
+	    (cdl_bundle_get_wwn(dev, wwn, sizeof(wwn)) ||
+	     fnmatch(bd->match[CDL_BUNDLE_MATCH_WWN], wwn, 0) != 0))
+		return false;
+
+	if (bd->match[CDL_BUNDLE_MATCH_VENDOR] &&
+	    fnmatch(bd->match[CDL_BUNDLE_MATCH_VENDOR], dev->vendor, 0) != 0)
+		return false;
+
+	if (bd->match[CDL_BUNDLE_MATCH_MODEL] &&
+	    fnmatch(bd->match[CDL_BUNDLE_MATCH_MODEL], dev->id, 0) != 0)
+		return false;
+
+	if (bd->match[CDL_BUNDLE_MATCH_FIRMWARE] &&
+	    fnmatch(bd->match[CDL_BUNDLE_MATCH_FIRMWARE], dev->rev, 0) != 0)
+		return false;
+
+	if (bd->match[CDL_BUNDLE_MATCH_SLOT] &&
+	    !cdl_bundle_match_slot(dev, bd->match[CDL_BUNDLE_MATCH_SLOT]))
+		return false;
+
+	return true;
+}
+
+/*
+ * Get the first device section of a bundle matching a device.
+ */
+struct cdl_bundle_dev *cdl_bundle_match(struct cdl_bundle *b,
+					struct cdl_dev *dev)
+{
+	int i;
+
+	for (i = 0; i < b->nr_devs; i++) {
+		if (cdl_bundle_dev_match(dev, &b->devs[i]))
+			return &b->devs[i];
+	}
+
+	return NULL;
+}
+
+static int cdl_bundle_check_min(struct cdl_dev *dev, struct cdl_page *page,
+				int d, uint32_t val, const char *name)
+{
+	uint64_t t;
+
+	if (!val || !dev->min_limit)
+		return 0;
+
+	t = cdl_t2time(val, page->descs[d].cdltunit);
+	if (t >= dev->min_limit)
+		return 0;
+
+	fprintf(stderr,
+		"[ERROR] page %s descriptor %d: %s is lower than the device "
+		"minimum limit\n",
+		cdl_page_name(page->cdlp), d + 1, name);
+
+	return -EINVAL;
+}
+
+/*
+ * Check that a device section can be applied to a device: the pages must
+ * be supported and their limits within the device minimum and maximum
+ * limits. Limits longer than the device command timeout are warned about.
+ */
+int cdl_bundle_check(struct cdl_dev *dev, struct cdl_bundle_dev *bd)
+{
+	struct cdl_page *page;
+	int i, d, ret = 0;
+
+	for (i = 0; i < CDL_MAX_PAGES; i++) {
+		page = &bd->pages[i];
+		if (page->cdlp == CDLP_NONE)
+			continue;
+
+		if (!cdl_page_supported(dev, i)) {
+			fprintf(stderr, "[ERROR] page %s is not supported\n",
+				cdl_page_name(i));
+			ret = -EINVAL;
+			continue;
+		}
+
+		if (cdl_page_check(dev, page))
+			ret = -EINVAL;
+
+		for (d = 0; d < CDL_MAX_DESC; d++) {
+			if (cdl_bundle_check_min(dev, page, d,
+					page->descs[d].max_inactive_time,
+					"max inactive time") ||
+			    cdl_bundle_check_min(dev, page, d,
+					page->descs[d].max_active_time,
+					"max active time") ||
+			    cdl_bundle_check_min(dev, page, d,
+					page->descs[d].duration,
+					"duration guideline"))
+				ret = -EINVAL;
+		}
+	}
+
+	if (bd->has_selectors &&
+	    (!cdl_dev_is_ata(dev) || !cdl_dev_statistics_supported(dev))) {
+		fprintf(stderr,
+			"[ERROR] statistics selectors are not supported\n");
+		ret = -EINVAL;
+	}
+
+	if (bd->highpri == 1 && !(dev->flags & CDL_HIGHPRI_DEV_SUPPORTED)) {
+		fprintf(stderr,
+			"[ERROR] high priority enhancement is not supported\n");
+		ret = -EINVAL;
+	}
+
+	return ret;
+}
@@ -337,41 +337,45 @@ void cdl_init_cmd(struct cdl_sg_cmd *cmd, int cdb_len,
 }
 
 /*
- * Get comamnd ASC/ASCQ.
+ * Get the sense key and ASC/ASCQ from fixed or descriptor format sense data.
  */
-static void cdl_sg_get_sense(struct cdl_sg_cmd *cmd)
+void cdl_sg_get_sense_data(uint8_t *sense_buf, unsigned int sense_buf_len,
+			   uint8_t *sense_key, uint16_t *asc_ascq)
 {
-	unsigned int sense_buf_len = cmd->io_hdr.sb_len_wr;
-	uint8_t *sense_buf = cmd->sense_buf;
+	*sense_key = 0;
+	*asc_ascq = 0;
 
-	if (sense_buf_len < 4) {
-		cmd->sense_key = 0;
-		cmd->asc_ascq = 0;
+	if (sense_buf_len < 4)
 		return;
-	}
 
 	if ((sense_buf[0] & 0x7F) == 0x72 ||
 	    (sense_buf[0] & 0x7F) == 0x73) {
 		/* store sense key, ASC/ASCQ */
-		cmd->sense_key = sense_buf[1] & 0x0F;
-		cmd->asc_ascq = ((int)sense_buf[2] << 8) | (int)sense_buf[3];
+		*sense_key = sense_buf[1] & 0x0F;
+		*asc_ascq = ((int)sense_buf[2] << 8) | (int)sense_buf[3];
 		return;
 	}
 
-	if (sense_buf_len < 14) {
-		cmd->sense_key = 0;
-		cmd->asc_ascq = 0;
+	if (sense_buf_len < 14)
 		return;
-	}
 
 	if ((sense_buf[0] & 0x7F) == 0x70 ||
 	    (sense_buf[0] & 0x7F) == 0x71) {
 		/* store sense key, ASC/ASCQ */
-		cmd->sense_key = sense_buf[2] & 0x0F;
-		cmd->asc_ascq = ((int)sense_buf[12] << 8) | (int)sense_buf[13];
+		*sense_key = sense_buf[2] & 0x0F;
+		*asc_ascq = ((int)sense_buf[12] << 8) | (int)sense_buf[13];
 	}
 }
 
+/*
+ * Get comamnd ASC/ASCQ.
+ */
+static void cdl_sg_get_sense(struct cdl_sg_cmd *cmd)
+{
+	cdl_sg_get_sense_data(cmd->sense_buf, cmd->io_hdr.sb_len_wr,
+			      &cmd->sense_key, &cmd->asc_ascq);
+}
+
 int cdl_exec_cmd(struct cdl_dev *dev, struct cdl_sg_cmd *cmd)
 {
 	int ret;
@@ -504,6 +508,7 @@ static int cdl_get_dev_info(struct cdl_dev *dev)
 
 	capacity = cdl_sg_get_be64(&cmd.buf[0]) + 1;
 	lba_size = cdl_sg_get_be32(&cmd.buf[8]);
+	dev->lba_size = lba_size;
 	dev->capacity = (capacity * lba_size) >> 9;
 
 	/* Get the device command timeout */
@@ -547,9 +552,11 @@ static int cdl_dev_init(struct cdl_dev *dev)
 }
 
 /*
- * Open a device.
+ * Open a device. With @excl, the device is opened exclusively: this fails
+ * if the device is mounted or opened exclusively by another process. Users
+ * only reading the device pages should not request an exclusive open.
  */
-int cdl_open_dev(struct cdl_dev *dev, mode_t mode)
+int cdl_open_dev(struct cdl_dev *dev, mode_t mode, bool excl)
 {
 	struct stat st;
 	int ret = 0;
@@ -573,7 +580,7 @@ int cdl_open_dev(struct cdl_dev *dev, mode_t mode)
 	}
 
 	/* Open device */
-	dev->fd = open(dev->path, mode | O_EXCL);
+	dev->fd = open(dev->path, excl ? mode | O_EXCL : mode);
 	if (dev->fd < 0) {
 		fprintf(stderr,
 			"Open %s failed %d (%s)\n",
@@ -627,8 +634,32 @@ void cdl_close_dev(struct cdl_dev *dev)
  */
 void cdl_revalidate_dev(struct cdl_dev *dev)
 {
+	if (dev->flags & CDL_DEFER_REVALIDATE) {
+		dev->flags |= CDL_NEED_REVALIDATE;
+		return;
+	}
+
 	if (cdl_dev_use_ata(dev))
 		cdl_ata_revalidate(dev);
 
 	cdl_scsi_revalidate(dev);
 }
+
+/*
+ * Defer device revalidations to execute several changes with a single
+ * revalidation. When ending the deferral, revalidate the device if any
+ * change needed it.
+ */
+void cdl_defer_revalidate(struct cdl_dev *dev, bool defer)
+{
+	if (defer) {
+		dev->flags |= CDL_DEFER_REVALIDATE;
+		return;
+	}
+
+	dev->flags &= ~CDL_DEFER_REVALIDATE;
+	if (dev->flags & CDL_NEED_REVALIDATE) {
+		dev->flags &= ~CDL_NEED_REVALIDATE;
+		cdl_revalidate_dev(dev);
+	}
+}
@@ -0,0 +1,141 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include "cdl.h"
+
+#include <string.h>
+
+/*
+ * Get the bucket index of a value.
+ */
+static unsigned int cdl_hist_idx(uint64_t val)
+{
+	unsigned int msb, shift;
+
+	if (val < CDL_HIST_SUB)
+		return val;
+
+	msb = 63 - __builtin_clzll(val);
+	shift = msb - CDL_HIST_SUB_BITS;
+
+	return (shift + 1) * CDL_HIST_SUB + ((val >> shift) & (CDL_HIST_SUB - 1));
+}
+
+/*
+ * Get the lowest value of a bucket.
+ */
+uint64_t cdl_hist_bucket_val(unsigned int idx)
+{
+	unsigned int shift;
+
+	if (idx < CDL_HIST_SUB)
+		return idx;
+
+	shift = idx / CDL_HIST_SUB - 1;
+
+	return (uint64_t)(CDL_HIST_SUB + idx % CDL_HIST_SUB) << shift;
+}
+
+void cdl_hist_init(struct cdl_hist *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+void cdl_hist_add(struct cdl_hist *h, uint64_t val)
+{
+	h->buckets[cdl_hist_idx(val)]++;
+	h->count++;
+	h->sum += val;
+	if (val < h->min)
+		h->min = val;
+	if (val > h->max)
+		h->max = val;
+}
+
+/*
+ * Add a value to a histogram updated concurrently by several threads or
+ * processes (e.g. a histogram in shared memory).
+ */
+void cdl_hist_add_atomic(struct cdl_hist *h, uint64_t val)
+{
+	uint64_t cur;
+
+	__atomic_fetch_add(&h->buckets[cdl_hist_idx(val)], 1,
+			   __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sum, val, __ATOMIC_RELAXED);
+
+	cur = __atomic_load_n(&h->min, __ATOMIC_RELAXED);
+	while (val < cur &&
+	       !__atomic_compare_exchange_n(&h->min, &cur, val, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	cur = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+	while (val > cur &&
+	       !__atomic_compare_exchange_n(&h->max, &cur, val, true,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void cdl_hist_merge(struct cdl_hist *dst, struct cdl_hist *src)
+{
+	unsigned int i;
+
+	if (!src->count)
+		return;
+
+	for (i = 0; i < CDL_HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/*
+ * Get a percentile (0 to 100) of the histogram values. The lowest value of
+ * the bucket holding the percentile is returned, clamped to the histogram
+ * minimum and maximum values.
+ */
+uint64_t cdl_hist_percentile(struct cdl_hist *h, double pct)
+{
+	uint64_t target, c = 0, val;
+	unsigned int i;
+
+	if (!h->count)
+		return 0;
+
+	target = (uint64_t)((double)h->count * pct / 100.0);
+	if (target < 1)
+		target = 1;
+
+	for (i = 0; i < CDL_HIST_BUCKETS; i++) {
+		c += h->buckets[i];
+		if (c >= target)
+			break;
+	}
+
+	val = cdl_hist_bucket_val(i);
+	if (val < h->min)
+		return h->min;
+	if (val > h->max)
+		return h->max;
+
+	return val;
+}
+
+uint64_t cdl_hist_avg(struct cdl_hist *h)
+{
+	if (!h->count)
+		return 0;
+
+	return h->sum / h->count;
+}
@@ -0,0 +1,309 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+#include "cdl.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <time.h>
+#include <libgen.h>
+
+static void *cdl_schedule_grow(void *array, int nr, size_t size)
+{
+	void *a;
+
+	a = realloc(array, size * (nr + 1));
+	if (!a) {
+		fprintf(stderr, "No memory for schedule\n");
+		return NULL;
+	}
+
+	memset((char *)a + size * nr, 0, size);
+
+	return a;
+}
+
+static struct cdl_profile *cdl_schedule_add_profile(struct cdl_schedule *s,
+						    char *name)
+{
+	struct cdl_profile *p;
+	int i;
+
+	if (!*name || strlen(name) >= CDL_PROFILE_NAME_LEN ||
+	    strpbrk(name, " \t")) {
+		fprintf(stderr, "Invalid profile name \"%s\"\n", name);
+		return NULL;
+	}
+
+	if (cdl_schedule_find_profile(s, name) >= 0) {
+		fprintf(stderr, "Profile %s defined several times\n", name);
+		return NULL;
+	}
+
+	p = cdl_schedule_grow(s->profiles, s->nr_profiles, sizeof(*p));
+	if (!p)
+		return NULL;
+	s->profiles = p;
+
+	p = &s->profiles[s->nr_profiles];
+	strcpy(p->name, name);
+	for (i = 0; i < CDL_MAX_PAGES; i++)
+		p->pages[i].cdlp = CDLP_NONE;
+	s->nr_profiles++;
+
+	return p;
+}
+
+/*
+ * Parse a page file of a profile. Relative paths are relative to the
+ * directory of the schedule file.
+ */
+static int cdl_schedule_parse_file(struct cdl_dev *dev, const char *path,
+				   struct cdl_profile *p, char *file)
+{
+	char fpath[PATH_MAX], *dpath;
+	struct cdl_page page;
+	FILE *f;
+	int ret;
+
+	if (file[0] == '/') {
+		snprintf(fpath, sizeof(fpath), "%s", file);
+	} else {
+		dpath = strdup(path);
+		if (!dpath)
+			return -ENOMEM;
+		snprintf(fpath, sizeof(fpath), "%s/%s", dirname(dpath), file);
+		free(dpath);
+	}
+
+	f = fopen(fpath, "r");
+	if (!f) {
+		fprintf(stderr, "Open file %s failed (%s)\n",
+			fpath, strerror(errno));
+		return -errno;
+	}
+
+	ret = cdl_page_parse_file(f, dev, &page);
+	fclose(f);
+	if (ret)
+		return ret;
+
+	if (!cdl_page_supported(dev, page.cdlp)) {
+		fprintf(stderr, "Page %s is not supported\n",
+			cdl_page_name(page.cdlp));
+		return -EINVAL;
+	}
+
+	if (p->pages[page.cdlp].cdlp != CDLP_NONE) {
+		fprintf(stderr, "Profile %s: page %s specified several times\n",
+			p->name, cdl_page_name(page.cdlp));
+		return -EINVAL;
+	}
+
+	p->pages[page.cdlp] = page;
+
+	return 0;
+}
+
+static int cdl_schedule_add_rule(struct cdl_schedule *s,
+				 enum cdl_rule_type type, const char *rule)
+{
+	char str[CDL_LINE_MAX_LEN], *name, *end;
+	struct cdl_rule *r;
+	int h, m, n = 0;
+	int profile;
+
+	snprintf(str, sizeof(str), "%s", rule);
+
+	/* The profile name is the last word of the rule */
+	name = str + strlen(str);
+	while (name > str && !isblank(name[-1]))
+		name--;
+	if (name == str)
+		return -EINVAL;
+	for (end = name - 1; end >= str && isblank(*end); end--)
+		*end = '\0';
+
+	profile = cdl_schedule_find_profile(s, name);
+	if (profile < 0) {
+		fprintf(stderr, "Profile %s is not defined\n", name);
+		return -EINVAL;
+	}
+
+	if (type == CDL_RULE_AT &&
+	    (sscanf(str, "%d:%d%n", &h, &m, &n) != 2 || str[n] ||
+	     h < 0 || h > 23 || m < 0 || m > 59))
+		return -EINVAL;
+
+	r = cdl_schedule_grow(s->rules, s->nr_rules, sizeof(*r));
+	if (!r)
+		return -ENOMEM;
+	s->rules = r;
+
+	r = &s->rules[s->nr_rules];
+	r->type = type;
+	r->profile = profile;
+	if (type == CDL_RULE_AT) {
+		r->minute = h * 60 + m;
+	} else {
+		r->path = strdup(str);
+		if (!r->path)
+			return -ENOMEM;
+	}
+	s->nr_rules++;
+
+	return 0;
+}
+
+/*
+ * Parse a schedule file: "== profile <name>" sections listing the page
+ * files of the profile with "file:" lines, followed by a "== rules" section
+ * with "at: <hh:mm> <profile>" rules switching profile at a time of the day
+ * and "when: <path> <profile>" rules selecting a profile while a file
+ * exists. Event rules take precedence over time of the day rules, in the
+ * order of the file.
+ */
+int cdl_schedule_parse(struct cdl_dev *dev, const char *path,
+		       struct cdl_schedule *s)
+{
+	char line[CDL_LINE_MAX_LEN];
+	struct cdl_profile *p = NULL;
+	bool rules = false;
+	char *str, *val;
+	int ret = 0;
+	FILE *f;
+
+	memset(s, 0, sizeof(*s));
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Open file %s failed (%s)\n",
+			path, strerror(errno));
+		return -errno;
+	}
+
+	while (!ret) {
+		str = cdl_get_line(f, line);
+		if (!str)
+			break;
+
+		if (strncmp(str, "== profile ", 11) == 0) {
+			if (rules) {
+				fprintf(stderr,
+					"Profiles must be defined before "
+					"the rules\n");
+				ret = -EINVAL;
+				break;
+			}
+			p = cdl_schedule_add_profile(s,
+						cdl_skip_spaces(str + 10, 0));
+			if (!p)
+				ret = -EINVAL;
+			continue;
+		}
+
+		if (strcmp(str, "== rules") == 0) {
+			rules = true;
+			continue;
+		}
+
+		val = strchr(str, ':');
+		if (val)
+			val = cdl_skip_spaces(val, 1);
+		if (!val)
+			ret = -EINVAL;
+		else if (!rules && p && strncmp(str, "file:", 5) == 0)
+			ret = cdl_schedule_parse_file(dev, path, p, val);
+		else if (rules && strncmp(str, "at:", 3) == 0)
+			ret = cdl_schedule_add_rule(s, CDL_RULE_AT, val);
+		else if (rules && strncmp(str, "when:", 5) == 0)
+			ret = cdl_schedule_add_rule(s, CDL_RULE_WHEN, val);
+		else
+			ret = -EINVAL;
+
+		if (ret)
+			fprintf(stderr, "Invalid line \"%s\"\n", str);
+	}
+
+	fclose(f);
+
+	if (!ret && !s->nr_profiles) {
+		fprintf(stderr, "No profile defined\n");
+		ret = -EINVAL;
+	}
+
+	if (ret) {
+		cdl_schedule_free(s);
+		return ret;
+	}
+
+	return 0;
+}
+
+void cdl_schedule_free(struct cdl_schedule *s)
+{
+	int i;
+
+	for (i = 0; i < s->nr_rules; i++)
+		free(s->rules[i].path);
+	free(s->rules);
+	free(s->profiles);
+	memset(s, 0, sizeof(*s));
+}
+
+int cdl_schedule_find_profile(struct cdl_schedule *s, const char *name)
+{
+	int i;
+
+	for (i = 0; i < s->nr_profiles; i++) {
+		if (strcmp(s->profiles[i].name, name) == 0)
+			return i;
+	}
+
+	return -1;
+}
+
+/*
+ * Get the profile selected by the rules at a given time: the profile of the
+ * first "when" rule with an existing event file, or otherwise the profile of
+ * the last "at" rule reached in the day, wrapping around to the last rule of
+ * the previous day. Return -1 if no rule applies.
+ */
+int cdl_schedule_select(struct cdl_schedule *s, time_t now)
+{
+	int i, minute, best = -1, last = -1;
+	struct tm tm;
+
+	for (i = 0; i < s->nr_rules; i++) {
+		if (s->rules[i].type == CDL_RULE_WHEN &&
+		    access(s->rules[i].path, F_OK) == 0)
+			return s->rules[i].profile;
+	}
+
+	localtime_r(&now, &tm);
+	minute = tm.tm_hour * 60 + tm.tm_min;
+
+	for (i = 0; i < s->nr_rules; i++) {
+		if (s->rules[i].type != CDL_RULE_AT)
+			continue;
+		if (s->rules[i].minute <= minute &&
+		    (best < 0 || s->rules[i].minute >= s->rules[best].minute))
+			best = i;
+		if (last < 0 || s->rules[i].minute >= s->rules[last].minute)
+			last = i;
+	}
+
+	if (best < 0)
+		best = last;
+	if (best < 0)
+		return -1;
+
+	return s->rules[best].profile;
+}
@@ -311,35 +311,20 @@ int cdl_scsi_init(struct cdl_dev *dev)
 }
 
 /*
- * Read a CDL page from the device.
+ * Parse a CDL page from its mode sense data.
  */
-int cdl_scsi_read_page(struct cdl_dev *dev, enum cdl_p cdlp,
-		       struct cdl_page *page)
+int cdl_scsi_parse_page(struct cdl_dev *dev, enum cdl_p cdlp,
+			struct cdl_page *page, uint8_t *msbuf, size_t msbufsz)
 {
-	struct cdl_sg_cmd cmd;
 	struct cdl_desc *desc = &page->descs[0];
 	uint8_t *buf;
-	int i, ret;
-
-	/* Get a CDL page */
-	cdl_init_cmd(&cmd, 10, SG_DXFER_FROM_DEV, 512);
-	cmd.cdb[0] = 0x5a; /* MODE SENSE 10 */
-	cmd.cdb[1] = 0x08; /* DBD = 1 */
-	cmd.cdb[2] = 0x0A;
-	cmd.cdb[3] = cdl_page_code(cdlp);
-	cdl_sg_set_be16(&cmd.cdb[7], 512);
-
-	ret = cdl_exec_cmd(dev, &cmd);
-	if (ret) {
-		cdl_dev_err(dev, "MODE SENSE 10 failed\n");
-		return ret;
-	}
+	int i;
 
 	/* Check that we do not have any block descriptor */
-	if (cdl_sg_get_be16(&cmd.buf[6])) {
+	if (cdl_sg_get_be16(&msbuf[6])) {
 		fprintf(stderr,
 			"%s: DBD = 1 but got %d B of block descriptors\n",
-			dev->name, (int)cdl_sg_get_be16(&cmd.buf[6]));
+			dev->name, (int)cdl_sg_get_be16(&msbuf[6]));
 		return -EIO;
 	}
 
@@ -347,19 +332,19 @@ int cdl_scsi_read_page(struct cdl_dev *dev, enum cdl_p cdlp,
 	 * Save the mode sense buffer as we will need it for mode select
 	 * when changing the page descriptors.
 	 */
-	page->msbufsz = cmd.bufsz;
 	if (!page->msbuf) {
-		page->msbuf = malloc(page->msbufsz);
+		page->msbuf = malloc(CDL_SG_BUF_MAX_SIZE);
 		if (!page->msbuf) {
 			fprintf(stderr, "%s: No memory for page %s mode sense buffer\n",
 				dev->name, cdl_page_name(cdlp));
 			return -ENOMEM;
 		}
 	}
-	memcpy(page->msbuf, cmd.buf, page->msbufsz);
+	page->msbufsz = msbufsz;
+	memcpy(page->msbuf, msbuf, page->msbufsz);
 
 	/* Skip header and block descriptors */
-	buf = cmd.buf + 8 + cdl_sg_get_be16(&cmd.buf[6]);
+	buf = msbuf + 8 + cdl_sg_get_be16(&msbuf[6]);
 
 	if ((buf[0] & 0x3f) != 0x0a ||
 	    buf[1] != cdl_page_code(cdlp)) {
@@ -397,23 +382,130 @@ int cdl_scsi_read_page(struct cdl_dev *dev, enum cdl_p cdlp,
 }
 
 /*
- * Write a CDL page to the device.
+ * Read a CDL page from the device.
  */
-int cdl_scsi_write_page(struct cdl_dev *dev, struct cdl_page *page)
+int cdl_scsi_read_page(struct cdl_dev *dev, enum cdl_p cdlp,
+		       struct cdl_page *page)
 {
-	struct cdl_desc *desc = &page->descs[0];
-	uint8_t cdlp = page->cdlp;
 	struct cdl_sg_cmd cmd;
-	uint8_t *buf = cmd.buf;
-	size_t bufsz;
-	int i, ret;
+	int ret;
+
+	/* Get a CDL page */
+	cdl_init_cmd(&cmd, 10, SG_DXFER_FROM_DEV, 512);
+	cmd.cdb[0] = 0x5a; /* MODE SENSE 10 */
+	cmd.cdb[1] = 0x08; /* DBD = 1 */
+	cmd.cdb[2] = 0x0A;
+	cmd.cdb[3] = cdl_page_code(cdlp);
+	cdl_sg_set_be16(&cmd.cdb[7], 512);
+
+	ret = cdl_exec_cmd(dev, &cmd);
+	if (ret) {
+		cdl_dev_err(dev, "MODE SENSE 10 failed\n");
+		return ret;
+	}
+
+	return cdl_scsi_parse_page(dev, cdlp, page, cmd.buf, cmd.bufsz);
+}
+
+/*
+ * Read all the supported CDL pages with a single MODE SENSE 10 command
+ * for all the subpages of the control mode page.
+ */
+int cdl_scsi_read_all_pages(struct cdl_dev *dev)
+{
+	uint8_t msbuf[CDL_SG_BUF_MAX_SIZE];
+	struct cdl_sg_cmd cmd;
+	unsigned int found = 0;
+	uint8_t *buf, *end;
+	size_t len, pgsz;
+	int cdlp, ret;
+
+	cdl_init_cmd(&cmd, 10, SG_DXFER_FROM_DEV, CDL_SG_BUF_MAX_SIZE);
+	cmd.cdb[0] = 0x5a; /* MODE SENSE 10 */
+	cmd.cdb[1] = 0x08; /* DBD = 1 */
+	cmd.cdb[2] = 0x0A;
+	cmd.cdb[3] = 0xFF; /* All subpages */
+	cdl_sg_set_be16(&cmd.cdb[7], CDL_SG_BUF_MAX_SIZE);
+
+	ret = cdl_exec_cmd(dev, &cmd);
+	if (ret) {
+		/* Subpage FFh is optional: read the pages one at a time */
+		for (cdlp = 0; cdlp < CDL_MAX_PAGES; cdlp++) {
+			if (!cdl_page_supported(dev, cdlp))
+				continue;
+			ret = cdl_scsi_read_page(dev, cdlp,
+						 &dev->cdl_pages[cdlp]);
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
+	len = cdl_sg_get_be16(&cmd.buf[0]) + 2;
+	if (len > cmd.bufsz)
+		len = cmd.bufsz;
+	buf = cmd.buf + 8 + cdl_sg_get_be16(&cmd.buf[6]);
+	end = cmd.buf + len;
 
 	/*
-	 * Initialize MODE SELECT 10 command: use the mode sense use the
-	 * mode sense buffer to initialize the command buffer.
+	 * Build the mode sense data of each CDL page, as returned when
+	 * reading the page alone.
 	 */
+	while (buf + 4 <= end) {
+		/* Skip the control mode page (page_0 format) */
+		if (!(buf[0] & 0x40)) {
+			buf += 2 + buf[1];
+			continue;
+		}
+
+		pgsz = 4 + cdl_sg_get_be16(&buf[2]);
+		if (buf + pgsz > end)
+			break;
+
+		for (cdlp = 0; cdlp < CDL_MAX_PAGES; cdlp++) {
+			if (buf[1] != cdl_page_code(cdlp) ||
+			    !cdl_page_supported(dev, cdlp))
+				continue;
+
+			memcpy(msbuf, cmd.buf, 8);
+			cdl_sg_set_be16(&msbuf[0], 6 + pgsz);
+			cdl_sg_set_be16(&msbuf[6], 0);
+			memcpy(&msbuf[8], buf, pgsz);
+			ret = cdl_scsi_parse_page(dev, cdlp,
+						  &dev->cdl_pages[cdlp],
+						  msbuf, 8 + pgsz);
+			if (ret)
+				return ret;
+			found |= 1 << cdlp;
+		}
+
+		buf += pgsz;
+	}
+
+	for (cdlp = 0; cdlp < CDL_MAX_PAGES; cdlp++) {
+		if (cdl_page_supported(dev, cdlp) && !(found & (1 << cdlp))) {
+			cdl_dev_err(dev, "Page %s not found\n",
+				    cdl_page_name(cdlp));
+			return -ENODATA;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Prepare the MODE SELECT 10 parameter list for a CDL page, using the page
+ * mode sense buffer. Return the parameter list length.
+ */
+size_t cdl_scsi_page_buf(struct cdl_dev *dev, struct cdl_page *page,
+			 uint8_t *buf)
+{
+	uint8_t cdlp = page->cdlp;
+	struct cdl_desc d;
+	size_t bufsz;
+	int i;
+
 	bufsz = dev->cdl_pages[cdlp].msbufsz;
-	cdl_init_cmd(&cmd, 10, SG_DXFER_TO_DEV, bufsz);
 	memcpy(buf, dev->cdl_pages[cdlp].msbuf, bufsz);
 
 	cdl_sg_set_be16(&buf[0], 0); /* Clear mode data length */
@@ -430,9 +522,11 @@ int cdl_scsi_write_page(struct cdl_dev *dev, struct cdl_page *page)
 		/* A and B limits page */
 		cdl_sg_set_be16(&buf[2], 0x0020);
 		buf += 8;
-		for (i = 0; i < CDL_MAX_DESC; i++, buf += 4, desc++) {
-			buf[0] = (desc->cdltunit & 0x3) << 5;
-			cdl_sg_set_be16(&buf[2], desc->duration);
+		for (i = 0; i < CDL_MAX_DESC; i++, buf += 4) {
+			d = page->descs[i];
+			cdl_desc_scsi_encode(cdlp, &d);
+			buf[0] = (d.cdltunit & 0x7) << 5;
+			cdl_sg_set_be16(&buf[2], d.duration);
 		}
 	} else {
 		/* T2A and T2B limits page */
@@ -440,17 +534,33 @@ int cdl_scsi_write_page(struct cdl_dev *dev, struct cdl_page *page)
 		if (cdlp == CDLP_T2A)
 			buf[7] = (page->perf_vs_duration_guideline & 0x0f) << 4;
 		buf += 8;
-		for (i = 0; i < CDL_MAX_DESC; i++, buf += 32, desc++) {
-			buf[0] = desc->cdltunit & 0x0f;
-			cdl_sg_set_be16(&buf[2], desc->max_inactive_time);
-			cdl_sg_set_be16(&buf[4], desc->max_active_time);
-			buf[6] = ((desc->max_inactive_policy & 0x0f) << 4) |
-				(desc->max_active_policy & 0x0f);
-			cdl_sg_set_be16(&buf[10], desc->duration);
-			buf[14] = desc->duration_policy & 0x0f;
+		for (i = 0; i < CDL_MAX_DESC; i++, buf += 32) {
+			d = page->descs[i];
+			cdl_desc_scsi_encode(cdlp, &d);
+			buf[0] = d.cdltunit & 0x0f;
+			cdl_sg_set_be16(&buf[2], d.max_inactive_time);
+			cdl_sg_set_be16(&buf[4], d.max_active_time);
+			buf[6] = ((d.max_inactive_policy & 0x0f) << 4) |
+				(d.max_active_policy & 0x0f);
+			cdl_sg_set_be16(&buf[10], d.duration);
+			buf[14] = d.duration_policy & 0x0f;
 		}
 	}
 
+	return bufsz;
+}
+
+/*
+ * Issue a MODE SELECT 10 command with a prepared parameter list.
+ */
+int cdl_scsi_mode_select(struct cdl_dev *dev, uint8_t *buf, size_t bufsz)
+{
+	struct cdl_sg_cmd cmd;
+	int ret;
+
+	cdl_init_cmd(&cmd, 10, SG_DXFER_TO_DEV, bufsz);
+	memcpy(cmd.buf, buf, bufsz);
+
 	cmd.cdb[0] = 0x55; /* MODE SELECT 10 */
 	cmd.cdb[1] = 0x10; /* PF = 1, RTD = 0, SP = 0 */
 	if (dev->flags & CDL_USE_MS_SP)
@@ -465,6 +575,31 @@ int cdl_scsi_write_page(struct cdl_dev *dev, struct cdl_page *page)
 	return 0;
 }
 
+/*
+ * Write a CDL page to the device.
+ */
+int cdl_scsi_write_page(struct cdl_dev *dev, struct cdl_page *page)
+{
+	uint8_t buf[CDL_SG_BUF_MAX_SIZE];
+	size_t bufsz;
+	int ret;
+
+	bufsz = cdl_scsi_page_buf(dev, page, buf);
+
+	ret = cdl_scsi_mode_select(dev, buf, bufsz);
+	if (ret)
+		return ret;
+
+	/*
+	 * Update the cached page with the data written, restoring the mode
+	 * data length cleared for the mode select.
+	 */
+	cdl_sg_set_be16(&buf[0], bufsz - 2);
+
+	return cdl_scsi_parse_page(dev, page->cdlp,
+				   &dev->cdl_pages[page->cdlp], buf, bufsz);
+}
+
 /*
  * Check the device CDL enable status.
  */
@@ -0,0 +1,393 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include "cdl.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define CDL_SGIO_DID_TIME_OUT		0x03
+#define CDL_SGIO_DRIVER_TIMEOUT		0x06
+#define CDL_SGIO_DRIVER_STATUS_MASK	0x0f
+
+#define CDL_SGIO_ABORTED_COMMAND	0x0b
+
+/*
+ * ATA PASS-THROUGH (32) service action and NCQ commands.
+ */
+#define CDL_SGIO_ATA_32_SA		0x1ff0
+#define CDL_SGIO_ATA_PROTO_FPDMA	12
+#define CDL_SGIO_ATA_READ_FPDMA		0x60
+#define CDL_SGIO_ATA_WRITE_FPDMA	0x61
+
+unsigned long long cdl_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Get the SG node of a block device.
+ */
+static int cdl_sgio_get_sg_path(struct cdl_dev *dev, struct cdl_sgio *sgio)
+{
+	char path[PATH_MAX];
+	struct dirent *d;
+	struct stat st;
+	DIR *dir;
+	int ret = -ENODEV;
+
+	if (stat(dev->path, &st) == 0 && S_ISCHR(st.st_mode)) {
+		snprintf(sgio->path, sizeof(sgio->path), "%s", dev->path);
+		return 0;
+	}
+
+	snprintf(path, sizeof(path),
+		 "/sys/block/%s/device/scsi_generic", dev->name);
+	dir = opendir(path);
+	if (!dir) {
+		cdl_dev_err(dev, "No SG node found (is the sg driver loaded ?)\n");
+		return -ENODEV;
+	}
+
+	while ((d = readdir(dir)) != NULL) {
+		if (d->d_name[0] == '.')
+			continue;
+		snprintf(sgio->path, sizeof(sgio->path), "/dev/%s", d->d_name);
+		ret = 0;
+		break;
+	}
+
+	closedir(dir);
+
+	if (ret)
+		cdl_dev_err(dev, "No SG node found\n");
+
+	return ret;
+}
+
+/*
+ * Open the device SG node with enough file descriptors for a queue depth.
+ */
+int cdl_sgio_open(struct cdl_dev *dev, struct cdl_sgio *sgio,
+		  unsigned int qd)
+{
+	int i, ret;
+
+	if (!qd || qd > CDL_SGIO_MAX_QD) {
+		cdl_dev_err(dev, "Invalid queue depth %u (max %d)\n",
+			    qd, CDL_SGIO_MAX_QD);
+		return -EINVAL;
+	}
+
+	ret = cdl_sgio_get_sg_path(dev, sgio);
+	if (ret)
+		return ret;
+
+	sgio->qd = qd;
+	sgio->nr_fds = (qd + CDL_SGIO_FD_MAX_QD - 1) / CDL_SGIO_FD_MAX_QD;
+	sgio->fds = calloc(sgio->nr_fds, sizeof(int));
+	sgio->fd_qd = calloc(sgio->nr_fds, sizeof(unsigned int));
+	if (!sgio->fds || !sgio->fd_qd) {
+		cdl_sgio_close(sgio);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < sgio->nr_fds; i++)
+		sgio->fds[i] = -1;
+
+	for (i = 0; i < sgio->nr_fds; i++) {
+		sgio->fds[i] = open(sgio->path, O_RDWR | O_NONBLOCK);
+		if (sgio->fds[i] < 0) {
+			ret = -errno;
+			fprintf(stderr, "Open %s failed %d (%s)\n",
+				sgio->path, errno, strerror(errno));
+			cdl_sgio_close(sgio);
+			return ret;
+		}
+	}
+
+	/* Use the device command timeout for all commands */
+	sgio->timeout = dev->cmd_timeout / 1000000ULL;
+	if (!sgio->timeout)
+		sgio->timeout = 30000;
+
+	return 0;
+}
+
+void cdl_sgio_close(struct cdl_sgio *sgio)
+{
+	int i;
+
+	if (sgio->fds) {
+		for (i = 0; i < sgio->nr_fds; i++) {
+			if (sgio->fds[i] >= 0)
+				close(sgio->fds[i]);
+		}
+	}
+
+	free(sgio->fds);
+	sgio->fds = NULL;
+	free(sgio->fd_qd);
+	sgio->fd_qd = NULL;
+	sgio->nr_fds = 0;
+}
+
+int cdl_sgio_alloc_cmd(struct cdl_sgio_cmd *cmd, size_t bufsz)
+{
+	memset(cmd, 0, sizeof(*cmd));
+
+	if (posix_memalign(&cmd->buf, sysconf(_SC_PAGESIZE), bufsz))
+		return -ENOMEM;
+	memset(cmd->buf, 0, bufsz);
+	cmd->bufsz = bufsz;
+
+	return 0;
+}
+
+void cdl_sgio_free_cmd(struct cdl_sgio_cmd *cmd)
+{
+	free(cmd->buf);
+	cmd->buf = NULL;
+}
+
+/*
+ * READ 16 and WRITE 16: the duration limit descriptor index is split
+ * between the DLD2 bit of byte 1 and the DLD1 and DLD0 bits of byte 14.
+ */
+static void cdl_sgio_prep_16(struct cdl_sgio *sgio, struct cdl_sgio_cmd *cmd,
+			     uint32_t nr_lbas)
+{
+	enum cdl_cmd c = cmd->rw == CDL_READ ? CDL_READ_16 : CDL_WRITE_16;
+
+	cmd->io_hdr.cmd_len = 16;
+	cmd->cdb[0] = cdl_cmd_opcode(c);
+	if (sgio->fua)
+		cmd->cdb[1] |= 0x08;
+	cmd->cdb[1] |= (cmd->dld >> 2) & 0x01;
+	cdl_sg_set_be64(&cmd->cdb[2], cmd->lba);
+	cdl_sg_set_be32(&cmd->cdb[10], nr_lbas);
+	cmd->cdb[14] = (cmd->dld & 0x03) << 6;
+}
+
+/*
+ * READ 32 and WRITE 32: the duration limit descriptor index is in byte 11.
+ */
+static void cdl_sgio_prep_32(struct cdl_sgio *sgio, struct cdl_sgio_cmd *cmd,
+			     uint32_t nr_lbas)
+{
+	enum cdl_cmd c = cmd->rw == CDL_READ ? CDL_READ_32 : CDL_WRITE_32;
+
+	cmd->io_hdr.cmd_len = 32;
+	cmd->cdb[0] = cdl_cmd_opcode(c);
+	cmd->cdb[7] = 0x18; /* Additional CDB length */
+	cdl_sg_set_be16(&cmd->cdb[8], cdl_cmd_sa(c));
+	if (sgio->fua)
+		cmd->cdb[10] |= 0x08;
+	cmd->cdb[11] = cmd->dld & 0x07;
+	cdl_sg_set_be64(&cmd->cdb[12], cmd->lba);
+	cdl_sg_set_be32(&cmd->cdb[20], cmd->lba);
+	cdl_sg_set_be32(&cmd->cdb[28], nr_lbas);
+}
+
+/*
+ * READ FPDMA QUEUED and WRITE FPDMA QUEUED through ATA PASS-THROUGH (32),
+ * which is needed to set the auxiliary field holding the duration limit
+ * descriptor index. The NCQ tag in the count field is set by the SATL.
+ */
+static void cdl_sgio_prep_ata(struct cdl_sgio *sgio, struct cdl_sgio_cmd *cmd,
+			      uint32_t nr_lbas)
+{
+	cmd->io_hdr.cmd_len = 32;
+	cmd->cdb[0] = 0x7f;
+	cmd->cdb[7] = 0x18; /* Additional CDB length */
+	cdl_sg_set_be16(&cmd->cdb[8], CDL_SGIO_ATA_32_SA);
+	cmd->cdb[10] = (CDL_SGIO_ATA_PROTO_FPDMA << 1) | 0x01; /* extend */
+	/* t_type (logical sectors), byt_blok, t_length in features */
+	cmd->cdb[11] = 0x10 | 0x04 | 0x01;
+	if (cmd->rw == CDL_READ)
+		cmd->cdb[11] |= 0x08; /* t_dir */
+	cdl_sg_set_be64(&cmd->cdb[12], cmd->lba);
+	cdl_sg_set_be16(&cmd->cdb[20], nr_lbas);
+	cmd->cdb[24] = 0x40; /* device: LBA */
+	if (sgio->fua)
+		cmd->cdb[24] |= 0x80;
+	if (cmd->rw == CDL_READ)
+		cmd->cdb[25] = CDL_SGIO_ATA_READ_FPDMA;
+	else
+		cmd->cdb[25] = CDL_SGIO_ATA_WRITE_FPDMA;
+	cdl_sg_set_be32(&cmd->cdb[28], cmd->dld & 0x07);
+}
+
+/*
+ * Prepare a read or write command using the duration limit descriptor dld
+ * (0 for no limit).
+ */
+void cdl_sgio_prep_cmd(struct cdl_dev *dev, struct cdl_sgio *sgio,
+		       struct cdl_sgio_cmd *cmd, enum cdl_rw rw,
+		       uint64_t lba, uint32_t nr_lbas, uint8_t dld)
+{
+	size_t bufsz = (size_t)nr_lbas * dev->lba_size;
+
+	memset(&cmd->io_hdr, 0, sizeof(cmd->io_hdr));
+	memset(cmd->cdb, 0, sizeof(cmd->cdb));
+
+	cmd->rw = rw;
+	cmd->dld = dld;
+	cmd->lba = lba;
+	cmd->lat = 0;
+	cmd->sense_key = 0;
+	cmd->asc_ascq = 0;
+
+	if (sgio->use_ata)
+		cdl_sgio_prep_ata(sgio, cmd, nr_lbas);
+	else if (sgio->use_32)
+		cdl_sgio_prep_32(sgio, cmd, nr_lbas);
+	else
+		cdl_sgio_prep_16(sgio, cmd, nr_lbas);
+
+	cmd->io_hdr.interface_id = 'S';
+	cmd->io_hdr.cmdp = cmd->cdb;
+	cmd->io_hdr.dxfer_direction =
+		rw == CDL_READ ? SG_DXFER_FROM_DEV : SG_DXFER_TO_DEV;
+	cmd->io_hdr.dxferp = cmd->buf;
+	cmd->io_hdr.dxfer_len = bufsz < cmd->bufsz ? bufsz : cmd->bufsz;
+	cmd->io_hdr.mx_sb_len = CDL_SG_SENSE_MAX_LENGTH;
+	cmd->io_hdr.sbp = cmd->sense_buf;
+	cmd->io_hdr.timeout = sgio->timeout;
+	cmd->io_hdr.usr_ptr = cmd;
+}
+
+/*
+ * Submit a command using the first file descriptor with a free slot.
+ */
+int cdl_sgio_submit(struct cdl_sgio *sgio, struct cdl_sgio_cmd *cmd)
+{
+	int i;
+
+	for (i = 0; i < sgio->nr_fds; i++) {
+		if (sgio->fd_qd[i] < CDL_SGIO_FD_MAX_QD)
+			break;
+	}
+	if (i >= sgio->nr_fds)
+		return -EBUSY;
+
+	cmd->fdi = i;
+	cmd->start = cdl_now_ns();
+	if (write(sgio->fds[i], &cmd->io_hdr, sizeof(sg_io_hdr_t)) < 0) {
+		fprintf(stderr, "%s: Submit command failed %d (%s)\n",
+			sgio->path, errno, strerror(errno));
+		return -errno;
+	}
+
+	sgio->fd_qd[i]++;
+
+	return 0;
+}
+
+/*
+ * Wait for a command completion and return the completed command.
+ */
+struct cdl_sgio_cmd *cdl_sgio_reap(struct cdl_sgio *sgio)
+{
+	struct pollfd pfds[sgio->nr_fds];
+	struct cdl_sgio_cmd *cmd;
+	sg_io_hdr_t io_hdr;
+	int i, n;
+
+	while (1) {
+		for (i = 0, n = 0; i < sgio->nr_fds; i++) {
+			pfds[i].fd = sgio->fds[i];
+			pfds[i].events = sgio->fd_qd[i] ? POLLIN : 0;
+			pfds[i].revents = 0;
+			n += sgio->fd_qd[i];
+		}
+		if (!n)
+			return NULL;
+
+		if (poll(pfds, sgio->nr_fds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: poll failed %d (%s)\n",
+				sgio->path, errno, strerror(errno));
+			return NULL;
+		}
+
+		for (i = 0; i < sgio->nr_fds; i++) {
+			if (!(pfds[i].revents & POLLIN))
+				continue;
+
+			memset(&io_hdr, 0, sizeof(io_hdr));
+			io_hdr.interface_id = 'S';
+			if (read(sgio->fds[i], &io_hdr, sizeof(io_hdr)) < 0) {
+				if (errno == EAGAIN || errno == EINTR)
+					continue;
+				fprintf(stderr, "%s: Reap command failed %d (%s)\n",
+					sgio->path, errno, strerror(errno));
+				return NULL;
+			}
+
+			cmd = io_hdr.usr_ptr;
+			cmd->lat = cdl_now_ns() - cmd->start;
+			cmd->io_hdr = io_hdr;
+			sgio->fd_qd[i]--;
+
+			return cmd;
+		}
+	}
+}
+
+/*
+ * Get the status of a completed command. Commands failed because of a
+ * duration limit policy are reported with CDL_SGIO_LIMIT.
+ */
+enum cdl_sgio_status cdl_sgio_cmd_status(struct cdl_sgio *sgio,
+					 struct cdl_sgio_cmd *cmd)
+{
+	uint8_t driver_status =
+		cmd->io_hdr.driver_status & CDL_SGIO_DRIVER_STATUS_MASK;
+
+	if (cmd->io_hdr.host_status == CDL_SGIO_DID_TIME_OUT ||
+	    driver_status == CDL_SGIO_DRIVER_TIMEOUT)
+		return CDL_SGIO_TIMEOUT;
+
+	if (!cmd->io_hdr.status && !cmd->io_hdr.host_status &&
+	    !driver_status)
+		return CDL_SGIO_OK;
+
+	cdl_sg_get_sense_data(cmd->sense_buf, cmd->io_hdr.sb_len_wr,
+			      &cmd->sense_key, &cmd->asc_ascq);
+
+	/*
+	 * COMMAND TIMEOUT BEFORE PROCESSING, COMMAND TIMEOUT DURING
+	 * PROCESSING and COMMAND TIMEOUT DURING PROCESSING DUE TO ERROR
+	 * RECOVERY.
+	 */
+	if (cmd->asc_ascq >= 0x2e01 && cmd->asc_ascq <= 0x2e03)
+		return CDL_SGIO_LIMIT;
+
+	/*
+	 * Without NCQ sense data reporting, a SATL may only report an
+	 * aborted command for an ATA command failed by a limit policy.
+	 */
+	if (sgio->use_ata && cmd->dld &&
+	    cmd->sense_key == CDL_SGIO_ABORTED_COMMAND)
+		return CDL_SGIO_LIMIT;
+
+	return CDL_SGIO_ERROR;
+}
@@ -0,0 +1,764 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include "cdl.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/*
+ * Ring buffer data size per CPU (must be a power of 2 number of pages).
+ */
+#define CDL_TRACE_RING_PAGES	64
+
+/*
+ * Maximum number of commands in flight tracked (must be a power of 2).
+ */
+#define CDL_TRACE_INFLIGHT_BITS	13
+#define CDL_TRACE_INFLIGHT_MAX	(1U << CDL_TRACE_INFLIGHT_BITS)
+
+struct cdl_trace_rec {
+	uint64_t	time;
+	uint64_t	sector;
+	int		error;
+	uint8_t		complete;
+	uint8_t		retry;
+	uint8_t		rw;
+	uint8_t		dld;
+};
+
+struct cdl_trace_inflight {
+	uint64_t	sector;
+	uint64_t	time;
+	uint8_t		used;
+	uint8_t		rw;
+	uint8_t		dld;
+};
+
+static const char *cdl_tracefs[] = {
+	"/sys/kernel/tracing",
+	"/sys/kernel/debug/tracing",
+	NULL
+};
+
+/*
+ * Get a block layer tracepoint ID and the offset and size of the fields used.
+ */
+static int cdl_trace_get_event(const char *name, struct cdl_trace_event *ev)
+{
+	char path[PATH_MAX], line[CDL_LINE_MAX_LEN];
+	struct cdl_trace_field *fld;
+	char *f, *semi, *fname, *p;
+	FILE *file = NULL;
+	int i;
+
+	for (i = 0; cdl_tracefs[i]; i++) {
+		snprintf(path, sizeof(path), "%s/events/block/%s/id",
+			 cdl_tracefs[i], name);
+		file = fopen(path, "r");
+		if (file)
+			break;
+	}
+	if (!file) {
+		fprintf(stderr, "Tracepoint block/%s not found\n", name);
+		return -ENOENT;
+	}
+
+	if (fscanf(file, "%" SCNu64, &ev->id) != 1) {
+		fclose(file);
+		fprintf(stderr, "Invalid tracepoint block/%s ID\n", name);
+		return -EINVAL;
+	}
+	fclose(file);
+
+	snprintf(path, sizeof(path), "%s/events/block/%s/format",
+		 cdl_tracefs[i], name);
+	file = fopen(path, "r");
+	if (!file) {
+		fprintf(stderr, "Open %s failed (%s)\n", path, strerror(errno));
+		return -errno;
+	}
+
+	while (fgets(line, sizeof(line), file)) {
+		f = strstr(line, "field:");
+		if (!f)
+			continue;
+		semi = strchr(f, ';');
+		if (!semi)
+			continue;
+		*semi = '\0';
+
+		fname = strrchr(f, ' ');
+		if (!fname)
+			continue;
+		fname++;
+		p = strchr(fname, '[');
+		if (p)
+			*p = '\0';
+
+		if (strcmp(fname, "dev") == 0)
+			fld = &ev->dev;
+		else if (strcmp(fname, "sector") == 0)
+			fld = &ev->sector;
+		else if (strcmp(fname, "ioprio") == 0)
+			fld = &ev->ioprio;
+		else if (strcmp(fname, "rwbs") == 0)
+			fld = &ev->rwbs;
+		else if (strcmp(fname, "error") == 0)
+			fld = &ev->error;
+		else
+			continue;
+
+		p = strstr(semi + 1, "offset:");
+		if (!p || sscanf(p, "offset:%u;", &fld->offset) != 1)
+			continue;
+		p = strstr(semi + 1, "size:");
+		if (!p || sscanf(p, "size:%u;", &fld->size) != 1)
+			continue;
+	}
+
+	fclose(file);
+
+	if (!ev->dev.size || !ev->sector.size || !ev->rwbs.size) {
+		fprintf(stderr, "Invalid tracepoint block/%s format\n", name);
+		return -EINVAL;
+	}
+
+	if (!ev->ioprio.size) {
+		fprintf(stderr,
+			"Tracepoint block/%s has no ioprio field (kernel too old)\n",
+			name);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static uint64_t cdl_trace_get_val(uint8_t *raw, uint32_t raw_size,
+				  struct cdl_trace_field *fld)
+{
+	uint8_t v8;
+	uint16_t v16;
+	uint32_t v32;
+	uint64_t v64;
+
+	if (!fld->size || fld->offset + fld->size > raw_size)
+		return 0;
+
+	switch (fld->size) {
+	case 1:
+		memcpy(&v8, raw + fld->offset, 1);
+		return v8;
+	case 2:
+		memcpy(&v16, raw + fld->offset, 2);
+		return v16;
+	case 4:
+		memcpy(&v32, raw + fld->offset, 4);
+		return v32;
+	case 8:
+		memcpy(&v64, raw + fld->offset, 8);
+		return v64;
+	default:
+		return 0;
+	}
+}
+
+static int cdl_trace_open_event(struct cdl_trace *t, struct cdl_trace_event *ev,
+				int cpu)
+{
+	struct perf_event_attr attr;
+	char filter[64];
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_TRACEPOINT;
+	attr.size = sizeof(attr);
+	attr.config = ev->id;
+	attr.sample_period = 1;
+	attr.sample_type = PERF_SAMPLE_TIME | PERF_SAMPLE_RAW;
+	attr.disabled = 1;
+	attr.watermark = 1;
+	attr.wakeup_watermark = t->ring_size / 2;
+	attr.use_clockid = 1;
+	attr.clockid = CLOCK_MONOTONIC;
+
+	fd = syscall(__NR_perf_event_open, &attr, -1, cpu, -1,
+		     PERF_FLAG_FD_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	/* Filter in the kernel events for other devices, if possible */
+	snprintf(filter, sizeof(filter), "dev == %u", t->devt);
+	ioctl(fd, PERF_EVENT_IOC_SET_FILTER, filter);
+
+	return fd;
+}
+
+/*
+ * Start tracing commands of a device: open the block_rq_issue and
+ * block_rq_complete tracepoint events on all CPUs, with both events of
+ * a CPU sharing the same ring buffer.
+ */
+int cdl_trace_start(struct cdl_dev *dev, struct cdl_trace *t)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	struct stat st;
+	int cpu, fd, i, n = 0, ret;
+
+	if (stat(dev->path, &st) < 0 || !S_ISBLK(st.st_mode)) {
+		cdl_dev_err(dev, "Tracing requires a block device file\n");
+		return -EINVAL;
+	}
+
+	/* Kernel internal dev_t format */
+	t->devt = (major(st.st_rdev) << 20) | minor(st.st_rdev);
+
+	ret = cdl_trace_get_event("block_rq_issue", &t->issue);
+	if (ret)
+		return ret;
+	ret = cdl_trace_get_event("block_rq_complete", &t->complete);
+	if (ret)
+		return ret;
+	if (!t->complete.error.size) {
+		fprintf(stderr, "Invalid tracepoint block_rq_complete format\n");
+		return -EINVAL;
+	}
+
+	t->nr_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	t->ring_size = CDL_TRACE_RING_PAGES * page_size;
+	t->fds = calloc(t->nr_cpus * 2, sizeof(int));
+	t->rings = calloc(t->nr_cpus, sizeof(void *));
+	t->inflight = calloc(CDL_TRACE_INFLIGHT_MAX,
+			     sizeof(struct cdl_trace_inflight));
+	if (!t->fds || !t->rings || !t->inflight) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	for (cpu = 0; cpu < t->nr_cpus * 2; cpu++)
+		t->fds[cpu] = -1;
+
+	for (cpu = 0; cpu < t->nr_cpus; cpu++) {
+		fd = cdl_trace_open_event(t, &t->issue, cpu);
+		if (fd < 0) {
+			/* Offline CPU */
+			if (fd == -ENODEV || fd == -EINVAL)
+				continue;
+			fprintf(stderr, "perf_event_open failed %d (%s)\n",
+				-fd, strerror(-fd));
+			ret = fd;
+			goto err;
+		}
+		t->fds[cpu * 2] = fd;
+
+		t->rings[cpu] = mmap(NULL, page_size + t->ring_size,
+				     PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (t->rings[cpu] == MAP_FAILED) {
+			t->rings[cpu] = NULL;
+			ret = -errno;
+			fprintf(stderr, "mmap perf ring buffer failed (%s)\n",
+				strerror(errno));
+			goto err;
+		}
+
+		fd = cdl_trace_open_event(t, &t->complete, cpu);
+		if (fd < 0) {
+			ret = fd;
+			fprintf(stderr, "perf_event_open failed %d (%s)\n",
+				-fd, strerror(-fd));
+			goto err;
+		}
+		t->fds[cpu * 2 + 1] = fd;
+
+		if (ioctl(fd, PERF_EVENT_IOC_SET_OUTPUT, t->fds[cpu * 2]) < 0) {
+			ret = -errno;
+			fprintf(stderr, "Set perf event output failed (%s)\n",
+				strerror(errno));
+			goto err;
+		}
+
+		n++;
+	}
+
+	if (!n) {
+		ret = -ENODEV;
+		goto err;
+	}
+
+	for (cpu = 0; cpu < t->nr_cpus * 2; cpu++) {
+		if (t->fds[cpu] >= 0)
+			ioctl(t->fds[cpu], PERF_EVENT_IOC_ENABLE, 0);
+	}
+
+	for (i = 0; i <= CDL_MAX_DESC; i++) {
+		cdl_hist_init(&t->stats[CDL_READ][i].lat);
+		cdl_hist_init(&t->stats[CDL_WRITE][i].lat);
+	}
+
+	t->start = cdl_now_ns();
+
+	return 0;
+
+err:
+	cdl_trace_stop(t);
+	return ret;
+}
+
+void cdl_trace_stop(struct cdl_trace *t)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	int i;
+
+	if (t->fds) {
+		for (i = 0; i < t->nr_cpus * 2; i++) {
+			if (t->fds[i] >= 0) {
+				ioctl(t->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+				close(t->fds[i]);
+			}
+		}
+	}
+
+	if (t->rings) {
+		for (i = 0; i < t->nr_cpus; i++) {
+			if (t->rings[i])
+				munmap(t->rings[i], page_size + t->ring_size);
+		}
+	}
+
+	free(t->fds);
+	t->fds = NULL;
+	free(t->rings);
+	t->rings = NULL;
+	free(t->recs);
+	t->recs = NULL;
+	t->nr_recs = 0;
+	t->max_recs = 0;
+	free(t->inflight);
+	t->inflight = NULL;
+}
+
+static struct cdl_trace_rec *cdl_trace_add_rec(struct cdl_trace *t)
+{
+	struct cdl_trace_rec *recs;
+
+	if (t->nr_recs >= t->max_recs) {
+		recs = realloc(t->recs, (t->max_recs + 4096) *
+			       sizeof(struct cdl_trace_rec));
+		if (!recs)
+			return NULL;
+		t->recs = recs;
+		t->max_recs += 4096;
+	}
+
+	return &t->recs[t->nr_recs++];
+}
+
+static void cdl_trace_copy(uint8_t *dst, uint8_t *data, size_t data_size,
+			   uint64_t pos, size_t len)
+{
+	size_t ofst = pos & (data_size - 1);
+	size_t n = len;
+
+	if (ofst + n > data_size)
+		n = data_size - ofst;
+	memcpy(dst, data + ofst, n);
+	if (n < len)
+		memcpy(dst + n, data, len - n);
+}
+
+static void cdl_trace_decode(struct cdl_trace *t, uint64_t time,
+			     uint8_t *raw, uint32_t raw_size)
+{
+	struct cdl_trace_event *ev;
+	struct cdl_trace_rec *rec;
+	uint16_t common_type;
+	unsigned int i, ioprio;
+	char rwbs[16];
+	int rw = -1;
+
+	if (raw_size < sizeof(uint16_t))
+		return;
+
+	memcpy(&common_type, raw, sizeof(uint16_t));
+	if (common_type == t->issue.id)
+		ev = &t->issue;
+	else if (common_type == t->complete.id)
+		ev = &t->complete;
+	else
+		return;
+
+	if (cdl_trace_get_val(raw, raw_size, &ev->dev) != t->devt)
+		return;
+
+	/* Ignore flush, discard and other non read/write commands */
+	memset(rwbs, 0, sizeof(rwbs));
+	if (ev->rwbs.offset + ev->rwbs.size > raw_size)
+		return;
+	memcpy(rwbs, raw + ev->rwbs.offset,
+	       ev->rwbs.size < sizeof(rwbs) ? ev->rwbs.size : sizeof(rwbs) - 1);
+	for (i = 0; i < sizeof(rwbs) && rwbs[i]; i++) {
+		if (rwbs[i] == 'R') {
+			rw = CDL_READ;
+			break;
+		}
+		if (rwbs[i] == 'W') {
+			rw = CDL_WRITE;
+			break;
+		}
+		if (rwbs[i] == 'D' || rwbs[i] == 'N')
+			break;
+	}
+	if (rw < 0)
+		return;
+
+	rec = cdl_trace_add_rec(t);
+	if (!rec)
+		return;
+
+	memset(rec, 0, sizeof(*rec));
+	rec->time = time;
+	rec->rw = rw;
+	rec->sector = cdl_trace_get_val(raw, raw_size, &ev->sector);
+	if (ev == &t->complete) {
+		rec->complete = 1;
+		rec->error = (int32_t)cdl_trace_get_val(raw, raw_size,
+							&ev->error);
+	}
+
+	/* The I/O priority hint is the duration limit descriptor index */
+	ioprio = cdl_trace_get_val(raw, raw_size, &ev->ioprio);
+	rec->dld = (ioprio >> 3) & 0x3ff;
+	if (rec->dld > CDL_MAX_DESC)
+		rec->dld = 0;
+}
+
+/*
+ * Read all the records of a CPU ring buffer.
+ */
+static void cdl_trace_read_ring(struct cdl_trace *t, int cpu)
+{
+	struct perf_event_mmap_page *meta = t->rings[cpu];
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	uint8_t *data = (uint8_t *)t->rings[cpu] + page_size;
+	struct perf_event_header hdr;
+	uint8_t rec[t->ring_size < 65536 ? t->ring_size : 65536];
+	uint64_t head, tail, time, lost;
+	uint32_t raw_size;
+
+	head = __atomic_load_n(&meta->data_head, __ATOMIC_ACQUIRE);
+	tail = meta->data_tail;
+
+	while (tail < head) {
+		cdl_trace_copy((uint8_t *)&hdr, data, t->ring_size,
+			       tail, sizeof(hdr));
+		if (hdr.size < sizeof(hdr) || hdr.size > sizeof(rec)) {
+			tail = head;
+			break;
+		}
+		cdl_trace_copy(rec, data, t->ring_size, tail, hdr.size);
+
+		switch (hdr.type) {
+		case PERF_RECORD_SAMPLE:
+			memcpy(&time, rec + sizeof(hdr), sizeof(uint64_t));
+			memcpy(&raw_size, rec + sizeof(hdr) + sizeof(uint64_t),
+			       sizeof(uint32_t));
+			if (sizeof(hdr) + sizeof(uint64_t) +
+			    sizeof(uint32_t) + raw_size > hdr.size)
+				break;
+			cdl_trace_decode(t, time,
+					 rec + sizeof(hdr) + sizeof(uint64_t) +
+					 sizeof(uint32_t), raw_size);
+			break;
+		case PERF_RECORD_LOST:
+			memcpy(&lost, rec + sizeof(hdr) + sizeof(uint64_t),
+			       sizeof(uint64_t));
+			t->nr_lost += lost;
+			break;
+		default:
+			break;
+		}
+
+		tail += hdr.size;
+	}
+
+	__atomic_store_n(&meta->data_tail, tail, __ATOMIC_RELEASE);
+}
+
+static unsigned int cdl_trace_hash(uint64_t sector)
+{
+	return (sector * 0x9E3779B97F4A7C15ULL) >>
+		(64 - CDL_TRACE_INFLIGHT_BITS);
+}
+
+static void cdl_trace_issue(struct cdl_trace *t, struct cdl_trace_rec *rec)
+{
+	unsigned int i = cdl_trace_hash(rec->sector), n;
+	struct cdl_trace_inflight *inf;
+
+	for (n = 0; n < CDL_TRACE_INFLIGHT_MAX; n++) {
+		inf = &t->inflight[i];
+		/* Reuse the entry of a command with a lost completion */
+		if (!inf->used || inf->sector == rec->sector) {
+			inf->used = 1;
+			inf->sector = rec->sector;
+			inf->time = rec->time;
+			inf->rw = rec->rw;
+			inf->dld = rec->dld;
+			return;
+		}
+		i = (i + 1) & (CDL_TRACE_INFLIGHT_MAX - 1);
+	}
+
+	t->nr_unmatched++;
+}
+
+/*
+ * Remove an entry from the in-flight table, moving back the entries
+ * following it in its probe sequence.
+ */
+static void cdl_trace_remove(struct cdl_trace *t, unsigned int i)
+{
+	unsigned int j = i, h;
+
+	t->inflight[i].used = 0;
+
+	while (1) {
+		j = (j + 1) & (CDL_TRACE_INFLIGHT_MAX - 1);
+		if (!t->inflight[j].used)
+			return;
+		h = cdl_trace_hash(t->inflight[j].sector);
+		if (i <= j ? (i < h && h <= j) : (i < h || h <= j))
+			continue;
+		t->inflight[i] = t->inflight[j];
+		t->inflight[j].used = 0;
+		i = j;
+	}
+}
+
+static bool cdl_trace_complete(struct cdl_trace *t, struct cdl_trace_rec *rec)
+{
+	unsigned int i = cdl_trace_hash(rec->sector), n;
+	struct cdl_trace_inflight *inf;
+	struct cdl_trace_stats *st;
+	uint64_t lat;
+
+	for (n = 0; n < CDL_TRACE_INFLIGHT_MAX; n++) {
+		inf = &t->inflight[i];
+		if (!inf->used)
+			return false;
+		if (inf->sector == rec->sector && inf->rw == rec->rw)
+			break;
+		i = (i + 1) & (CDL_TRACE_INFLIGHT_MAX - 1);
+	}
+	if (n >= CDL_TRACE_INFLIGHT_MAX || inf->time > rec->time)
+		return false;
+
+	lat = rec->time - inf->time;
+	st = &t->stats[inf->rw][inf->dld];
+	if (!rec->error)
+		cdl_hist_add(&st->lat, lat);
+	else if (rec->error == -ETIME)
+		st->nr_etime++;
+	else
+		st->nr_errors++;
+
+	cdl_trace_remove(t, i);
+
+	return true;
+}
+
+static int cdl_trace_rec_cmp(const void *a, const void *b)
+{
+	const struct cdl_trace_rec *ra = a, *rb = b;
+
+	if (ra->time < rb->time)
+		return -1;
+	if (ra->time > rb->time)
+		return 1;
+
+	/* Issue first */
+	return (int)ra->complete - (int)rb->complete;
+}
+
+/*
+ * Wait for events and process all records collected. Since the issue and
+ * completion of a command may be recorded on different CPUs, records are
+ * sorted by time and completions without a matching issue are retried once
+ * in the next round.
+ */
+int cdl_trace_poll(struct cdl_dev *dev, struct cdl_trace *t, int timeout_ms)
+{
+	struct pollfd pfds[t->nr_cpus];
+	unsigned int i, n;
+	int cpu, nfds = 0;
+
+	for (cpu = 0; cpu < t->nr_cpus; cpu++) {
+		if (!t->rings[cpu])
+			continue;
+		pfds[nfds].fd = t->fds[cpu * 2];
+		pfds[nfds].events = POLLIN;
+		pfds[nfds].revents = 0;
+		nfds++;
+	}
+
+	if (poll(pfds, nfds, timeout_ms) < 0 && errno != EINTR) {
+		cdl_dev_err(dev, "poll failed %d (%s)\n",
+			    errno, strerror(errno));
+		return -errno;
+	}
+
+	for (cpu = 0; cpu < t->nr_cpus; cpu++) {
+		if (t->rings[cpu])
+			cdl_trace_read_ring(t, cpu);
+	}
+
+	qsort(t->recs, t->nr_recs, sizeof(struct cdl_trace_rec),
+	      cdl_trace_rec_cmp);
+
+	for (i = 0, n = 0; i < t->nr_recs; i++) {
+		if (!t->recs[i].complete) {
+			cdl_trace_issue(t, &t->recs[i]);
+			continue;
+		}
+		if (cdl_trace_complete(t, &t->recs[i]))
+			continue;
+		if (t->recs[i].retry) {
+			t->nr_unmatched++;
+			continue;
+		}
+		t->recs[i].retry = 1;
+		t->recs[n++] = t->recs[i];
+	}
+	t->nr_recs = n;
+
+	return 0;
+}
+
+static enum cdl_p cdl_trace_cdlp(struct cdl_dev *dev, enum cdl_rw rw)
+{
+	if (rw == CDL_READ) {
+		if (dev->cmd_cdlp[CDL_READ_16] != CDLP_NONE)
+			return dev->cmd_cdlp[CDL_READ_16];
+		return dev->cmd_cdlp[CDL_READ_32];
+	}
+
+	if (dev->cmd_cdlp[CDL_WRITE_16] != CDLP_NONE)
+		return dev->cmd_cdlp[CDL_WRITE_16];
+	return dev->cmd_cdlp[CDL_WRITE_32];
+}
+
+static void cdl_trace_show_stats(struct cdl_trace_stats *st, int d)
+{
+	struct cdl_hist *h = &st->lat;
+
+	if (d)
+		printf("  Descriptor %d:\n", d);
+	else
+		printf("  No limit:\n");
+
+	printf("    Commands completed       : %" PRIu64 "\n", h->count);
+	printf("    Commands failed (ETIME)  : %" PRIu64 "\n", st->nr_etime);
+	printf("    Commands failed (other)  : %" PRIu64 "\n", st->nr_errors);
+	if (!h->count)
+		return;
+
+	printf("    Latency (ms)             : min %.3f, avg %.3f, max %.3f\n",
+	       (double)h->min / 1000000.0,
+	       (double)cdl_hist_avg(h) / 1000000.0,
+	       (double)h->max / 1000000.0);
+	printf("    Latency percentiles (ms) : p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f\n",
+	       (double)cdl_hist_percentile(h, 50) / 1000000.0,
+	       (double)cdl_hist_percentile(h, 90) / 1000000.0,
+	       (double)cdl_hist_percentile(h, 99) / 1000000.0,
+	       (double)cdl_hist_percentile(h, 99.9) / 1000000.0);
+}
+
+void cdl_trace_show(struct cdl_dev *dev, struct cdl_trace *t)
+{
+	struct cdl_trace_stats *st;
+	enum cdl_p cdlp;
+	int rw, d, n;
+
+	printf("Traced %.1f s\n",
+	       (double)(cdl_now_ns() - t->start) / 1000000000.0);
+	if (t->nr_lost || t->nr_unmatched)
+		printf("WARNING: %" PRIu64 " events lost, %" PRIu64
+		       " completions not matched\n",
+		       t->nr_lost, t->nr_unmatched);
+
+	for (rw = CDL_READ; rw <= CDL_WRITE; rw++) {
+		for (d = 0, n = 0; d <= CDL_MAX_DESC; d++) {
+			st = &t->stats[rw][d];
+			if (!st->lat.count && !st->nr_etime && !st->nr_errors)
+				continue;
+
+			if (!n) {
+				cdlp = cdl_trace_cdlp(dev, rw);
+				if (cdlp != CDLP_NONE)
+					printf("Page %s: %s descriptors\n",
+					       cdl_page_name(cdlp),
+					       rw == CDL_READ ? "read" : "write");
+				else
+					printf("%s commands\n",
+					       rw == CDL_READ ? "Read" : "Write");
+			}
+			n++;
+
+			cdl_trace_show_stats(st, d);
+		}
+	}
+}
+
+/*
+ * Save the histograms of all descriptors used. For each direction and
+ * descriptor, a summary line is followed by one line per non-empty bucket
+ * with the bucket lowest latency (ns) and the number of commands.
+ */
+void cdl_trace_save(struct cdl_dev *dev, struct cdl_trace *t, FILE *f)
+{
+	struct cdl_trace_stats *st;
+	unsigned int i;
+	int rw, d;
+
+	fprintf(f, "# Command latency histograms of %s\n", dev->name);
+	fprintf(f, "# duration-ms: %llu\n",
+		(cdl_now_ns() - t->start) / 1000000ULL);
+
+	for (rw = CDL_READ; rw <= CDL_WRITE; rw++) {
+		for (d = 0; d <= CDL_MAX_DESC; d++) {
+			st = &t->stats[rw][d];
+			if (!st->lat.count && !st->nr_etime && !st->nr_errors)
+				continue;
+
+			fprintf(f, "\n%s descriptor %d: completed %" PRIu64
+				", etime %" PRIu64 ", errors %" PRIu64
+				", min %" PRIu64 ", max %" PRIu64
+				", sum %" PRIu64 "\n",
+				rw == CDL_READ ? "read" : "write", d,
+				st->lat.count, st->nr_etime, st->nr_errors,
+				st->lat.count ? st->lat.min : 0,
+				st->lat.max, st->lat.sum);
+
+			for (i = 0; i < CDL_HIST_BUCKETS; i++) {
+				if (st->lat.buckets[i])
+					fprintf(f, "%" PRIu64 " %" PRIu64 "\n",
+						cdl_hist_bucket_val(i),
+						st->lat.buckets[i]);
+			}
+		}
+	}
+}
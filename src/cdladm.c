@@ -11,7 +11,19 @@
 #include <errno.h>
 #include <ctype.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <sys/utsname.h>
+#include <sys/wait.h>
+
+/*
+ * Directory of the device state files (original timeouts and active
+ * profile) and margin in seconds added to the longest limit of a device to
+ * set its timeouts.
+ */
+#define CDLADM_STATE_DIR	"/run/cdl-tools"
+#define CDLADM_TIMEOUT_MARGIN	5
 
 /*
  * Print usage.
@@ -21,7 +33,8 @@ static void cdladm_usage(void)
 	printf("Usage:\n"
 	       "  cdladm --help | -h\n"
 	       "  cdladm --version\n"
-	       "  cdladm <command> [options] <device>\n");
+	       "  cdladm <command> [options] <device>\n"
+	       "  cdladm apply [options] <device> [<device>...]\n");
 	printf("Options common to all commands:\n"
 	       "  --verbose | -v       : Verbose output\n"
 	       "  --force-ata | -a     : Force the use of ATA passthrough commands\n");
@@ -40,7 +53,17 @@ static void cdladm_usage(void)
 	       "  stats-reset     : Reset to 0 all CDL statistics values\n"
 	       "  stats-save      : Save CDL statistics configuration to a file\n"
 	       "  stats-upload    : Upload CDL statistics configuration\n"
-	       "                    to the device\n");
+	       "                    to the device\n"
+	       "  trace           : Trace commands and show per descriptor\n"
+	       "                    latency statistics\n"
+	       "  watch           : Periodically check the device pages and\n"
+	       "                    CDL enable state against a profile\n"
+	       "  apply           : Apply a configuration bundle to one or\n"
+	       "                    more devices\n"
+	       "  batch           : Execute a sequence of commands read from\n"
+	       "                    a file or from the standard input\n"
+	       "  schedule        : Switch between the profiles of a schedule\n"
+	       "                    file at times of the day or on events\n");
 	printf("Command options:\n");
 	printf("  --count\n"
 	       "\tApply to the show command.\n"
@@ -51,15 +74,51 @@ static void cdladm_usage(void)
 	       "\tSpecify the name of the page to show,clear or save. The\n"
 	       "\tpage name tcan be: \"A\", \"B\", \"T2A\" or \"T2B\".\n");
 	printf("  --file <path>\n"
-	       "\tApplies to the save, upload, stats-save and stats-upload\n"
-	       "\tcommands to specify the path of the page file or statistics\n"
-	       "\tconfiguration file to use.\n"
+	       "\tApplies to the save, upload, stats-save, stats-upload and\n"
+	       "\ttrace commands to specify the path of the page file,\n"
+	       "\tstatistics configuration file or latency histograms file\n"
+	       "\tto use.\n"
 	       "\tUsing this option is mandatory with the upload and\n"
 	       "\tstats-upload commands.\n"
 	       "\tIf this option is not specified with the save command,\n"
 	       "\tthe default file name <dev name>-<page name>.cdl is used.\n"
 	       "\tIf this option is not specified with the stats-save command,\n"
-	       "\tthe default file name <dev name>-cdl-stats.cfg is used.\n");
+	       "\tthe default file name <dev name>-cdl-stats.cfg is used.\n"
+	       "\tWith the watch command, this option can be specified once\n"
+	       "\tper page to specify the page files defining the profile.\n"
+	       "\tOtherwise, the profile is the device state when starting.\n"
+	       "\tWith the apply command, this option is mandatory and\n"
+	       "\tspecifies the configuration bundle file to use.\n"
+	       "\tWith the batch command, this option specifies the file of\n"
+	       "\tcommands to execute. Otherwise, the commands are read from\n"
+	       "\tthe standard input.\n"
+	       "\tWith the schedule command, this option is mandatory and\n"
+	       "\tspecifies the schedule file to use.\n");
+	printf("  --blob\n"
+	       "\tApply to the save and upload commands.\n"
+	       "\tSave or upload a binary page blob: the page data exactly\n"
+	       "\tas written to the device (MODE SELECT parameter list or\n"
+	       "\tATA command duration limits log), only valid for devices\n"
+	       "\twith the same model and firmware revision. Uploading a\n"
+	       "\tblob does not read the device pages and does not parse a\n"
+	       "\tpage file. If --file is not specified with the save\n"
+	       "\tcommand, the default file name <dev name>-<page name>.blob\n"
+	       "\tis used, or <dev name>-log.blob for ATA devices.\n");
+	printf("  --check\n"
+	       "\tApply to the upload and apply commands.\n"
+	       "\tCompare the page file or bundle with the device settings\n"
+	       "\tand report the differences without changing the device.\n"
+	       "\tThe command fails if the settings differ.\n");
+	printf("  --timeouts\n"
+	       "\tApply to the upload command.\n"
+	       "\tAfter uploading, set the device command timeout and error\n"
+	       "\thandling timeout to the longest limit of the device pages\n"
+	       "\tplus %d seconds, if longer than the original timeouts.\n"
+	       "\tSetting the command timeout also sets the I/O timeout of\n"
+	       "\tthe device request queue.\n"
+	       "\tThe original timeouts are restored when the limits are\n"
+	       "\tcleared or when command duration limits is disabled.\n",
+	       CDLADM_TIMEOUT_MARGIN);
 	printf("  --permanent\n"
 	       "\tApply to the upload command.\n"
 	       "\tSpecify that the device should save the page in\n"
@@ -68,6 +127,29 @@ static void cdladm_usage(void)
 	printf("  --raw\n"
 	       "\tApply to the show and stats-show commands.\n"
 	       "\tShow the raw values of the CDL pages and statistics fields.\n");
+	printf("  --duration <seconds>\n"
+	       "\tApply to the trace command.\n"
+	       "\tSpecify the tracing duration (default: 60 seconds).\n"
+	       "\tTracing can be stopped earlier with Ctrl-C.\n");
+	printf("  --interval <seconds>\n"
+	       "\tApply to the watch and schedule commands.\n"
+	       "\tSpecify the interval between checks (default: 60 seconds).\n");
+	printf("  --profile <name>\n"
+	       "\tApply to the schedule command.\n"
+	       "\tSwitch to the named profile of the schedule file and exit,\n"
+	       "\tignoring the schedule rules.\n");
+	printf("  --once\n"
+	       "\tApply to the schedule command.\n"
+	       "\tSwitch to the profile selected by the schedule rules and\n"
+	       "\texit, e.g. when executed periodically by cron.\n");
+	printf("  --repair\n"
+	       "\tApply to the watch command.\n"
+	       "\tRe-apply the profile when the device does not match it.\n");
+	printf("  --enabled | --disabled\n"
+	       "\tApply to the watch command.\n"
+	       "\tSpecify the CDL enable state of the profile. By default,\n"
+	       "\tCDL is expected to be enabled if page files are specified\n"
+	       "\tand to be in the state when starting otherwise.\n");
 	printf("  --force-dev\n"
 	       "\tApply to the enable and disable commands for ATA devices.\n"
 	       "\tForce enabling and disabling the CDL feature directly on\n"
@@ -145,6 +227,213 @@ static int cdladm_show(struct cdl_dev *dev, char *page)
 	return 0;
 }
 
+/*
+ * Device timeouts, in seconds. The original timeouts of a device are saved in
+ * a state file when they are first changed, to be restored when the device
+ * limits are cleared or CDL disabled.
+ */
+struct cdladm_timeouts {
+	unsigned long	timeout;
+	unsigned long	eh_timeout;
+};
+
+static void cdladm_state_path(struct cdl_dev *dev, const char *state,
+			      char *path, size_t len)
+{
+	snprintf(path, len, CDLADM_STATE_DIR "/%s.%s", dev->name, state);
+}
+
+static FILE *cdladm_create_state(struct cdl_dev *dev, const char *state)
+{
+	char path[PATH_MAX];
+	FILE *f;
+
+	if (mkdir(CDLADM_STATE_DIR, 0755) && errno != EEXIST) {
+		fprintf(stderr, "Create %s failed (%s)\n",
+			CDLADM_STATE_DIR, strerror(errno));
+		return NULL;
+	}
+
+	cdladm_state_path(dev, state, path, sizeof(path));
+	f = fopen(path, "w");
+	if (!f)
+		fprintf(stderr, "Open file %s failed (%s)\n",
+			path, strerror(errno));
+
+	return f;
+}
+
+static int cdladm_close_state(struct cdl_dev *dev, const char *state, FILE *f)
+{
+	char path[PATH_MAX];
+
+	if (fclose(f)) {
+		cdladm_state_path(dev, state, path, sizeof(path));
+		fprintf(stderr, "Write file %s failed (%s)\n",
+			path, strerror(errno));
+		return 1;
+	}
+
+	return 0;
+}
+
+static int cdladm_load_timeouts(struct cdl_dev *dev, struct cdladm_timeouts *t)
+{
+	char path[PATH_MAX];
+	FILE *f;
+	int ret;
+
+	cdladm_state_path(dev, "timeouts", path, sizeof(path));
+	f = fopen(path, "r");
+	if (!f)
+		return -ENOENT;
+
+	ret = fscanf(f, "%lu %lu", &t->timeout, &t->eh_timeout);
+	fclose(f);
+	if (ret != 2) {
+		fprintf(stderr, "Invalid timeouts state file %s\n", path);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static int cdladm_save_timeouts(struct cdl_dev *dev, struct cdladm_timeouts *t)
+{
+	FILE *f;
+
+	f = cdladm_create_state(dev, "timeouts");
+	if (!f)
+		return 1;
+
+	fprintf(f, "%lu %lu\n", t->timeout, t->eh_timeout);
+
+	return cdladm_close_state(dev, "timeouts", f);
+}
+
+static int cdladm_set_timeout_attr(struct cdl_dev *dev, const char *attr,
+				   unsigned long val)
+{
+	char str[32];
+
+	if (!val)
+		return 0;
+
+	snprintf(str, sizeof(str), "%lu", val);
+	if (cdl_sysfs_set_attr(dev, str, "/sys/block/%s/%s", dev->name, attr) ||
+	    cdl_sysfs_get_ulong_attr(dev, "/sys/block/%s/%s",
+				     dev->name, attr) != val) {
+		fprintf(stderr, "Set %s of %s to %lu failed\n",
+			attr, dev->name, val);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Writing the device command timeout also sets the block layer I/O timeout
+ * of the device request queue.
+ */
+static int cdladm_set_timeouts(struct cdl_dev *dev, struct cdladm_timeouts *t)
+{
+	if (cdladm_set_timeout_attr(dev, "device/timeout", t->timeout) ||
+	    cdladm_set_timeout_attr(dev, "device/eh_timeout", t->eh_timeout))
+		return 1;
+
+	dev->cmd_timeout = t->timeout * 1000000000ULL;
+
+	printf("Device timeouts: command %lu s, error handling %lu s\n",
+	       t->timeout, t->eh_timeout);
+
+	return 0;
+}
+
+static int cdladm_restore_timeouts(struct cdl_dev *dev)
+{
+	struct cdladm_timeouts orig;
+	char path[PATH_MAX];
+	int ret;
+
+	ret = cdladm_load_timeouts(dev, &orig);
+	if (ret == -ENOENT)
+		return 0;
+	if (ret)
+		return 1;
+
+	printf("Restoring the device timeouts\n");
+	if (cdladm_set_timeouts(dev, &orig))
+		return 1;
+
+	cdladm_state_path(dev, "timeouts", path, sizeof(path));
+	unlink(path);
+
+	return 0;
+}
+
+/*
+ * Set the device command timeout and error handling timeout so that commands
+ * are not timed out by the kernel, triggering error handling and possibly a device
+ * reset, before the device completes or aborts them according to the
+ * longest limit of the device pages. Timeouts are never set lower than
+ * their original value and are restored if no limit remains.
+ */
+static int cdladm_apply_timeouts(struct cdl_dev *dev)
+{
+	struct cdladm_timeouts orig, t;
+	uint64_t longest;
+	unsigned long secs;
+	int ret;
+
+	longest = cdl_longest_limit(dev);
+	if (!longest)
+		return cdladm_restore_timeouts(dev);
+
+	ret = cdladm_load_timeouts(dev, &orig);
+	if (ret == -ENOENT) {
+		orig.timeout = cdl_sysfs_get_ulong_attr(dev,
+				"/sys/block/%s/device/timeout", dev->name);
+		orig.eh_timeout = cdl_sysfs_get_ulong_attr(dev,
+				"/sys/block/%s/device/eh_timeout", dev->name);
+		if (!orig.timeout) {
+			fprintf(stderr, "Get %s timeouts failed\n", dev->name);
+			return 1;
+		}
+		if (cdladm_save_timeouts(dev, &orig))
+			return 1;
+	} else if (ret) {
+		return 1;
+	}
+
+	secs = (longest + 999999999ULL) / 1000000000ULL +
+		CDLADM_TIMEOUT_MARGIN;
+	printf("Longest limit: %llu ms\n",
+	       (unsigned long long)(longest + 999999) / 1000000);
+
+	t.timeout = orig.timeout > secs ? orig.timeout : secs;
+	t.eh_timeout = orig.eh_timeout > secs ? orig.eh_timeout : secs;
+
+	return cdladm_set_timeouts(dev, &t);
+}
+
+/*
+ * Update the device timeouts after a change of the limits, if they were
+ * set with an upload.
+ */
+static int cdladm_update_timeouts(struct cdl_dev *dev)
+{
+	struct cdladm_timeouts orig;
+	int ret;
+
+	ret = cdladm_load_timeouts(dev, &orig);
+	if (ret == -ENOENT)
+		return 0;
+	if (ret)
+		return 1;
+
+	return cdladm_apply_timeouts(dev);
+}
+
 static int cdladm_clear(struct cdl_dev *dev, char *page_name)
 {
 	struct cdl_page page;
@@ -183,18 +472,24 @@ static int cdladm_clear(struct cdl_dev *dev, char *page_name)
 			break;
 	}
 
-	return 0;
+	return cdladm_update_timeouts(dev);
 }
 
-static int cdladm_save_page(struct cdl_dev *dev, enum cdl_p cdlp, char *path)
+static int cdladm_save_page(struct cdl_dev *dev, enum cdl_p cdlp, char *path,
+			    bool blob)
 {
+	const char *name = cdl_page_name(cdlp);
 	char *fpath;
 	int ret;
 	FILE *f;
 
+	/* An ATA log blob holds both the T2A and T2B pages */
+	if (blob && cdl_dev_use_ata(dev))
+		name = "log";
+
 	if (!path) {
-		ret = asprintf(&fpath, "%s-%s.cdl",
-			       dev->name, cdl_page_name(cdlp));
+		ret = asprintf(&fpath, "%s-%s.%s",
+			       dev->name, name, blob ? "blob" : "cdl");
 		if (ret < 0) {
 			fprintf(stderr, "Failed to allocate file path\n");
 			return 1;
@@ -206,16 +501,24 @@ static int cdladm_save_page(struct cdl_dev *dev, enum cdl_p cdlp, char *path)
 	f = fopen(fpath, "w");
 	if (!f) {
 		fprintf(stderr, "Open page %s file %s failed (%s)\n",
-			cdl_page_name(cdlp), fpath, strerror(errno));
+			name, fpath, strerror(errno));
 		ret = 1;
 		goto out;
 	}
 
-	printf("Saving page %s to file %s\n",
-	       cdl_page_name(cdlp), fpath);
+	printf("Saving page %s %sto file %s\n",
+	       name, blob ? "blob " : "", fpath);
 
-	cdl_page_save(&dev->cdl_pages[cdlp], f);
-	ret = 0;
+	if (blob) {
+		ret = cdl_blob_save(dev, cdlp, f);
+		if (ret) {
+			fprintf(stderr, "Write file %s failed\n", fpath);
+			ret = 1;
+		}
+	} else {
+		cdl_page_save(&dev->cdl_pages[cdlp], f);
+		ret = 0;
+	}
 
 	fclose(f);
 
@@ -226,7 +529,7 @@ out:
 	return ret;
 }
 
-static int cdladm_save(struct cdl_dev *dev, char *page, char *path)
+static int cdladm_save(struct cdl_dev *dev, char *page, char *path, bool blob)
 {
 	enum cdl_p cdlp;
 	int i, ret;
@@ -239,24 +542,73 @@ static int cdladm_save(struct cdl_dev *dev, char *page, char *path)
 			fprintf(stderr, "Page %s is not supported\n", page);
 			return 1;
 		}
-		return cdladm_save_page(dev, cdlp, path);
+		return cdladm_save_page(dev, cdlp, path, blob);
 	}
 
 	/* Save all supported pages */
 	for (i = 0; i < CDL_MAX_PAGES; i++) {
 		if (!cdl_page_supported(dev, i))
 			continue;
-		ret = cdladm_save_page(dev, i, NULL);
+		ret = cdladm_save_page(dev, i, NULL, blob);
 		if (ret)
 			return 1;
+		if (blob && cdl_dev_use_ata(dev))
+			break;
 	}
 
 	return 0;
 }
 
-static int cdladm_upload(struct cdl_dev *dev, char *path)
+static int cdladm_upload_blob(struct cdl_dev *dev, FILE *f)
+{
+	struct cdl_blob *blob;
+	int ret;
+
+	blob = malloc(sizeof(*blob));
+	if (!blob) {
+		fprintf(stderr, "No memory for blob\n");
+		return 1;
+	}
+
+	ret = cdl_blob_load(dev, f, blob);
+	if (ret)
+		goto out;
+
+	if (blob->type == CDL_BLOB_ATA_LOG)
+		printf("Uploading pages T2A and T2B (ATA log, %u B)\n",
+		       CDL_ATA_LOG_SIZE);
+	else
+		printf("Uploading page %s (mode select, %u B)\n",
+		       cdl_page_name(blob->cdlp),
+		       cdl_sg_get_le32(blob->len));
+
+	ret = cdl_blob_upload(dev, blob);
+
+out:
+	free(blob);
+
+	return ret ? 1 : 0;
+}
+
+static void cdladm_show_diff(struct cdl_page *page, unsigned int changed)
+{
+	int i;
+
+	printf("Page %s differs from the device page:\n",
+	       cdl_page_name(page->cdlp));
+	if (changed & 1)
+		printf("  Page parameters changed\n");
+	for (i = 1; i <= CDL_MAX_DESC; i++) {
+		if (changed & (1 << i))
+			printf("  Descriptor %d changed\n", i);
+	}
+}
+
+static int cdladm_upload(struct cdl_dev *dev, char *path, bool blob,
+			 bool check)
 {
 	struct cdl_page page;
+	unsigned int changed;
 	FILE *f;
 	int ret;
 
@@ -273,12 +625,35 @@ static int cdladm_upload(struct cdl_dev *dev, char *path)
 		return 1;
 	}
 
+	if (blob) {
+		ret = cdladm_upload_blob(dev, f);
+		fclose(f);
+		return ret;
+	}
+
 	printf("Parsing file %s...\n", path);
 	ret = cdl_page_parse_file(f, dev, &page);
 	fclose(f);
 	if (ret)
 		return 1;
 
+	/*
+	 * Skip the write and the device revalidation if the device page is
+	 * already identical. With --permanent, always write as the current
+	 * page values do not tell if the saved page values also match.
+	 */
+	changed = cdl_page_diff(dev, &page);
+	if (!changed) {
+		printf("Page %s is identical to the device page\n",
+		       cdl_page_name(page.cdlp));
+		if (check || !(dev->flags & CDL_USE_MS_SP))
+			return 0;
+	} else {
+		cdladm_show_diff(&page, changed);
+		if (check)
+			return 1;
+	}
+
 	printf("Uploading page %s:\n",
 	       cdl_page_name(page.cdlp));
 	cdl_page_show(&page, false);
@@ -430,6 +805,78 @@ static int cdladm_stats_upload(struct cdl_dev *dev, char *path)
 	return 0;
 }
 
+static volatile sig_atomic_t cdladm_stop;
+
+static void cdladm_sigint(int sig)
+{
+	cdladm_stop = 1;
+}
+
+static int cdladm_trace(struct cdl_dev *dev, char *path,
+			unsigned int duration)
+{
+	unsigned long long end;
+	struct cdl_trace *t;
+	FILE *f = NULL;
+	int ret;
+
+	if (path) {
+		f = fopen(path, "w");
+		if (!f) {
+			fprintf(stderr, "Open file %s failed (%s)\n",
+				path, strerror(errno));
+			return 1;
+		}
+	}
+
+	t = calloc(1, sizeof(struct cdl_trace));
+	if (!t) {
+		fprintf(stderr, "Failed to allocate trace\n");
+		ret = 1;
+		goto out;
+	}
+
+	ret = cdl_trace_start(dev, t);
+	if (ret) {
+		fprintf(stderr, "Start tracing failed\n");
+		ret = 1;
+		goto out;
+	}
+
+	printf("Tracing commands for %u seconds...\n", duration);
+
+	signal(SIGINT, cdladm_sigint);
+	signal(SIGTERM, cdladm_sigint);
+
+	end = cdl_now_ns() + (unsigned long long)duration * 1000000000ULL;
+	while (!cdladm_stop && cdl_now_ns() < end) {
+		ret = cdl_trace_poll(dev, t, 100);
+		if (ret) {
+			ret = 1;
+			break;
+		}
+	}
+
+	/* Process the events pending in the ring buffers */
+	if (!ret)
+		cdl_trace_poll(dev, t, 0);
+
+	cdl_trace_show(dev, t);
+	if (f) {
+		printf("Saving latency histograms to file %s\n", path);
+		cdl_trace_save(dev, t, f);
+	}
+
+	cdl_trace_stop(t);
+
+out:
+	free(t);
+	if (f)
+		fclose(f);
+
+	return ret;
+}
+
 static void cdladm_get_kernel_support(struct cdl_dev *dev)
 {
 	bool supported, enabled;
@@ -568,7 +1015,7 @@ static int cdladm_disable(struct cdl_dev *dev)
 		printf("WARNING: Command duration limits is still enabled "
 		       "on the device\n");
 
-	return 0;
+	return cdladm_restore_timeouts(dev);
 }
 
 static int cdladm_enable_highpri(struct cdl_dev *dev)
@@ -631,132 +1078,862 @@ static int cdladm_disable_highpri(struct cdl_dev *dev)
 	return 0;
 }
 
-/*
- * Possible command codes.
- */
-enum cdladm_cmd_code {
-	CDLADM_NONE,
-	CDLADM_INFO,
-	CDLADM_LIST,
-	CDLADM_SHOW,
-	CDLADM_CLEAR,
-	CDLADM_SAVE,
-	CDLADM_UPLOAD,
-	CDLADM_ENABLE,
-	CDLADM_DISABLE,
-	CDLADM_ENABLE_HIGHPRI,
-	CDLADM_DISABLE_HIGHPRI,
-	CDLADM_STATS_SHOW,
-	CDLADM_STATS_RESET,
-	CDLADM_STATS_SAVE,
-	CDLADM_STATS_UPLOAD,
-
-	CDLADM_CMD_MAX,
-};
-
-/*
- * Command codes and the device open mode needed.
- */
-static struct {
-	const char *opt;
-	enum cdladm_cmd_code code;
-	mode_t mode;
-} cdladm_cmd[CDLADM_CMD_MAX + 1] =
+static void cdladm_print_time(void)
 {
-	{ "",			CDLADM_NONE,		0	 },
-	{ "info",		CDLADM_INFO,		O_RDONLY },
-	{ "list",		CDLADM_LIST,		O_RDONLY },
-	{ "show",		CDLADM_SHOW,		O_RDONLY },
-	{ "clear",		CDLADM_CLEAR,		O_RDWR	 },
-	{ "save",		CDLADM_SAVE,		O_RDONLY },
-	{ "upload",		CDLADM_UPLOAD,		O_RDWR	 },
-	{ "enable",		CDLADM_ENABLE,		O_RDWR   },
-	{ "disable",		CDLADM_DISABLE,		O_RDWR   },
-	{ "enable-highpri",	CDLADM_ENABLE_HIGHPRI,	O_RDWR   },
-	{ "disable-highpri",	CDLADM_DISABLE_HIGHPRI,	O_RDWR   },
-	{ "stats-show",		CDLADM_STATS_SHOW,	O_RDWR   },
-	{ "stats-reset",	CDLADM_STATS_RESET,	O_RDWR   },
-	{ "stats-save",		CDLADM_STATS_SAVE,	O_RDWR   },
-	{ "stats-upload",	CDLADM_STATS_UPLOAD,	O_RDWR   },
-	{ NULL,			CDLADM_CMD_MAX,		0        }
-};
+	time_t now = time(NULL);
+	char str[32];
 
-static int cdladm_get_command(char *opt)
-{
-	int i;
+	strftime(str, sizeof(str), "%F %T", localtime(&now));
+	printf("[%s] ", str);
+}
 
-	for (i = 1; i < CDLADM_CMD_MAX; i++) {
-		if (strcmp(opt, cdladm_cmd[i].opt) == 0)
-			return cdladm_cmd[i].code;
-	}
+static bool cdladm_sys_enabled(struct cdl_dev *dev)
+{
+	if (!(dev->flags & CDL_SYS_SUPPORTED))
+		return false;
 
-	return CDLADM_CMD_MAX;
+	return cdl_sysfs_get_ulong_attr(dev, "/sys/block/%s/device/cdl_enable",
+					dev->name);
 }
 
 /*
- * Main function.
+ * Periodically check that the device pages and the CDL enable state match
+ * the profile defined by page files, or the device state when starting.
+ * The enable state of the profile is @enable if it is not negative, enabled
+ * if page files are given, and the state when starting otherwise.
+ * Each check re-reads all pages with a single command and compares the
+ * fingerprint of the page raw data with the one of the last good check.
+ * The pages are fully compared only if the fingerprint changed.
  */
-int main(int argc, char **argv)
+static int cdladm_watch(struct cdl_dev *dev, char **files, int nr_files,
+			int enable, unsigned int interval, bool repair)
 {
-	struct cdl_dev dev;
-	char *page = NULL;
-	char *path = NULL;
-	int command = CDLADM_NONE;
-	bool reopen = false;
-	int i, ret;
+	unsigned long long nr_checks = 0, nr_drifts = 0, nr_repairs = 0;
+	unsigned int changed[CDL_MAX_PAGES];
+	struct cdl_page want[CDL_MAX_PAGES];
+	struct cdl_page *pages[CDL_MAX_PAGES];
+	bool want_enabled, enabled, drift;
+	struct cdl_page page;
+	uint64_t fp, good_fp = 0;
+	bool good = false;
+	unsigned int t;
+	int i, n, ret;
+	FILE *f;
 
-	/* Initialize */
-	memset(&dev, 0, sizeof(dev));
-	dev.fd = -1;
-	for (i = 0; i < CDL_CMD_MAX; i++)
-		dev.cmd_cdlp[i] = CDLP_NONE;
-	for (i = 0; i < CDL_MAX_PAGES; i++)
-		dev.cdl_pages[i].cdlp = CDLP_NONE;
+	/* Get the profile */
+	for (i = 0; i < CDL_MAX_PAGES; i++) {
+		want[i].cdlp = CDLP_NONE;
+		if (!nr_files && cdl_page_supported(dev, i))
+			want[i] = dev->cdl_pages[i];
+	}
 
-	if (argc == 1) {
-		cdladm_usage();
+	for (i = 0; i < nr_files; i++) {
+		f = fopen(files[i], "r");
+		if (!f) {
+			fprintf(stderr, "Open file %s failed (%s)\n",
+				files[i], strerror(errno));
+			return 1;
+		}
+		printf("Parsing file %s...\n", files[i]);
+		ret = cdl_page_parse_file(f, dev, &page);
+		fclose(f);
+		if (ret)
+			return 1;
+		if (want[page.cdlp].cdlp != CDLP_NONE) {
+			fprintf(stderr, "Page %s specified several times\n",
+				cdl_page_name(page.cdlp));
+			return 1;
+		}
+		want[page.cdlp] = page;
+	}
+
+	if (enable >= 0)
+		want_enabled = enable;
+	else if (nr_files)
+		want_enabled = true;
+	else
+		want_enabled = dev->flags & CDL_SYS_ENABLED;
+
+	printf("Watching pages");
+	for (i = 0; i < CDL_MAX_PAGES; i++) {
+		if (want[i].cdlp != CDLP_NONE)
+			printf(" %s", cdl_page_name(i));
+	}
+	printf(" (CDL %s) every %u s%s\n",
+	       want_enabled ? "enabled" : "disabled", interval,
+	       repair ? ", repairing mismatches" : "");
+
+	signal(SIGINT, cdladm_sigint);
+	signal(SIGTERM, cdladm_sigint);
+
+	while (!cdladm_stop) {
+		nr_checks++;
+
+		ret = cdl_reread_pages(dev);
+		if (ret) {
+			cdladm_print_time();
+			printf("Read pages failed\n");
+			good = false;
+			goto next;
+		}
+
+		enabled = cdladm_sys_enabled(dev);
+		fp = cdl_pages_fingerprint(dev);
+		if (good && fp == good_fp && enabled == want_enabled)
+			goto next;
+
+		drift = enabled != want_enabled;
+		for (i = 0; i < CDL_MAX_PAGES; i++) {
+			changed[i] = 0;
+			if (want[i].cdlp != CDLP_NONE)
+				changed[i] = cdl_page_diff(dev, &want[i]);
+			if (changed[i])
+				drift = true;
+		}
+
+		if (!drift) {
+			if (!good) {
+				cdladm_print_time();
+				printf("Profile OK\n");
+			}
+			good = true;
+			good_fp = fp;
+			goto next;
+		}
+
+		good = false;
+		nr_drifts++;
+
+		cdladm_print_time();
+		printf("ALERT: profile mismatch\n");
+		if (enabled != want_enabled)
+			printf("Command duration limits is %s\n",
+			       enabled ? "enabled" : "disabled");
+		for (i = 0; i < CDL_MAX_PAGES; i++) {
+			if (changed[i])
+				cdladm_show_diff(&want[i], changed[i]);
+		}
+
+		if (!repair)
+			goto next;
+
+		for (i = 0, n = 0; i < CDL_MAX_PAGES; i++) {
+			if (changed[i])
+				pages[n++] = &want[i];
+		}
+		ret = cdl_write_pages(dev, pages, n);
+		if (!ret && enabled != want_enabled) {
+			if (want_enabled)
+				ret = cdladm_enable(dev);
+			else
+				ret = cdladm_disable(dev);
+		}
+
+		cdladm_print_time();
+		if (ret) {
+			printf("Repair failed\n");
+		} else {
+			printf("Profile re-applied\n");
+			nr_repairs++;
+		}
+
+next:
+		fflush(stdout);
+		for (t = 0; t < interval * 10 && !cdladm_stop; t++)
+			usleep(100000);
+	}
+
+	printf("%llu checks, %llu mismatches, %llu repairs\n",
+	       nr_checks, nr_drifts, nr_repairs);
+
+	return good ? 0 : 1;
+}
+
+/*
+ * Statistics snapshot: completed I/Os and time spent doing them in
+ * milliseconds per direction, from the block device stat file, and the
+ * device statistics counters of the read and write descriptors, if
+ * supported.
+ */
+struct cdladm_snapshot {
+	unsigned long long		time;
+	unsigned long long		ios[2];
+	unsigned long long		ticks[2];
+	int				has_counters;
+	struct cdl_stats_counters	c[2];
+};
+
+static void cdladm_snapshot(struct cdl_dev *dev, struct cdladm_snapshot *snap)
+{
+	unsigned long long v[8];
+	char path[PATH_MAX];
+	FILE *f;
+
+	memset(snap, 0, sizeof(*snap));
+	snap->time = time(NULL);
+
+	snprintf(path, sizeof(path), "/sys/block/%s/stat", dev->name);
+	f = fopen(path, "r");
+	if (f) {
+		if (fscanf(f, "%llu %llu %llu %llu %llu %llu %llu %llu",
+			   &v[0], &v[1], &v[2], &v[3],
+			   &v[4], &v[5], &v[6], &v[7]) == 8) {
+			snap->ios[CDL_READ] = v[0];
+			snap->ticks[CDL_READ] = v[3];
+			snap->ios[CDL_WRITE] = v[4];
+			snap->ticks[CDL_WRITE] = v[7];
+		}
+		fclose(f);
+	}
+
+	if (cdl_dev_statistics_supported(dev) && cdl_dev_is_ata(dev))
+		snap->has_counters =
+			cdl_statistics_get_counters(dev, snap->c) == 0;
+}
+
+/*
+ * The schedule state file holds the name of the active profile and the
+ * statistics snapshot taken after switching to it.
+ */
+static int cdladm_load_profile_state(struct cdl_dev *dev, char *name,
+				     struct cdladm_snapshot *snap)
+{
+	struct cdl_stats_counters *c;
+	char path[PATH_MAX];
+	int rw, d, valid;
+	int ret = 0;
+	FILE *f;
+
+	memset(snap, 0, sizeof(*snap));
+
+	cdladm_state_path(dev, "profile", path, sizeof(path));
+	f = fopen(path, "r");
+	if (!f)
+		return -ENOENT;
+
+	if (fscanf(f, "%31s %llu %llu %llu %llu %llu %d", name, &snap->time,
+		   &snap->ios[CDL_READ], &snap->ticks[CDL_READ],
+		   &snap->ios[CDL_WRITE], &snap->ticks[CDL_WRITE],
+		   &snap->has_counters) != 7)
+		ret = -EINVAL;
+
+	for (rw = CDL_READ; rw <= CDL_WRITE && snap->has_counters && !ret;
+	     rw++) {
+		c = &snap->c[rw];
+		for (d = 0; d < CDL_MAX_DESC; d++) {
+			if (fscanf(f, "%d %" SCNu64 " %" SCNu64, &valid,
+				   &c->nr_cmds[d], &c->nr_misses[d]) != 3) {
+				ret = -EINVAL;
+				break;
+			}
+			c->valid[d] = valid;
+		}
+	}
+
+	fclose(f);
+
+	if (ret)
+		fprintf(stderr, "Invalid profile state file %s\n", path);
+
+	return ret;
+}
+
+static int cdladm_save_profile_state(struct cdl_dev *dev, const char *name,
+				     struct cdladm_snapshot *snap)
+{
+	struct cdl_stats_counters *c;
+	int rw, d;
+	FILE *f;
+
+	f = cdladm_create_state(dev, "profile");
+	if (!f)
+		return 1;
+
+	fprintf(f, "%s %llu %llu %llu %llu %llu %d\n", name, snap->time,
+		snap->ios[CDL_READ], snap->ticks[CDL_READ],
+		snap->ios[CDL_WRITE], snap->ticks[CDL_WRITE],
+		snap->has_counters);
+
+	for (rw = CDL_READ; rw <= CDL_WRITE && snap->has_counters; rw++) {
+		c = &snap->c[rw];
+		for (d = 0; d < CDL_MAX_DESC; d++)
+			fprintf(f, "%d %" PRIu64 " %" PRIu64 "\n",
+				c->valid[d], c->nr_cmds[d], c->nr_misses[d]);
+	}
+
+	return cdladm_close_state(dev, "profile", f);
+}
+
+/*
+ * Show the statistics of the period a profile was active, between the
+ * snapshot taken after switching to it and the one taken before switching
+ * to another profile.
+ */
+static void cdladm_show_period(const char *name, struct cdladm_snapshot *from,
+			       struct cdladm_snapshot *to)
+{
+	unsigned long long ios, ticks, nr_cmds, nr_misses;
+	int rw, d;
+
+	printf("  Profile %s was active for %llu s\n",
+	       name, to->time - from->time);
+
+	for (rw = CDL_READ; rw <= CDL_WRITE; rw++) {
+		if (to->ios[rw] < from->ios[rw])
+			continue;
+		ios = to->ios[rw] - from->ios[rw];
+		ticks = to->ticks[rw] - from->ticks[rw];
+		printf("    %s: %llu I/Os", rw == CDL_READ ? "Reads" : "Writes",
+		       ios);
+		if (ios)
+			printf(", average latency %.3f ms",
+			       (double)ticks / (double)ios);
+		printf("\n");
+	}
+
+	if (!from->has_counters || !to->has_counters)
+		return;
+
+	for (rw = CDL_READ; rw <= CDL_WRITE; rw++) {
+		for (d = 0; d < CDL_MAX_DESC; d++) {
+			if (!from->c[rw].valid[d] || !to->c[rw].valid[d] ||
+			    to->c[rw].nr_cmds[d] <= from->c[rw].nr_cmds[d])
+				continue;
+			nr_cmds = to->c[rw].nr_cmds[d] -
+				from->c[rw].nr_cmds[d];
+			nr_misses = to->c[rw].nr_misses[d] -
+				from->c[rw].nr_misses[d];
+			if (nr_misses > nr_cmds)
+				continue;
+			printf("    %s descriptor %d: %llu commands, "
+			       "%llu limits missed (%.2f %%)\n",
+			       rw == CDL_READ ? "Read" : "Write", d + 1,
+			       nr_cmds, nr_misses,
+			       (double)nr_misses * 100.0 / (double)nr_cmds);
+		}
+	}
+}
+
+/*
+ * Switch to a profile, writing only the profile pages that differ from the
+ * device pages, all at once and with a single device revalidation. The
+ * statistics are snapshotted before and after the switch, to show the
+ * statistics of the period the previous profile was active.
+ */
+static int cdladm_switch_profile(struct cdl_dev *dev, struct cdl_profile *p)
+{
+	struct cdladm_snapshot prev, before, after;
+	struct cdl_page *pages[CDL_MAX_PAGES];
+	char name[CDL_PROFILE_NAME_LEN];
+	int i, nr_pages = 0;
+	bool same;
+
+	if (cdl_reread_pages(dev)) {
+		fprintf(stderr, "Read pages failed\n");
+		return 1;
+	}
+
+	for (i = 0; i < CDL_MAX_PAGES; i++) {
+		if (p->pages[i].cdlp != CDLP_NONE &&
+		    cdl_page_diff(dev, &p->pages[i]))
+			pages[nr_pages++] = &p->pages[i];
+	}
+
+	if (cdladm_load_profile_state(dev, name, &prev))
+		name[0] = '\0';
+	same = strcmp(name, p->name) == 0;
+	if (same && !nr_pages)
 		return 0;
+
+	cdladm_snapshot(dev, &before);
+
+	cdladm_print_time();
+	if (same)
+		printf("Re-applying profile %s\n", p->name);
+	else if (name[0])
+		printf("Switching from profile %s to profile %s\n",
+		       name, p->name);
+	else
+		printf("Switching to profile %s\n", p->name);
+
+	if (name[0] && !same)
+		cdladm_show_period(name, &prev, &before);
+
+	for (i = 0; i < nr_pages; i++)
+		printf("  Writing page %s\n", cdl_page_name(pages[i]->cdlp));
+
+	if (cdl_write_pages(dev, pages, nr_pages) ||
+	    cdladm_update_timeouts(dev)) {
+		fprintf(stderr, "Switch to profile %s failed\n", p->name);
+		return 1;
+	}
+
+	printf("  Profile %s active\n", p->name);
+
+	if (same)
+		return 0;
+
+	cdladm_snapshot(dev, &after);
+
+	return cdladm_save_profile_state(dev, p->name, &after);
+}
+
+static volatile sig_atomic_t cdladm_wakeup;
+
+static void cdladm_sigusr1(int sig)
+{
+	cdladm_wakeup = 1;
+}
+
+/*
+ * Switch between the profiles of a schedule file. With a profile name,
+ * switch to this profile and exit. With once, switch to the profile
+ * selected by the schedule rules and exit. Otherwise, evaluate the rules
+ * every interval seconds, or immediately on SIGUSR1, until interrupted.
+ */
+static int cdladm_schedule(struct cdl_dev *dev, char *path, char *profile,
+			   bool once, unsigned int interval)
+{
+	struct cdl_schedule s;
+	int p, cur = -1, ret = 0;
+	unsigned int t;
+
+	if (!path) {
+		fprintf(stderr, "No file specified\n");
+		return 1;
+	}
+
+	printf("Parsing file %s...\n", path);
+	if (cdl_schedule_parse(dev, path, &s))
+		return 1;
+
+	if (profile) {
+		p = cdl_schedule_find_profile(&s, profile);
+		if (p < 0) {
+			fprintf(stderr, "Profile %s is not defined\n",
+				profile);
+			ret = 1;
+		} else {
+			ret = cdladm_switch_profile(dev, &s.profiles[p]);
+		}
+		goto out;
+	}
+
+	if (!s.nr_rules) {
+		fprintf(stderr, "No rules defined\n");
+		ret = 1;
+		goto out;
 	}
 
-	/* Generic options */
-	if (strcmp(argv[1], "--version") == 0) {
-		printf("cdladm, version %s\n", PACKAGE_VERSION);
-		printf("Copyright (C) 2021, Western Digital Corporation"
-		       " or its affiliates.\n");
-		return 0;
-	}
+	if (!once)
+		printf("Scheduling %d profiles, checking every %u s\n",
+		       s.nr_profiles, interval);
+
+	signal(SIGINT, cdladm_sigint);
+	signal(SIGTERM, cdladm_sigint);
+	signal(SIGUSR1, cdladm_sigusr1);
+
+	while (!cdladm_stop) {
+		cdladm_wakeup = 0;
+
+		p = cdl_schedule_select(&s, time(NULL));
+		if (p >= 0 && p != cur) {
+			ret = cdladm_switch_profile(dev, &s.profiles[p]);
+			if (!ret)
+				cur = p;
+		} else if (p < 0 && once) {
+			printf("No rule applies\n");
+		}
+
+		if (once)
+			break;
+
+		fflush(stdout);
+		for (t = 0; t < interval * 10 && !cdladm_stop &&
+			     !cdladm_wakeup; t++)
+			usleep(100000);
+	}
+
+out:
+	cdl_schedule_free(&s);
+
+	return ret ? 1 : 0;
+}
+
+static void cdladm_init_dev(struct cdl_dev *dev)
+{
+	int i;
+
+	memset(dev, 0, sizeof(*dev));
+	dev->fd = -1;
+	for (i = 0; i < CDL_CMD_MAX; i++)
+		dev->cmd_cdlp[i] = CDLP_NONE;
+	for (i = 0; i < CDL_MAX_PAGES; i++)
+		dev->cdl_pages[i].cdlp = CDLP_NONE;
+}
+
+/*
+ * Apply to a device the first bundle device section matching it.
+ * Return the number of changes needed or applied, or a negative error code.
+ */
+static int cdladm_apply_section(struct cdl_dev *dev, struct cdl_bundle *b,
+				bool check)
+{
+	struct cdl_bundle_dev *bd;
+	unsigned int changed;
+	int i, ret, nr_changes = 0;
+
+	printf("Device: /dev/%s, %s %s, revision %s\n",
+	       dev->name, dev->vendor, dev->id, dev->rev);
+
+	if (!(dev->flags & CDL_DEV_SUPPORTED)) {
+		fprintf(stderr, "Command duration limits is not supported\n");
+		return -EOPNOTSUPP;
+	}
+
+	bd = cdl_bundle_match(b, dev);
+	if (!bd) {
+		printf("No matching device section\n");
+		return 0;
+	}
+	printf("Using device section %d\n", (int)(bd - b->devs) + 1);
+
+	ret = cdl_read_pages(dev);
+	if (ret)
+		return ret;
+
+	ret = cdl_bundle_check(dev, bd);
+	if (ret)
+		return ret;
+
+	/* Pages */
+	for (i = 0; i < CDL_MAX_PAGES; i++) {
+		if (bd->pages[i].cdlp == CDLP_NONE)
+			continue;
+		changed = cdl_page_diff(dev, &bd->pages[i]);
+		if (!changed)
+			continue;
+		cdladm_show_diff(&bd->pages[i], changed);
+		nr_changes++;
+		if (check)
+			continue;
+		ret = cdl_write_page(dev, &bd->pages[i]);
+		if (ret)
+			return ret;
+	}
+
+	/* Statistics selectors */
+	if (bd->has_selectors) {
+		ret = cdl_ata_statistics_set_selectors(dev, bd->selectors,
+						       !check);
+		if (ret < 0)
+			return ret;
+		if (ret) {
+			printf("%d statistics selectors changed\n", ret);
+			nr_changes++;
+		}
+	}
+
+	/* CDL and high priority enhancement states */
+	if (bd->enable == 0 && (dev->flags & CDL_SYS_ENABLED)) {
+		printf("Command duration limits must be disabled\n");
+		nr_changes++;
+		if (!check && cdladm_disable(dev))
+			return -EIO;
+	}
+
+	if (bd->highpri == 0 && (dev->flags & CDL_HIGHPRI_DEV_ENABLED)) {
+		printf("High priority enhancement must be disabled\n");
+		nr_changes++;
+		if (!check && cdladm_disable_highpri(dev))
+			return -EIO;
+	}
+
+	if (bd->highpri == 1 && !(dev->flags & CDL_HIGHPRI_DEV_ENABLED)) {
+		printf("High priority enhancement must be enabled\n");
+		nr_changes++;
+		if (!check && cdladm_enable_highpri(dev))
+			return -EIO;
+	}
+
+	if (bd->enable == 1 && !(dev->flags & CDL_SYS_ENABLED)) {
+		printf("Command duration limits must be enabled\n");
+		nr_changes++;
+		if (!check && cdladm_enable(dev))
+			return -EIO;
+	}
+
+	return nr_changes;
+}
+
+static int cdladm_apply_dev(struct cdl_dev *tmpl, char *path,
+			    struct cdl_bundle *b, bool check)
+{
+	struct cdl_dev dev;
+	int ret;
+
+	cdladm_init_dev(&dev);
+	dev.flags = tmpl->flags;
+
+	dev.path = realpath(path, NULL);
+	if (!dev.path) {
+		fprintf(stderr, "Failed to get device real path\n");
+		return 1;
+	}
+
+	ret = cdl_open_dev(&dev, O_RDWR, true);
+	if (ret) {
+		free(dev.path);
+		return 1;
+	}
+
+	cdladm_get_kernel_support(&dev);
+
+	ret = cdladm_apply_section(&dev, b, check);
+	if (ret > 0)
+		printf("%d changes %s\n", ret, check ? "needed" : "applied");
+	else if (!ret)
+		printf("No changes needed\n");
+
+	cdl_close_dev(&dev);
+	free(dev.path);
+
+	if (ret < 0 || (check && ret))
+		return 1;
+
+	return 0;
+}
+
+/*
+ * Apply a configuration bundle to a set of devices. The bundle is parsed
+ * once and each device is handled in parallel by a child process, with
+ * the output of each child shown in the order of the devices once all
+ * devices are done.
+ */
+static int cdladm_apply(struct cdl_dev *tmpl, char *path,
+			char **devs, int nr_devs, bool check)
+{
+	struct cdl_bundle b;
+	int i, c, status, nr_failed = 0;
+	FILE **out = NULL;
+	pid_t *pids = NULL;
+	FILE *f;
+	int ret;
+
+	if (!path) {
+		fprintf(stderr, "No file specified\n");
+		return 1;
+	}
+
+	f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Open file %s failed (%s)\n",
+			path, strerror(errno));
+		return 1;
+	}
+
+	printf("Parsing bundle %s...\n", path);
+	ret = cdl_bundle_parse(f, &b);
+	fclose(f);
+	if (ret)
+		return 1;
+
+	printf("%d device sections, %s %d devices\n",
+	       b.nr_devs, check ? "checking" : "applying to", nr_devs);
+	fflush(stdout);
+
+	out = calloc(nr_devs, sizeof(FILE *));
+	pids = calloc(nr_devs, sizeof(pid_t));
+	if (!out || !pids) {
+		fprintf(stderr, "No memory for devices\n");
+		ret = 1;
+		goto free;
+	}
+
+	for (i = 0; i < nr_devs; i++) {
+		pids[i] = -1;
+		out[i] = tmpfile();
+		if (!out[i]) {
+			fprintf(stderr, "Create output file failed (%s)\n",
+				strerror(errno));
+			continue;
+		}
+
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			fprintf(stderr, "fork failed (%s)\n", strerror(errno));
+			continue;
+		}
+
+		if (!pids[i]) {
+			dup2(fileno(out[i]), STDOUT_FILENO);
+			dup2(fileno(out[i]), STDERR_FILENO);
+			setvbuf(stdout, NULL, _IOLBF, 0);
+			exit(cdladm_apply_dev(tmpl, devs[i], &b, check));
+		}
+	}
+
+	for (i = 0; i < nr_devs; i++) {
+		printf("\n== %s\n", devs[i]);
+
+		if (pids[i] < 0 ||
+		    waitpid(pids[i], &status, 0) < 0 ||
+		    !WIFEXITED(status) || WEXITSTATUS(status))
+			status = 1;
+		else
+			status = 0;
+
+		if (out[i]) {
+			rewind(out[i]);
+			while ((c = fgetc(out[i])) != EOF)
+				putchar(c);
+			fclose(out[i]);
+		}
+
+		if (status) {
+			printf("%s: %s\n", devs[i],
+			       check ? "check failed" : "failed");
+			nr_failed++;
+		}
+	}
+
+	printf("\n%d / %d devices %s\n",
+	       nr_devs - nr_failed, nr_devs, check ? "up to date" : "done");
+
+	ret = nr_failed ? 1 : 0;
+
+free:
+	free(out);
+	free(pids);
+	cdl_bundle_free(&b);
+
+	return ret;
+}
+
+/*
+ * Possible command codes.
+ */
+enum cdladm_cmd_code {
+	CDLADM_NONE,
+	CDLADM_INFO,
+	CDLADM_LIST,
+	CDLADM_SHOW,
+	CDLADM_CLEAR,
+	CDLADM_SAVE,
+	CDLADM_UPLOAD,
+	CDLADM_ENABLE,
+	CDLADM_DISABLE,
+	CDLADM_ENABLE_HIGHPRI,
+	CDLADM_DISABLE_HIGHPRI,
+	CDLADM_STATS_SHOW,
+	CDLADM_STATS_RESET,
+	CDLADM_STATS_SAVE,
+	CDLADM_STATS_UPLOAD,
+	CDLADM_TRACE,
+	CDLADM_WATCH,
+	CDLADM_APPLY,
+	CDLADM_BATCH,
+	CDLADM_SCHEDULE,
+
+	CDLADM_CMD_MAX,
+};
+
+/*
+ * Command codes and the device open mode needed.
+ */
+static struct {
+	const char *opt;
+	enum cdladm_cmd_code code;
+	mode_t mode;
+} cdladm_cmd[CDLADM_CMD_MAX + 1] =
+{
+	{ "",			CDLADM_NONE,		0	 },
+	{ "info",		CDLADM_INFO,		O_RDONLY },
+	{ "list",		CDLADM_LIST,		O_RDONLY },
+	{ "show",		CDLADM_SHOW,		O_RDONLY },
+	{ "clear",		CDLADM_CLEAR,		O_RDWR	 },
+	{ "save",		CDLADM_SAVE,		O_RDONLY },
+	{ "upload",		CDLADM_UPLOAD,		O_RDWR	 },
+	{ "enable",		CDLADM_ENABLE,		O_RDWR   },
+	{ "disable",		CDLADM_DISABLE,		O_RDWR   },
+	{ "enable-highpri",	CDLADM_ENABLE_HIGHPRI,	O_RDWR   },
+	{ "disable-highpri",	CDLADM_DISABLE_HIGHPRI,	O_RDWR   },
+	{ "stats-show",		CDLADM_STATS_SHOW,	O_RDWR   },
+	{ "stats-reset",	CDLADM_STATS_RESET,	O_RDWR   },
+	{ "stats-save",		CDLADM_STATS_SAVE,	O_RDWR   },
+	{ "stats-upload",	CDLADM_STATS_UPLOAD,	O_RDWR   },
+	{ "trace",		CDLADM_TRACE,		O_RDONLY },
+	{ "watch",		CDLADM_WATCH,		O_RDWR   },
+	{ "apply",		CDLADM_APPLY,		O_RDWR   },
+	{ "batch",		CDLADM_BATCH,		O_RDWR   },
+	{ "schedule",		CDLADM_SCHEDULE,	O_RDWR   },
+	{ NULL,			CDLADM_CMD_MAX,		0        }
+};
+
+static int cdladm_get_command(char *opt)
+{
+	int i;
 
-	if (strcmp(argv[1], "--help") == 0 ||
-	    strcmp(argv[1], "-h") == 0) {
-		cdladm_usage();
-		return 0;
+	for (i = 1; i < CDLADM_CMD_MAX; i++) {
+		if (strcmp(opt, cdladm_cmd[i].opt) == 0)
+			return cdladm_cmd[i].code;
 	}
 
-	/* Get the command */
-	command = cdladm_get_command(argv[1]);
-	if (command >= CDLADM_CMD_MAX) {
-		fprintf(stderr, "Invalid command %s\n", argv[1]);
-		return 1;
-	}
+	return CDLADM_CMD_MAX;
+}
 
-	/* Parse options */
-	for (i = 2; i < argc; i++) {
+/*
+ * Command options.
+ */
+struct cdladm_opts {
+	char			*page;
+	char			*path;
+	char			*files[CDL_MAX_PAGES];
+	int			nr_files;
+	unsigned int		duration;
+	unsigned int		interval;
+	int			enable;
+	char			*profile;
+	bool			once;
+	bool			blob;
+	bool			check;
+	bool			repair;
+	bool			timeouts;
+	unsigned int		flags;
+};
+
+static void cdladm_init_opts(struct cdladm_opts *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+	opts->duration = 60;
+	opts->interval = 60;
+	opts->enable = -1;
+}
+
+/*
+ * Parse the options of a command, starting from argv[i].
+ * Return the index of the first non-option argument or -1 on error.
+ */
+static int cdladm_parse_opts(struct cdladm_opts *opts, int command,
+			     int argc, char **argv, int i)
+{
+	for (; i < argc; i++) {
 		if (strcmp(argv[i], "--verbose") == 0 ||
 		    strcmp(argv[i], "-v") == 0) {
-			dev.flags |= CDL_VERBOSE;
+			opts->flags |= CDL_VERBOSE;
 			continue;
 		}
 
 		if (strcmp(argv[i], "--force-ata") == 0 ||
 		    strcmp(argv[i], "-a") == 0) {
-			dev.flags |= CDL_USE_ATA;
+			opts->flags |= CDL_USE_ATA;
 			continue;
 		}
 
 		if (strcmp(argv[i], "--count") == 0) {
 			if (command != CDLADM_SHOW)
 				goto err_cmd_line;
-			dev.flags |= CDL_SHOW_COUNT;
+			opts->flags |= CDL_SHOW_COUNT;
 			continue;
 		}
 
@@ -767,9 +1944,9 @@ int main(int argc, char **argv)
 			    command != CDLADM_SAVE)
 				goto err_cmd_line;
 			i++;
-			if (i >= argc - 1)
+			if (i >= argc)
 				goto err_cmd_line;
-			page = argv[i];
+			opts->page = argv[i];
 			continue;
 		}
 
@@ -777,19 +1954,113 @@ int main(int argc, char **argv)
 			if (command != CDLADM_SAVE &&
 			    command != CDLADM_UPLOAD &&
 			    command != CDLADM_STATS_SAVE &&
-			    command != CDLADM_STATS_UPLOAD)
+			    command != CDLADM_STATS_UPLOAD &&
+			    command != CDLADM_TRACE &&
+			    command != CDLADM_WATCH &&
+			    command != CDLADM_APPLY &&
+			    command != CDLADM_BATCH &&
+			    command != CDLADM_SCHEDULE)
+				goto err_cmd_line;
+			i++;
+			if (i >= argc)
+				goto err_cmd_line;
+			opts->path = argv[i];
+			if (command == CDLADM_WATCH) {
+				if (opts->nr_files >= CDL_MAX_PAGES)
+					goto err_cmd_line;
+				opts->files[opts->nr_files++] = opts->path;
+			}
+			continue;
+		}
+
+		if (strcmp(argv[i], "--duration") == 0) {
+			if (command != CDLADM_TRACE)
+				goto err_cmd_line;
+			i++;
+			if (i >= argc)
+				goto err_cmd_line;
+			opts->duration = atoi(argv[i]);
+			if (!opts->duration) {
+				fprintf(stderr, "Invalid duration\n");
+				return -1;
+			}
+			continue;
+		}
+
+		if (strcmp(argv[i], "--interval") == 0) {
+			if (command != CDLADM_WATCH &&
+			    command != CDLADM_SCHEDULE)
+				goto err_cmd_line;
+			i++;
+			if (i >= argc)
+				goto err_cmd_line;
+			opts->interval = atoi(argv[i]);
+			if (!opts->interval) {
+				fprintf(stderr, "Invalid interval\n");
+				return -1;
+			}
+			continue;
+		}
+
+		if (strcmp(argv[i], "--profile") == 0) {
+			if (command != CDLADM_SCHEDULE)
 				goto err_cmd_line;
 			i++;
-			if (i >= argc - 1)
+			if (i >= argc)
+				goto err_cmd_line;
+			opts->profile = argv[i];
+			continue;
+		}
+
+		if (strcmp(argv[i], "--once") == 0) {
+			if (command != CDLADM_SCHEDULE)
+				goto err_cmd_line;
+			opts->once = true;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--repair") == 0) {
+			if (command != CDLADM_WATCH)
+				goto err_cmd_line;
+			opts->repair = true;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--enabled") == 0 ||
+		    strcmp(argv[i], "--disabled") == 0) {
+			if (command != CDLADM_WATCH)
+				goto err_cmd_line;
+			opts->enable = strcmp(argv[i], "--enabled") == 0;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--blob") == 0) {
+			if (command != CDLADM_SAVE &&
+			    command != CDLADM_UPLOAD)
+				goto err_cmd_line;
+			opts->blob = true;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--check") == 0) {
+			if (command != CDLADM_UPLOAD &&
+			    command != CDLADM_APPLY)
+				goto err_cmd_line;
+			opts->check = true;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--timeouts") == 0) {
+			if (command != CDLADM_UPLOAD)
 				goto err_cmd_line;
-			path = argv[i];
+			opts->timeouts = true;
 			continue;
 		}
 
 		if (strcmp(argv[i], "--permanent") == 0) {
 			if (command != CDLADM_UPLOAD)
 				goto err_cmd_line;
-			dev.flags |= CDL_USE_MS_SP;
+			opts->flags |= CDL_USE_MS_SP;
 			continue;
 		}
 
@@ -797,7 +2068,7 @@ int main(int argc, char **argv)
 			if (command != CDLADM_SHOW &&
 			    command != CDLADM_STATS_SHOW)
 				goto err_cmd_line;
-			dev.flags |= CDL_SHOW_RAW_VAL;
+			opts->flags |= CDL_SHOW_RAW_VAL;
 			continue;
 		}
 
@@ -805,7 +2076,7 @@ int main(int argc, char **argv)
 			if (command != CDLADM_ENABLE &&
 			    command != CDLADM_DISABLE)
 				goto err_cmd_line;
-			dev.flags |= CDL_FORCE_DEV;
+			opts->flags |= CDL_FORCE_DEV;
 			continue;
 		}
 
@@ -813,7 +2084,228 @@ int main(int argc, char **argv)
 			break;
 
 		fprintf(stderr, "Invalid option '%s'\n", argv[i]);
+		return -1;
+	}
+
+	if (opts->check && (opts->blob || opts->timeouts))
+		goto err_cmd_line;
+
+	return i;
+
+err_cmd_line:
+	fprintf(stderr, "Invalid command line\n");
+	return -1;
+}
+
+/*
+ * Execute a command on an open device with its pages read.
+ */
+static int cdladm_exec(struct cdl_dev *dev, int command,
+		       struct cdladm_opts *opts)
+{
+	switch (command) {
+	case CDLADM_LIST:
+		return cdladm_list(dev);
+	case CDLADM_SHOW:
+		return cdladm_show(dev, opts->page);
+	case CDLADM_CLEAR:
+		return cdladm_clear(dev, opts->page);
+	case CDLADM_SAVE:
+		return cdladm_save(dev, opts->page, opts->path, opts->blob);
+	case CDLADM_UPLOAD:
+		if (cdladm_upload(dev, opts->path, opts->blob, opts->check))
+			return 1;
+		if (opts->timeouts)
+			return cdladm_apply_timeouts(dev);
+		return 0;
+	case CDLADM_ENABLE:
+		return cdladm_enable(dev);
+	case CDLADM_DISABLE:
+		return cdladm_disable(dev);
+	case CDLADM_ENABLE_HIGHPRI:
+		return cdladm_enable_highpri(dev);
+	case CDLADM_DISABLE_HIGHPRI:
+		return cdladm_disable_highpri(dev);
+	case CDLADM_STATS_SHOW:
+		return cdladm_stats_show(dev, opts->page);
+	case CDLADM_STATS_RESET:
+		return cdladm_stats_reset(dev);
+	case CDLADM_STATS_SAVE:
+		return cdladm_stats_save(dev, opts->path);
+	case CDLADM_STATS_UPLOAD:
+		return cdladm_stats_upload(dev, opts->path);
+	case CDLADM_TRACE:
+		return cdladm_trace(dev, opts->path, opts->duration);
+	case CDLADM_WATCH:
+		return cdladm_watch(dev, opts->files, opts->nr_files,
+				    opts->enable, opts->interval, opts->repair);
+	case CDLADM_SCHEDULE:
+		return cdladm_schedule(dev, opts->path, opts->profile,
+				       opts->once, opts->interval);
+	case CDLADM_NONE:
+	default:
+		fprintf(stderr, "No command specified\n");
+		return 1;
+	}
+}
+
+#define CDLADM_BATCH_MAX_ARGS	32
+
+/*
+ * Execute a batch command line.
+ */
+static int cdladm_batch_line(struct cdl_dev *dev, char *str)
+{
+	char *argv[CDLADM_BATCH_MAX_ARGS];
+	struct cdladm_opts opts;
+	unsigned int flags;
+	int argc = 0, command, ret;
+	char *arg;
+
+	for (arg = strtok(str, " \t"); arg; arg = strtok(NULL, " \t")) {
+		if (argc >= CDLADM_BATCH_MAX_ARGS) {
+			fprintf(stderr, "Too many arguments\n");
+			return 1;
+		}
+		argv[argc++] = arg;
+	}
+
+	command = cdladm_get_command(argv[0]);
+	switch (command) {
+	case CDLADM_CMD_MAX:
+		fprintf(stderr, "Invalid command %s\n", argv[0]);
+		return 1;
+	case CDLADM_INFO:
+	case CDLADM_TRACE:
+	case CDLADM_WATCH:
+	case CDLADM_APPLY:
+	case CDLADM_BATCH:
+	case CDLADM_SCHEDULE:
+		fprintf(stderr, "Command %s cannot be used in a batch\n",
+			argv[0]);
+		return 1;
+	default:
+		break;
+	}
+
+	cdladm_init_opts(&opts);
+	if (cdladm_parse_opts(&opts, command, argc, argv, 1) != argc)
+		return 1;
+
+	if (opts.flags & CDL_USE_ATA) {
+		fprintf(stderr, "--force-ata cannot be used in a batch\n");
+		return 1;
+	}
+
+	/* Options only apply to this command */
+	flags = opts.flags & ~dev->flags;
+	dev->flags |= opts.flags;
+	ret = cdladm_exec(dev, command, &opts);
+	dev->flags &= ~flags;
+
+	return ret;
+}
+
+/*
+ * Execute a sequence of commands read from a file or from the standard
+ * input, one command per line, with the device opened and its pages read
+ * only once. Commands update the device state they change and the device
+ * revalidations are deferred until the end of the batch.
+ */
+static int cdladm_batch(struct cdl_dev *dev, char *path)
+{
+	char line[CDL_LINE_MAX_LEN];
+	FILE *f = stdin;
+	int n = 0, ret = 0;
+	char *str;
+
+	if (path && strcmp(path, "-") != 0) {
+		f = fopen(path, "r");
+		if (!f) {
+			fprintf(stderr, "Open file %s failed (%s)\n",
+				path, strerror(errno));
+			return 1;
+		}
+	}
+
+	cdl_defer_revalidate(dev, true);
+
+	while ((str = cdl_get_line(f, line))) {
+		n++;
+		printf("[%d] %s\n", n, str);
+		ret = cdladm_batch_line(dev, str);
+		if (ret) {
+			fprintf(stderr, "Batch command %d failed\n", n);
+			break;
+		}
+	}
+
+	/* Revalidate once for all the changes */
+	cdl_defer_revalidate(dev, false);
+
+	if (f != stdin)
+		fclose(f);
+
+	if (!ret)
+		printf("%d commands executed\n", n);
+
+	return ret ? 1 : 0;
+}
+
+
+/*
+ * Main function.
+ */
+int main(int argc, char **argv)
+{
+	struct cdl_dev dev;
+	struct cdladm_opts opts;
+	int command = CDLADM_NONE;
+	bool reopen = false;
+	int i, ret;
+
+	/* Initialize */
+	cdladm_init_dev(&dev);
+	cdladm_init_opts(&opts);
+
+	if (argc == 1) {
+		cdladm_usage();
+		return 0;
+	}
+
+	/* Generic options */
+	if (strcmp(argv[1], "--version") == 0) {
+		printf("cdladm, version %s\n", PACKAGE_VERSION);
+		printf("Copyright (C) 2021, Western Digital Corporation"
+		       " or its affiliates.\n");
+		return 0;
+	}
+
+	if (strcmp(argv[1], "--help") == 0 ||
+	    strcmp(argv[1], "-h") == 0) {
+		cdladm_usage();
+		return 0;
+	}
+
+	/* Get the command */
+	command = cdladm_get_command(argv[1]);
+	if (command >= CDLADM_CMD_MAX) {
+		fprintf(stderr, "Invalid command %s\n", argv[1]);
+		return 1;
+	}
+
+	/* Parse options */
+	i = cdladm_parse_opts(&opts, command, argc, argv, 2);
+	if (i < 0)
 		return 1;
+	dev.flags |= opts.flags;
+
+	/* Apply a bundle to one or more devices */
+	if (command == CDLADM_APPLY) {
+		if (i >= argc)
+			goto err_cmd_line;
+		return cdladm_apply(&dev, opts.path, &argv[i], argc - i,
+				    opts.check);
 	}
 
 	if (i != argc - 1) {
@@ -830,7 +2322,7 @@ err_cmd_line:
 	}
 
 	/* Open the device and printf some information about it */
-	ret = cdl_open_dev(&dev, cdladm_cmd[command].mode);
+	ret = cdl_open_dev(&dev, cdladm_cmd[command].mode, true);
 	if (ret)
 		return 1;
 
@@ -879,7 +2371,7 @@ err_cmd_line:
 	if (reopen) {
 		/* Close and re-open the device to get updated information */
 		cdl_close_dev(&dev);
-		ret = cdl_open_dev(&dev, cdladm_cmd[command].mode);
+		ret = cdl_open_dev(&dev, cdladm_cmd[command].mode, true);
 		if (ret)
 			return 1;
 	}
@@ -956,52 +2448,27 @@ err_cmd_line:
 		goto out;
 	}
 
-	ret = cdl_read_pages(&dev);
-	if (ret)
-		goto out;
+	/*
+	 * Uploading a blob does not need the current pages, unless the
+	 * timeouts are set from the limits of all pages.
+	 */
+	if (command != CDLADM_UPLOAD || !opts.blob || opts.timeouts) {
+		ret = cdl_read_pages(&dev);
+		if (ret)
+			goto out;
+	}
 
 	/* Execute the command */
 	switch (command) {
-	case CDLADM_LIST:
-		ret = cdladm_list(&dev);
-		break;
-	case CDLADM_SHOW:
-		ret = cdladm_show(&dev, page);
-		break;
-	case CDLADM_CLEAR:
-		ret = cdladm_clear(&dev, page);
-		break;
-	case CDLADM_SAVE:
-		ret = cdladm_save(&dev, page, path);
-		break;
-	case CDLADM_UPLOAD:
-		ret = cdladm_upload(&dev, path);
-		break;
 	case CDLADM_ENABLE:
 	case CDLADM_DISABLE:
 		break;
-	case CDLADM_ENABLE_HIGHPRI:
-		ret = cdladm_enable_highpri(&dev);
-		break;
-	case CDLADM_DISABLE_HIGHPRI:
-		ret = cdladm_disable_highpri(&dev);
-		break;
-	case CDLADM_STATS_SHOW:
-		ret = cdladm_stats_show(&dev, page);
-		break;
-	case CDLADM_STATS_RESET:
-		ret = cdladm_stats_reset(&dev);
-		break;
-	case CDLADM_STATS_SAVE:
-		ret = cdladm_stats_save(&dev, path);
-		break;
-	case CDLADM_STATS_UPLOAD:
-		ret = cdladm_stats_upload(&dev, path);
+	case CDLADM_BATCH:
+		ret = cdladm_batch(&dev, opts.path);
 		break;
-	case CDLADM_NONE:
 	default:
-		fprintf(stderr, "No command specified\n");
-		ret = 1;
+		ret = cdladm_exec(&dev, command, &opts);
+		break;
 	}
 
 out:
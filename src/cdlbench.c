@@ -0,0 +1,674 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include "cdl.h"
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+
+enum cdlb_rw {
+	CDLB_RANDREAD,
+	CDLB_RANDWRITE,
+	CDLB_RANDRW,
+};
+
+struct cdlb_stats {
+	struct cdl_hist	lat;
+	uint64_t	nr_limit;
+	uint64_t	limit_lat_sum;
+	uint64_t	limit_lat_max;
+	uint64_t	nr_errors;
+	uint64_t	nr_timeouts;
+};
+
+struct cdlb {
+	enum cdlb_rw		rw;
+	unsigned int		rwmixread;
+	size_t			bs;
+	unsigned int		qd;
+	unsigned int		runtime;
+	unsigned int		dld;
+	unsigned int		percentage;
+	int			cdb_len;
+	uint64_t		seed;
+	char			*lat_log_path;
+	FILE			*lat_log;
+
+	uint64_t		nr_lbas;
+	uint64_t		nr_blocks;
+	struct cdl_sgio		sgio;
+	struct cdl_sgio_cmd	*cmds;
+	struct cdlb_stats	stats[2][CDL_MAX_DESC + 1];
+};
+
+static volatile sig_atomic_t cdlb_stop;
+
+static void cdlb_sigint(int sig)
+{
+	cdlb_stop = 1;
+}
+
+/*
+ * Print usage.
+ */
+static void cdlb_usage(void)
+{
+	printf("Usage:\n"
+	       "  cdlbench --help | -h\n"
+	       "  cdlbench --version\n"
+	       "  cdlbench [options] <device>\n");
+	printf("Options:\n"
+	       "  --verbose | -v       : Verbose output\n"
+	       "  --force-ata | -a     : Force the use of ATA NCQ passthrough\n"
+	       "                         commands\n"
+	       "  --rw <str>           : randread, randwrite or randrw\n"
+	       "                         (default: randread)\n"
+	       "  --rwmixread <pct>    : Percentage of reads of a randrw\n"
+	       "                         workload (default: 70)\n"
+	       "  --bs <bytes>         : Command size (default: 131072)\n"
+	       "  --qd <n>             : Queue depth (default: 8)\n"
+	       "  --runtime <sec>      : Run time in seconds (default: 60)\n"
+	       "  --dld <index>        : Duration limit descriptor index (1 to 7)\n"
+	       "                         to use (default: 0, no limit)\n"
+	       "  --percentage <pct>   : Percentage of commands using the\n"
+	       "                         descriptor --dld (default: 100)\n"
+	       "  --cdb <16|32>        : Use READ/WRITE 16 or READ/WRITE 32\n"
+	       "                         commands (default: the first supporting\n"
+	       "                         duration limits)\n"
+	       "  --fua                : Set the FUA bit of commands\n"
+	       "  --seed <n>           : Random generator seed (default: 1)\n"
+	       "  --lat-log <file>     : Save the latency of all commands to\n"
+	       "                         a fio format latency log file\n");
+	printf("See \"man cdlbench\" for more information.\n");
+}
+
+/*
+ * xorshift64* random number generator.
+ */
+static uint64_t cdlb_rand(struct cdlb *b)
+{
+	b->seed ^= b->seed >> 12;
+	b->seed ^= b->seed << 25;
+	b->seed ^= b->seed >> 27;
+
+	return b->seed * 0x2545F4914F6CDD1DULL;
+}
+
+static void cdlb_prep(struct cdl_dev *dev, struct cdlb *b,
+		      struct cdl_sgio_cmd *cmd)
+{
+	enum cdl_rw rw;
+	uint8_t dld = 0;
+	uint64_t lba;
+
+	switch (b->rw) {
+	case CDLB_RANDREAD:
+		rw = CDL_READ;
+		break;
+	case CDLB_RANDWRITE:
+		rw = CDL_WRITE;
+		break;
+	case CDLB_RANDRW:
+	default:
+		if (cdlb_rand(b) % 100 < b->rwmixread)
+			rw = CDL_READ;
+		else
+			rw = CDL_WRITE;
+		break;
+	}
+
+	if (b->dld && cdlb_rand(b) % 100 < b->percentage)
+		dld = b->dld;
+
+	lba = (cdlb_rand(b) % b->nr_blocks) * b->nr_lbas;
+
+	cdl_sgio_prep_cmd(dev, &b->sgio, cmd, rw, lba, b->nr_lbas, dld);
+}
+
+static void cdlb_account(struct cdl_dev *dev, struct cdlb *b,
+			 struct cdl_sgio_cmd *cmd, unsigned long long start)
+{
+	struct cdlb_stats *st = &b->stats[cmd->rw][cmd->dld];
+	enum cdl_sgio_status status;
+
+	status = cdl_sgio_cmd_status(&b->sgio, cmd);
+	switch (status) {
+	case CDL_SGIO_OK:
+		cdl_hist_add(&st->lat, cmd->lat);
+		break;
+	case CDL_SGIO_LIMIT:
+		st->nr_limit++;
+		st->limit_lat_sum += cmd->lat;
+		if (cmd->lat > st->limit_lat_max)
+			st->limit_lat_max = cmd->lat;
+		break;
+	case CDL_SGIO_TIMEOUT:
+		st->nr_timeouts++;
+		break;
+	case CDL_SGIO_ERROR:
+	default:
+		st->nr_errors++;
+		if (cdl_verbose(dev))
+			cdl_dev_err(dev,
+				"%s LBA %llu failed: status 0x%02x, host 0x%02x, driver 0x%02x, sense key 0x%02x, asc/ascq 0x%04x\n",
+				cmd->rw == CDL_READ ? "Read" : "Write",
+				(unsigned long long)cmd->lba,
+				cmd->io_hdr.status, cmd->io_hdr.host_status,
+				cmd->io_hdr.driver_status,
+				cmd->sense_key, cmd->asc_ascq);
+		break;
+	}
+
+	/* Same format as fio latency logs, with the CDL I/O priority hint */
+	if (b->lat_log)
+		fprintf(b->lat_log, "%llu, %llu, %d, %zu, 0x%x\n",
+			(cmd->start - start) / 1000000ULL, cmd->lat,
+			cmd->rw == CDL_READ ? 0 : 1, b->bs,
+			cmd->dld ? (2 << 13) | (cmd->dld << 3) : 0);
+}
+
+static int cdlb_run(struct cdl_dev *dev, struct cdlb *b)
+{
+	unsigned long long start, end;
+	struct cdl_sgio_cmd *cmd;
+	unsigned int i, inflight = 0;
+	int ret;
+
+	start = cdl_now_ns();
+	end = start + (unsigned long long)b->runtime * 1000000000ULL;
+
+	for (i = 0; i < b->qd; i++) {
+		cmd = &b->cmds[i];
+		cdlb_prep(dev, b, cmd);
+		ret = cdl_sgio_submit(&b->sgio, cmd);
+		if (ret)
+			goto drain;
+		inflight++;
+	}
+
+	ret = 0;
+	while (inflight) {
+		cmd = cdl_sgio_reap(&b->sgio);
+		if (!cmd) {
+			ret = -EIO;
+			break;
+		}
+		inflight--;
+
+		cdlb_account(dev, b, cmd, start);
+
+		if (cdlb_stop || cdl_now_ns() >= end)
+			continue;
+
+		cdlb_prep(dev, b, cmd);
+		ret = cdl_sgio_submit(&b->sgio, cmd);
+		if (ret)
+			goto drain;
+		inflight++;
+	}
+
+	return ret;
+
+drain:
+	while (inflight) {
+		if (!cdl_sgio_reap(&b->sgio))
+			break;
+		inflight--;
+	}
+
+	return ret;
+}
+
+static void cdlb_report(struct cdl_dev *dev, struct cdlb *b,
+			unsigned long long elapsed)
+{
+	struct cdlb_stats *st;
+	double secs = (double)elapsed / 1000000000.0;
+	uint64_t nr_ios;
+	int rw, d;
+
+	printf("  %-5s %3s %10s %10s %8s %7s %10s %10s %10s %10s %10s\n",
+	       "ddir", "dld", "ios", "iops", "limit", "errors",
+	       "avg (ms)", "p50 (ms)", "p99 (ms)", "p99.9 (ms)", "max (ms)");
+
+	for (rw = CDL_READ; rw <= CDL_WRITE; rw++) {
+		for (d = 0; d <= CDL_MAX_DESC; d++) {
+			st = &b->stats[rw][d];
+			nr_ios = st->lat.count + st->nr_limit +
+				st->nr_errors + st->nr_timeouts;
+			if (!nr_ios)
+				continue;
+
+			printf("  %-5s %3d %10llu %10.1f %8llu %7llu %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+			       rw == CDL_READ ? "read" : "write", d,
+			       (unsigned long long)nr_ios,
+			       (double)nr_ios / secs,
+			       (unsigned long long)st->nr_limit,
+			       (unsigned long long)(st->nr_errors +
+						    st->nr_timeouts),
+			       (double)cdl_hist_avg(&st->lat) / 1000000.0,
+			       (double)cdl_hist_percentile(&st->lat, 50) / 1000000.0,
+			       (double)cdl_hist_percentile(&st->lat, 99) / 1000000.0,
+			       (double)cdl_hist_percentile(&st->lat, 99.9) / 1000000.0,
+			       (double)st->lat.max / 1000000.0);
+		}
+	}
+
+	for (rw = CDL_READ; rw <= CDL_WRITE; rw++) {
+		for (d = 1; d <= CDL_MAX_DESC; d++) {
+			st = &b->stats[rw][d];
+			if (!st->nr_limit)
+				continue;
+			printf("  %s descriptor %d: %llu commands failed by the limit policy, latency avg %.3f ms, max %.3f ms\n",
+			       rw == CDL_READ ? "Read" : "Write", d,
+			       (unsigned long long)st->nr_limit,
+			       (double)st->limit_lat_sum / st->nr_limit / 1000000.0,
+			       (double)st->limit_lat_max / 1000000.0);
+		}
+	}
+}
+
+/*
+ * Check that the commands used support duration limits and that
+ * the descriptor used is not empty.
+ */
+static int cdlb_check_dld(struct cdl_dev *dev, struct cdlb *b, enum cdl_rw rw)
+{
+	enum cdl_cmd c;
+	struct cdl_desc *desc;
+	enum cdl_p cdlp;
+
+	if (rw == CDL_READ)
+		c = b->cdb_len == 32 ? CDL_READ_32 : CDL_READ_16;
+	else
+		c = b->cdb_len == 32 ? CDL_WRITE_32 : CDL_WRITE_16;
+
+	cdlp = dev->cmd_cdlp[c];
+	if (cdlp == CDLP_NONE) {
+		fprintf(stderr, "%s does not support duration limits\n",
+			cdl_cmd_str(c));
+		return 1;
+	}
+
+	desc = &dev->cdl_pages[cdlp].descs[b->dld - 1];
+	if (!desc->max_inactive_time && !desc->max_active_time &&
+	    !desc->duration)
+		printf("WARNING: page %s descriptor %u has no limits\n",
+		       cdl_page_name(cdlp), b->dld);
+
+	return 0;
+}
+
+/*
+ * Use the smallest CDB supporting duration limits for the workload
+ * directions, unless specified.
+ */
+static void cdlb_set_cdb_len(struct cdl_dev *dev, struct cdlb *b)
+{
+	bool r16 = dev->cmd_cdlp[CDL_READ_16] != CDLP_NONE;
+	bool w16 = dev->cmd_cdlp[CDL_WRITE_16] != CDLP_NONE;
+	bool r32 = dev->cmd_cdlp[CDL_READ_32] != CDLP_NONE;
+	bool w32 = dev->cmd_cdlp[CDL_WRITE_32] != CDLP_NONE;
+
+	if (b->cdb_len)
+		return;
+
+	b->cdb_len = 16;
+	switch (b->rw) {
+	case CDLB_RANDREAD:
+		if (!r16 && r32)
+			b->cdb_len = 32;
+		break;
+	case CDLB_RANDWRITE:
+		if (!w16 && w32)
+			b->cdb_len = 32;
+		break;
+	case CDLB_RANDRW:
+		if ((!r16 || !w16) && r32 && w32)
+			b->cdb_len = 32;
+		break;
+	}
+}
+
+static int cdlb_init(struct cdl_dev *dev, struct cdlb *b)
+{
+	unsigned long max_kb;
+	unsigned int i;
+	int ret;
+
+	if (!dev->lba_size || b->bs % dev->lba_size) {
+		fprintf(stderr, "Invalid command size %zu (LBA size %u B)\n",
+			b->bs, dev->lba_size);
+		return 1;
+	}
+
+	max_kb = cdl_sysfs_get_ulong_attr(dev,
+				"/sys/block/%s/queue/max_hw_sectors_kb",
+				dev->name);
+	if (max_kb && b->bs > max_kb * 1024) {
+		fprintf(stderr, "Command size %zu exceeds the maximum %lu B\n",
+			b->bs, max_kb * 1024);
+		return 1;
+	}
+
+	b->nr_lbas = b->bs / dev->lba_size;
+	b->nr_blocks = ((dev->capacity << 9) / dev->lba_size) / b->nr_lbas;
+	if (!b->nr_blocks) {
+		fprintf(stderr, "Invalid device capacity\n");
+		return 1;
+	}
+
+	b->sgio.use_ata = cdl_dev_use_ata(dev);
+	if (b->sgio.use_ata) {
+		if (b->cdb_len == 16) {
+			fprintf(stderr,
+				"ATA NCQ commands use ATA PASS-THROUGH 32\n");
+			return 1;
+		}
+		if (b->bs > 65535ULL * dev->lba_size) {
+			fprintf(stderr, "Command size too large for NCQ\n");
+			return 1;
+		}
+		b->cdb_len = 32;
+		if (b->dld && !(dev->flags & CDL_DEV_ENABLED)) {
+			fprintf(stderr,
+				"Command duration limits is disabled on the device\n");
+			return 1;
+		}
+	} else {
+		cdlb_set_cdb_len(dev, b);
+		b->sgio.use_32 = b->cdb_len == 32;
+	}
+
+	if (b->dld) {
+		if (b->rw != CDLB_RANDWRITE && cdlb_check_dld(dev, b, CDL_READ))
+			return 1;
+		if (b->rw != CDLB_RANDREAD && cdlb_check_dld(dev, b, CDL_WRITE))
+			return 1;
+	}
+
+	ret = cdl_sgio_open(dev, &b->sgio, b->qd);
+	if (ret)
+		return 1;
+
+	b->cmds = calloc(b->qd, sizeof(struct cdl_sgio_cmd));
+	if (!b->cmds) {
+		fprintf(stderr, "Failed to allocate commands\n");
+		return 1;
+	}
+
+	for (i = 0; i < b->qd; i++) {
+		ret = cdl_sgio_alloc_cmd(&b->cmds[i], b->bs);
+		if (ret) {
+			fprintf(stderr, "Failed to allocate command buffers\n");
+			return 1;
+		}
+	}
+
+	for (i = 0; i <= CDL_MAX_DESC; i++) {
+		cdl_hist_init(&b->stats[CDL_READ][i].lat);
+		cdl_hist_init(&b->stats[CDL_WRITE][i].lat);
+	}
+
+	if (b->lat_log_path) {
+		b->lat_log = fopen(b->lat_log_path, "w");
+		if (!b->lat_log) {
+			fprintf(stderr, "Open file %s failed (%s)\n",
+				b->lat_log_path, strerror(errno));
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void cdlb_cleanup(struct cdlb *b)
+{
+	unsigned int i;
+
+	if (b->lat_log)
+		fclose(b->lat_log);
+
+	if (b->cmds) {
+		for (i = 0; i < b->qd; i++)
+			cdl_sgio_free_cmd(&b->cmds[i]);
+		free(b->cmds);
+	}
+
+	cdl_sgio_close(&b->sgio);
+}
+
+static const char *cdlb_rw_str[] = {
+	"randread",
+	"randwrite",
+	"randrw",
+};
+
+static int cdlb_parse_ulong(char *str, unsigned long long *val)
+{
+	char *end;
+
+	errno = 0;
+	*val = strtoull(str, &end, 0);
+	if (errno || end == str || *end)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Main function.
+ */
+int main(int argc, char **argv)
+{
+	struct cdl_dev dev;
+	struct cdlb *b;
+	unsigned long long val, start, elapsed;
+	int i, ret;
+
+	/* Initialize */
+	memset(&dev, 0, sizeof(dev));
+	dev.fd = -1;
+	for (i = 0; i < CDL_CMD_MAX; i++)
+		dev.cmd_cdlp[i] = CDLP_NONE;
+	for (i = 0; i < CDL_MAX_PAGES; i++)
+		dev.cdl_pages[i].cdlp = CDLP_NONE;
+
+	if (argc == 1) {
+		cdlb_usage();
+		return 0;
+	}
+
+	/* Generic options */
+	if (strcmp(argv[1], "--version") == 0) {
+		printf("cdlbench, version %s\n", PACKAGE_VERSION);
+		printf("Copyright (C) 2021, Western Digital Corporation"
+		       " or its affiliates.\n");
+		return 0;
+	}
+
+	if (strcmp(argv[1], "--help") == 0 ||
+	    strcmp(argv[1], "-h") == 0) {
+		cdlb_usage();
+		return 0;
+	}
+
+	b = calloc(1, sizeof(struct cdlb));
+	if (!b) {
+		fprintf(stderr, "Failed to allocate benchmark\n");
+		return 1;
+	}
+	b->rw = CDLB_RANDREAD;
+	b->rwmixread = 70;
+	b->bs = 128 * 1024;
+	b->qd = 8;
+	b->runtime = 60;
+	b->percentage = 100;
+	b->seed = 1;
+
+	/* Parse options */
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--verbose") == 0 ||
+		    strcmp(argv[i], "-v") == 0) {
+			dev.flags |= CDL_VERBOSE;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--force-ata") == 0 ||
+		    strcmp(argv[i], "-a") == 0) {
+			dev.flags |= CDL_USE_ATA;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--fua") == 0) {
+			b->sgio.fua = true;
+			continue;
+		}
+
+		if (argv[i][0] != '-')
+			break;
+
+		/* All other options have a value */
+		if (i >= argc - 2)
+			goto err_cmd_line;
+
+		if (strcmp(argv[i], "--rw") == 0) {
+			i++;
+			if (strcmp(argv[i], "randread") == 0)
+				b->rw = CDLB_RANDREAD;
+			else if (strcmp(argv[i], "randwrite") == 0)
+				b->rw = CDLB_RANDWRITE;
+			else if (strcmp(argv[i], "randrw") == 0)
+				b->rw = CDLB_RANDRW;
+			else
+				goto err_cmd_line;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--lat-log") == 0) {
+			i++;
+			b->lat_log_path = argv[i];
+			continue;
+		}
+
+		if (cdlb_parse_ulong(argv[i + 1], &val)) {
+			fprintf(stderr, "Invalid value '%s' for %s\n",
+				argv[i + 1], argv[i]);
+			return 1;
+		}
+
+		if (strcmp(argv[i], "--rwmixread") == 0) {
+			if (val > 100)
+				goto err_cmd_line;
+			b->rwmixread = val;
+		} else if (strcmp(argv[i], "--bs") == 0) {
+			if (!val)
+				goto err_cmd_line;
+			b->bs = val;
+		} else if (strcmp(argv[i], "--qd") == 0) {
+			if (!val || val > CDL_SGIO_MAX_QD)
+				goto err_cmd_line;
+			b->qd = val;
+		} else if (strcmp(argv[i], "--runtime") == 0) {
+			if (!val)
+				goto err_cmd_line;
+			b->runtime = val;
+		} else if (strcmp(argv[i], "--dld") == 0) {
+			if (val > CDL_MAX_DESC)
+				goto err_cmd_line;
+			b->dld = val;
+		} else if (strcmp(argv[i], "--percentage") == 0) {
+			if (val > 100)
+				goto err_cmd_line;
+			b->percentage = val;
+		} else if (strcmp(argv[i], "--cdb") == 0) {
+			if (val != 16 && val != 32)
+				goto err_cmd_line;
+			b->cdb_len = val;
+		} else if (strcmp(argv[i], "--seed") == 0) {
+			b->seed = val ? val : 1;
+		} else {
+			fprintf(stderr, "Invalid option '%s'\n", argv[i]);
+			return 1;
+		}
+		i++;
+	}
+
+	if (i != argc - 1) {
+err_cmd_line:
+		fprintf(stderr, "Invalid command line\n");
+		return 1;
+	}
+
+	/* Get device path */
+	dev.path = realpath(argv[i], NULL);
+	if (!dev.path) {
+		fprintf(stderr, "Failed to get device real path\n");
+		return 1;
+	}
+
+	ret = cdl_open_dev(&dev, O_RDONLY, true);
+	if (ret)
+		return 1;
+
+	if (!(dev.flags & CDL_DEV_SUPPORTED)) {
+		fprintf(stderr,
+			"Device does not support command duration limits\n");
+		ret = 1;
+		goto out;
+	}
+
+	ret = cdl_read_pages(&dev);
+	if (ret)
+		goto out;
+
+	ret = cdlb_init(&dev, b);
+	if (ret)
+		goto out;
+
+	printf("Device: /dev/%s (%s)\n", dev.name, b->sgio.path);
+	printf("    Commands: %s\n",
+	       b->sgio.use_ata ? "ATA NCQ (ATA PASS-THROUGH 32)" :
+	       (b->cdb_len == 32 ? "READ 32 / WRITE 32" :
+		"READ 16 / WRITE 16"));
+	printf("    Workload: %s", cdlb_rw_str[b->rw]);
+	if (b->rw == CDLB_RANDRW)
+		printf(" (%u %% reads)", b->rwmixread);
+	printf(", %zu B, QD %u, %u s\n", b->bs, b->qd, b->runtime);
+	if (b->dld)
+		printf("    Duration limit descriptor %u for %u %% of commands\n",
+		       b->dld, b->percentage);
+	else
+		printf("    No duration limit\n");
+	if (b->rw != CDLB_RANDREAD)
+		printf("WARNING: write workloads overwrite the device data\n");
+
+	signal(SIGINT, cdlb_sigint);
+	signal(SIGTERM, cdlb_sigint);
+
+	start = cdl_now_ns();
+	ret = cdlb_run(&dev, b);
+	elapsed = cdl_now_ns() - start;
+	if (ret) {
+		fprintf(stderr, "Workload failed\n");
+		ret = 1;
+	}
+
+	cdlb_report(&dev, b, elapsed);
+
+out:
+	cdlb_cleanup(b);
+	free(b);
+	cdl_close_dev(&dev);
+
+	if (ret)
+		return 1;
+
+	return 0;
+}
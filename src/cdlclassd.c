@@ -0,0 +1,1337 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include "cdl.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <pwd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+
+#define CDLC_MAX_RULES		256
+#define CDLC_MAX_DEVS		64
+#define CDLC_MAX_DEVTS		64
+
+#define CDLC_IOPRIO_WHO_PROCESS		1
+#define CDLC_IOPRIO_CLASS_NONE		0
+#define CDLC_IOPRIO_CLASS_BE		2
+#define CDLC_IOPRIO_CLASS_SHIFT		13
+#define CDLC_IOPRIO_HINT_SHIFT		3
+#define CDLC_IOPRIO_HINT_MASK		(0x3ff << CDLC_IOPRIO_HINT_SHIFT)
+
+enum cdlc_match {
+	CDLC_MATCH_COMM,
+	CDLC_MATCH_CGROUP,
+	CDLC_MATCH_UID,
+	CDLC_MATCH_FILE,
+};
+
+/*
+ * Device holding the descriptors of rules: the CDL pages are read when the
+ * rules are loaded and revalidated periodically. read indicates that the
+ * pages were read at least once and updated that the last read succeeded.
+ */
+struct cdlc_dev {
+	struct cdl_dev		cdev;
+	bool			read;
+	bool			updated;
+};
+
+struct cdlc_rule {
+	unsigned int		line;
+	enum cdlc_match		match;
+	char			*value;
+	uid_t			uid;
+
+	/* For file rules on a block device: the disk and its partitions */
+	bool			bdev;
+	unsigned int		nr_devts;
+	dev_t			devts[CDLC_MAX_DEVTS];
+
+	struct cdlc_dev		*dev;
+	int			dld;
+	bool			valid;
+	uint64_t		nr_procs;
+};
+
+struct cdlc_rules {
+	unsigned int		nr_rules;
+	struct cdlc_rule	rules[CDLC_MAX_RULES];
+	unsigned int		nr_devs;
+	struct cdlc_dev		devs[CDLC_MAX_DEVS];
+	bool			has_file_rules;
+};
+
+/*
+ * Thread of a classified process: the I/O priority of the thread before it
+ * was classified and the I/O priority set.
+ */
+struct cdlc_thread {
+	pid_t			tid;
+	int			orig_ioprio;
+	int			ioprio;
+};
+
+/*
+ * Process classified by a rule: tracked so that the original I/O priority
+ * of its threads is restored if the rule is disabled or removed and the
+ * process matches no other rule.
+ */
+struct cdlc_task {
+	pid_t			pid;
+	unsigned int		line;
+	bool			seen;
+	unsigned int		nr_threads;
+	struct cdlc_thread	*threads;
+};
+
+struct cdlc {
+	char			*path;
+	unsigned int		interval;
+	bool			once;
+	bool			verbose;
+	struct cdlc_rules	*rules;
+	int			nl_fd;
+	uint64_t		nr_events;
+	unsigned int		nr_tasks;
+	unsigned int		max_tasks;
+	struct cdlc_task	*tasks;
+};
+
+/*
+ * Process attributes, read only if needed by a rule.
+ */
+struct cdlc_proc {
+	pid_t			pid;
+	bool			has_comm;
+	char			comm[32];
+	bool			has_uid;
+	uid_t			uid;
+	bool			has_cgroup;
+	char			cgroup[PATH_MAX];
+};
+
+static volatile sig_atomic_t cdlc_stop;
+static volatile sig_atomic_t cdlc_reload;
+
+static void cdlc_sigint(int sig)
+{
+	cdlc_stop = 1;
+}
+
+static void cdlc_sighup(int sig)
+{
+	cdlc_reload = 1;
+}
+
+/*
+ * Print usage.
+ */
+static void cdlc_usage(void)
+{
+	printf("Usage:\n"
+	       "  cdlclassd --help | -h\n"
+	       "  cdlclassd --version\n"
+	       "  cdlclassd [options] <rules file>\n");
+	printf("Options:\n"
+	       "  --interval <sec>     : Interval of the revalidation of the\n"
+	       "                         rules descriptors and of the scan of\n"
+	       "                         all processes (default: 30)\n"
+	       "  --once               : Classify all processes once and exit\n"
+	       "  --verbose | -v       : Verbose output\n");
+	printf("Rules file lines:\n"
+	       "  <comm|cgroup|uid|file> <value> <device> <descriptor>\n");
+	printf("See \"man cdlclassd\" for more information.\n");
+}
+
+/*
+ * Get the I/O priority of a thread with the hint of a descriptor, keeping
+ * the class and level of the I/O priority of the thread. The I/Os of a
+ * thread without an I/O priority class use the best-effort class with a
+ * level derived from the nice value of the thread, and the kernel ignores
+ * the hint of such thread: use this class and level explicitly.
+ */
+static int cdlc_ioprio(pid_t tid, int ioprio, int dld)
+{
+	int nice;
+
+	ioprio &= ~CDLC_IOPRIO_HINT_MASK;
+	if (!dld)
+		return ioprio;
+
+	if ((ioprio >> CDLC_IOPRIO_CLASS_SHIFT) == CDLC_IOPRIO_CLASS_NONE) {
+		errno = 0;
+		nice = getpriority(PRIO_PROCESS, tid);
+		if (errno)
+			nice = 0;
+		ioprio = (CDLC_IOPRIO_CLASS_BE << CDLC_IOPRIO_CLASS_SHIFT) |
+			((nice + 20) / 5);
+	}
+
+	return ioprio | (dld << CDLC_IOPRIO_HINT_SHIFT);
+}
+
+static const char *cdlc_match_name(enum cdlc_match match)
+{
+	switch (match) {
+	case CDLC_MATCH_COMM:
+		return "comm";
+	case CDLC_MATCH_CGROUP:
+		return "cgroup";
+	case CDLC_MATCH_UID:
+		return "uid";
+	case CDLC_MATCH_FILE:
+		return "file";
+	}
+
+	return "?";
+}
+
+/*
+ * Read the CDL pages of a rule device. The device is not opened exclusively
+ * as it may be mounted or used by other tools. If the read fails, the pages
+ * of the last successful read are kept.
+ */
+static int cdlc_read_pages(struct cdlc_dev *d)
+{
+	struct cdl_dev cdev;
+	int i, ret;
+
+	memset(&cdev, 0, sizeof(struct cdl_dev));
+	cdev.path = d->cdev.path;
+	cdev.fd = -1;
+	for (i = 0; i < CDL_CMD_MAX; i++)
+		cdev.cmd_cdlp[i] = CDLP_NONE;
+	for (i = 0; i < CDL_MAX_PAGES; i++)
+		cdev.cdl_pages[i].cdlp = CDLP_NONE;
+	d->updated = false;
+
+	ret = cdl_open_dev(&cdev, O_RDONLY, false);
+	if (ret)
+		return -ENODEV;
+
+	if (!(cdev.flags & CDL_DEV_SUPPORTED)) {
+		cdl_dev_err(&cdev,
+			    "Device does not support command duration limits\n");
+		ret = -EOPNOTSUPP;
+		goto close;
+	}
+
+	ret = cdl_read_pages(&cdev);
+	if (ret) {
+		cdl_dev_err(&cdev, "Read duration limits pages failed\n");
+		ret = -EIO;
+		goto close;
+	}
+
+	if (!(cdev.flags & CDL_DEV_ENABLED))
+		printf("%s: command duration limits are disabled, "
+		       "descriptor hints will be ignored\n", cdev.name);
+
+close:
+	cdl_close_dev(&cdev);
+
+	/* A device without CDL support has no descriptor defined */
+	if (!ret || ret == -EOPNOTSUPP) {
+		d->cdev = cdev;
+		d->read = true;
+		d->updated = true;
+	}
+
+	return ret;
+}
+
+/*
+ * Check if a rule descriptor defines a limit for both reads and writes: the
+ * I/O priority of a process applies to all its I/Os, so a descriptor
+ * defining a limit for only one direction would issue the I/Os of the other
+ * direction with an undefined descriptor.
+ */
+static bool cdlc_rule_check(struct cdlc_rule *r)
+{
+	struct cdl_dev *cdev = &r->dev->cdev;
+
+	if (!r->dld)
+		return true;
+
+	if (!r->dev->read || !(r->dev->cdev.flags & CDL_DEV_SUPPORTED))
+		return false;
+
+	return !cdl_check_dld(cdev, CDL_READ, r->dld) &&
+		!cdl_check_dld(cdev, CDL_WRITE, r->dld);
+}
+
+/*
+ * Read the CDL pages of all rule devices and check the rules descriptors.
+ * Report the rules that changed state. The rules of a device that could not
+ * be read keep their state.
+ */
+static void cdlc_validate(struct cdlc_rules *rs, bool init)
+{
+	struct cdlc_rule *r;
+	unsigned int i;
+	bool valid;
+
+	for (i = 0; i < rs->nr_devs; i++)
+		cdlc_read_pages(&rs->devs[i]);
+
+	for (i = 0; i < rs->nr_rules; i++) {
+		r = &rs->rules[i];
+		if (!init && !r->dev->updated)
+			continue;
+		valid = cdlc_rule_check(r);
+		if (!init && valid == r->valid)
+			continue;
+		r->valid = valid;
+
+		if (valid && !init)
+			printf("Rule line %u: descriptor %d of %s is now valid\n",
+			       r->line, r->dld, r->dev->cdev.path);
+		else if (!valid)
+			fprintf(stderr,
+				"Rule line %u: descriptor %d of %s does not "
+				"define a limit for both reads and writes, "
+				"rule disabled\n",
+				r->line, r->dld, r->dev->cdev.path);
+	}
+}
+
+static struct cdlc_dev *cdlc_get_dev(struct cdlc_rules *rs, char *path)
+{
+	struct cdlc_dev *d;
+	unsigned int i;
+	char *rpath;
+
+	rpath = realpath(path, NULL);
+	if (!rpath) {
+		fprintf(stderr, "Invalid device %s (%s)\n",
+			path, strerror(errno));
+		return NULL;
+	}
+
+	for (i = 0; i < rs->nr_devs; i++) {
+		if (strcmp(rs->devs[i].cdev.path, rpath) == 0) {
+			free(rpath);
+			return &rs->devs[i];
+		}
+	}
+
+	if (rs->nr_devs >= CDLC_MAX_DEVS) {
+		fprintf(stderr, "Too many devices\n");
+		free(rpath);
+		return NULL;
+	}
+
+	d = &rs->devs[rs->nr_devs++];
+	d->cdev.path = rpath;
+	d->cdev.fd = -1;
+
+	return d;
+}
+
+/*
+ * Get the device numbers of a disk and of its partitions.
+ */
+static int cdlc_get_devts(struct cdlc_rule *r, struct stat *st)
+{
+	char path[PATH_MAX], *name;
+	unsigned int maj, min;
+	struct dirent *de;
+	DIR *dir;
+	FILE *f;
+
+	r->devts[0] = st->st_rdev;
+	r->nr_devts = 1;
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u",
+		 major(st->st_rdev), minor(st->st_rdev));
+	name = realpath(path, NULL);
+	if (!name)
+		return 0;
+
+	dir = opendir(name);
+	if (!dir)
+		goto out;
+
+	while ((de = readdir(dir)) && r->nr_devts < CDLC_MAX_DEVTS) {
+		if (de->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s/partition",
+			 name, de->d_name);
+		if (access(path, F_OK))
+			continue;
+		snprintf(path, sizeof(path), "%s/%s/dev", name, de->d_name);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fscanf(f, "%u:%u", &maj, &min) == 2)
+			r->devts[r->nr_devts++] = makedev(maj, min);
+		fclose(f);
+	}
+
+	closedir(dir);
+out:
+	free(name);
+
+	return 0;
+}
+
+static int cdlc_parse_rule(struct cdlc_rules *rs, struct cdlc_rule *r,
+			   char *str)
+{
+	char *match, *value, *dev, *dld, *end, *save;
+	struct passwd *pw;
+	struct stat st;
+	long val;
+
+	match = strtok_r(str, " \t", &save);
+	value = strtok_r(NULL, " \t", &save);
+	dev = strtok_r(NULL, " \t", &save);
+	dld = strtok_r(NULL, " \t", &save);
+	if (!match || !value || !dev || !dld ||
+	    strtok_r(NULL, " \t", &save)) {
+		fprintf(stderr, "Line %u: invalid rule\n", r->line);
+		return -EINVAL;
+	}
+
+	if (strcmp(match, "comm") == 0) {
+		r->match = CDLC_MATCH_COMM;
+	} else if (strcmp(match, "cgroup") == 0) {
+		r->match = CDLC_MATCH_CGROUP;
+		if (value[0] != '/') {
+			fprintf(stderr,
+				"Line %u: cgroup path must be absolute\n",
+				r->line);
+			return -EINVAL;
+		}
+	} else if (strcmp(match, "uid") == 0) {
+		r->match = CDLC_MATCH_UID;
+		errno = 0;
+		val = strtol(value, &end, 10);
+		if (!errno && end != value && !*end && val >= 0) {
+			r->uid = val;
+		} else {
+			pw = getpwnam(value);
+			if (!pw) {
+				fprintf(stderr, "Line %u: unknown user %s\n",
+					r->line, value);
+				return -EINVAL;
+			}
+			r->uid = pw->pw_uid;
+		}
+	} else if (strcmp(match, "file") == 0) {
+		r->match = CDLC_MATCH_FILE;
+		if (value[0] != '/') {
+			fprintf(stderr,
+				"Line %u: file path must be absolute\n",
+				r->line);
+			return -EINVAL;
+		}
+		if (stat(value, &st) == 0 && S_ISBLK(st.st_mode)) {
+			r->bdev = true;
+			cdlc_get_devts(r, &st);
+		}
+		rs->has_file_rules = true;
+	} else {
+		fprintf(stderr, "Line %u: invalid match type %s\n",
+			r->line, match);
+		return -EINVAL;
+	}
+
+	errno = 0;
+	val = strtol(dld, &end, 10);
+	if (errno || end == dld || *end || val < 0 || val > CDL_MAX_DESC) {
+		fprintf(stderr, "Line %u: invalid descriptor %s\n",
+			r->line, dld);
+		return -EINVAL;
+	}
+	r->dld = val;
+
+	r->value = strdup(value);
+	if (!r->value)
+		return -ENOMEM;
+
+	r->dev = cdlc_get_dev(rs, dev);
+	if (!r->dev)
+		return -EINVAL;
+
+	return 0;
+}
+
+static void cdlc_free_rules(struct cdlc_rules *rs)
+{
+	unsigned int i;
+
+	if (!rs)
+		return;
+
+	for (i = 0; i < rs->nr_rules; i++)
+		free(rs->rules[i].value);
+	for (i = 0; i < rs->nr_devs; i++)
+		free(rs->devs[i].cdev.path);
+	free(rs);
+}
+
+/*
+ * Load the rules file and validate the rules descriptors.
+ */
+static struct cdlc_rules *cdlc_load_rules(struct cdlc *c)
+{
+	char line[CDL_LINE_MAX_LEN], *str;
+	struct cdlc_rules *rs;
+	unsigned int lineno = 0;
+	FILE *f;
+	int ret = 0;
+
+	f = fopen(c->path, "r");
+	if (!f) {
+		fprintf(stderr, "Open %s failed (%s)\n",
+			c->path, strerror(errno));
+		return NULL;
+	}
+
+	rs = calloc(1, sizeof(struct cdlc_rules));
+	if (!rs) {
+		fclose(f);
+		return NULL;
+	}
+
+	while (1) {
+		memset(line, 0, sizeof(line));
+		if (!fgets(line, sizeof(line), f))
+			break;
+		lineno++;
+
+		str = line;
+		while (*str && (isblank(*str) || *str == '\n' || *str == '\r'))
+			str++;
+		if (!*str || *str == '#')
+			continue;
+		str[strcspn(str, "\r\n")] = '\0';
+
+		if (rs->nr_rules >= CDLC_MAX_RULES) {
+			fprintf(stderr, "Too many rules\n");
+			ret = -EINVAL;
+			break;
+		}
+
+		rs->rules[rs->nr_rules].line = lineno;
+		ret = cdlc_parse_rule(rs, &rs->rules[rs->nr_rules], str);
+		rs->nr_rules++;
+		if (ret)
+			break;
+	}
+
+	fclose(f);
+
+	if (!ret && !rs->nr_rules) {
+		fprintf(stderr, "No rules defined in %s\n", c->path);
+		ret = -EINVAL;
+	}
+
+	if (ret) {
+		cdlc_free_rules(rs);
+		return NULL;
+	}
+
+	cdlc_validate(rs, true);
+
+	return rs;
+}
+
+static int cdlc_read_file(pid_t pid, const char *name, char *buf,
+			  size_t bufsz)
+{
+	char path[64];
+	ssize_t ret;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	ret = read(fd, buf, bufsz - 1);
+	close(fd);
+	if (ret < 0)
+		return -errno;
+	buf[ret] = '\0';
+
+	return 0;
+}
+
+static int cdlc_get_comm(struct cdlc_proc *p)
+{
+	if (!p->has_comm) {
+		if (cdlc_read_file(p->pid, "comm", p->comm, sizeof(p->comm)))
+			return -1;
+		p->comm[strcspn(p->comm, "\n")] = '\0';
+		p->has_comm = true;
+	}
+
+	return 0;
+}
+
+static bool cdlc_match_comm(struct cdlc_proc *p, struct cdlc_rule *r)
+{
+	if (cdlc_get_comm(p))
+		return false;
+
+	return strcmp(p->comm, r->value) == 0;
+}
+
+static bool cdlc_match_uid(struct cdlc_proc *p, struct cdlc_rule *r)
+{
+	char buf[4096], *str;
+
+	if (!p->has_uid) {
+		if (cdlc_read_file(p->pid, "status", buf, sizeof(buf)))
+			return false;
+		str = strstr(buf, "\nUid:");
+		if (!str || sscanf(str + 5, "%u", &p->uid) != 1)
+			return false;
+		p->has_uid = true;
+	}
+
+	return p->uid == r->uid;
+}
+
+/*
+ * Check if a path is equal to a directory path or below it.
+ */
+static bool cdlc_path_below(const char *path, const char *dir)
+{
+	size_t len = strlen(dir);
+
+	while (len > 1 && dir[len - 1] == '/')
+		len--;
+
+	if (strncmp(path, dir, len) != 0)
+		return false;
+
+	return path[len] == '\0' || path[len] == '/' || len == 1;
+}
+
+static bool cdlc_match_cgroup(struct cdlc_proc *p, struct cdlc_rule *r)
+{
+	char buf[4096], *line, *path, *save;
+
+	if (!p->has_cgroup) {
+		if (cdlc_read_file(p->pid, "cgroup", buf, sizeof(buf)))
+			return false;
+
+		/*
+		 * Use the unified hierarchy path if there is one, and the
+		 * path of the first hierarchy otherwise.
+		 */
+		p->cgroup[0] = '\0';
+		for (line = strtok_r(buf, "\n", &save); line;
+		     line = strtok_r(NULL, "\n", &save)) {
+			path = strchr(line, ':');
+			if (path)
+				path = strchr(path + 1, ':');
+			if (!path)
+				continue;
+			if (strncmp(line, "0::", 3) == 0 || !p->cgroup[0])
+				snprintf(p->cgroup, sizeof(p->cgroup),
+					 "%s", path + 1);
+		}
+		p->has_cgroup = true;
+	}
+
+	return cdlc_path_below(p->cgroup, r->value);
+}
+
+static bool cdlc_match_file(struct cdlc_proc *p, struct cdlc_rule *r)
+{
+	char path[PATH_MAX], target[PATH_MAX];
+	struct dirent *de;
+	bool match = false;
+	struct stat st;
+	unsigned int i;
+	ssize_t len;
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "/proc/%d/fd", p->pid);
+	dir = opendir(path);
+	if (!dir)
+		return false;
+
+	while (!match && (de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof(path), "/proc/%d/fd/%s",
+			 p->pid, de->d_name);
+
+		if (r->bdev) {
+			if (stat(path, &st))
+				continue;
+			for (i = 0; i < r->nr_devts; i++) {
+				if (st.st_dev == r->devts[i] ||
+				    (S_ISBLK(st.st_mode) &&
+				     st.st_rdev == r->devts[i])) {
+					match = true;
+					break;
+				}
+			}
+			continue;
+		}
+
+		len = readlink(path, target, sizeof(target) - 1);
+		if (len <= 0)
+			continue;
+		target[len] = '\0';
+		match = cdlc_path_below(target, r->value);
+	}
+
+	closedir(dir);
+
+	return match;
+}
+
+static bool cdlc_match(struct cdlc_proc *p, struct cdlc_rule *r)
+{
+	switch (r->match) {
+	case CDLC_MATCH_COMM:
+		return cdlc_match_comm(p, r);
+	case CDLC_MATCH_CGROUP:
+		return cdlc_match_cgroup(p, r);
+	case CDLC_MATCH_UID:
+		return cdlc_match_uid(p, r);
+	case CDLC_MATCH_FILE:
+		return cdlc_match_file(p, r);
+	}
+
+	return false;
+}
+
+static struct cdlc_thread *cdlc_get_thread(struct cdlc_task *t, pid_t tid)
+{
+	unsigned int i;
+
+	for (i = 0; i < t->nr_threads; i++) {
+		if (t->threads[i].tid == tid)
+			return &t->threads[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Get the original I/O priority of a thread of a classified process from
+ * its current I/O priority. Threads created after the process was
+ * classified inherited the I/O priority set for their creator.
+ */
+static int cdlc_orig_ioprio(struct cdlc_task *t, pid_t tid, int cur)
+{
+	struct cdlc_thread *th = cdlc_get_thread(t, tid);
+	unsigned int i;
+
+	if (th && th->ioprio == cur)
+		return th->orig_ioprio;
+
+	for (i = 0; i < t->nr_threads; i++) {
+		if (t->threads[i].ioprio == cur)
+			return t->threads[i].orig_ioprio;
+	}
+
+	/* The I/O priority was changed by the process */
+	return cur;
+}
+
+static int cdlc_set_thread_ioprio(struct cdlc *c, pid_t tid, int ioprio)
+{
+	if (syscall(SYS_ioprio_set, CDLC_IOPRIO_WHO_PROCESS,
+		    tid, ioprio) < 0) {
+		if (errno != ESRCH && c->verbose)
+			fprintf(stderr,
+				"Set thread %d I/O priority failed (%s)\n",
+				tid, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Set the hint of a descriptor in the I/O priority of all threads of a
+ * classified process, recording the original I/O priority of the threads.
+ * Return the number of threads changed.
+ */
+static int cdlc_set_ioprio(struct cdlc *c, struct cdlc_task *t, int dld)
+{
+	struct cdlc_thread *threads = NULL, *th;
+	unsigned int nr_threads = 0, max = 0;
+	int tid, cur, orig, ioprio, nr = 0;
+	struct dirent *de;
+	char path[64];
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "/proc/%d/task", t->pid);
+	dir = opendir(path);
+	if (!dir)
+		return 0;
+
+	while ((de = readdir(dir))) {
+		tid = atoi(de->d_name);
+		if (tid <= 0)
+			continue;
+
+		cur = syscall(SYS_ioprio_get, CDLC_IOPRIO_WHO_PROCESS, tid);
+		if (cur < 0)
+			continue;
+
+		orig = cdlc_orig_ioprio(t, tid, cur);
+		ioprio = cdlc_ioprio(tid, orig, dld);
+		if (ioprio != cur) {
+			if (cdlc_set_thread_ioprio(c, tid, ioprio))
+				continue;
+			nr++;
+		}
+
+		if (nr_threads >= max) {
+			max = max ? max * 2 : 16;
+			th = realloc(threads, max * sizeof(struct cdlc_thread));
+			if (!th) {
+				/* Do not leave a thread we cannot restore */
+				cdlc_set_thread_ioprio(c, tid, orig);
+				continue;
+			}
+			threads = th;
+		}
+		th = &threads[nr_threads++];
+		th->tid = tid;
+		th->orig_ioprio = orig;
+		th->ioprio = ioprio;
+	}
+
+	closedir(dir);
+
+	free(t->threads);
+	t->threads = threads;
+	t->nr_threads = nr_threads;
+
+	return nr;
+}
+
+/*
+ * Restore the original I/O priority of the threads of a classified process
+ * which still use the I/O priority set. Return the number of threads
+ * changed.
+ */
+static int cdlc_restore_ioprio(struct cdlc *c, struct cdlc_task *t)
+{
+	int tid, cur, orig, nr = 0;
+	struct dirent *de;
+	char path[64];
+	DIR *dir;
+
+	snprintf(path, sizeof(path), "/proc/%d/task", t->pid);
+	dir = opendir(path);
+	if (!dir)
+		return 0;
+
+	while ((de = readdir(dir))) {
+		tid = atoi(de->d_name);
+		if (tid <= 0)
+			continue;
+
+		cur = syscall(SYS_ioprio_get, CDLC_IOPRIO_WHO_PROCESS, tid);
+		if (cur < 0)
+			continue;
+
+		orig = cdlc_orig_ioprio(t, tid, cur);
+		if (orig != cur && !cdlc_set_thread_ioprio(c, tid, orig))
+			nr++;
+	}
+
+	closedir(dir);
+
+	return nr;
+}
+
+static struct cdlc_task *cdlc_get_task(struct cdlc *c, pid_t pid)
+{
+	unsigned int i;
+
+	for (i = 0; i < c->nr_tasks; i++) {
+		if (c->tasks[i].pid == pid)
+			return &c->tasks[i];
+	}
+
+	return NULL;
+}
+
+static struct cdlc_task *cdlc_add_task(struct cdlc *c, pid_t pid)
+{
+	struct cdlc_task *tasks;
+	unsigned int max;
+
+	if (c->nr_tasks >= c->max_tasks) {
+		max = c->max_tasks ? c->max_tasks * 2 : 64;
+		tasks = realloc(c->tasks, max * sizeof(struct cdlc_task));
+		if (!tasks) {
+			fprintf(stderr, "No memory to track process %d\n",
+				pid);
+			return NULL;
+		}
+		c->tasks = tasks;
+		c->max_tasks = max;
+	}
+
+	memset(&c->tasks[c->nr_tasks], 0, sizeof(struct cdlc_task));
+	c->tasks[c->nr_tasks].pid = pid;
+
+	return &c->tasks[c->nr_tasks++];
+}
+
+static void cdlc_del_task(struct cdlc *c, struct cdlc_task *t)
+{
+	free(t->threads);
+	*t = c->tasks[--c->nr_tasks];
+}
+
+/*
+ * Apply the first matching rule to a process. A process previously
+ * classified which does not match any valid rule anymore has the original
+ * I/O priority of the threads still using the priority set restored.
+ */
+static void cdlc_classify(struct cdlc *c, pid_t pid)
+{
+	struct cdlc_rules *rs = c->rules;
+	struct cdlc_rule *r = NULL;
+	struct cdlc_task *t;
+	struct cdlc_proc p;
+	unsigned int i;
+	int nr;
+
+	if (pid <= 1 || pid == getpid())
+		return;
+
+	memset(&p, 0, sizeof(p));
+	p.pid = pid;
+
+	for (i = 0; i < rs->nr_rules; i++) {
+		if (rs->rules[i].valid && cdlc_match(&p, &rs->rules[i])) {
+			r = &rs->rules[i];
+			break;
+		}
+	}
+
+	t = cdlc_get_task(c, pid);
+	if (t)
+		t->seen = true;
+
+	if (!r) {
+		if (!t)
+			return;
+		nr = cdlc_restore_ioprio(c, t);
+		if (nr) {
+			cdlc_get_comm(&p);
+			printf("Process %d (%s): rule line %u removed or "
+			       "disabled, I/O priority restored, %d thread%s\n",
+			       pid, p.comm, t->line, nr, nr > 1 ? "s" : "");
+		}
+		cdlc_del_task(c, t);
+		return;
+	}
+
+	if (!t) {
+		t = cdlc_add_task(c, pid);
+		if (!t)
+			return;
+	}
+	t->line = r->line;
+	t->seen = true;
+
+	nr = cdlc_set_ioprio(c, t, r->dld);
+	if (!nr)
+		return;
+
+	r->nr_procs++;
+	cdlc_get_comm(&p);
+	printf("Process %d (%s): rule line %u (%s %s), descriptor %d, "
+	       "%d thread%s\n",
+	       pid, p.comm, r->line, cdlc_match_name(r->match), r->value,
+	       r->dld, nr, nr > 1 ? "s" : "");
+}
+
+/*
+ * Classify all processes and stop tracking the processes that exited.
+ */
+static void cdlc_scan(struct cdlc *c)
+{
+	struct dirent *de;
+	unsigned int i;
+	DIR *dir;
+	int pid;
+
+	dir = opendir("/proc");
+	if (!dir) {
+		fprintf(stderr, "Open /proc failed (%s)\n", strerror(errno));
+		return;
+	}
+
+	for (i = 0; i < c->nr_tasks; i++)
+		c->tasks[i].seen = false;
+
+	while ((de = readdir(dir))) {
+		pid = atoi(de->d_name);
+		if (pid > 0)
+			cdlc_classify(c, pid);
+	}
+
+	closedir(dir);
+
+	i = 0;
+	while (i < c->nr_tasks) {
+		if (c->tasks[i].seen)
+			i++;
+		else
+			cdlc_del_task(c, &c->tasks[i]);
+	}
+}
+
+/*
+ * Subscribe to process events using the netlink process connector.
+ */
+static int cdlc_nl_open(struct cdlc *c)
+{
+	char buf[NLMSG_SPACE(sizeof(struct cn_msg) +
+			     sizeof(enum proc_cn_mcast_op))];
+	enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+	struct sockaddr_nl sa;
+	struct cn_msg *cn;
+	int fd;
+
+	fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+	if (fd < 0)
+		return -errno;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	sa.nl_groups = CN_IDX_PROC;
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		goto err;
+
+	memset(buf, 0, sizeof(buf));
+	nlh->nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(op));
+	nlh->nlmsg_type = NLMSG_DONE;
+	cn = NLMSG_DATA(nlh);
+	cn->id.idx = CN_IDX_PROC;
+	cn->id.val = CN_VAL_PROC;
+	cn->len = sizeof(op);
+	memcpy(cn->data, &op, sizeof(op));
+
+	if (send(fd, nlh, nlh->nlmsg_len, 0) < 0)
+		goto err;
+
+	c->nl_fd = fd;
+
+	return 0;
+
+err:
+	close(fd);
+	return -errno;
+}
+
+/*
+ * Process the pending process events. Return true if events were lost.
+ */
+static bool cdlc_nl_recv(struct cdlc *c)
+{
+	char buf[8192] __attribute__((aligned(NLMSG_ALIGNTO)));
+	struct proc_event *ev;
+	struct cdlc_task *t;
+	struct nlmsghdr *nlh;
+	struct cn_msg *cn;
+	pid_t pid;
+	ssize_t len;
+
+	len = recv(c->nl_fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (len < 0)
+		return errno == ENOBUFS;
+
+	for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+	     nlh = NLMSG_NEXT(nlh, len)) {
+		if (nlh->nlmsg_type == NLMSG_NOOP)
+			continue;
+		if (nlh->nlmsg_type == NLMSG_ERROR ||
+		    nlh->nlmsg_type == NLMSG_OVERRUN)
+			return true;
+
+		cn = NLMSG_DATA(nlh);
+		if (cn->id.idx != CN_IDX_PROC || cn->id.val != CN_VAL_PROC)
+			continue;
+
+		ev = (struct proc_event *)cn->data;
+		switch (ev->what) {
+		case PROC_EVENT_FORK:
+			/* Threads inherit the I/O priority of their creator */
+			if (ev->event_data.fork.child_pid !=
+			    ev->event_data.fork.child_tgid)
+				continue;
+			pid = ev->event_data.fork.child_tgid;
+			break;
+		case PROC_EVENT_EXEC:
+			pid = ev->event_data.exec.process_tgid;
+			break;
+		case PROC_EVENT_UID:
+			pid = ev->event_data.id.process_tgid;
+			break;
+		case PROC_EVENT_COMM:
+			pid = ev->event_data.comm.process_tgid;
+			break;
+		case PROC_EVENT_EXIT:
+			pid = ev->event_data.exit.process_pid;
+			if (pid == ev->event_data.exit.process_tgid) {
+				t = cdlc_get_task(c, pid);
+				if (t)
+					cdlc_del_task(c, t);
+			}
+			continue;
+		default:
+			continue;
+		}
+
+		c->nr_events++;
+		cdlc_classify(c, pid);
+	}
+
+	return false;
+}
+
+static void cdlc_reload_rules(struct cdlc *c)
+{
+	struct cdlc_rules *rs;
+
+	rs = cdlc_load_rules(c);
+	if (!rs) {
+		fprintf(stderr, "Reload %s failed, keeping current rules\n",
+			c->path);
+		return;
+	}
+
+	cdlc_free_rules(c->rules);
+	c->rules = rs;
+	printf("Reloaded %u rules from %s\n", rs->nr_rules, c->path);
+}
+
+static int cdlc_run(struct cdlc *c)
+{
+	unsigned long long now, next;
+	struct pollfd pfd;
+	bool lost = false;
+	int ret, timeout;
+
+	ret = cdlc_nl_open(c);
+	if (ret) {
+		fprintf(stderr,
+			"Process connector not available (%s), "
+			"only scanning processes every %u s\n",
+			strerror(-ret), c->interval);
+		c->nl_fd = -1;
+	}
+
+	pfd.fd = c->nl_fd;
+	pfd.events = POLLIN;
+
+	/* Scan after subscribing so that no process is missed */
+	cdlc_scan(c);
+	next = cdl_now_ns() + (unsigned long long)c->interval * 1000000000ULL;
+
+	while (!cdlc_stop) {
+		now = cdl_now_ns();
+		timeout = now >= next ? 0 : (next - now) / 1000000 + 1;
+		ret = poll(&pfd, 1, timeout);
+		if (ret < 0 && errno != EINTR) {
+			ret = -errno;
+			fprintf(stderr, "poll failed (%s)\n", strerror(errno));
+			break;
+		}
+		ret = 0;
+
+		if (cdlc_stop)
+			break;
+
+		if (cdlc_reload) {
+			cdlc_reload = 0;
+			cdlc_reload_rules(c);
+			lost = true;
+		}
+
+		if (pfd.fd >= 0 && (pfd.revents & POLLIN))
+			lost |= cdlc_nl_recv(c);
+
+		if (cdl_now_ns() >= next) {
+			cdlc_validate(c->rules, false);
+			lost = true;
+			next = cdl_now_ns() +
+				(unsigned long long)c->interval * 1000000000ULL;
+		}
+
+		if (lost) {
+			cdlc_scan(c);
+			lost = false;
+		}
+	}
+
+	if (c->nl_fd >= 0)
+		close(c->nl_fd);
+
+	return ret;
+}
+
+static int cdlc_parse_ulong(char *str, unsigned long long *val)
+{
+	char *end;
+
+	errno = 0;
+	*val = strtoull(str, &end, 0);
+	if (errno || end == str || *end)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Main function.
+ */
+int main(int argc, char **argv)
+{
+	unsigned long long val;
+	struct cdlc_rule *r;
+	unsigned int i;
+	struct cdlc c;
+	int ret;
+
+	if (argc == 1) {
+		cdlc_usage();
+		return 0;
+	}
+
+	/* Generic options */
+	if (strcmp(argv[1], "--version") == 0) {
+		printf("cdlclassd, version %s\n", PACKAGE_VERSION);
+		printf("Copyright (C) 2021, Western Digital Corporation"
+		       " or its affiliates.\n");
+		return 0;
+	}
+
+	if (strcmp(argv[1], "--help") == 0 ||
+	    strcmp(argv[1], "-h") == 0) {
+		cdlc_usage();
+		return 0;
+	}
+
+	memset(&c, 0, sizeof(c));
+	c.interval = 30;
+	c.nl_fd = -1;
+
+	/* Parse options */
+	for (i = 1; i < (unsigned int)argc; i++) {
+		if (strcmp(argv[i], "--once") == 0) {
+			c.once = true;
+			continue;
+		}
+
+		if (strcmp(argv[i], "--verbose") == 0 ||
+		    strcmp(argv[i], "-v") == 0) {
+			c.verbose = true;
+			continue;
+		}
+
+		if (argv[i][0] != '-')
+			break;
+
+		if (strcmp(argv[i], "--interval") != 0) {
+			fprintf(stderr, "Invalid option '%s'\n", argv[i]);
+			return 1;
+		}
+
+		if (i + 1 >= (unsigned int)argc ||
+		    cdlc_parse_ulong(argv[i + 1], &val) || !val ||
+		    val > UINT_MAX)
+			goto err_cmd_line;
+		c.interval = val;
+		i++;
+	}
+
+	if (i != (unsigned int)argc - 1) {
+err_cmd_line:
+		fprintf(stderr, "Invalid command line\n");
+		return 1;
+	}
+	c.path = argv[i];
+
+	c.rules = cdlc_load_rules(&c);
+	if (!c.rules)
+		return 1;
+
+	if (c.verbose) {
+		for (i = 0; i < c.rules->nr_rules; i++) {
+			r = &c.rules->rules[i];
+			printf("Rule line %u: %s %s, %s descriptor %d%s\n",
+			       r->line, cdlc_match_name(r->match), r->value,
+			       r->dev->cdev.path, r->dld,
+			       r->valid ? "" : " (disabled)");
+		}
+	}
+
+	if (c.once) {
+		cdlc_scan(&c);
+		ret = 0;
+		goto out;
+	}
+
+	signal(SIGINT, cdlc_sigint);
+	signal(SIGTERM, cdlc_sigint);
+	signal(SIGHUP, cdlc_sighup);
+
+	/* Output may be redirected to a log */
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	printf("Classifying processes with %u rules from %s\n",
+	       c.rules->nr_rules, c.path);
+
+	ret = cdlc_run(&c);
+
+	if (c.verbose)
+		printf("%llu process events\n",
+		       (unsigned long long)c.nr_events);
+
+out:
+	for (i = 0; i < c.rules->nr_rules; i++) {
+		r = &c.rules->rules[i];
+		if (r->nr_procs)
+			printf("Rule line %u: %llu process%s classified\n",
+			       r->line, (unsigned long long)r->nr_procs,
+			       r->nr_procs > 1 ? "es" : "");
+	}
+
+	cdlc_free_rules(c.rules);
+	for (i = 0; i < c.nr_tasks; i++)
+		free(c.tasks[i].threads);
+	free(c.tasks);
+
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,493 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include "cdl.h"
+#include "cdlio.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+
+#define CDLH_MAX_DEVS	16
+
+struct cdlh {
+	unsigned int		nr_devs;
+	char			*paths[CDLH_MAX_DEVS];
+	struct cdlio_dev	*devs[CDLH_MAX_DEVS];
+	size_t			bs;
+	unsigned int		qd;
+	unsigned int		runtime;
+	unsigned int		dld;
+	unsigned long long	deadline;
+	bool			hedge;
+	uint64_t		seed;
+	uint64_t		nr_blocks;
+	char			*bufs;
+
+	/* Baseline (no hedging) */
+	struct cdlio_ctx	*ctxs[CDLH_MAX_DEVS];
+	struct pollfd		pfds[CDLH_MAX_DEVS];
+	unsigned int		next_dev;
+	struct cdl_hist		lat;
+	uint64_t		nr_reads;
+	uint64_t		nr_errors;
+
+	/* Hedging */
+	struct cdlio_hedge	*h;
+};
+
+static volatile sig_atomic_t cdlh_stop;
+
+static void cdlh_sigint(int sig)
+{
+	cdlh_stop = 1;
+}
+
+/*
+ * Print usage.
+ */
+static void cdlh_usage(void)
+{
+	printf("Usage:\n"
+	       "  cdlhedge --help | -h\n"
+	       "  cdlhedge --version\n"
+	       "  cdlhedge [options] <device> <device> [<device>...]\n");
+	printf("Options:\n"
+	       "  --bs <bytes>         : Read size (default: 131072)\n"
+	       "  --qd <n>             : Queue depth (default: 8)\n"
+	       "  --runtime <sec>      : Run time in seconds (default: 60)\n"
+	       "  --dld <index>        : Duration limit descriptor index (1 to 7)\n"
+	       "                         of primary reads (default: 1)\n"
+	       "  --deadline <usec>    : Soft deadline after which a read is\n"
+	       "                         hedged (default: 0, hedge only reads\n"
+	       "                         failed by the descriptor policy)\n"
+	       "  --no-hedge           : Baseline run reading the devices\n"
+	       "                         round-robin without limit\n"
+	       "  --seed <n>           : Random generator seed (default: 1)\n");
+	printf("See \"man cdlhedge\" for more information.\n");
+}
+
+/*
+ * xorshift64* random number generator.
+ */
+static uint64_t cdlh_rand(struct cdlh *c)
+{
+	c->seed ^= c->seed >> 12;
+	c->seed ^= c->seed << 25;
+	c->seed ^= c->seed >> 27;
+
+	return c->seed * 0x2545F4914F6CDD1DULL;
+}
+
+static off_t cdlh_ofst(struct cdlh *c)
+{
+	return (cdlh_rand(c) % c->nr_blocks) * c->bs;
+}
+
+static int cdlh_queue(struct cdlh *c, unsigned int i)
+{
+	char *buf = c->bufs + (size_t)i * c->bs;
+	void *data = (void *)(uintptr_t)i;
+	unsigned int d;
+
+	if (c->hedge)
+		return cdlio_hedge_read(c->h, buf, c->bs, cdlh_ofst(c), data);
+
+	d = c->next_dev;
+	c->next_dev = (c->next_dev + 1) % c->nr_devs;
+
+	return cdlio_queue(c->ctxs[d], CDLIO_READ, buf, c->bs, cdlh_ofst(c),
+			   0, data);
+}
+
+/*
+ * Baseline run reap: get at least one completion of any device.
+ */
+static int cdlh_reap_baseline(struct cdlh *c, struct cdlio_hedge_cqe *cqes)
+{
+	struct cdlio_cqe cqe[8];
+	unsigned int i, n = 0;
+	uint64_t cnt;
+	int j, ret;
+
+	while (!n) {
+		for (i = 0; i < c->nr_devs; i++) {
+			if (read(c->pfds[i].fd, &cnt, sizeof(cnt)) < 0 &&
+			    errno != EAGAIN)
+				return -errno;
+		}
+
+		for (i = 0; i < c->nr_devs && n < c->qd; i++) {
+			ret = cdlio_reap(c->ctxs[i], cqe,
+					 c->qd - n < 8 ? c->qd - n : 8, 0);
+			if (ret < 0)
+				return ret;
+			for (j = 0; j < ret; j++) {
+				cqes[n].cqe = cqe[j];
+				cqes[n].replica = i;
+				cqes[n].hedged = false;
+				n++;
+			}
+		}
+
+		if (!n && poll(c->pfds, c->nr_devs, -1) < 0 && errno != EINTR)
+			return -errno;
+	}
+
+	return n;
+}
+
+static int cdlh_run(struct cdlh *c)
+{
+	struct cdlio_hedge_cqe *cqes;
+	unsigned int *pending, nr_pending = 0;
+	unsigned long long end;
+	unsigned int i, inflight = 0;
+	int n, ret = 0;
+
+	cqes = calloc(c->qd, sizeof(struct cdlio_hedge_cqe));
+	pending = calloc(c->qd, sizeof(unsigned int));
+	if (!cqes || !pending) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	end = cdl_now_ns() + (unsigned long long)c->runtime * 1000000000ULL;
+
+	for (i = 0; i < c->qd; i++)
+		pending[nr_pending++] = i;
+
+	while (1) {
+		/*
+		 * Reads are deferred if the hedge context is busy with the
+		 * replica reads of already completed requests.
+		 */
+		while (nr_pending && !cdlh_stop && cdl_now_ns() < end) {
+			ret = cdlh_queue(c, pending[nr_pending - 1]);
+			if (ret == -EBUSY)
+				break;
+			if (ret)
+				goto out;
+			nr_pending--;
+			inflight++;
+		}
+		ret = 0;
+
+		if (!c->hedge) {
+			for (i = 0; i < c->nr_devs; i++)
+				cdlio_submit(c->ctxs[i]);
+		}
+
+		if (!inflight)
+			break;
+
+		if (c->hedge)
+			n = cdlio_hedge_reap(c->h, cqes, c->qd, 1);
+		else
+			n = cdlh_reap_baseline(c, cqes);
+		if (n < 0) {
+			ret = n;
+			break;
+		}
+
+		for (i = 0; i < (unsigned int)n; i++) {
+			inflight--;
+			if (!c->hedge) {
+				c->nr_reads++;
+				if (cqes[i].cqe.status == CDLIO_OK)
+					cdl_hist_add(&c->lat, cqes[i].cqe.lat);
+				else
+					c->nr_errors++;
+			}
+			pending[nr_pending++] =
+				(uintptr_t)cqes[i].cqe.user_data;
+		}
+	}
+
+out:
+	free(pending);
+	free(cqes);
+
+	return ret;
+}
+
+static void cdlh_report(struct cdlh *c, unsigned long long elapsed)
+{
+	struct cdlio_hedge_stats st;
+	double secs = (double)elapsed / 1000000000.0;
+
+	if (c->hedge) {
+		cdlio_hedge_get_stats(c->h, &st);
+	} else {
+		memset(&st, 0, sizeof(st));
+		st.nr_reads = c->nr_reads;
+		st.nr_primary_wins = c->lat.count;
+		st.nr_errors = c->nr_errors;
+		st.lat_avg = cdl_hist_avg(&c->lat);
+		st.lat_p50 = cdl_hist_percentile(&c->lat, 50);
+		st.lat_p99 = cdl_hist_percentile(&c->lat, 99);
+		st.lat_p999 = cdl_hist_percentile(&c->lat, 99.9);
+		st.lat_max = c->lat.max;
+	}
+
+	printf("  %10s %10s %8s %8s %8s %10s %7s"
+	       " %10s %10s %10s %10s %10s\n",
+	       "reads", "iops", "hedges", "limit", "deadline", "hedge-wins",
+	       "errors", "avg (ms)", "p50 (ms)", "p99 (ms)", "p99.9 (ms)",
+	       "max (ms)");
+	printf("  %10llu %10.1f %8llu %8llu %8llu %10llu %7llu"
+	       " %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+	       (unsigned long long)st.nr_reads,
+	       secs > 0 ? (double)st.nr_reads / secs : 0.0,
+	       (unsigned long long)st.nr_hedges,
+	       (unsigned long long)st.nr_limit_hedges,
+	       (unsigned long long)st.nr_deadline_hedges,
+	       (unsigned long long)st.nr_hedge_wins,
+	       (unsigned long long)st.nr_errors,
+	       (double)st.lat_avg / 1000000.0,
+	       (double)st.lat_p50 / 1000000.0,
+	       (double)st.lat_p99 / 1000000.0,
+	       (double)st.lat_p999 / 1000000.0,
+	       (double)st.lat_max / 1000000.0);
+
+	if (c->hedge && st.nr_reads)
+		printf("  Hedge rate: %.2f %%, hedge wins: %.2f %% of hedges\n",
+		       (double)st.nr_hedges * 100.0 / (double)st.nr_reads,
+		       st.nr_hedges ?
+		       (double)st.nr_hedge_wins * 100.0 /
+		       (double)st.nr_hedges : 0.0);
+}
+
+static int cdlh_init(struct cdlh *c)
+{
+	uint64_t size, min_size = 0;
+	unsigned int i;
+	off_t ofst;
+	int efd;
+
+	for (i = 0; i < c->nr_devs; i++) {
+		c->devs[i] = cdlio_open(c->paths[i], O_DIRECT);
+		if (!c->devs[i]) {
+			fprintf(stderr, "Open %s failed (%s)\n",
+				c->paths[i], strerror(errno));
+			return -1;
+		}
+
+		ofst = lseek(cdlio_fd(c->devs[i]), 0, SEEK_END);
+		if (ofst < 0) {
+			fprintf(stderr, "Get %s capacity failed\n",
+				c->paths[i]);
+			return -1;
+		}
+		size = ofst;
+		if (!min_size || size < min_size)
+			min_size = size;
+	}
+
+	c->nr_blocks = min_size / c->bs;
+	if (!c->nr_blocks) {
+		fprintf(stderr, "Invalid read size\n");
+		return -1;
+	}
+
+	if (posix_memalign((void **)&c->bufs, 4096, c->bs * c->qd)) {
+		fprintf(stderr, "Failed to allocate buffers\n");
+		return -1;
+	}
+
+	cdl_hist_init(&c->lat);
+
+	if (c->hedge) {
+		c->h = cdlio_hedge_create(c->devs, c->nr_devs, c->qd, c->dld,
+					  c->deadline * 1000ULL);
+		if (!c->h) {
+			fprintf(stderr, "Create hedge context failed (%s)\n",
+				errno == EINVAL ?
+				"invalid descriptor" : strerror(errno));
+			return -1;
+		}
+		return 0;
+	}
+
+	for (i = 0; i < c->nr_devs; i++) {
+		c->ctxs[i] = cdlio_ctx_create(c->devs[i], c->qd);
+		if (!c->ctxs[i]) {
+			fprintf(stderr, "Create context failed (%s)\n",
+				strerror(errno));
+			return -1;
+		}
+		efd = cdlio_ctx_eventfd(c->ctxs[i]);
+		if (efd < 0) {
+			fprintf(stderr, "Create eventfd failed (%s)\n",
+				strerror(-efd));
+			return -1;
+		}
+		c->pfds[i].fd = efd;
+		c->pfds[i].events = POLLIN;
+	}
+
+	return 0;
+}
+
+static void cdlh_cleanup(struct cdlh *c)
+{
+	unsigned int i;
+
+	cdlio_hedge_destroy(c->h);
+	for (i = 0; i < c->nr_devs; i++) {
+		cdlio_ctx_destroy(c->ctxs[i]);
+		cdlio_close(c->devs[i]);
+	}
+	free(c->bufs);
+}
+
+static int cdlh_parse_ulong(char *str, unsigned long long *val)
+{
+	char *end;
+
+	errno = 0;
+	*val = strtoull(str, &end, 0);
+	if (errno || end == str || *end)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Main function.
+ */
+int main(int argc, char **argv)
+{
+	unsigned long long val, start, elapsed;
+	struct cdlh c;
+	unsigned int i;
+	int ret;
+
+	if (argc == 1) {
+		cdlh_usage();
+		return 0;
+	}
+
+	/* Generic options */
+	if (strcmp(argv[1], "--version") == 0) {
+		printf("cdlhedge, version %s\n", PACKAGE_VERSION);
+		printf("Copyright (C) 2021, Western Digital Corporation"
+		       " or its affiliates.\n");
+		return 0;
+	}
+
+	if (strcmp(argv[1], "--help") == 0 ||
+	    strcmp(argv[1], "-h") == 0) {
+		cdlh_usage();
+		return 0;
+	}
+
+	memset(&c, 0, sizeof(c));
+	c.bs = 128 * 1024;
+	c.qd = 8;
+	c.runtime = 60;
+	c.dld = 1;
+	c.hedge = true;
+	c.seed = 1;
+
+	/* Parse options */
+	for (i = 1; i < (unsigned int)argc; i++) {
+		if (strcmp(argv[i], "--no-hedge") == 0) {
+			c.hedge = false;
+			continue;
+		}
+
+		if (argv[i][0] != '-')
+			break;
+
+		/* All other options have a value */
+		if (i + 1 >= (unsigned int)argc)
+			goto err_cmd_line;
+
+		if (cdlh_parse_ulong(argv[i + 1], &val)) {
+			fprintf(stderr, "Invalid value '%s' for %s\n",
+				argv[i + 1], argv[i]);
+			return 1;
+		}
+
+		if (strcmp(argv[i], "--bs") == 0) {
+			if (!val || val % 512)
+				goto err_cmd_line;
+			c.bs = val;
+		} else if (strcmp(argv[i], "--qd") == 0) {
+			if (!val || val > CDL_SGIO_MAX_QD)
+				goto err_cmd_line;
+			c.qd = val;
+		} else if (strcmp(argv[i], "--runtime") == 0) {
+			if (!val)
+				goto err_cmd_line;
+			c.runtime = val;
+		} else if (strcmp(argv[i], "--dld") == 0) {
+			if (!val || val > CDL_MAX_DESC)
+				goto err_cmd_line;
+			c.dld = val;
+		} else if (strcmp(argv[i], "--deadline") == 0) {
+			c.deadline = val;
+		} else if (strcmp(argv[i], "--seed") == 0) {
+			c.seed = val ? val : 1;
+		} else {
+			fprintf(stderr, "Invalid option '%s'\n", argv[i]);
+			return 1;
+		}
+		i++;
+	}
+
+	for (; i < (unsigned int)argc; i++) {
+		if (c.nr_devs >= CDLH_MAX_DEVS) {
+			fprintf(stderr, "Too many devices\n");
+			return 1;
+		}
+		c.paths[c.nr_devs++] = argv[i];
+	}
+
+	if (c.nr_devs < 2) {
+err_cmd_line:
+		fprintf(stderr, "Invalid command line\n");
+		return 1;
+	}
+
+	ret = cdlh_init(&c);
+	if (ret)
+		goto out;
+
+	printf("Devices:");
+	for (i = 0; i < c.nr_devs; i++)
+		printf(" %s", c.paths[i]);
+	printf("\n    Workload: randread, %zu B, QD %u, %u s\n",
+	       c.bs, c.qd, c.runtime);
+	if (c.hedge)
+		printf("    Hedging: descriptor %u, soft deadline %llu us\n",
+		       c.dld, c.deadline);
+	else
+		printf("    Hedging: disabled\n");
+
+	signal(SIGINT, cdlh_sigint);
+	signal(SIGTERM, cdlh_sigint);
+
+	start = cdl_now_ns();
+	ret = cdlh_run(&c);
+	elapsed = cdl_now_ns() - start;
+	if (ret) {
+		fprintf(stderr, "Run failed (%s)\n", strerror(-ret));
+		goto out;
+	}
+
+	cdlh_report(&c, elapsed);
+
+out:
+	cdlh_cleanup(&c);
+
+	return ret ? 1 : 0;
+}
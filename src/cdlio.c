@@ -0,0 +1,1140 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include "cdl.h"
+#include "cdlio.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#define CDLIO_IOPRIO_CLASS_BE	2
+#define CDLIO_IOPRIO_CLASS_SHIFT	13
+#define CDLIO_IOPRIO_HINT_SHIFT	3
+
+/*
+ * Per context statistics: only the context owner thread modifies these, so
+ * no locking is needed. A concurrent aggregation may see a context
+ * statistics in the middle of an update, which is acceptable for monitoring.
+ */
+struct cdlio_ctx_stats {
+	struct cdl_hist		lat;
+	uint64_t		nr_limit;
+	uint64_t		nr_errors;
+};
+
+struct cdlio_req {
+	void			*user_data;
+	unsigned long long	start;
+	uint8_t			rw;
+	uint8_t			desc;
+	int			next_free;
+};
+
+struct cdlio_ctx {
+	struct cdlio_dev	*dev;
+	struct cdlio_ctx	*next;
+
+	/* io_uring rings */
+	int			ring_fd;
+	int			event_fd;
+	void			*sq_ptr;
+	size_t			sq_size;
+	void			*cq_ptr;
+	size_t			cq_size;
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_size;
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		*sq_array;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	unsigned int		qd;
+	unsigned int		to_submit;
+	unsigned int		inflight;
+	struct cdlio_req	*reqs;
+	int			free_req;
+
+	struct cdlio_ctx_stats	stats[2][CDLIO_MAX_DESC + 1];
+};
+
+struct cdlio_feed_dev;
+
+struct cdlio_dev {
+	int			fd;
+	struct cdlio_desc	descs[2][CDLIO_MAX_DESC + 1];
+
+	/*
+	 * Device information, used with the device file descriptor to read
+	 * the device statistics.
+	 */
+	struct cdl_dev		cdev;
+
+	/* Miss rate feed entry of the device, if any */
+	struct cdlio_feed_dev	*feed_dev;
+
+	/* Contexts list and statistics of destroyed contexts */
+	pthread_mutex_t		lock;
+	struct cdlio_ctx	*ctxs;
+	struct cdlio_ctx_stats	stats[2][CDLIO_MAX_DESC + 1];
+};
+
+/*
+ * Get the descriptors of the page used by the kernel for a direction.
+ */
+static void cdlio_get_page_descs(struct cdl_dev *cdev, struct cdlio_dev *dev,
+				 enum cdl_rw rw)
+{
+	enum cdl_p cdlp = cdl_hint_page(cdev, rw);
+	struct cdl_desc *desc;
+	struct cdlio_desc *d;
+	int i;
+
+	/* Only T2A and T2B pages are used for I/O priority hints */
+	if (cdlp == CDLP_NONE)
+		return;
+
+	for (i = 0; i < CDL_MAX_DESC; i++) {
+		desc = &cdev->cdl_pages[cdlp].descs[i];
+		d = &dev->descs[rw][i + 1];
+		d->max_inactive_time =
+			cdl_t2time(desc->max_inactive_time, desc->cdltunit);
+		d->max_active_time =
+			cdl_t2time(desc->max_active_time, desc->cdltunit);
+		d->duration_guideline =
+			cdl_t2time(desc->duration, desc->cdltunit);
+		d->max_inactive_policy = desc->max_inactive_policy;
+		d->max_active_policy = desc->max_active_policy;
+		d->duration_guideline_policy = desc->duration_policy;
+		d->valid = d->max_inactive_time || d->max_active_time ||
+			d->duration_guideline;
+	}
+}
+
+/*
+ * Read the device duration limits descriptors. The device is not opened
+ * exclusively so that it can be mounted or used by other processes.
+ */
+static int cdlio_read_descs(const char *path, struct cdlio_dev *dev)
+{
+	struct cdl_dev *cdev = &dev->cdev;
+	int i, ret;
+
+	cdev->fd = -1;
+	for (i = 0; i < CDL_CMD_MAX; i++)
+		cdev->cmd_cdlp[i] = CDLP_NONE;
+	for (i = 0; i < CDL_MAX_PAGES; i++)
+		cdev->cdl_pages[i].cdlp = CDLP_NONE;
+
+	cdev->path = realpath(path, NULL);
+	if (!cdev->path)
+		return -errno;
+
+	ret = cdl_open_dev(cdev, O_RDONLY, false);
+	if (ret)
+		return -ENODEV;
+
+	if (!(cdev->flags & CDL_DEV_SUPPORTED)) {
+		cdl_dev_err(cdev,
+			    "Device does not support command duration limits\n");
+		ret = -EOPNOTSUPP;
+		goto close;
+	}
+
+	ret = cdl_read_pages(cdev);
+	if (ret) {
+		ret = -EIO;
+		goto close;
+	}
+
+	cdlio_get_page_descs(cdev, dev, CDL_READ);
+	cdlio_get_page_descs(cdev, dev, CDL_WRITE);
+
+close:
+	cdl_close_dev(cdev);
+
+	return ret;
+}
+
+/*
+ * Open a device for I/Os. flags are added to O_RDWR to open the device
+ * (e.g. O_DIRECT). Return NULL with errno set on error.
+ */
+struct cdlio_dev *cdlio_open(const char *path, int flags)
+{
+	struct cdlio_dev *dev;
+	int i, ret;
+
+	dev = calloc(1, sizeof(struct cdlio_dev));
+	if (!dev) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	ret = cdlio_read_descs(path, dev);
+	if (ret)
+		goto err;
+
+	dev->fd = open(path, O_RDWR | flags);
+	if (dev->fd < 0) {
+		ret = -errno;
+		goto err;
+	}
+
+	/* Use the I/O file descriptor for reading statistics */
+	dev->cdev.fd = dev->fd;
+
+	for (i = 0; i <= CDLIO_MAX_DESC; i++) {
+		cdl_hist_init(&dev->stats[CDLIO_READ][i].lat);
+		cdl_hist_init(&dev->stats[CDLIO_WRITE][i].lat);
+	}
+	pthread_mutex_init(&dev->lock, NULL);
+
+	return dev;
+
+err:
+	free(dev->cdev.path);
+	free(dev);
+	errno = -ret;
+	return NULL;
+}
+
+/*
+ * Close a device. All contexts must have been destroyed.
+ */
+void cdlio_close(struct cdlio_dev *dev)
+{
+	if (!dev)
+		return;
+
+	close(dev->fd);
+	pthread_mutex_destroy(&dev->lock);
+	free(dev->cdev.path);
+	free(dev);
+}
+
+int cdlio_fd(struct cdlio_dev *dev)
+{
+	return dev->fd;
+}
+
+/*
+ * Get the limits of a descriptor of the page used for a direction.
+ */
+int cdlio_get_desc(struct cdlio_dev *dev, enum cdlio_rw rw,
+		   unsigned int desc, struct cdlio_desc *d)
+{
+	if ((rw != CDLIO_READ && rw != CDLIO_WRITE) || desc > CDLIO_MAX_DESC)
+		return -EINVAL;
+
+	*d = dev->descs[rw][desc];
+
+	return 0;
+}
+
+/*
+ * I/O priority value for a descriptor: best-effort class with the
+ * descriptor index as the I/O priority hint.
+ */
+uint16_t cdlio_ioprio(unsigned int desc)
+{
+	if (!desc || desc > CDLIO_MAX_DESC)
+		return 0;
+
+	return (CDLIO_IOPRIO_CLASS_BE << CDLIO_IOPRIO_CLASS_SHIFT) |
+		(desc << CDLIO_IOPRIO_HINT_SHIFT);
+}
+
+/*
+ * Time after which an I/O using a descriptor is completed or failed: the
+ * duration guideline if set, or the sum of the inactive and active limits.
+ */
+static uint64_t cdlio_desc_limit(struct cdlio_desc *d)
+{
+	if (d->duration_guideline)
+		return d->duration_guideline;
+
+	return d->max_inactive_time + d->max_active_time;
+}
+
+/*
+ * Test if a descriptor policies can fail I/Os (abort or complete-unavailable)
+ * instead of only completing them as early as possible.
+ */
+static bool cdlio_desc_fail_fast(struct cdlio_desc *d)
+{
+	return (d->max_inactive_time && d->max_inactive_policy) ||
+		(d->max_active_time && d->max_active_policy) ||
+		(d->duration_guideline &&
+		 (d->duration_guideline_policy == 0xd ||
+		  d->duration_guideline_policy == 0xf));
+}
+
+/*
+ * Select the descriptor best fitting a time budget (ns) for an I/O. The
+ * selected descriptor is the one with the longest limit that leaves enough
+ * time in the budget to retry the I/O with the same descriptor if it is
+ * failed by the descriptor policy. Descriptors with a miss rate higher than
+ * CDLIO_SEL_MAX_MISS in stats (which may be NULL) are ignored, and ties are
+ * broken using the lowest miss rate.
+ *
+ * If no descriptor leaves room for a retry, the descriptor with the longest
+ * limit fitting the budget is selected with sel->retry set to 0. Return the
+ * selected descriptor index, 0 if the device has no descriptor for the
+ * direction, and -ETIME if no descriptor fits the budget.
+ */
+int cdlio_select_desc(struct cdlio_dev *dev, const struct cdlio_stats *stats,
+		      enum cdlio_rw rw, uint64_t budget,
+		      struct cdlio_sel *sel)
+{
+	const struct cdlio_desc_stats *ds;
+	unsigned int i, best = 0, single = 0, nr_valid = 0;
+	double miss[CDLIO_MAX_DESC + 1] = { 0 };
+	uint64_t limit[CDLIO_MAX_DESC + 1] = { 0 };
+	struct cdlio_desc *d;
+
+	if (rw != CDLIO_READ && rw != CDLIO_WRITE)
+		return -EINVAL;
+
+	memset(sel, 0, sizeof(*sel));
+
+	for (i = 1; i <= CDLIO_MAX_DESC; i++) {
+		d = &dev->descs[rw][i];
+		if (!d->valid)
+			continue;
+		nr_valid++;
+
+		limit[i] = cdlio_desc_limit(d);
+		if (stats) {
+			ds = &stats->desc[rw][i];
+			if (ds->nr_ios >= CDLIO_SEL_MIN_IOS)
+				miss[i] = (double)ds->nr_limit /
+					(double)ds->nr_ios;
+		}
+		if (miss[i] > CDLIO_SEL_MAX_MISS || limit[i] > budget)
+			continue;
+
+		if (!single || limit[i] > limit[single] ||
+		    (limit[i] == limit[single] && miss[i] < miss[single]))
+			single = i;
+
+		if (limit[i] > budget - limit[i])
+			continue;
+		if (!best || limit[i] > limit[best] ||
+		    (limit[i] == limit[best] && miss[i] < miss[best]))
+			best = i;
+	}
+
+	if (!nr_valid)
+		return 0;
+
+	if (best) {
+		sel->retry = budget - limit[best];
+	} else {
+		best = single;
+		if (!best)
+			return -ETIME;
+	}
+
+	d = &dev->descs[rw][best];
+	sel->desc = best;
+	sel->ioprio = cdlio_ioprio(best);
+	sel->limit = limit[best];
+	sel->miss_rate = miss[best];
+	sel->fail_fast = cdlio_desc_fail_fast(d);
+
+	return best;
+}
+
+static int cdlio_ring_setup(struct cdlio_ctx *ctx)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	ctx->ring_fd = syscall(__NR_io_uring_setup, ctx->qd, &p);
+	if (ctx->ring_fd < 0)
+		return -errno;
+
+	ctx->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ctx->cq_size = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ctx->cq_size > ctx->sq_size)
+			ctx->sq_size = ctx->cq_size;
+		ctx->cq_size = 0;
+	}
+
+	ctx->sq_ptr = mmap(NULL, ctx->sq_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ctx->ring_fd,
+			   IORING_OFF_SQ_RING);
+	if (ctx->sq_ptr == MAP_FAILED) {
+		ctx->sq_ptr = NULL;
+		return -errno;
+	}
+
+	if (ctx->cq_size) {
+		ctx->cq_ptr = mmap(NULL, ctx->cq_size, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, ctx->ring_fd,
+				   IORING_OFF_CQ_RING);
+		if (ctx->cq_ptr == MAP_FAILED) {
+			ctx->cq_ptr = NULL;
+			return -errno;
+		}
+	} else {
+		ctx->cq_ptr = ctx->sq_ptr;
+	}
+
+	ctx->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ctx->sqes = mmap(NULL, ctx->sqes_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ctx->ring_fd,
+			 IORING_OFF_SQES);
+	if (ctx->sqes == MAP_FAILED) {
+		ctx->sqes = NULL;
+		return -errno;
+	}
+
+	ctx->sq_head = (unsigned int *)((char *)ctx->sq_ptr + p.sq_off.head);
+	ctx->sq_tail = (unsigned int *)((char *)ctx->sq_ptr + p.sq_off.tail);
+	ctx->sq_mask = (unsigned int *)((char *)ctx->sq_ptr +
+					p.sq_off.ring_mask);
+	ctx->sq_array = (unsigned int *)((char *)ctx->sq_ptr + p.sq_off.array);
+	ctx->cq_head = (unsigned int *)((char *)ctx->cq_ptr + p.cq_off.head);
+	ctx->cq_tail = (unsigned int *)((char *)ctx->cq_ptr + p.cq_off.tail);
+	ctx->cq_mask = (unsigned int *)((char *)ctx->cq_ptr +
+					p.cq_off.ring_mask);
+	ctx->cqes = (struct io_uring_cqe *)((char *)ctx->cq_ptr +
+					    p.cq_off.cqes);
+
+	return 0;
+}
+
+static void cdlio_ring_cleanup(struct cdlio_ctx *ctx)
+{
+	if (ctx->event_fd >= 0)
+		close(ctx->event_fd);
+	if (ctx->sqes)
+		munmap(ctx->sqes, ctx->sqes_size);
+	if (ctx->cq_ptr && ctx->cq_ptr != ctx->sq_ptr)
+		munmap(ctx->cq_ptr, ctx->cq_size);
+	if (ctx->sq_ptr)
+		munmap(ctx->sq_ptr, ctx->sq_size);
+	if (ctx->ring_fd >= 0)
+		close(ctx->ring_fd);
+}
+
+/*
+ * Create a context for the calling thread, allowing up to qd I/Os in flight.
+ * Return NULL with errno set on error.
+ */
+struct cdlio_ctx *cdlio_ctx_create(struct cdlio_dev *dev, unsigned int qd)
+{
+	struct cdlio_ctx *ctx;
+	unsigned int i;
+	int ret;
+
+	if (!qd) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	ctx = calloc(1, sizeof(struct cdlio_ctx));
+	if (!ctx) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	ctx->dev = dev;
+	ctx->qd = qd;
+	ctx->ring_fd = -1;
+	ctx->event_fd = -1;
+	ctx->reqs = calloc(qd, sizeof(struct cdlio_req));
+	if (!ctx->reqs) {
+		ret = -ENOMEM;
+		goto err;
+	}
+
+	for (i = 0; i < qd; i++)
+		ctx->reqs[i].next_free = i + 1 < qd ? (int)i + 1 : -1;
+	ctx->free_req = 0;
+
+	for (i = 0; i <= CDLIO_MAX_DESC; i++) {
+		cdl_hist_init(&ctx->stats[CDLIO_READ][i].lat);
+		cdl_hist_init(&ctx->stats[CDLIO_WRITE][i].lat);
+	}
+
+	ret = cdlio_ring_setup(ctx);
+	if (ret)
+		goto err;
+
+	pthread_mutex_lock(&dev->lock);
+	ctx->next = dev->ctxs;
+	dev->ctxs = ctx;
+	pthread_mutex_unlock(&dev->lock);
+
+	return ctx;
+
+err:
+	cdlio_ring_cleanup(ctx);
+	free(ctx->reqs);
+	free(ctx);
+	errno = -ret;
+	return NULL;
+}
+
+/*
+ * Get an eventfd signaled for every completion of a context, allowing to
+ * wait for completions of several contexts with poll(). The eventfd is
+ * created on the first call and closed with the context.
+ */
+int cdlio_ctx_eventfd(struct cdlio_ctx *ctx)
+{
+	int efd, ret;
+
+	if (ctx->event_fd >= 0)
+		return ctx->event_fd;
+
+	efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd < 0)
+		return -errno;
+
+	ret = syscall(__NR_io_uring_register, ctx->ring_fd,
+		      IORING_REGISTER_EVENTFD, &efd, 1);
+	if (ret < 0) {
+		ret = -errno;
+		close(efd);
+		return ret;
+	}
+
+	ctx->event_fd = efd;
+
+	return efd;
+}
+
+static void cdlio_merge_stats(struct cdlio_ctx_stats dst[2][CDLIO_MAX_DESC + 1],
+			      struct cdlio_ctx_stats src[2][CDLIO_MAX_DESC + 1])
+{
+	int rw, d;
+
+	for (rw = CDLIO_READ; rw <= CDLIO_WRITE; rw++) {
+		for (d = 0; d <= CDLIO_MAX_DESC; d++) {
+			cdl_hist_merge(&dst[rw][d].lat, &src[rw][d].lat);
+			dst[rw][d].nr_limit += src[rw][d].nr_limit;
+			dst[rw][d].nr_errors += src[rw][d].nr_errors;
+		}
+	}
+}
+
+/*
+ * Destroy a context. All I/Os of the context must have been reaped.
+ */
+void cdlio_ctx_destroy(struct cdlio_ctx *ctx)
+{
+	struct cdlio_dev *dev;
+	struct cdlio_ctx **p;
+
+	if (!ctx)
+		return;
+
+	/* Keep the context statistics in the device statistics */
+	dev = ctx->dev;
+	pthread_mutex_lock(&dev->lock);
+	for (p = &dev->ctxs; *p; p = &(*p)->next) {
+		if (*p == ctx) {
+			*p = ctx->next;
+			break;
+		}
+	}
+	cdlio_merge_stats(dev->stats, ctx->stats);
+	pthread_mutex_unlock(&dev->lock);
+
+	cdlio_ring_cleanup(ctx);
+	free(ctx->reqs);
+	free(ctx);
+}
+
+/*
+ * Queue an I/O using the descriptor desc (0 for no limit). The I/O is
+ * issued to the device with the next call to cdlio_submit() or cdlio_reap().
+ * Using an empty descriptor or a length larger than 4 GiB - 1 is an error.
+ */
+int cdlio_queue(struct cdlio_ctx *ctx, enum cdlio_rw rw, void *buf,
+		size_t len, off_t ofst, unsigned int desc, void *user_data)
+{
+	struct io_uring_sqe *sqe;
+	struct cdlio_req *req;
+	unsigned int tail, idx;
+	int r;
+
+	if ((rw != CDLIO_READ && rw != CDLIO_WRITE) || desc > CDLIO_MAX_DESC)
+		return -EINVAL;
+	if (desc && !ctx->dev->descs[rw][desc].valid)
+		return -EINVAL;
+	if (len > UINT32_MAX)
+		return -EINVAL;
+
+	r = ctx->free_req;
+	if (r < 0)
+		return -EBUSY;
+
+	req = &ctx->reqs[r];
+	ctx->free_req = req->next_free;
+	req->user_data = user_data;
+	req->rw = rw;
+	req->desc = desc;
+
+	tail = *ctx->sq_tail;
+	idx = tail & *ctx->sq_mask;
+	sqe = &ctx->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = rw == CDLIO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+	sqe->fd = ctx->dev->fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = ofst;
+	sqe->ioprio = cdlio_ioprio(desc);
+	sqe->user_data = r;
+	ctx->sq_array[idx] = idx;
+
+	req->start = cdl_now_ns();
+	__atomic_store_n(ctx->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ctx->to_submit++;
+	ctx->inflight++;
+
+	return 0;
+}
+
+static int cdlio_enter(struct cdlio_ctx *ctx, unsigned int min)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, ctx->ring_fd,
+			      ctx->to_submit, min,
+			      min ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+
+	ctx->to_submit -= ret;
+
+	return ret;
+}
+
+/*
+ * Issue all queued I/Os. Return the number of I/Os submitted.
+ */
+int cdlio_submit(struct cdlio_ctx *ctx)
+{
+	if (!ctx->to_submit)
+		return 0;
+
+	return cdlio_enter(ctx, 0);
+}
+
+/*
+ * Issue queued I/Os and get up to nr completions, waiting for at least min
+ * completions. Return the number of completions.
+ */
+int cdlio_reap(struct cdlio_ctx *ctx, struct cdlio_cqe *cqes,
+	       unsigned int nr, unsigned int min)
+{
+	struct cdlio_ctx_stats *st;
+	struct io_uring_cqe *cqe;
+	struct cdlio_req *req;
+	unsigned int head, tail, n = 0;
+	int ret;
+
+	if (min > ctx->inflight)
+		min = ctx->inflight;
+	if (min > nr)
+		min = nr;
+
+	while (1) {
+		head = *ctx->cq_head;
+		tail = __atomic_load_n(ctx->cq_tail, __ATOMIC_ACQUIRE);
+		while (head != tail && n < nr) {
+			cqe = &ctx->cqes[head & *ctx->cq_mask];
+			req = &ctx->reqs[cqe->user_data];
+
+			cqes[n].user_data = req->user_data;
+			cqes[n].res = cqe->res;
+			cqes[n].rw = req->rw;
+			cqes[n].desc = req->desc;
+			cqes[n].lat = cdl_now_ns() - req->start;
+
+			st = &ctx->stats[req->rw][req->desc];
+			if (cqe->res >= 0) {
+				cqes[n].status = CDLIO_OK;
+				cdl_hist_add(&st->lat, cqes[n].lat);
+			} else if (cqe->res == -ETIME) {
+				cqes[n].status = CDLIO_LIMIT;
+				st->nr_limit++;
+			} else {
+				cqes[n].status = CDLIO_ERROR;
+				st->nr_errors++;
+			}
+
+			req->next_free = ctx->free_req;
+			ctx->free_req = cqe->user_data;
+			ctx->inflight--;
+			head++;
+			n++;
+		}
+		__atomic_store_n(ctx->cq_head, head, __ATOMIC_RELEASE);
+
+		if (n >= min && !ctx->to_submit)
+			return n;
+
+		ret = cdlio_enter(ctx, n >= min ? 0 : min - n);
+		if (ret < 0)
+			return n ? (int)n : ret;
+	}
+}
+
+/*
+ * Aggregate the statistics of all contexts of a device.
+ */
+void cdlio_get_stats(struct cdlio_dev *dev, struct cdlio_stats *stats)
+{
+	struct cdlio_ctx_stats (*agg)[CDLIO_MAX_DESC + 1];
+	struct cdlio_desc_stats *ds;
+	struct cdlio_ctx *ctx;
+	struct cdl_hist *h;
+	int rw, d;
+
+	memset(stats, 0, sizeof(*stats));
+
+	agg = calloc(2, sizeof(*agg));
+	if (!agg)
+		return;
+
+	for (rw = CDLIO_READ; rw <= CDLIO_WRITE; rw++)
+		for (d = 0; d <= CDLIO_MAX_DESC; d++)
+			cdl_hist_init(&agg[rw][d].lat);
+
+	pthread_mutex_lock(&dev->lock);
+	cdlio_merge_stats(agg, dev->stats);
+	for (ctx = dev->ctxs; ctx; ctx = ctx->next)
+		cdlio_merge_stats(agg, ctx->stats);
+	pthread_mutex_unlock(&dev->lock);
+
+	for (rw = CDLIO_READ; rw <= CDLIO_WRITE; rw++) {
+		for (d = 0; d <= CDLIO_MAX_DESC; d++) {
+			h = &agg[rw][d].lat;
+			ds = &stats->desc[rw][d];
+			ds->nr_limit = agg[rw][d].nr_limit;
+			ds->nr_errors = agg[rw][d].nr_errors;
+			ds->nr_ios = h->count + ds->nr_limit + ds->nr_errors;
+			if (!h->count)
+				continue;
+			ds->lat_min = h->min;
+			ds->lat_avg = cdl_hist_avg(h);
+			ds->lat_max = h->max;
+			ds->lat_p50 = cdl_hist_percentile(h, 50);
+			ds->lat_p90 = cdl_hist_percentile(h, 90);
+			ds->lat_p99 = cdl_hist_percentile(h, 99);
+			ds->lat_p999 = cdl_hist_percentile(h, 99.9);
+		}
+	}
+
+	free(agg);
+}
+
+/*
+ * Miss rate feed. A feed thread periodically computes, for each device added
+ * to the feed, the number of I/Os and of I/Os failed by a descriptor policy
+ * (host aborts) since the previous update, using the statistics of the device
+ * contexts, and the number of commands and of commands that missed their
+ * limits from the device statistics, if supported. The resulting miss rates
+ * are smoothed with an exponentially weighted moving average and published
+ * using a sequence counter so that readers never block.
+ */
+#define CDLIO_FEED_EWMA_WEIGHT	0.25
+
+struct cdlio_feed_dev {
+	struct cdlio_dev		*dev;
+	struct cdlio_feed_dev		*next;
+
+	/* Counters at the previous update */
+	struct cdlio_ctx_stats		prev[2][CDLIO_MAX_DESC + 1];
+	struct cdl_stats_counters	prev_cnt[2];
+	bool				dev_stats;
+	bool				have_prev;
+
+	/* Published values */
+	unsigned int			seq;
+	struct cdlio_miss		miss[2][CDLIO_MAX_DESC + 1];
+};
+
+struct cdlio_feed {
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	bool			stop;
+	unsigned int		interval_ms;
+	struct cdlio_feed_dev	*devs;
+};
+
+static double cdlio_feed_ewma(double avg, double val, bool first)
+{
+	if (first)
+		return val;
+
+	return CDLIO_FEED_EWMA_WEIGHT * val +
+		(1.0 - CDLIO_FEED_EWMA_WEIGHT) * avg;
+}
+
+/*
+ * Get the latency histogram of the I/Os completed since the previous update.
+ */
+static void cdlio_feed_hist_delta(struct cdl_hist *cur, struct cdl_hist *prev,
+				  struct cdl_hist *delta)
+{
+	unsigned int i;
+
+	for (i = 0; i < CDL_HIST_BUCKETS; i++)
+		delta->buckets[i] = cur->buckets[i] - prev->buckets[i];
+	delta->count = cur->count - prev->count;
+	delta->sum = cur->sum - prev->sum;
+	delta->min = 0;
+	delta->max = cur->max;
+}
+
+static void cdlio_feed_update_dev(struct cdlio_feed_dev *fd,
+				  struct cdlio_ctx_stats cur[2][CDLIO_MAX_DESC + 1],
+				  struct cdl_hist *delta)
+{
+	struct cdlio_dev *dev = fd->dev;
+	struct cdl_stats_counters cnt[2];
+	struct cdlio_miss miss[2][CDLIO_MAX_DESC + 1];
+	struct cdlio_ctx_stats *c, *p;
+	struct cdlio_ctx *ctx;
+	struct cdlio_miss *m;
+	uint64_t nr_limit, nr_cmds, nr_misses;
+	bool dev_cnt = false;
+	int rw, d;
+
+	for (rw = CDLIO_READ; rw <= CDLIO_WRITE; rw++) {
+		for (d = 0; d <= CDLIO_MAX_DESC; d++) {
+			memset(&cur[rw][d], 0, sizeof(cur[rw][d]));
+			cdl_hist_init(&cur[rw][d].lat);
+		}
+	}
+
+	pthread_mutex_lock(&dev->lock);
+	cdlio_merge_stats(cur, dev->stats);
+	for (ctx = dev->ctxs; ctx; ctx = ctx->next)
+		cdlio_merge_stats(cur, ctx->stats);
+	pthread_mutex_unlock(&dev->lock);
+
+	/* Device statistics: stop trying if this fails */
+	if (fd->dev_stats) {
+		if (cdl_statistics_get_counters(&dev->cdev, cnt))
+			fd->dev_stats = false;
+		else
+			dev_cnt = fd->have_prev;
+	}
+
+	memcpy(miss, fd->miss, sizeof(miss));
+
+	for (rw = CDLIO_READ; rw <= CDLIO_WRITE; rw++) {
+		for (d = 0; d <= CDLIO_MAX_DESC; d++) {
+			c = &cur[rw][d];
+			p = &fd->prev[rw][d];
+			m = &miss[rw][d];
+
+			if (!fd->have_prev)
+				cdl_hist_init(&p->lat);
+
+			cdlio_feed_hist_delta(&c->lat, &p->lat, delta);
+			nr_limit = c->nr_limit - p->nr_limit;
+			m->nr_ios = delta->count + nr_limit +
+				c->nr_errors - p->nr_errors;
+			m->nr_limit = nr_limit;
+			if (delta->count + nr_limit) {
+				m->host_rate = cdlio_feed_ewma(m->host_rate,
+					(double)nr_limit /
+					(double)(delta->count + nr_limit),
+					!m->host_samples);
+				m->host_samples = true;
+			}
+			if (delta->count)
+				m->lat_p99 = cdl_hist_percentile(delta, 99);
+
+			if (d && dev_cnt && cnt[rw].valid[d - 1] &&
+			    fd->prev_cnt[rw].valid[d - 1]) {
+				nr_cmds = cnt[rw].nr_cmds[d - 1] -
+					fd->prev_cnt[rw].nr_cmds[d - 1];
+				nr_misses = cnt[rw].nr_misses[d - 1] -
+					fd->prev_cnt[rw].nr_misses[d - 1];
+				if (nr_cmds && nr_misses <= nr_cmds) {
+					m->dev_rate = cdlio_feed_ewma(m->dev_rate,
+						(double)nr_misses /
+						(double)nr_cmds,
+						!m->dev_samples);
+					m->dev_samples = true;
+				}
+			}
+
+			m->rate = m->host_rate > m->dev_rate ?
+				m->host_rate : m->dev_rate;
+			m->updated = cdl_now_ns();
+		}
+	}
+
+	/* Publish */
+	__atomic_store_n(&fd->seq, fd->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(fd->miss, miss, sizeof(miss));
+	__atomic_store_n(&fd->seq, fd->seq + 1, __ATOMIC_RELEASE);
+
+	memcpy(fd->prev, cur, sizeof(fd->prev));
+	if (fd->dev_stats)
+		memcpy(fd->prev_cnt, cnt, sizeof(cnt));
+	fd->have_prev = true;
+}
+
+static void *cdlio_feed_run(void *arg)
+{
+	struct cdlio_feed *f = arg;
+	struct cdlio_ctx_stats (*cur)[CDLIO_MAX_DESC + 1];
+	struct cdlio_feed_dev *devs, *fd;
+	struct cdl_hist *delta;
+	struct timespec ts;
+
+	cur = calloc(2, sizeof(*cur));
+	delta = malloc(sizeof(struct cdl_hist));
+	if (!cur || !delta)
+		goto out;
+
+	pthread_mutex_lock(&f->lock);
+	while (!f->stop) {
+		/*
+		 * Devices are only added at the head of the list and freed
+		 * once this thread is stopped: update the devices of the list
+		 * snapshot without holding the lock, so that reading the
+		 * device statistics does not block cdlio_feed_add() and
+		 * cdlio_feed_stop().
+		 */
+		devs = f->devs;
+		pthread_mutex_unlock(&f->lock);
+
+		for (fd = devs; fd; fd = fd->next)
+			cdlio_feed_update_dev(fd, cur, delta);
+
+		pthread_mutex_lock(&f->lock);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += f->interval_ms / 1000;
+		ts.tv_nsec += (long)(f->interval_ms % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		while (!f->stop &&
+		       pthread_cond_timedwait(&f->cond, &f->lock, &ts) == 0)
+			;
+	}
+	pthread_mutex_unlock(&f->lock);
+
+out:
+	free(delta);
+	free(cur);
+
+	return NULL;
+}
+
+/*
+ * Start a miss rate feed updated every interval_ms milliseconds.
+ * Return NULL with errno set on error.
+ */
+struct cdlio_feed *cdlio_feed_start(unsigned int interval_ms)
+{
+	struct cdlio_feed *f;
+	int ret;
+
+	if (!interval_ms) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	f = calloc(1, sizeof(struct cdlio_feed));
+	if (!f) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	f->interval_ms = interval_ms;
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_cond_init(&f->cond, NULL);
+
+	ret = pthread_create(&f->thread, NULL, cdlio_feed_run, f);
+	if (ret) {
+		pthread_cond_destroy(&f->cond);
+		pthread_mutex_destroy(&f->lock);
+		free(f);
+		errno = ret;
+		return NULL;
+	}
+
+	return f;
+}
+
+/*
+ * Add a device to a feed. A device can only be added to a single feed.
+ */
+int cdlio_feed_add(struct cdlio_feed *f, struct cdlio_dev *dev)
+{
+	struct cdlio_feed_dev *fd;
+
+	if (dev->feed_dev)
+		return -EBUSY;
+
+	fd = calloc(1, sizeof(struct cdlio_feed_dev));
+	if (!fd)
+		return -ENOMEM;
+
+	fd->dev = dev;
+	fd->dev_stats = cdl_dev_statistics_supported(&dev->cdev);
+
+	pthread_mutex_lock(&f->lock);
+	fd->next = f->devs;
+	f->devs = fd;
+	__atomic_store_n(&dev->feed_dev, fd, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&f->lock);
+
+	return 0;
+}
+
+/*
+ * Stop a feed. The devices of the feed must be closed after the feed is
+ * stopped.
+ */
+void cdlio_feed_stop(struct cdlio_feed *f)
+{
+	struct cdlio_feed_dev *fd;
+
+	if (!f)
+		return;
+
+	pthread_mutex_lock(&f->lock);
+	f->stop = true;
+	pthread_cond_signal(&f->cond);
+	pthread_mutex_unlock(&f->lock);
+
+	pthread_join(f->thread, NULL);
+
+	while (f->devs) {
+		fd = f->devs;
+		f->devs = fd->next;
+		fd->dev->feed_dev = NULL;
+		free(fd);
+	}
+
+	pthread_cond_destroy(&f->cond);
+	pthread_mutex_destroy(&f->lock);
+	free(f);
+}
+
+/*
+ * Get the miss rate of a descriptor of a device. This never blocks.
+ * Return -ENOENT if the device was not added to a feed.
+ */
+int cdlio_get_miss(struct cdlio_dev *dev, enum cdlio_rw rw,
+		   unsigned int desc, struct cdlio_miss *m)
+{
+	struct cdlio_feed_dev *fd;
+	unsigned int seq;
+
+	if ((rw != CDLIO_READ && rw != CDLIO_WRITE) || desc > CDLIO_MAX_DESC)
+		return -EINVAL;
+
+	fd = __atomic_load_n(&dev->feed_dev, __ATOMIC_ACQUIRE);
+	if (!fd)
+		return -ENOENT;
+
+	do {
+		seq = __atomic_load_n(&fd->seq, __ATOMIC_ACQUIRE);
+		*m = fd->miss[rw][desc];
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) ||
+		 seq != __atomic_load_n(&fd->seq, __ATOMIC_RELAXED));
+
+	return 0;
+}
+
+/*
+ * Rank devices by expected tail latency of I/Os using a descriptor. The
+ * expected tail latency of a device is the 99th percentile latency of the
+ * recently completed I/Os, increased by the descriptor limit weighted by
+ * the miss rate (the time lost for I/Os failed and retried). order is
+ * filled with the device indexes, from the lowest to the highest expected
+ * tail latency. Devices not added to a feed or without any sample for the
+ * descriptor are ranked last, in their order in devs, with an expected tail
+ * latency of UINT64_MAX: these devices only get samples once I/Os are issued
+ * to them, so callers should occasionally issue I/Os to them.
+ */
+int cdlio_rank_devs(struct cdlio_dev **devs, unsigned int nr_devs,
+		    enum cdlio_rw rw, unsigned int desc, unsigned int *order,
+		    uint64_t *tail_lat)
+{
+	struct cdlio_miss m;
+	uint64_t *lat, l;
+	unsigned int i, j;
+	int ret;
+
+	if ((rw != CDLIO_READ && rw != CDLIO_WRITE) || desc > CDLIO_MAX_DESC)
+		return -EINVAL;
+
+	lat = calloc(nr_devs, sizeof(uint64_t));
+	if (!lat)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_devs; i++) {
+		ret = cdlio_get_miss(devs[i], rw, desc, &m);
+		if (ret && ret != -ENOENT)
+			goto out;
+		if (ret == -ENOENT || (!m.host_samples && !m.dev_samples)) {
+			l = UINT64_MAX;
+		} else {
+			l = m.lat_p99;
+			if (desc)
+				l += m.rate * (double)
+					cdlio_desc_limit(&devs[i]->descs[rw][desc]);
+		}
+
+		/* Insertion sort: the number of candidates is small */
+		for (j = i; j > 0 && lat[j - 1] > l; j--) {
+			lat[j] = lat[j - 1];
+			order[j] = order[j - 1];
+		}
+		lat[j] = l;
+		order[j] = i;
+	}
+
+	if (tail_lat) {
+		for (i = 0; i < nr_devs; i++)
+			tail_lat[i] = lat[i];
+	}
+	ret = 0;
+
+out:
+	free(lat);
+
+	return ret;
+}
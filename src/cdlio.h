@@ -0,0 +1,232 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+#ifndef CDLIO_H
+#define CDLIO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Descriptor-aware I/O submission library.
+ *
+ * A device is opened with cdlio_open(), which reads the device duration
+ * limits descriptors. I/Os are submitted with io_uring through per-thread
+ * contexts (struct cdlio_ctx) and tagged with a descriptor index (0 for no
+ * limit, 1 to 7 otherwise). A context must only be used by the thread that
+ * created it. Per-descriptor statistics are kept in each context without
+ * any locking and can be aggregated for a device at any time with
+ * cdlio_get_stats().
+ */
+
+#define CDLIO_MAX_DESC		7
+
+enum cdlio_rw {
+	CDLIO_READ,
+	CDLIO_WRITE,
+};
+
+/*
+ * Completion status: CDLIO_LIMIT indicates an I/O failed by the policy of
+ * its duration limit descriptor (ETIME error).
+ */
+enum cdlio_status {
+	CDLIO_OK,
+	CDLIO_LIMIT,
+	CDLIO_ERROR,
+};
+
+/*
+ * Duration limits of a descriptor in nanoseconds (0 for no limit).
+ */
+struct cdlio_desc {
+	bool		valid;
+	uint64_t	max_inactive_time;
+	uint64_t	max_active_time;
+	uint64_t	duration_guideline;
+	uint8_t		max_inactive_policy;
+	uint8_t		max_active_policy;
+	uint8_t		duration_guideline_policy;
+};
+
+struct cdlio_cqe {
+	void			*user_data;
+	int			res;
+	enum cdlio_status	status;
+	enum cdlio_rw		rw;
+	unsigned int		desc;
+	uint64_t		lat;
+};
+
+/*
+ * Statistics of a descriptor, latencies in nanoseconds.
+ */
+struct cdlio_desc_stats {
+	uint64_t	nr_ios;
+	uint64_t	nr_limit;
+	uint64_t	nr_errors;
+	uint64_t	lat_min;
+	uint64_t	lat_avg;
+	uint64_t	lat_max;
+	uint64_t	lat_p50;
+	uint64_t	lat_p90;
+	uint64_t	lat_p99;
+	uint64_t	lat_p999;
+};
+
+struct cdlio_stats {
+	struct cdlio_desc_stats	desc[2][CDLIO_MAX_DESC + 1];
+};
+
+/*
+ * Descriptor selection result. limit is the time (ns) after which an I/O
+ * using the descriptor is expected to be completed or failed, and retry the
+ * time left in the budget for retrying a failed I/O.
+ */
+struct cdlio_sel {
+	unsigned int	desc;
+	uint16_t	ioprio;
+	uint64_t	limit;
+	uint64_t	retry;
+	double		miss_rate;
+	bool		fail_fast;
+};
+
+/*
+ * Descriptors with an observed miss rate above this value are not selected.
+ * The miss rate of a descriptor is only considered once at least
+ * CDLIO_SEL_MIN_IOS I/Os were executed with it.
+ */
+#define CDLIO_SEL_MAX_MISS	0.1
+#define CDLIO_SEL_MIN_IOS	100
+
+/*
+ * Recent miss rate of a descriptor. host_rate is the rate of I/Os failed by
+ * the descriptor policy, dev_rate the rate of commands that missed their
+ * limits according to the device statistics, and rate the highest of both.
+ * dev_rate is only available for ATA devices with the statistics of the
+ * descriptor configured to count commands and limits met (see the cdladm
+ * stats-upload command), and dev_samples is false otherwise. nr_ios,
+ * nr_limit and lat_p99 (ns) are for the I/Os completed during the last
+ * update interval.
+ */
+struct cdlio_miss {
+	double		rate;
+	double		host_rate;
+	double		dev_rate;
+	bool		host_samples;
+	bool		dev_samples;
+	uint64_t	nr_ios;
+	uint64_t	nr_limit;
+	uint64_t	lat_p99;
+	uint64_t	updated;
+};
+
+struct cdlio_dev;
+struct cdlio_ctx;
+struct cdlio_feed;
+struct cdlio_admit;
+
+struct cdlio_dev *cdlio_open(const char *path, int flags);
+void cdlio_close(struct cdlio_dev *dev);
+int cdlio_fd(struct cdlio_dev *dev);
+int cdlio_get_desc(struct cdlio_dev *dev, enum cdlio_rw rw,
+		   unsigned int desc, struct cdlio_desc *d);
+uint16_t cdlio_ioprio(unsigned int desc);
+int cdlio_select_desc(struct cdlio_dev *dev, const struct cdlio_stats *stats,
+		      enum cdlio_rw rw, uint64_t budget,
+		      struct cdlio_sel *sel);
+
+struct cdlio_ctx *cdlio_ctx_create(struct cdlio_dev *dev, unsigned int qd);
+void cdlio_ctx_destroy(struct cdlio_ctx *ctx);
+int cdlio_ctx_eventfd(struct cdlio_ctx *ctx);
+int cdlio_queue(struct cdlio_ctx *ctx, enum cdlio_rw rw, void *buf,
+		size_t len, off_t ofst, unsigned int desc, void *user_data);
+int cdlio_submit(struct cdlio_ctx *ctx);
+int cdlio_reap(struct cdlio_ctx *ctx, struct cdlio_cqe *cqes,
+	       unsigned int nr, unsigned int min);
+
+void cdlio_get_stats(struct cdlio_dev *dev, struct cdlio_stats *stats);
+
+struct cdlio_feed *cdlio_feed_start(unsigned int interval_ms);
+int cdlio_feed_add(struct cdlio_feed *f, struct cdlio_dev *dev);
+void cdlio_feed_stop(struct cdlio_feed *f);
+int cdlio_get_miss(struct cdlio_dev *dev, enum cdlio_rw rw,
+		   unsigned int desc, struct cdlio_miss *m);
+int cdlio_rank_devs(struct cdlio_dev **devs, unsigned int nr_devs,
+		    enum cdlio_rw rw, unsigned int desc, unsigned int *order,
+		    uint64_t *tail_lat);
+
+/*
+ * Admission control of I/Os without a limit: the number of these I/Os in
+ * flight is limited to a budget lowered when the descriptors miss rates
+ * exceed a threshold and restored as the miss rates decrease.
+ */
+struct cdlio_admit *cdlio_admit_create(struct cdlio_dev *dev,
+				       unsigned int min_budget,
+				       unsigned int max_budget,
+				       double max_miss);
+void cdlio_admit_destroy(struct cdlio_admit *a);
+bool cdlio_admit_get(struct cdlio_admit *a);
+void cdlio_admit_put(struct cdlio_admit *a);
+unsigned int cdlio_admit_budget(struct cdlio_admit *a);
+
+/*
+ * Hedged reads across replica devices holding the same data. A read is
+ * first issued to a primary replica (chosen round-robin) using a tight
+ * descriptor. If the read is failed by the descriptor policy, or if it is
+ * not completed within the soft deadline (0 to disable), the read is issued
+ * to the next replica. The last replica is read without a limit. The first
+ * successful read completes the request. With a soft deadline, replicas
+ * are read into internal buffers and the data of the first completed read
+ * copied to the request buffer. A hedge context must only be used by the
+ * thread that created it.
+ */
+struct cdlio_hedge_cqe {
+	struct cdlio_cqe	cqe;
+	unsigned int		replica;
+	bool			hedged;
+};
+
+struct cdlio_hedge_stats {
+	uint64_t	nr_reads;
+	uint64_t	nr_hedges;
+	uint64_t	nr_limit_hedges;
+	uint64_t	nr_deadline_hedges;
+	uint64_t	nr_primary_wins;
+	uint64_t	nr_hedge_wins;
+	uint64_t	nr_errors;
+	uint64_t	lat_avg;
+	uint64_t	lat_p50;
+	uint64_t	lat_p99;
+	uint64_t	lat_p999;
+	uint64_t	lat_max;
+};
+
+struct cdlio_hedge;
+
+struct cdlio_hedge *cdlio_hedge_create(struct cdlio_dev **devs,
+				       unsigned int nr_devs, unsigned int qd,
+				       unsigned int desc,
+				       uint64_t soft_deadline);
+void cdlio_hedge_destroy(struct cdlio_hedge *h);
+int cdlio_hedge_read(struct cdlio_hedge *h, void *buf, size_t len,
+		     off_t ofst, void *user_data);
+int cdlio_hedge_reap(struct cdlio_hedge *h, struct cdlio_hedge_cqe *cqes,
+		     unsigned int nr, unsigned int min);
+void cdlio_hedge_get_stats(struct cdlio_hedge *h,
+			   struct cdlio_hedge_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* CDLIO_H */
@@ -0,0 +1,150 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include "cdlio.h"
+
+#include <stdlib.h>
+#include <errno.h>
+
+/*
+ * Admission control of I/Os without a limit (background I/Os such as scrub,
+ * rebuild or compaction). The number of background I/Os in flight is
+ * limited to a budget adjusted with the miss rate feed updates of the
+ * device: the budget is halved if the miss rate of a descriptor used by
+ * I/Os during the last feed interval exceeds the maximum miss rate, and
+ * increased by one when all miss rates are below half of the maximum.
+ */
+struct cdlio_admit {
+	struct cdlio_dev	*dev;
+	unsigned int		min_budget;
+	unsigned int		max_budget;
+	double			max_miss;
+
+	unsigned int		budget;
+	unsigned int		inflight;
+	uint64_t		last_update;
+};
+
+/*
+ * Create an admission controller for a device. The device must have been
+ * added to a miss rate feed. The budget is initially max_budget and is
+ * never lowered below min_budget (at least 1). max_miss is the maximum miss
+ * rate (0 to 1) tolerated for the descriptors.
+ */
+struct cdlio_admit *cdlio_admit_create(struct cdlio_dev *dev,
+				       unsigned int min_budget,
+				       unsigned int max_budget,
+				       double max_miss)
+{
+	struct cdlio_admit *a;
+	struct cdlio_miss m;
+	int ret;
+
+	if (!min_budget || min_budget > max_budget ||
+	    max_miss <= 0.0 || max_miss >= 1.0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	ret = cdlio_get_miss(dev, CDLIO_READ, 0, &m);
+	if (ret) {
+		errno = -ret;
+		return NULL;
+	}
+
+	a = calloc(1, sizeof(struct cdlio_admit));
+	if (!a) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	a->dev = dev;
+	a->min_budget = min_budget;
+	a->max_budget = max_budget;
+	a->max_miss = max_miss;
+	a->budget = max_budget;
+	a->last_update = m.updated;
+
+	return a;
+}
+
+void cdlio_admit_destroy(struct cdlio_admit *a)
+{
+	free(a);
+}
+
+/*
+ * Adjust the budget if the feed was updated since the last adjustment.
+ * Only one of the threads seeing the feed update does the adjustment.
+ */
+static void cdlio_admit_update(struct cdlio_admit *a)
+{
+	struct cdlio_miss m;
+	uint64_t last = __atomic_load_n(&a->last_update, __ATOMIC_ACQUIRE);
+	unsigned int budget, d;
+	double worst = 0.0;
+	int rw;
+
+	if (cdlio_get_miss(a->dev, CDLIO_READ, 0, &m) ||
+	    m.updated == last ||
+	    !__atomic_compare_exchange_n(&a->last_update, &last, m.updated,
+					 false, __ATOMIC_ACQ_REL,
+					 __ATOMIC_RELAXED))
+		return;
+
+	for (rw = CDLIO_READ; rw <= CDLIO_WRITE; rw++) {
+		for (d = 1; d <= CDLIO_MAX_DESC; d++) {
+			if (cdlio_get_miss(a->dev, rw, d, &m) || !m.nr_ios)
+				continue;
+			if (m.rate > worst)
+				worst = m.rate;
+		}
+	}
+
+	budget = __atomic_load_n(&a->budget, __ATOMIC_RELAXED);
+	if (worst > a->max_miss) {
+		budget /= 2;
+		if (budget < a->min_budget)
+			budget = a->min_budget;
+	} else if (worst < a->max_miss / 2 && budget < a->max_budget) {
+		budget++;
+	}
+	__atomic_store_n(&a->budget, budget, __ATOMIC_RELAXED);
+}
+
+/*
+ * Try to get an admission for an I/O without a limit. This never blocks.
+ * Return true if the I/O can be issued, in which case cdlio_admit_put()
+ * must be called when the I/O completes.
+ */
+bool cdlio_admit_get(struct cdlio_admit *a)
+{
+	unsigned int inflight;
+
+	cdlio_admit_update(a);
+
+	inflight = __atomic_load_n(&a->inflight, __ATOMIC_RELAXED);
+	do {
+		if (inflight >= __atomic_load_n(&a->budget, __ATOMIC_RELAXED))
+			return false;
+	} while (!__atomic_compare_exchange_n(&a->inflight, &inflight,
+					      inflight + 1, true,
+					      __ATOMIC_ACQUIRE,
+					      __ATOMIC_RELAXED));
+
+	return true;
+}
+
+void cdlio_admit_put(struct cdlio_admit *a)
+{
+	__atomic_fetch_sub(&a->inflight, 1, __ATOMIC_RELEASE);
+}
+
+unsigned int cdlio_admit_budget(struct cdlio_admit *a)
+{
+	return __atomic_load_n(&a->budget, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,445 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include "cdl.h"
+#include "cdlio.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+#define CDLIO_HEDGE_BUF_ALIGN	4096
+
+struct cdlio_hedge_req;
+
+/*
+ * Read of a request issued to a replica.
+ */
+struct cdlio_hedge_sub {
+	struct cdlio_hedge_req	*req;
+	unsigned int		attempt;
+	void			*buf;
+	size_t			bufsz;
+};
+
+struct cdlio_hedge_req {
+	void			*buf;
+	size_t			len;
+	off_t			ofst;
+	void			*user_data;
+	unsigned long long	start;
+	unsigned long long	deadline;
+	unsigned int		primary;
+	unsigned int		nr_issued;
+	unsigned int		nr_inflight;
+	bool			active;
+	bool			done;
+	struct cdlio_hedge_sub	*subs;
+	int			next_free;
+};
+
+struct cdlio_hedge {
+	unsigned int		nr_devs;
+	struct cdlio_ctx	**ctxs;
+	struct pollfd		*pfds;
+	unsigned int		desc;
+	uint64_t		soft_deadline;
+
+	unsigned int		qd;
+	unsigned int		nr_reqs;
+	struct cdlio_hedge_req	*reqs;
+	struct cdlio_hedge_sub	*subs;
+	int			free_req;
+	unsigned int		nr_active;
+	unsigned int		next_primary;
+	struct cdlio_cqe	*cqes;
+
+	struct cdlio_hedge_stats stats;
+	struct cdl_hist		lat;
+};
+
+/*
+ * Create a hedge context for reads to nr_devs (at least 2) replica devices,
+ * with up to qd requests in flight. The primary reads are issued using the
+ * descriptor desc, which must be valid for all replicas.
+ */
+struct cdlio_hedge *cdlio_hedge_create(struct cdlio_dev **devs,
+				       unsigned int nr_devs, unsigned int qd,
+				       unsigned int desc,
+				       uint64_t soft_deadline)
+{
+	struct cdlio_hedge *h;
+	struct cdlio_desc d;
+	unsigned int i;
+	int ret, efd;
+
+	if (nr_devs < 2 || !qd || !desc || desc > CDLIO_MAX_DESC) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	for (i = 0; i < nr_devs; i++) {
+		if (cdlio_get_desc(devs[i], CDLIO_READ, desc, &d) || !d.valid) {
+			errno = EINVAL;
+			return NULL;
+		}
+	}
+
+	h = calloc(1, sizeof(struct cdlio_hedge));
+	if (!h) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	h->nr_devs = nr_devs;
+	h->desc = desc;
+	h->soft_deadline = soft_deadline;
+	h->qd = qd;
+	h->nr_reqs = qd * nr_devs;
+	cdl_hist_init(&h->lat);
+
+	h->ctxs = calloc(nr_devs, sizeof(struct cdlio_ctx *));
+	h->pfds = calloc(nr_devs, sizeof(struct pollfd));
+	h->reqs = calloc(h->nr_reqs, sizeof(struct cdlio_hedge_req));
+	h->subs = calloc(h->nr_reqs * nr_devs,
+			 sizeof(struct cdlio_hedge_sub));
+	h->cqes = calloc(qd, sizeof(struct cdlio_cqe));
+	if (!h->ctxs || !h->pfds || !h->reqs || !h->subs || !h->cqes) {
+		ret = ENOMEM;
+		goto err;
+	}
+
+	for (i = 0; i < nr_devs; i++) {
+		h->ctxs[i] = cdlio_ctx_create(devs[i], h->nr_reqs);
+		if (!h->ctxs[i]) {
+			ret = errno;
+			goto err;
+		}
+		efd = cdlio_ctx_eventfd(h->ctxs[i]);
+		if (efd < 0) {
+			ret = -efd;
+			goto err;
+		}
+		h->pfds[i].fd = efd;
+		h->pfds[i].events = POLLIN;
+	}
+
+	for (i = 0; i < h->nr_reqs; i++) {
+		h->reqs[i].subs = &h->subs[i * nr_devs];
+		h->reqs[i].next_free =
+			i + 1 < h->nr_reqs ? (int)i + 1 : -1;
+	}
+	for (i = 0; i < h->nr_reqs * nr_devs; i++) {
+		h->subs[i].req = &h->reqs[i / nr_devs];
+		h->subs[i].attempt = i % nr_devs;
+	}
+	h->free_req = 0;
+
+	return h;
+
+err:
+	cdlio_hedge_destroy(h);
+	errno = ret;
+	return NULL;
+}
+
+/*
+ * Destroy a hedge context. All requests must have been reaped.
+ */
+void cdlio_hedge_destroy(struct cdlio_hedge *h)
+{
+	unsigned int i;
+
+	if (!h)
+		return;
+
+	if (h->ctxs) {
+		for (i = 0; i < h->nr_devs; i++)
+			cdlio_ctx_destroy(h->ctxs[i]);
+	}
+	if (h->subs) {
+		for (i = 0; i < h->nr_reqs * h->nr_devs; i++)
+			free(h->subs[i].buf);
+	}
+
+	free(h->ctxs);
+	free(h->pfds);
+	free(h->reqs);
+	free(h->subs);
+	free(h->cqes);
+	free(h);
+}
+
+/*
+ * Issue the next read of a request. The last replica is read without limit.
+ */
+static int cdlio_hedge_issue(struct cdlio_hedge *h,
+			     struct cdlio_hedge_req *req)
+{
+	struct cdlio_hedge_sub *sub = &req->subs[req->nr_issued];
+	unsigned int replica = (req->primary + req->nr_issued) % h->nr_devs;
+	unsigned int desc = h->desc;
+	void *buf = req->buf;
+	int ret;
+
+	if (req->nr_issued == h->nr_devs - 1)
+		desc = 0;
+
+	if (h->soft_deadline) {
+		if (sub->bufsz < req->len) {
+			free(sub->buf);
+			sub->bufsz = 0;
+			if (posix_memalign(&sub->buf, CDLIO_HEDGE_BUF_ALIGN,
+					   req->len)) {
+				sub->buf = NULL;
+				return -ENOMEM;
+			}
+			sub->bufsz = req->len;
+		}
+		buf = sub->buf;
+	}
+
+	ret = cdlio_queue(h->ctxs[replica], CDLIO_READ, buf, req->len,
+			  req->ofst, desc, sub);
+	if (ret)
+		return ret;
+
+	if (req->nr_issued)
+		h->stats.nr_hedges++;
+	req->nr_issued++;
+	req->nr_inflight++;
+	if (h->soft_deadline)
+		req->deadline = cdl_now_ns() + h->soft_deadline;
+
+	return 0;
+}
+
+/*
+ * Queue a hedged read. The read is issued with the next call to
+ * cdlio_hedge_reap(). Return -EBUSY if qd requests are in flight, or if too
+ * many replica reads of already completed requests are still in flight.
+ */
+int cdlio_hedge_read(struct cdlio_hedge *h, void *buf, size_t len,
+		     off_t ofst, void *user_data)
+{
+	struct cdlio_hedge_req *req;
+	int r, ret;
+
+	r = h->free_req;
+	if (r < 0 || h->nr_active >= h->qd)
+		return -EBUSY;
+
+	req = &h->reqs[r];
+	req->buf = buf;
+	req->len = len;
+	req->ofst = ofst;
+	req->user_data = user_data;
+	req->start = cdl_now_ns();
+	req->deadline = 0;
+	req->primary = h->next_primary;
+	req->nr_issued = 0;
+	req->nr_inflight = 0;
+	req->done = false;
+
+	ret = cdlio_hedge_issue(h, req);
+	if (ret)
+		return ret;
+
+	h->free_req = req->next_free;
+	req->active = true;
+	h->nr_active++;
+	h->next_primary = (h->next_primary + 1) % h->nr_devs;
+	h->stats.nr_reads++;
+
+	return 0;
+}
+
+static void cdlio_hedge_free_req(struct cdlio_hedge *h,
+				 struct cdlio_hedge_req *req)
+{
+	req->active = false;
+	req->next_free = h->free_req;
+	h->free_req = req - h->reqs;
+}
+
+/*
+ * Complete a request, filling its completion entry.
+ */
+static void cdlio_hedge_done(struct cdlio_hedge *h,
+			     struct cdlio_hedge_req *req,
+			     struct cdlio_hedge_sub *sub,
+			     struct cdlio_cqe *c,
+			     struct cdlio_hedge_cqe *hcqe)
+{
+	req->done = true;
+	h->nr_active--;
+
+	hcqe->cqe = *c;
+	hcqe->cqe.user_data = req->user_data;
+	hcqe->cqe.lat = cdl_now_ns() - req->start;
+	hcqe->replica = (req->primary + sub->attempt) % h->nr_devs;
+	hcqe->hedged = req->nr_issued > 1;
+
+	if (c->status == CDLIO_OK) {
+		if (sub->buf && c->res > 0)
+			memcpy(req->buf, sub->buf, c->res);
+		if (sub->attempt)
+			h->stats.nr_hedge_wins++;
+		else
+			h->stats.nr_primary_wins++;
+		cdl_hist_add(&h->lat, hcqe->cqe.lat);
+	} else {
+		h->stats.nr_errors++;
+	}
+
+	if (!req->nr_inflight)
+		cdlio_hedge_free_req(h, req);
+}
+
+/*
+ * Process a replica read completion. Return true if the request completed.
+ */
+static bool cdlio_hedge_complete(struct cdlio_hedge *h, struct cdlio_cqe *c,
+				 struct cdlio_hedge_cqe *hcqe)
+{
+	struct cdlio_hedge_sub *sub = c->user_data;
+	struct cdlio_hedge_req *req = sub->req;
+
+	req->nr_inflight--;
+
+	/* Read of an already completed request */
+	if (req->done) {
+		if (!req->nr_inflight)
+			cdlio_hedge_free_req(h, req);
+		return false;
+	}
+
+	if (c->status == CDLIO_OK) {
+		cdlio_hedge_done(h, req, sub, c, hcqe);
+		return true;
+	}
+
+	/* Wait for the other replica reads in flight */
+	if (req->nr_inflight)
+		return false;
+
+	if (req->nr_issued < h->nr_devs && !cdlio_hedge_issue(h, req)) {
+		if (c->status == CDLIO_LIMIT)
+			h->stats.nr_limit_hedges++;
+		return false;
+	}
+
+	cdlio_hedge_done(h, req, sub, c, hcqe);
+
+	return true;
+}
+
+/*
+ * Issue the next replica read of requests past their soft deadline and
+ * return the time until the earliest soft deadline (0 if none).
+ */
+static unsigned long long cdlio_hedge_check_deadlines(struct cdlio_hedge *h)
+{
+	unsigned long long now, next = 0;
+	struct cdlio_hedge_req *req;
+	unsigned int i;
+
+	if (!h->soft_deadline)
+		return 0;
+
+	now = cdl_now_ns();
+	for (i = 0; i < h->nr_reqs; i++) {
+		req = &h->reqs[i];
+		if (!req->active || req->done || req->nr_issued >= h->nr_devs)
+			continue;
+		if (now >= req->deadline) {
+			if (cdlio_hedge_issue(h, req))
+				continue;
+			h->stats.nr_deadline_hedges++;
+			if (req->nr_issued >= h->nr_devs)
+				continue;
+		}
+		if (!next || req->deadline - now < next)
+			next = req->deadline > now ? req->deadline - now : 1;
+	}
+
+	return next;
+}
+
+/*
+ * Issue queued reads and get up to nr request completions, waiting for at
+ * least min completions. Return the number of completions.
+ */
+int cdlio_hedge_reap(struct cdlio_hedge *h, struct cdlio_hedge_cqe *cqes,
+		     unsigned int nr, unsigned int min)
+{
+	unsigned long long wait;
+	struct timespec ts;
+	unsigned int i, n = 0;
+	uint64_t cnt;
+	int j, ret;
+
+	if (min > h->nr_active)
+		min = h->nr_active;
+	if (min > nr)
+		min = nr;
+
+	while (1) {
+		for (i = 0; i < h->nr_devs; i++) {
+			if (read(h->pfds[i].fd, &cnt, sizeof(cnt)) < 0 &&
+			    errno != EAGAIN)
+				return n ? (int)n : -errno;
+		}
+
+		for (i = 0; i < h->nr_devs && n < nr; i++) {
+			ret = cdlio_reap(h->ctxs[i], h->cqes,
+					 nr - n < h->qd ? nr - n : h->qd, 0);
+			if (ret < 0)
+				return n ? (int)n : ret;
+			for (j = 0; j < ret; j++) {
+				if (cdlio_hedge_complete(h, &h->cqes[j],
+							 &cqes[n]))
+					n++;
+			}
+		}
+
+		wait = cdlio_hedge_check_deadlines(h);
+
+		for (i = 0; i < h->nr_devs; i++) {
+			ret = cdlio_submit(h->ctxs[i]);
+			if (ret < 0)
+				return n ? (int)n : ret;
+		}
+
+		/* Requests failed on submission reduce what we can wait for */
+		if (n + h->nr_active < min)
+			min = n + h->nr_active;
+		if (n >= min)
+			return n;
+
+		ts.tv_sec = wait / 1000000000ULL;
+		ts.tv_nsec = wait % 1000000000ULL;
+		ret = ppoll(h->pfds, h->nr_devs, wait ? &ts : NULL, NULL);
+		if (ret < 0 && errno != EINTR)
+			return n ? (int)n : -errno;
+	}
+}
+
+void cdlio_hedge_get_stats(struct cdlio_hedge *h,
+			   struct cdlio_hedge_stats *stats)
+{
+	*stats = h->stats;
+	stats->lat_avg = cdl_hist_avg(&h->lat);
+	stats->lat_p50 = cdl_hist_percentile(&h->lat, 50);
+	stats->lat_p99 = cdl_hist_percentile(&h->lat, 99);
+	stats->lat_p999 = cdl_hist_percentile(&h->lat, 99.9);
+	stats->lat_max = h->lat.max;
+}
@@ -0,0 +1,496 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include "cdl.h"
+#include "cdlio.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+
+struct cdlm {
+	char			*path;
+	struct cdlio_dev	*dev;
+	size_t			bs;
+	unsigned int		qd;
+	unsigned int		dld;
+	size_t			bg_bs;
+	unsigned int		bg_qd;
+	unsigned int		runtime;
+	unsigned long long	elapsed;
+	unsigned int		interval;
+	unsigned int		admit_pct;
+	uint64_t		seed;
+	uint64_t		nr_blocks;
+	uint64_t		nr_bg_blocks;
+
+	struct cdlio_feed	*feed;
+	struct cdlio_admit	*admit;
+	struct cdlio_ctx	*fg;
+	struct cdlio_ctx	*bg;
+	struct pollfd		pfds[2];
+	char			*fg_bufs;
+	char			*bg_bufs;
+
+	/* Background stream state */
+	uint64_t		bg_next;
+	unsigned int		*bg_free;
+	unsigned int		nr_bg_free;
+	uint64_t		bg_bytes;
+	uint64_t		budget_sum;
+	uint64_t		budget_samples;
+	unsigned int		budget_min;
+};
+
+static volatile sig_atomic_t cdlm_stop;
+
+static void cdlm_sigint(int sig)
+{
+	cdlm_stop = 1;
+}
+
+/*
+ * Print usage.
+ */
+static void cdlm_usage(void)
+{
+	printf("Usage:\n"
+	       "  cdlmix --help | -h\n"
+	       "  cdlmix --version\n"
+	       "  cdlmix [options] <device>\n");
+	printf("Options:\n"
+	       "  --bs <bytes>         : Foreground read size (default: 131072)\n"
+	       "  --qd <n>             : Foreground queue depth (default: 4)\n"
+	       "  --dld <index>        : Duration limit descriptor index (1 to 7)\n"
+	       "                         of foreground reads (default: 1)\n"
+	       "  --bg-bs <bytes>      : Background read size (default: 1048576)\n"
+	       "  --bg-qd <n>          : Maximum background queue depth\n"
+	       "                         (default: 32)\n"
+	       "  --admit <pct>        : Enable admission control of background\n"
+	       "                         reads with a maximum descriptor miss\n"
+	       "                         rate of <pct> %% (default: disabled)\n"
+	       "  --interval <msec>    : Miss rate update interval\n"
+	       "                         (default: 100)\n"
+	       "  --runtime <sec>      : Run time in seconds (default: 60)\n"
+	       "  --seed <n>           : Random generator seed (default: 1)\n");
+	printf("See \"man cdlmix\" for more information.\n");
+}
+
+/*
+ * xorshift64* random number generator.
+ */
+static uint64_t cdlm_rand(struct cdlm *m)
+{
+	m->seed ^= m->seed >> 12;
+	m->seed ^= m->seed << 25;
+	m->seed ^= m->seed >> 27;
+
+	return m->seed * 0x2545F4914F6CDD1DULL;
+}
+
+static int cdlm_queue_fg(struct cdlm *m, unsigned int i)
+{
+	off_t ofst = (cdlm_rand(m) % m->nr_blocks) * m->bs;
+
+	return cdlio_queue(m->fg, CDLIO_READ, m->fg_bufs + (size_t)i * m->bs,
+			   m->bs, ofst, m->dld, (void *)(uintptr_t)i);
+}
+
+/*
+ * Issue background sequential reads, as allowed by the admission control.
+ */
+static int cdlm_queue_bg(struct cdlm *m)
+{
+	unsigned int i;
+	off_t ofst;
+	int ret;
+
+	while (m->nr_bg_free) {
+		if (m->admit && !cdlio_admit_get(m->admit))
+			break;
+
+		i = m->bg_free[--m->nr_bg_free];
+		ofst = m->bg_next * m->bg_bs;
+		m->bg_next = (m->bg_next + 1) % m->nr_bg_blocks;
+
+		ret = cdlio_queue(m->bg, CDLIO_READ,
+				  m->bg_bufs + (size_t)i * m->bg_bs,
+				  m->bg_bs, ofst, 0, (void *)(uintptr_t)i);
+		if (ret) {
+			if (m->admit)
+				cdlio_admit_put(m->admit);
+			m->bg_free[m->nr_bg_free++] = i;
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+static void cdlm_sample_budget(struct cdlm *m)
+{
+	unsigned int budget;
+
+	budget = m->admit ? cdlio_admit_budget(m->admit) : m->bg_qd;
+	m->budget_sum += budget;
+	m->budget_samples++;
+	if (budget < m->budget_min)
+		m->budget_min = budget;
+}
+
+static int cdlm_run(struct cdlm *m)
+{
+	unsigned long long start, end;
+	unsigned int i, fg_inflight = 0;
+	struct cdlio_cqe cqes[32];
+	uint64_t cnt;
+	bool stopping = false;
+	int j, n, ret;
+
+	start = cdl_now_ns();
+	end = start + (unsigned long long)m->runtime * 1000000000ULL;
+
+	for (i = 0; i < m->qd; i++) {
+		ret = cdlm_queue_fg(m, i);
+		if (ret)
+			return ret;
+		fg_inflight++;
+	}
+
+	while (1) {
+		if (!stopping && (cdlm_stop || cdl_now_ns() >= end)) {
+			stopping = true;
+			m->elapsed = cdl_now_ns() - start;
+		}
+
+		if (!stopping) {
+			ret = cdlm_queue_bg(m);
+			if (ret)
+				return ret;
+		}
+
+		ret = cdlio_submit(m->fg);
+		if (ret < 0)
+			return ret;
+		ret = cdlio_submit(m->bg);
+		if (ret < 0)
+			return ret;
+
+		if (stopping && !fg_inflight &&
+		    m->nr_bg_free == m->bg_qd)
+			break;
+
+		for (i = 0; i < 2; i++) {
+			if (read(m->pfds[i].fd, &cnt, sizeof(cnt)) < 0 &&
+			    errno != EAGAIN)
+				return -errno;
+		}
+
+		n = cdlio_reap(m->fg, cqes, 32, 0);
+		if (n < 0)
+			return n;
+		for (j = 0; j < n; j++) {
+			fg_inflight--;
+			if (stopping)
+				continue;
+			ret = cdlm_queue_fg(m,
+				(uintptr_t)cqes[j].user_data);
+			if (ret)
+				return ret;
+			fg_inflight++;
+		}
+
+		ret = cdlio_reap(m->bg, cqes, 32, 0);
+		if (ret < 0)
+			return ret;
+		for (j = 0; j < ret; j++) {
+			if (cqes[j].res > 0 && !stopping)
+				m->bg_bytes += cqes[j].res;
+			m->bg_free[m->nr_bg_free++] =
+				(uintptr_t)cqes[j].user_data;
+			if (m->admit)
+				cdlio_admit_put(m->admit);
+			cdlm_sample_budget(m);
+		}
+
+		if (!n && !ret &&
+		    poll(m->pfds, 2, m->interval) < 0 && errno != EINTR)
+			return -errno;
+	}
+
+	return 0;
+}
+
+static void cdlm_report(struct cdlm *m)
+{
+	struct cdlio_desc_stats *ds;
+	struct cdlio_stats st;
+	double secs = (double)m->elapsed / 1000000000.0;
+
+	cdlio_get_stats(m->dev, &st);
+	ds = &st.desc[CDLIO_READ][m->dld];
+
+	printf("  %10s %10s %8s %7s %10s %10s %10s %10s %10s"
+	       " %10s %10s %10s\n",
+	       "fg reads", "iops", "limit", "errors", "avg (ms)", "p50 (ms)",
+	       "p99 (ms)", "p99.9 (ms)", "max (ms)",
+	       "bg MB/s", "avg budget", "min budget");
+	printf("  %10llu %10.1f %8llu %7llu %10.3f %10.3f %10.3f %10.3f %10.3f"
+	       " %10.1f %10.1f %10u\n",
+	       (unsigned long long)ds->nr_ios,
+	       secs > 0 ? (double)ds->nr_ios / secs : 0.0,
+	       (unsigned long long)ds->nr_limit,
+	       (unsigned long long)ds->nr_errors,
+	       (double)ds->lat_avg / 1000000.0,
+	       (double)ds->lat_p50 / 1000000.0,
+	       (double)ds->lat_p99 / 1000000.0,
+	       (double)ds->lat_p999 / 1000000.0,
+	       (double)ds->lat_max / 1000000.0,
+	       secs > 0 ? (double)m->bg_bytes / secs / 1000000.0 : 0.0,
+	       m->budget_samples ?
+	       (double)m->budget_sum / (double)m->budget_samples : 0.0,
+	       m->budget_samples ? m->budget_min : m->bg_qd);
+}
+
+static int cdlm_init(struct cdlm *m)
+{
+	struct cdlio_desc d;
+	unsigned int i;
+	off_t size;
+	int efd;
+
+	m->dev = cdlio_open(m->path, O_DIRECT);
+	if (!m->dev) {
+		fprintf(stderr, "Open %s failed (%s)\n",
+			m->path, strerror(errno));
+		return -1;
+	}
+
+	if (cdlio_get_desc(m->dev, CDLIO_READ, m->dld, &d) || !d.valid) {
+		fprintf(stderr, "Read descriptor %u is empty\n", m->dld);
+		return -1;
+	}
+
+	size = lseek(cdlio_fd(m->dev), 0, SEEK_END);
+	if (size < 0) {
+		fprintf(stderr, "Get %s capacity failed\n", m->path);
+		return -1;
+	}
+	m->nr_blocks = size / m->bs;
+	m->nr_bg_blocks = size / m->bg_bs;
+	if (!m->nr_blocks || !m->nr_bg_blocks) {
+		fprintf(stderr, "Invalid read size\n");
+		return -1;
+	}
+
+	if (posix_memalign((void **)&m->fg_bufs, 4096, m->bs * m->qd) ||
+	    posix_memalign((void **)&m->bg_bufs, 4096, m->bg_bs * m->bg_qd)) {
+		fprintf(stderr, "Failed to allocate buffers\n");
+		return -1;
+	}
+
+	m->bg_free = calloc(m->bg_qd, sizeof(unsigned int));
+	if (!m->bg_free) {
+		fprintf(stderr, "Failed to allocate buffers\n");
+		return -1;
+	}
+	for (i = 0; i < m->bg_qd; i++)
+		m->bg_free[m->nr_bg_free++] = i;
+	m->budget_min = m->bg_qd;
+
+	if (m->admit_pct) {
+		m->feed = cdlio_feed_start(m->interval);
+		if (!m->feed || cdlio_feed_add(m->feed, m->dev)) {
+			fprintf(stderr, "Start miss rate feed failed\n");
+			return -1;
+		}
+
+		m->admit = cdlio_admit_create(m->dev, 1, m->bg_qd,
+					      (double)m->admit_pct / 100.0);
+		if (!m->admit) {
+			fprintf(stderr, "Create admission control failed (%s)\n",
+				strerror(errno));
+			return -1;
+		}
+	}
+
+	m->fg = cdlio_ctx_create(m->dev, m->qd);
+	m->bg = cdlio_ctx_create(m->dev, m->bg_qd);
+	if (!m->fg || !m->bg) {
+		fprintf(stderr, "Create context failed (%s)\n",
+			strerror(errno));
+		return -1;
+	}
+
+	efd = cdlio_ctx_eventfd(m->fg);
+	m->pfds[0].fd = efd;
+	m->pfds[0].events = POLLIN;
+	efd = efd < 0 ? efd : cdlio_ctx_eventfd(m->bg);
+	m->pfds[1].fd = efd;
+	m->pfds[1].events = POLLIN;
+	if (efd < 0) {
+		fprintf(stderr, "Create eventfd failed (%s)\n",
+			strerror(-efd));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void cdlm_cleanup(struct cdlm *m)
+{
+	cdlio_ctx_destroy(m->fg);
+	cdlio_ctx_destroy(m->bg);
+	cdlio_admit_destroy(m->admit);
+	cdlio_feed_stop(m->feed);
+	cdlio_close(m->dev);
+	free(m->bg_free);
+	free(m->fg_bufs);
+	free(m->bg_bufs);
+}
+
+static int cdlm_parse_ulong(char *str, unsigned long long *val)
+{
+	char *end;
+
+	errno = 0;
+	*val = strtoull(str, &end, 0);
+	if (errno || end == str || *end)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Main function.
+ */
+int main(int argc, char **argv)
+{
+	unsigned long long val;
+	struct cdlm m;
+	int i, ret;
+
+	if (argc == 1) {
+		cdlm_usage();
+		return 0;
+	}
+
+	/* Generic options */
+	if (strcmp(argv[1], "--version") == 0) {
+		printf("cdlmix, version %s\n", PACKAGE_VERSION);
+		printf("Copyright (C) 2021, Western Digital Corporation"
+		       " or its affiliates.\n");
+		return 0;
+	}
+
+	if (strcmp(argv[1], "--help") == 0 ||
+	    strcmp(argv[1], "-h") == 0) {
+		cdlm_usage();
+		return 0;
+	}
+
+	memset(&m, 0, sizeof(m));
+	m.bs = 128 * 1024;
+	m.qd = 4;
+	m.dld = 1;
+	m.bg_bs = 1024 * 1024;
+	m.bg_qd = 32;
+	m.runtime = 60;
+	m.interval = 100;
+	m.seed = 1;
+
+	/* Parse options: all options have a value */
+	for (i = 1; i < argc - 1; i += 2) {
+		if (argv[i][0] != '-')
+			break;
+
+		if (cdlm_parse_ulong(argv[i + 1], &val)) {
+			fprintf(stderr, "Invalid value '%s' for %s\n",
+				argv[i + 1], argv[i]);
+			return 1;
+		}
+
+		if (strcmp(argv[i], "--bs") == 0) {
+			if (!val || val % 512)
+				goto err_cmd_line;
+			m.bs = val;
+		} else if (strcmp(argv[i], "--qd") == 0) {
+			if (!val || val > CDL_SGIO_MAX_QD)
+				goto err_cmd_line;
+			m.qd = val;
+		} else if (strcmp(argv[i], "--dld") == 0) {
+			if (!val || val > CDL_MAX_DESC)
+				goto err_cmd_line;
+			m.dld = val;
+		} else if (strcmp(argv[i], "--bg-bs") == 0) {
+			if (!val || val % 512)
+				goto err_cmd_line;
+			m.bg_bs = val;
+		} else if (strcmp(argv[i], "--bg-qd") == 0) {
+			if (!val || val > CDL_SGIO_MAX_QD)
+				goto err_cmd_line;
+			m.bg_qd = val;
+		} else if (strcmp(argv[i], "--admit") == 0) {
+			if (!val || val >= 100)
+				goto err_cmd_line;
+			m.admit_pct = val;
+		} else if (strcmp(argv[i], "--interval") == 0) {
+			if (!val)
+				goto err_cmd_line;
+			m.interval = val;
+		} else if (strcmp(argv[i], "--runtime") == 0) {
+			if (!val)
+				goto err_cmd_line;
+			m.runtime = val;
+		} else if (strcmp(argv[i], "--seed") == 0) {
+			m.seed = val ? val : 1;
+		} else {
+			fprintf(stderr, "Invalid option '%s'\n", argv[i]);
+			return 1;
+		}
+	}
+
+	if (i != argc - 1) {
+err_cmd_line:
+		fprintf(stderr, "Invalid command line\n");
+		return 1;
+	}
+	m.path = argv[i];
+
+	ret = cdlm_init(&m);
+	if (ret)
+		goto out;
+
+	printf("Device: %s\n", m.path);
+	printf("    Foreground: randread, %zu B, QD %u, descriptor %u\n",
+	       m.bs, m.qd, m.dld);
+	printf("    Background: read, %zu B, QD %u\n", m.bg_bs, m.bg_qd);
+	if (m.admit)
+		printf("    Admission control: maximum miss rate %u %%\n",
+		       m.admit_pct);
+	else
+		printf("    Admission control: disabled\n");
+
+	signal(SIGINT, cdlm_sigint);
+	signal(SIGTERM, cdlm_sigint);
+
+	ret = cdlm_run(&m);
+	if (ret) {
+		fprintf(stderr, "Run failed (%s)\n", strerror(-ret));
+		goto out;
+	}
+
+	cdlm_report(&m);
+
+out:
+	cdlm_cleanup(&m);
+
+	return ret ? 1 : 0;
+}
@@ -0,0 +1,336 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+#include "cdlpreload.h"
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/*
+ * Print usage.
+ */
+static void cdlp_usage(void)
+{
+	printf("Usage:\n"
+	       "  cdlpreload --help | -h\n"
+	       "  cdlpreload --version\n"
+	       "  cdlpreload --stats <pid>\n"
+	       "  cdlpreload [options] <command> [arguments...]\n");
+	printf("Options:\n"
+	       "  --rules <file>       : Rules file\n"
+	       "  --lib <path>         : Path of the libcdlpreload library\n"
+	       "                         (default: %s)\n",
+	       CDLP_LIB_PATH);
+	printf("Rules file lines:\n"
+	       "  <path|fd|thread> <value> <device> <descriptor>\n");
+	printf("See \"man cdlpreload\" for more information.\n");
+}
+
+static void cdlp_show_stats(struct cdlp_stats *st, int d)
+{
+	struct cdl_hist *h = &st->lat;
+
+	if (d)
+		printf("  Descriptor %d:\n", d);
+	else
+		printf("  No limit:\n");
+
+	printf("    I/Os (sync, aio, io_uring): %" PRIu64 ", %" PRIu64
+	       ", %" PRIu64 "\n",
+	       st->nr_ios[CDLP_CALL_SYNC], st->nr_ios[CDLP_CALL_AIO],
+	       st->nr_ios[CDLP_CALL_URING]);
+	printf("    I/Os failed (ETIME)       : %" PRIu64 "\n", st->nr_limit);
+	printf("    I/Os failed (other)       : %" PRIu64 "\n", st->nr_errors);
+	if (!h->count)
+		return;
+
+	printf("    Latency (ms)              : min %.3f, avg %.3f, max %.3f\n",
+	       (double)h->min / 1000000.0,
+	       (double)cdl_hist_avg(h) / 1000000.0,
+	       (double)h->max / 1000000.0);
+	printf("    Latency percentiles (ms)  : p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f\n",
+	       (double)cdl_hist_percentile(h, 50) / 1000000.0,
+	       (double)cdl_hist_percentile(h, 90) / 1000000.0,
+	       (double)cdl_hist_percentile(h, 99) / 1000000.0,
+	       (double)cdl_hist_percentile(h, 99.9) / 1000000.0);
+}
+
+/*
+ * Show the statistics of a shared memory object.
+ */
+static void cdlp_show(struct cdlp_shm *shm)
+{
+	struct cdlp_stats *st;
+	int rw, d, n;
+
+	printf("%.1f s, %u rules applied\n",
+	       (double)(cdl_now_ns() - shm->start) / 1000000000.0,
+	       shm->nr_rules);
+
+	for (rw = CDL_READ; rw <= CDL_WRITE; rw++) {
+		for (d = 0, n = 0; d <= CDL_MAX_DESC; d++) {
+			st = &shm->stats[rw][d];
+			if (!st->nr_ios[CDLP_CALL_SYNC] &&
+			    !st->nr_ios[CDLP_CALL_AIO] &&
+			    !st->nr_ios[CDLP_CALL_URING])
+				continue;
+
+			if (!n)
+				printf("%s I/Os\n",
+				       rw == CDL_READ ? "Read" : "Write");
+			n++;
+
+			cdlp_show_stats(st, d);
+		}
+	}
+}
+
+static struct cdlp_shm *cdlp_map(const char *name, bool create)
+{
+	struct cdlp_shm *shm;
+	int fd;
+
+	if (create)
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	else
+		fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		fprintf(stderr, "Open shared memory %s failed (%s)\n",
+			name, strerror(errno));
+		return NULL;
+	}
+
+	if (create && ftruncate(fd, sizeof(struct cdlp_shm)) < 0) {
+		fprintf(stderr, "Resize shared memory %s failed (%s)\n",
+			name, strerror(errno));
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+
+	shm = mmap(NULL, sizeof(struct cdlp_shm),
+		   create ? PROT_READ | PROT_WRITE : PROT_READ,
+		   MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		fprintf(stderr, "Map shared memory %s failed (%s)\n",
+			name, strerror(errno));
+		if (create)
+			shm_unlink(name);
+		return NULL;
+	}
+
+	return shm;
+}
+
+static int cdlp_stats(char *pid)
+{
+	struct cdlp_shm *shm;
+	char name[64];
+	char *end;
+	long val;
+
+	errno = 0;
+	val = strtol(pid, &end, 10);
+	if (errno || end == pid || *end || val <= 0) {
+		fprintf(stderr, "Invalid PID %s\n", pid);
+		return 1;
+	}
+
+	snprintf(name, sizeof(name), CDLP_SHM_NAME, (int)val);
+	shm = cdlp_map(name, false);
+	if (!shm)
+		return 1;
+
+	if (shm->magic != CDLP_SHM_MAGIC || shm->version != CDLP_SHM_VERSION) {
+		fprintf(stderr, "Invalid statistics shared memory %s\n", name);
+		munmap(shm, sizeof(struct cdlp_shm));
+		return 1;
+	}
+
+	printf("Process %d: ", shm->pid);
+	cdlp_show(shm);
+	munmap(shm, sizeof(struct cdlp_shm));
+
+	return 0;
+}
+
+static int cdlp_setenv(const char *lib, const char *rules, const char *shm)
+{
+	const char *preload = getenv("LD_PRELOAD");
+	char *val;
+	int ret;
+
+	if (preload && *preload)
+		ret = asprintf(&val, "%s:%s", lib, preload);
+	else
+		ret = asprintf(&val, "%s", lib);
+	if (ret < 0)
+		return -ENOMEM;
+
+	ret = setenv("LD_PRELOAD", val, 1);
+	free(val);
+	if (ret ||
+	    setenv(CDLP_ENV_RULES, rules, 1) ||
+	    setenv(CDLP_ENV_SHM, shm, 1))
+		return -errno;
+
+	return 0;
+}
+
+/*
+ * Execute a command with the libcdlpreload library and show the statistics
+ * of all its processes when it exits.
+ */
+static int cdlp_run(char *lib, char *rules, char **argv)
+{
+	struct cdlp_shm *shm;
+	char name[64], *rpath;
+	int rw, d, status;
+	pid_t pid;
+	int ret = 1;
+
+	if (access(lib, R_OK)) {
+		fprintf(stderr, "Library %s not found\n", lib);
+		return 1;
+	}
+
+	rpath = realpath(rules, NULL);
+	if (!rpath) {
+		fprintf(stderr, "Invalid rules file %s (%s)\n",
+			rules, strerror(errno));
+		return 1;
+	}
+
+	snprintf(name, sizeof(name), CDLP_SHM_NAME, getpid());
+	shm = cdlp_map(name, true);
+	if (!shm)
+		goto out;
+
+	shm->magic = CDLP_SHM_MAGIC;
+	shm->version = CDLP_SHM_VERSION;
+	shm->pid = getpid();
+	shm->start = cdl_now_ns();
+	for (rw = CDL_READ; rw <= CDL_WRITE; rw++)
+		for (d = 0; d <= CDL_MAX_DESC; d++)
+			cdl_hist_init(&shm->stats[rw][d].lat);
+
+	/* The command receives the terminal signals */
+	signal(SIGINT, SIG_IGN);
+	signal(SIGQUIT, SIG_IGN);
+
+	pid = fork();
+	if (pid < 0) {
+		fprintf(stderr, "fork failed (%s)\n", strerror(errno));
+		goto unmap;
+	}
+
+	if (!pid) {
+		signal(SIGINT, SIG_DFL);
+		signal(SIGQUIT, SIG_DFL);
+		if (cdlp_setenv(lib, rpath, name)) {
+			fprintf(stderr, "Set environment failed\n");
+			_exit(127);
+		}
+		execvp(argv[0], argv);
+		fprintf(stderr, "Execute %s failed (%s)\n",
+			argv[0], strerror(errno));
+		_exit(127);
+	}
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			fprintf(stderr, "waitpid failed (%s)\n",
+				strerror(errno));
+			goto unmap;
+		}
+	}
+
+	printf("%s: ", argv[0]);
+	cdlp_show(shm);
+
+	if (WIFEXITED(status))
+		ret = WEXITSTATUS(status);
+	else
+		ret = 128 + WTERMSIG(status);
+
+unmap:
+	munmap(shm, sizeof(struct cdlp_shm));
+	shm_unlink(name);
+out:
+	free(rpath);
+
+	return ret;
+}
+
+/*
+ * Main function.
+ */
+int main(int argc, char **argv)
+{
+	char *lib = CDLP_LIB_PATH;
+	char *rules = NULL;
+	int i;
+
+	if (argc == 1) {
+		cdlp_usage();
+		return 0;
+	}
+
+	/* Generic options */
+	if (strcmp(argv[1], "--version") == 0) {
+		printf("cdlpreload, version %s\n", PACKAGE_VERSION);
+		printf("Copyright (C) 2021, Western Digital Corporation"
+		       " or its affiliates.\n");
+		return 0;
+	}
+
+	if (strcmp(argv[1], "--help") == 0 ||
+	    strcmp(argv[1], "-h") == 0) {
+		cdlp_usage();
+		return 0;
+	}
+
+	if (strcmp(argv[1], "--stats") == 0) {
+		if (argc != 3)
+			goto err_cmd_line;
+		return cdlp_stats(argv[2]);
+	}
+
+	/* Parse options */
+	for (i = 1; i < argc; i++) {
+		if (argv[i][0] != '-')
+			break;
+
+		if (i + 1 >= argc)
+			goto err_cmd_line;
+
+		if (strcmp(argv[i], "--rules") == 0) {
+			rules = argv[i + 1];
+		} else if (strcmp(argv[i], "--lib") == 0) {
+			lib = argv[i + 1];
+		} else {
+			fprintf(stderr, "Invalid option '%s'\n", argv[i]);
+			return 1;
+		}
+		i++;
+	}
+
+	if (i >= argc || !rules) {
+err_cmd_line:
+		fprintf(stderr, "Invalid command line\n");
+		return 1;
+	}
+
+	return cdlp_run(lib, rules, &argv[i]);
+}
@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+#ifndef CDLPRELOAD_H
+#define CDLPRELOAD_H
+
+#include "cdl.h"
+
+/*
+ * Environment variables used to configure the libcdlpreload library.
+ */
+#define CDLP_ENV_RULES		"CDL_PRELOAD_RULES"
+#define CDLP_ENV_SHM		"CDL_PRELOAD_SHM"
+
+/*
+ * Statistics shared memory object name. Without the CDL_PRELOAD_SHM
+ * variable, each process creates its own object named with its PID and
+ * removes it when exiting.
+ */
+#define CDLP_SHM_NAME		"/cdlpreload.%d"
+#define CDLP_SHM_MAGIC		0x43444c50
+#define CDLP_SHM_VERSION	1
+
+/*
+ * Intercepted calls: synchronous calls (pread, pwrite and their vectored
+ * variants), libaio submissions and io_uring submissions.
+ */
+enum cdlp_call {
+	CDLP_CALL_SYNC,
+	CDLP_CALL_AIO,
+	CDLP_CALL_URING,
+
+	CDLP_NR_CALLS,
+};
+
+/*
+ * Per direction and per descriptor statistics. Latencies are only measured
+ * for synchronous calls. Asynchronous I/Os are counted when submitted.
+ */
+struct cdlp_stats {
+	uint64_t		nr_ios[CDLP_NR_CALLS];
+	uint64_t		nr_limit;
+	uint64_t		nr_errors;
+	struct cdl_hist		lat;
+};
+
+struct cdlp_shm {
+	uint32_t		magic;
+	uint32_t		version;
+	int32_t			pid;
+	uint32_t		nr_rules;
+	uint64_t		start;
+	struct cdlp_stats	stats[2][CDL_MAX_DESC + 1];
+};
+
+#endif /* CDLPRELOAD_H */
@@ -0,0 +1,1196 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (c) 2021 Western Digital Corporation or its affiliates.
+ *
+ * Authors: Damien Le Moal (damien.lemoal@wdc.com)
+ */
+
+/*
+ * LD_PRELOAD library setting the I/O priority hint of the I/Os of unmodified
+ * applications, according to rules matching the file path, file descriptor
+ * or thread issuing the I/Os. Synchronous calls (pread, pwrite and their
+ * vectored variants) are executed with the thread I/O priority set to the
+ * hint of the rule descriptor. The I/O priority of libaio and io_uring
+ * submissions (using liburing or raw system calls) is set in the iocbs and
+ * SQEs, unless already set by the application.
+ */
+#include "cdlpreload.h"
+
+#include <dlfcn.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/aio_abi.h>
+#include <linux/io_uring.h>
+
+#ifndef IORING_SETUP_NO_SQARRAY
+#define IORING_SETUP_NO_SQARRAY	(1U << 16)
+#endif
+
+#define CDLP_MAX_RULES		64
+#define CDLP_MAX_FDS		65536
+#define CDLP_MAX_RINGS		64
+
+#define CDLP_IOPRIO_WHO_PROCESS		1
+#define CDLP_IOPRIO_CLASS_NONE		0
+#define CDLP_IOPRIO_CLASS_BE		2
+#define CDLP_IOPRIO_CLASS_SHIFT		13
+#define CDLP_IOPRIO_HINT_SHIFT		3
+#define CDLP_IOPRIO_HINT_MASK		(0x3ff << CDLP_IOPRIO_HINT_SHIFT)
+
+/*
+ * File descriptors table: the path rule matching a file is cached when the
+ * file is first used, together with a key identifying the file from its
+ * device and inode numbers. A cached rule is thus never used for another
+ * file reusing the file descriptor number, whichever way the previous file
+ * was closed. The low 8 bits of an entry hold the rule index + 2, or
+ * CDLP_FD_NO_RULE.
+ */
+#define CDLP_FD_NO_RULE		1
+#define CDLP_FD_RULE_MASK	0xffULL
+
+/*
+ * Thread rule states.
+ */
+#define CDLP_THREAD_UNKNOWN	-2
+#define CDLP_NO_RULE		-1
+
+enum cdlp_match {
+	CDLP_MATCH_PATH,
+	CDLP_MATCH_FD,
+	CDLP_MATCH_THREAD,
+};
+
+struct cdlp_rule {
+	unsigned int		line;
+	enum cdlp_match		match;
+	char			*value;
+	long			num;
+	char			*dev;
+	int			dld;
+
+	/* The rule applies to the directions its descriptor defines */
+	bool			valid;
+	bool			rw_valid[2];
+};
+
+/*
+ * io_uring ring set up with raw system calls.
+ */
+struct cdlp_ring {
+	int			fd;
+	unsigned int		flags;
+	struct io_sqring_offsets sq_off;
+	void			*sq_ring;
+	void			*sqes;
+};
+
+/*
+ * Beginning of the liburing 2.x struct io_uring, needed to find the SQEs
+ * prepared by the application and not yet submitted.
+ */
+struct cdlp_uring_sq {
+	unsigned int		*khead;
+	unsigned int		*ktail;
+	unsigned int		*kring_mask;
+	unsigned int		*kring_entries;
+	unsigned int		*kflags;
+	unsigned int		*kdropped;
+	unsigned int		*array;
+	struct io_uring_sqe	*sqes;
+	unsigned int		sqe_head;
+	unsigned int		sqe_tail;
+	size_t			ring_sz;
+	void			*ring_ptr;
+	unsigned int		ring_mask;
+	unsigned int		ring_entries;
+	unsigned int		pad[2];
+};
+
+struct cdlp_uring_cq {
+	unsigned int		*khead;
+	unsigned int		*ktail;
+	unsigned int		*kring_mask;
+	unsigned int		*kring_entries;
+	unsigned int		*kflags;
+	unsigned int		*koverflow;
+	struct io_uring_cqe	*cqes;
+	size_t			ring_sz;
+	void			*ring_ptr;
+	unsigned int		ring_mask;
+	unsigned int		ring_entries;
+	unsigned int		pad[2];
+};
+
+struct cdlp_uring {
+	struct cdlp_uring_sq	sq;
+	struct cdlp_uring_cq	cq;
+	unsigned int		flags;
+	int			ring_fd;
+};
+
+struct cdlp {
+	unsigned int		nr_rules;
+	struct cdlp_rule	rules[CDLP_MAX_RULES];
+	bool			has_fd_rules;
+	bool			has_path_rules;
+	bool			has_thread_rules;
+	uint64_t		fds[CDLP_MAX_FDS];
+
+	pthread_mutex_t		lock;
+	unsigned int		nr_rings;
+	struct cdlp_ring	rings[CDLP_MAX_RINGS];
+
+	struct cdlp_shm		*shm;
+	char			shm_name[64];
+	pid_t			shm_owner;
+};
+
+static struct cdlp cdlp = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread int cdlp_thread_rule = CDLP_THREAD_UNKNOWN;
+static __thread int cdlp_thread_ioprio = -1;
+
+/*
+ * Set while a liburing or libaio submission function is executed, so that
+ * the SQEs and iocbs already tagged by its wrapper are not tagged and
+ * counted again if the library submits them with the libc syscall().
+ */
+static __thread bool cdlp_in_submit;
+
+/*
+ * Functions intercepted.
+ */
+static ssize_t (*cdlp_real_pread)(int, void *, size_t, off_t);
+static ssize_t (*cdlp_real_pread64)(int, void *, size_t, off_t);
+static ssize_t (*cdlp_real_pwrite)(int, const void *, size_t, off_t);
+static ssize_t (*cdlp_real_pwrite64)(int, const void *, size_t, off_t);
+static ssize_t (*cdlp_real_preadv)(int, const struct iovec *, int, off_t);
+static ssize_t (*cdlp_real_preadv64)(int, const struct iovec *, int, off_t);
+static ssize_t (*cdlp_real_pwritev)(int, const struct iovec *, int, off_t);
+static ssize_t (*cdlp_real_pwritev64)(int, const struct iovec *, int,
+				      off_t);
+static ssize_t (*cdlp_real_preadv2)(int, const struct iovec *, int, off_t,
+				    int);
+static ssize_t (*cdlp_real_preadv64v2)(int, const struct iovec *, int, off_t,
+				       int);
+static ssize_t (*cdlp_real_pwritev2)(int, const struct iovec *, int, off_t,
+				     int);
+static ssize_t (*cdlp_real_pwritev64v2)(int, const struct iovec *, int,
+					off_t, int);
+static int (*cdlp_real_io_submit)(void *, long, struct iocb **);
+static int (*cdlp_real_io_uring_submit)(void *);
+static int (*cdlp_real_io_uring_submit_and_wait)(void *, unsigned int);
+static int (*cdlp_real_io_uring_submit_and_wait_timeout)(void *, void *,
+							  unsigned int,
+							  void *, void *);
+static int (*cdlp_real_io_uring_submit_and_get_events)(void *);
+static long (*cdlp_real_syscall)(long, ...);
+static void *(*cdlp_real_mmap)(void *, size_t, int, int, int, off_t);
+static void *(*cdlp_real_mmap64)(void *, size_t, int, int, int, off_t);
+static int (*cdlp_real_close)(int);
+
+static void *cdlp_sym(const char *name)
+{
+	void *sym = dlsym(RTLD_NEXT, name);
+
+	if (!sym)
+		fprintf(stderr, "libcdlpreload: %s not found\n", name);
+
+	return sym;
+}
+
+#define cdlp_real(func)						\
+	({								\
+		if (!cdlp_real_##func)					\
+			cdlp_real_##func = cdlp_sym(#func);		\
+		cdlp_real_##func;					\
+	})
+
+/*
+ * Get and set the I/O priority of the calling thread.
+ */
+static int cdlp_get_ioprio(void)
+{
+	if (cdlp_thread_ioprio < 0)
+		cdlp_thread_ioprio = cdlp_real(syscall)(SYS_ioprio_get,
+						CDLP_IOPRIO_WHO_PROCESS, 0);
+
+	return cdlp_thread_ioprio;
+}
+
+static int cdlp_set_ioprio(int ioprio)
+{
+	if (cdlp_real(syscall)(SYS_ioprio_set, CDLP_IOPRIO_WHO_PROCESS, 0,
+			       ioprio) < 0)
+		return -1;
+
+	cdlp_thread_ioprio = ioprio;
+
+	return 0;
+}
+
+/*
+ * Get the I/O priority of the calling thread with the hint of a descriptor,
+ * keeping the class and level of the thread I/O priority. The I/Os of a
+ * thread without an I/O priority class use the best-effort class with a
+ * level derived from the nice value of the thread, and the kernel ignores
+ * the hint of such thread: use this class and level explicitly.
+ */
+static int cdlp_ioprio(int dld)
+{
+	int ioprio = cdlp_get_ioprio();
+	int nice;
+
+	if (ioprio < 0)
+		ioprio = 0;
+
+	ioprio &= ~CDLP_IOPRIO_HINT_MASK;
+	if (!dld)
+		return ioprio;
+
+	if ((ioprio >> CDLP_IOPRIO_CLASS_SHIFT) == CDLP_IOPRIO_CLASS_NONE) {
+		errno = 0;
+		nice = getpriority(PRIO_PROCESS, 0);
+		if (errno)
+			nice = 0;
+		ioprio = (CDLP_IOPRIO_CLASS_BE << CDLP_IOPRIO_CLASS_SHIFT) |
+			((nice + 20) / 5);
+	}
+
+	return ioprio | (dld << CDLP_IOPRIO_HINT_SHIFT);
+}
+
+/*
+ * Check if a path is equal to a directory path or below it.
+ */
+static bool cdlp_path_below(const char *path, const char *dir)
+{
+	size_t len = strlen(dir);
+
+	while (len > 1 && dir[len - 1] == '/')
+		len--;
+
+	if (strncmp(path, dir, len) != 0)
+		return false;
+
+	return path[len] == '\0' || path[len] == '/' || len == 1;
+}
+
+/*
+ * Get the descriptor of a rule for I/Os of a direction.
+ */
+static int cdlp_rule_dld(int rule, enum cdl_rw rw)
+{
+	if (rule < 0 || !cdlp.rules[rule].rw_valid[rw])
+		return CDLP_NO_RULE;
+
+	return cdlp.rules[rule].dld;
+}
+
+/*
+ * Get the thread rule matching the calling thread. If the rule descriptor
+ * defines limits for both reads and writes, the I/O priority of the thread
+ * is set when the thread rule is found.
+ */
+static int cdlp_get_thread_rule(void)
+{
+	char comm[32];
+	struct cdlp_rule *r;
+	unsigned int i;
+	ssize_t len;
+	long tid;
+	int fd;
+
+	if (cdlp_thread_rule != CDLP_THREAD_UNKNOWN)
+		return cdlp_thread_rule;
+
+	cdlp_thread_rule = CDLP_NO_RULE;
+	if (!cdlp.has_thread_rules)
+		return cdlp_thread_rule;
+
+	tid = cdlp_real(syscall)(SYS_gettid);
+	comm[0] = '\0';
+	fd = open("/proc/thread-self/comm", O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		len = read(fd, comm, sizeof(comm) - 1);
+		cdlp_real(close)(fd);
+		comm[len > 0 ? len : 0] = '\0';
+		comm[strcspn(comm, "\n")] = '\0';
+	}
+
+	for (i = 0; i < cdlp.nr_rules; i++) {
+		r = &cdlp.rules[i];
+		if (!r->valid || r->match != CDLP_MATCH_THREAD)
+			continue;
+		if ((r->num >= 0 && r->num == tid) ||
+		    (r->num < 0 && strcmp(r->value, comm) == 0)) {
+			cdlp_thread_rule = i;
+			if (r->rw_valid[CDL_READ] && r->rw_valid[CDL_WRITE])
+				cdlp_set_ioprio(cdlp_ioprio(r->dld));
+			break;
+		}
+	}
+
+	return cdlp_thread_rule;
+}
+
+static int cdlp_get_fd_num_rule(int fd)
+{
+	struct cdlp_rule *r;
+	unsigned int i;
+
+	for (i = 0; i < cdlp.nr_rules; i++) {
+		r = &cdlp.rules[i];
+		if (r->valid && r->match == CDLP_MATCH_FD && r->num == fd)
+			return i;
+	}
+
+	return CDLP_NO_RULE;
+}
+
+static int cdlp_resolve_path_rule(int fd)
+{
+	char path[64], target[PATH_MAX];
+	struct cdlp_rule *r;
+	ssize_t len = -1;
+	unsigned int i;
+
+	for (i = 0; i < cdlp.nr_rules; i++) {
+		r = &cdlp.rules[i];
+		if (!r->valid || r->match != CDLP_MATCH_PATH)
+			continue;
+		if (len < 0) {
+			snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+			len = readlink(path, target, sizeof(target) - 1);
+			if (len <= 0)
+				return CDLP_NO_RULE;
+			target[len] = '\0';
+		}
+		if (cdlp_path_below(target, r->value))
+			return i;
+	}
+
+	return CDLP_NO_RULE;
+}
+
+/*
+ * Get the fd or path rule matching a file.
+ */
+static int cdlp_get_fd_rule(int fd)
+{
+	uint64_t key, v;
+	struct stat st;
+	int rule;
+
+	if (fd < 0)
+		return CDLP_NO_RULE;
+
+	if (cdlp.has_fd_rules) {
+		rule = cdlp_get_fd_num_rule(fd);
+		if (rule >= 0)
+			return rule;
+	}
+
+	if (!cdlp.has_path_rules || fstat(fd, &st))
+		return CDLP_NO_RULE;
+
+	if (fd >= CDLP_MAX_FDS)
+		return cdlp_resolve_path_rule(fd);
+
+	key = (((uint64_t)st.st_dev * 0x9e3779b97f4a7c15ULL) ^
+	       (uint64_t)st.st_ino) << 8;
+	v = __atomic_load_n(&cdlp.fds[fd], __ATOMIC_RELAXED);
+	if (v && (v & ~CDLP_FD_RULE_MASK) == key) {
+		v &= CDLP_FD_RULE_MASK;
+		return v == CDLP_FD_NO_RULE ? CDLP_NO_RULE : (int)v - 2;
+	}
+
+	rule = cdlp_resolve_path_rule(fd);
+	__atomic_store_n(&cdlp.fds[fd],
+			 key | (rule < 0 ? CDLP_FD_NO_RULE : rule + 2),
+			 __ATOMIC_RELAXED);
+
+	return rule;
+}
+
+/*
+ * Get the descriptor for I/Os of a direction to a file: the descriptor of
+ * the fd or path rule matching the file, or the descriptor of the thread
+ * rule matching the calling thread, if the rule descriptor defines a limit
+ * for the direction. Return CDLP_NO_RULE if no rule applies.
+ */
+static int cdlp_get_dld(int fd, enum cdl_rw rw)
+{
+	int thread_dld = cdlp_rule_dld(cdlp_get_thread_rule(), rw);
+	int dld = cdlp_rule_dld(cdlp_get_fd_rule(fd), rw);
+
+	return dld >= 0 ? dld : thread_dld;
+}
+
+static struct cdlp_stats *cdlp_stats(enum cdl_rw rw, int dld)
+{
+	if (!cdlp.shm)
+		return NULL;
+
+	return &cdlp.shm->stats[rw][dld > 0 ? dld : 0];
+}
+
+static void cdlp_count_async(enum cdlp_call call, enum cdl_rw rw, int dld)
+{
+	struct cdlp_stats *st = cdlp_stats(rw, dld);
+
+	if (st)
+		__atomic_fetch_add(&st->nr_ios[call], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Synchronous calls: the thread I/O priority is set to the hint of the
+ * descriptor for the duration of the call.
+ */
+struct cdlp_io {
+	int			dld;
+	int			prev_ioprio;
+	unsigned long long	start;
+};
+
+static void cdlp_sync_start(struct cdlp_io *io, enum cdl_rw rw, int fd)
+{
+	int ioprio, cur;
+
+	io->prev_ioprio = -1;
+	io->dld = cdlp_get_dld(fd, rw);
+	if (io->dld >= 0) {
+		ioprio = cdlp_ioprio(io->dld);
+		cur = cdlp_get_ioprio();
+		if (cur >= 0 && cur != ioprio && !cdlp_set_ioprio(ioprio))
+			io->prev_ioprio = cur;
+	}
+
+	io->start = cdl_now_ns();
+}
+
+static void cdlp_sync_end(struct cdlp_io *io, enum cdl_rw rw, ssize_t ret)
+{
+	unsigned long long lat = cdl_now_ns() - io->start;
+	struct cdlp_stats *st;
+	int err = errno;
+
+	if (io->prev_ioprio >= 0)
+		cdlp_set_ioprio(io->prev_ioprio);
+
+	st = cdlp_stats(rw, io->dld);
+	if (st) {
+		__atomic_fetch_add(&st->nr_ios[CDLP_CALL_SYNC], 1,
+				   __ATOMIC_RELAXED);
+		if (ret >= 0)
+			cdl_hist_add_atomic(&st->lat, lat);
+		else if (err == ETIME)
+			__atomic_fetch_add(&st->nr_limit, 1, __ATOMIC_RELAXED);
+		else
+			__atomic_fetch_add(&st->nr_errors, 1,
+					   __ATOMIC_RELAXED);
+	}
+
+	errno = err;
+}
+
+#define cdlp_sync_call(rw, fd, call)					\
+	({								\
+		struct cdlp_io __io;					\
+		ssize_t __ret;						\
+									\
+		cdlp_sync_start(&__io, rw, fd);				\
+		__ret = call;						\
+		cdlp_sync_end(&__io, rw, __ret);			\
+		__ret;							\
+	})
+
+ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+{
+	return cdlp_sync_call(CDL_READ, fd,
+		cdlp_real(pread)(fd, buf, count, offset));
+}
+
+ssize_t pread64(int fd, void *buf, size_t count, off_t offset)
+{
+	return cdlp_sync_call(CDL_READ, fd,
+		cdlp_real(pread64)(fd, buf, count, offset));
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+	return cdlp_sync_call(CDL_WRITE, fd,
+		cdlp_real(pwrite)(fd, buf, count, offset));
+}
+
+ssize_t pwrite64(int fd, const void *buf, size_t count, off_t offset)
+{
+	return cdlp_sync_call(CDL_WRITE, fd,
+		cdlp_real(pwrite64)(fd, buf, count, offset));
+}
+
+ssize_t preadv(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return cdlp_sync_call(CDL_READ, fd,
+		cdlp_real(preadv)(fd, iov, iovcnt, offset));
+}
+
+ssize_t preadv64(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return cdlp_sync_call(CDL_READ, fd,
+		cdlp_real(preadv64)(fd, iov, iovcnt, offset));
+}
+
+ssize_t pwritev(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return cdlp_sync_call(CDL_WRITE, fd,
+		cdlp_real(pwritev)(fd, iov, iovcnt, offset));
+}
+
+ssize_t pwritev64(int fd, const struct iovec *iov, int iovcnt, off_t offset)
+{
+	return cdlp_sync_call(CDL_WRITE, fd,
+		cdlp_real(pwritev64)(fd, iov, iovcnt, offset));
+}
+
+ssize_t preadv2(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+		int flags)
+{
+	return cdlp_sync_call(CDL_READ, fd,
+		cdlp_real(preadv2)(fd, iov, iovcnt, offset, flags));
+}
+
+ssize_t preadv64v2(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+		   int flags)
+{
+	return cdlp_sync_call(CDL_READ, fd,
+		cdlp_real(preadv64v2)(fd, iov, iovcnt, offset, flags));
+}
+
+ssize_t pwritev2(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+		 int flags)
+{
+	return cdlp_sync_call(CDL_WRITE, fd,
+		cdlp_real(pwritev2)(fd, iov, iovcnt, offset, flags));
+}
+
+ssize_t pwritev64v2(int fd, const struct iovec *iov, int iovcnt,
+		    off_t offset, int flags)
+{
+	return cdlp_sync_call(CDL_WRITE, fd,
+		cdlp_real(pwritev64v2)(fd, iov, iovcnt, offset, flags));
+}
+
+/*
+ * libaio submissions: set the I/O priority of read and write iocbs.
+ */
+static void cdlp_tag_iocbs(long nr, struct iocb **iocbs)
+{
+	struct iocb *iocb;
+	enum cdl_rw rw;
+	int dld;
+	long i;
+
+	for (i = 0; i < nr; i++) {
+		iocb = iocbs[i];
+		switch (iocb->aio_lio_opcode) {
+		case IOCB_CMD_PREAD:
+		case IOCB_CMD_PREADV:
+			rw = CDL_READ;
+			break;
+		case IOCB_CMD_PWRITE:
+		case IOCB_CMD_PWRITEV:
+			rw = CDL_WRITE;
+			break;
+		default:
+			continue;
+		}
+
+		if (iocb->aio_flags & IOCB_FLAG_IOPRIO) {
+			dld = CDLP_NO_RULE;
+		} else {
+			dld = cdlp_get_dld(iocb->aio_fildes, rw);
+			if (dld >= 0) {
+				iocb->aio_flags |= IOCB_FLAG_IOPRIO;
+				iocb->aio_reqprio = cdlp_ioprio(dld);
+			}
+		}
+
+		cdlp_count_async(CDLP_CALL_AIO, rw, dld);
+	}
+}
+
+int io_submit(void *ctx, long nr, struct iocb **iocbs)
+{
+	if (!cdlp_real(io_submit))
+		return -ENOSYS;
+
+	int ret;
+
+	if (nr > 0)
+		cdlp_tag_iocbs(nr, iocbs);
+
+	cdlp_in_submit = true;
+	ret = cdlp_real_io_submit(ctx, nr, iocbs);
+	cdlp_in_submit = false;
+
+	return ret;
+}
+
+/*
+ * io_uring submissions: set the I/O priority of read and write SQEs.
+ */
+static void cdlp_tag_sqe(struct io_uring_sqe *sqe)
+{
+	enum cdl_rw rw;
+	int dld;
+
+	switch (sqe->opcode) {
+	case IORING_OP_READV:
+	case IORING_OP_READ_FIXED:
+	case IORING_OP_READ:
+		rw = CDL_READ;
+		break;
+	case IORING_OP_WRITEV:
+	case IORING_OP_WRITE_FIXED:
+	case IORING_OP_WRITE:
+		rw = CDL_WRITE;
+		break;
+	default:
+		return;
+	}
+
+	if (sqe->ioprio) {
+		dld = CDLP_NO_RULE;
+	} else {
+		/* Registered files can only be matched with thread rules */
+		if (sqe->flags & IOSQE_FIXED_FILE)
+			dld = cdlp_rule_dld(cdlp_get_thread_rule(), rw);
+		else
+			dld = cdlp_get_dld(sqe->fd, rw);
+		if (dld >= 0)
+			sqe->ioprio = cdlp_ioprio(dld);
+	}
+
+	cdlp_count_async(CDLP_CALL_URING, rw, dld);
+}
+
+static void cdlp_tag_uring(void *ring)
+{
+	struct cdlp_uring *u = ring;
+	unsigned int i, mask = *u->sq.kring_mask;
+	unsigned int shift = u->flags & IORING_SETUP_SQE128 ? 1 : 0;
+
+	for (i = u->sq.sqe_head; i != u->sq.sqe_tail; i++)
+		cdlp_tag_sqe(&u->sq.sqes[(i & mask) << shift]);
+}
+
+#define cdlp_uring_submit(ring, call)					\
+	({								\
+		int __ret;						\
+									\
+		cdlp_tag_uring(ring);					\
+		cdlp_in_submit = true;					\
+		__ret = call;						\
+		cdlp_in_submit = false;					\
+		__ret;							\
+	})
+
+int io_uring_submit(void *ring)
+{
+	if (!cdlp_real(io_uring_submit))
+		return -ENOSYS;
+
+	return cdlp_uring_submit(ring, cdlp_real_io_uring_submit(ring));
+}
+
+int io_uring_submit_and_wait(void *ring, unsigned int wait_nr)
+{
+	if (!cdlp_real(io_uring_submit_and_wait))
+		return -ENOSYS;
+
+	return cdlp_uring_submit(ring,
+		cdlp_real_io_uring_submit_and_wait(ring, wait_nr));
+}
+
+int io_uring_submit_and_wait_timeout(void *ring, void *cqe_ptr,
+				     unsigned int wait_nr, void *ts,
+				     void *sigmask)
+{
+	if (!cdlp_real(io_uring_submit_and_wait_timeout))
+		return -ENOSYS;
+
+	return cdlp_uring_submit(ring,
+		cdlp_real_io_uring_submit_and_wait_timeout(ring, cqe_ptr,
+							   wait_nr, ts,
+							   sigmask));
+}
+
+int io_uring_submit_and_get_events(void *ring)
+{
+	if (!cdlp_real(io_uring_submit_and_get_events))
+		return -ENOSYS;
+
+	return cdlp_uring_submit(ring,
+		cdlp_real_io_uring_submit_and_get_events(ring));
+}
+
+/*
+ * Rings set up with raw system calls: the rings are tracked from their
+ * setup and mapping, and the SQEs not yet consumed by the kernel are tagged
+ * when io_uring_enter() is called. Rings using a kernel submission polling
+ * thread cannot be tagged.
+ */
+static struct cdlp_ring *cdlp_get_ring(int fd)
+{
+	unsigned int i;
+
+	for (i = 0; i < cdlp.nr_rings; i++) {
+		if (cdlp.rings[i].fd == fd)
+			return &cdlp.rings[i];
+	}
+
+	return NULL;
+}
+
+static void cdlp_add_ring(int fd, struct io_uring_params *p)
+{
+	struct cdlp_ring *ring;
+
+	pthread_mutex_lock(&cdlp.lock);
+	if (cdlp.nr_rings < CDLP_MAX_RINGS &&
+	    !(p->flags & IORING_SETUP_SQPOLL)) {
+		ring = &cdlp.rings[cdlp.nr_rings++];
+		memset(ring, 0, sizeof(struct cdlp_ring));
+		ring->fd = fd;
+		ring->flags = p->flags;
+		ring->sq_off = p->sq_off;
+	}
+	pthread_mutex_unlock(&cdlp.lock);
+}
+
+static void cdlp_map_ring(int fd, off_t offset, void *addr)
+{
+	struct cdlp_ring *ring;
+
+	pthread_mutex_lock(&cdlp.lock);
+	ring = cdlp_get_ring(fd);
+	if (ring) {
+		if (offset == IORING_OFF_SQ_RING)
+			ring->sq_ring = addr;
+		else if (offset == (off_t)IORING_OFF_SQES)
+			ring->sqes = addr;
+	}
+	pthread_mutex_unlock(&cdlp.lock);
+}
+
+static void cdlp_del_ring(int fd)
+{
+	struct cdlp_ring *ring;
+
+	pthread_mutex_lock(&cdlp.lock);
+	ring = cdlp_get_ring(fd);
+	if (ring)
+		*ring = cdlp.rings[--cdlp.nr_rings];
+	pthread_mutex_unlock(&cdlp.lock);
+}
+
+static void cdlp_tag_ring(int fd)
+{
+	unsigned int head, tail, mask, idx, shift;
+	struct io_uring_sqe *sqes;
+	struct cdlp_ring *ring;
+	unsigned int *array;
+	char *sq;
+
+	pthread_mutex_lock(&cdlp.lock);
+
+	ring = cdlp_get_ring(fd);
+	if (!ring || !ring->sq_ring || !ring->sqes)
+		goto out;
+
+	sq = ring->sq_ring;
+	sqes = ring->sqes;
+	shift = ring->flags & IORING_SETUP_SQE128 ? 1 : 0;
+	head = __atomic_load_n((unsigned int *)(sq + ring->sq_off.head),
+			       __ATOMIC_ACQUIRE);
+	tail = *(unsigned int *)(sq + ring->sq_off.tail);
+	mask = *(unsigned int *)(sq + ring->sq_off.ring_mask);
+	array = (unsigned int *)(sq + ring->sq_off.array);
+
+	for (; head != tail; head++) {
+		if (ring->flags & IORING_SETUP_NO_SQARRAY)
+			idx = head & mask;
+		else
+			idx = array[head & mask];
+		cdlp_tag_sqe(&sqes[idx << shift]);
+	}
+
+out:
+	pthread_mutex_unlock(&cdlp.lock);
+}
+
+long syscall(long number, ...)
+{
+	long a[6], ret;
+	va_list ap;
+	int i;
+
+	va_start(ap, number);
+	for (i = 0; i < 6; i++)
+		a[i] = va_arg(ap, long);
+	va_end(ap);
+
+	switch (cdlp_in_submit ? -1 : number) {
+	case SYS_io_submit:
+		if (a[1] > 0)
+			cdlp_tag_iocbs(a[1], (struct iocb **)a[2]);
+		break;
+	case SYS_io_uring_enter:
+		if (a[1] > 0)
+			cdlp_tag_ring(a[0]);
+		break;
+	default:
+		break;
+	}
+
+	ret = cdlp_real(syscall)(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+
+	if (number == SYS_io_uring_setup && ret >= 0)
+		cdlp_add_ring(ret, (struct io_uring_params *)a[1]);
+
+	/* The application changed an I/O priority: get it again when needed */
+	if (number == SYS_ioprio_set && ret >= 0)
+		cdlp_thread_ioprio = -1;
+
+	return ret;
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd,
+	   off_t offset)
+{
+	void *ret = cdlp_real(mmap)(addr, length, prot, flags, fd, offset);
+
+	if (ret != MAP_FAILED && fd >= 0 && cdlp.nr_rings)
+		cdlp_map_ring(fd, offset, ret);
+
+	return ret;
+}
+
+void *mmap64(void *addr, size_t length, int prot, int flags, int fd,
+	     off_t offset)
+{
+	void *ret = cdlp_real(mmap64)(addr, length, prot, flags, fd, offset);
+
+	if (ret != MAP_FAILED && fd >= 0 && cdlp.nr_rings)
+		cdlp_map_ring(fd, offset, ret);
+
+	return ret;
+}
+
+int close(int fd)
+{
+	if (cdlp.nr_rings)
+		cdlp_del_ring(fd);
+
+	return cdlp_real(close)(fd);
+}
+
+/*
+ * Check the descriptors of the rules against the pages of their device.
+ */
+static void cdlp_check_rules(void)
+{
+	struct cdlp_rule *r, *rj;
+	struct cdl_dev cdev;
+	unsigned int i, j;
+	int rw, ret;
+
+	for (i = 0; i < cdlp.nr_rules; i++) {
+		r = &cdlp.rules[i];
+		if (!r->dev)
+			continue;
+
+		memset(&cdev, 0, sizeof(struct cdl_dev));
+		cdev.path = r->dev;
+		cdev.fd = -1;
+		for (j = 0; j < CDL_CMD_MAX; j++)
+			cdev.cmd_cdlp[j] = CDLP_NONE;
+		for (j = 0; j < CDL_MAX_PAGES; j++)
+			cdev.cdl_pages[j].cdlp = CDLP_NONE;
+
+		ret = cdl_open_dev(&cdev, O_RDONLY, false);
+		if (!ret) {
+			if (cdev.flags & CDL_DEV_SUPPORTED)
+				ret = cdl_read_pages(&cdev);
+			else
+				ret = -1;
+			cdl_close_dev(&cdev);
+		}
+
+		/* Check all the rules using the same device */
+		for (j = i; j < cdlp.nr_rules; j++) {
+			rj = &cdlp.rules[j];
+			if (!rj->dev || strcmp(rj->dev, r->dev) != 0)
+				continue;
+
+			for (rw = CDL_READ; rw <= CDL_WRITE; rw++)
+				rj->rw_valid[rw] = !ret &&
+					(!rj->dld ||
+					 !cdl_check_dld(&cdev, rw, rj->dld));
+			rj->valid = rj->rw_valid[CDL_READ] ||
+				rj->rw_valid[CDL_WRITE];
+			if (ret)
+				fprintf(stderr,
+					"libcdlpreload: rule line %u: read "
+					"duration limits of %s failed, rule "
+					"disabled\n",
+					rj->line, r->dev);
+			else if (!rj->valid)
+				fprintf(stderr,
+					"libcdlpreload: rule line %u: "
+					"descriptor %d of %s does not define "
+					"a limit, rule disabled\n",
+					rj->line, rj->dld, r->dev);
+			else if (!rj->rw_valid[CDL_READ] ||
+				 !rj->rw_valid[CDL_WRITE])
+				fprintf(stderr,
+					"libcdlpreload: rule line %u: "
+					"descriptor %d of %s only defines a "
+					"%s limit, rule applied to %s only\n",
+					rj->line, rj->dld, r->dev,
+					rj->rw_valid[CDL_READ] ?
+					"read" : "write",
+					rj->rw_valid[CDL_READ] ?
+					"reads" : "writes");
+			if (j != i) {
+				free(rj->dev);
+				rj->dev = NULL;
+			}
+		}
+		free(r->dev);
+		r->dev = NULL;
+	}
+
+	for (i = 0; i < cdlp.nr_rules; i++) {
+		if (!cdlp.rules[i].valid)
+			continue;
+		if (cdlp.rules[i].match == CDLP_MATCH_THREAD)
+			cdlp.has_thread_rules = true;
+		else if (cdlp.rules[i].match == CDLP_MATCH_PATH)
+			cdlp.has_path_rules = true;
+		else if (cdlp.rules[i].match == CDLP_MATCH_FD)
+			cdlp.has_fd_rules = true;
+	}
+}
+
+static int cdlp_parse_rule(struct cdlp_rule *r, char *str)
+{
+	char *match, *value, *dev, *dld, *end, *save;
+	long val;
+
+	match = strtok_r(str, " \t", &save);
+	value = strtok_r(NULL, " \t", &save);
+	dev = strtok_r(NULL, " \t", &save);
+	dld = strtok_r(NULL, " \t", &save);
+	if (!match || !value || !dev || !dld ||
+	    strtok_r(NULL, " \t", &save))
+		return -EINVAL;
+
+	r->num = -1;
+	if (strcmp(match, "path") == 0) {
+		r->match = CDLP_MATCH_PATH;
+		if (value[0] != '/')
+			return -EINVAL;
+	} else if (strcmp(match, "fd") == 0) {
+		r->match = CDLP_MATCH_FD;
+		errno = 0;
+		r->num = strtol(value, &end, 10);
+		if (errno || end == value || *end || r->num < 0)
+			return -EINVAL;
+	} else if (strcmp(match, "thread") == 0) {
+		r->match = CDLP_MATCH_THREAD;
+		errno = 0;
+		val = strtol(value, &end, 10);
+		if (!errno && end != value && !*end && val > 0)
+			r->num = val;
+	} else {
+		return -EINVAL;
+	}
+
+	errno = 0;
+	val = strtol(dld, &end, 10);
+	if (errno || end == dld || *end || val < 0 || val > CDL_MAX_DESC)
+		return -EINVAL;
+	r->dld = val;
+
+	r->value = strdup(value);
+	r->dev = realpath(dev, NULL);
+	if (!r->value || !r->dev)
+		return -EINVAL;
+
+	return 0;
+}
+
+static void cdlp_free_rules(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < cdlp.nr_rules; i++) {
+		free(cdlp.rules[i].value);
+		free(cdlp.rules[i].dev);
+	}
+	cdlp.nr_rules = 0;
+}
+
+/*
+ * Load the rules file. On error, no rule is applied.
+ */
+static void cdlp_load_rules(const char *path)
+{
+	char line[CDL_LINE_MAX_LEN], *str;
+	unsigned int lineno = 0;
+	struct cdlp_rule *r;
+	FILE *f;
+
+	f = fopen(path, "re");
+	if (!f) {
+		fprintf(stderr, "libcdlpreload: open %s failed (%s)\n",
+			path, strerror(errno));
+		return;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+
+		str = line;
+		while (*str && (isblank(*str) || *str == '\n' || *str == '\r'))
+			str++;
+		if (!*str || *str == '#')
+			continue;
+		str[strcspn(str, "\r\n")] = '\0';
+
+		if (cdlp.nr_rules >= CDLP_MAX_RULES) {
+			fprintf(stderr, "libcdlpreload: too many rules\n");
+			goto err;
+		}
+
+		r = &cdlp.rules[cdlp.nr_rules++];
+		r->line = lineno;
+		if (cdlp_parse_rule(r, str)) {
+			fprintf(stderr,
+				"libcdlpreload: %s line %u: invalid rule\n",
+				path, lineno);
+			goto err;
+		}
+	}
+
+	fclose(f);
+
+	cdlp_check_rules();
+
+	return;
+
+err:
+	fprintf(stderr, "libcdlpreload: no rule applied\n");
+	fclose(f);
+	cdlp_free_rules();
+}
+
+/*
+ * Map the statistics shared memory: use the object created by cdlpreload
+ * if specified, or create an object for this process.
+ */
+static void cdlp_shm_init(void)
+{
+	const char *name = getenv(CDLP_ENV_SHM);
+	unsigned int i, nr_rules = 0, zero = 0;
+	struct cdlp_shm *shm;
+	bool create = !name;
+	int fd, rw, d;
+
+	if (create) {
+		snprintf(cdlp.shm_name, sizeof(cdlp.shm_name),
+			 CDLP_SHM_NAME, getpid());
+		fd = shm_open(cdlp.shm_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	} else {
+		fd = shm_open(name, O_RDWR, 0);
+	}
+	if (fd < 0) {
+		fprintf(stderr,
+			"libcdlpreload: open statistics shared memory failed "
+			"(%s)\n", strerror(errno));
+		return;
+	}
+
+	if (create && ftruncate(fd, sizeof(struct cdlp_shm)) < 0)
+		goto err;
+
+	shm = cdlp_real(mmap)(NULL, sizeof(struct cdlp_shm),
+			      PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED)
+		goto err;
+	cdlp_real(close)(fd);
+
+	if (create) {
+		shm->magic = CDLP_SHM_MAGIC;
+		shm->version = CDLP_SHM_VERSION;
+		shm->pid = getpid();
+		shm->start = cdl_now_ns();
+		for (rw = CDL_READ; rw <= CDL_WRITE; rw++)
+			for (d = 0; d <= CDL_MAX_DESC; d++)
+				cdl_hist_init(&shm->stats[rw][d].lat);
+		cdlp.shm_owner = getpid();
+	} else if (shm->magic != CDLP_SHM_MAGIC ||
+		   shm->version != CDLP_SHM_VERSION) {
+		munmap(shm, sizeof(struct cdlp_shm));
+		return;
+	}
+
+	for (i = 0; i < cdlp.nr_rules; i++)
+		nr_rules += cdlp.rules[i].valid;
+	__atomic_compare_exchange_n(&shm->nr_rules, &zero, nr_rules, false,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	cdlp.shm = shm;
+
+	return;
+
+err:
+	cdlp_real(close)(fd);
+	if (create)
+		shm_unlink(cdlp.shm_name);
+}
+
+__attribute__((constructor))
+static void cdlp_init(void)
+{
+	const char *rules = getenv(CDLP_ENV_RULES);
+
+	if (rules)
+		cdlp_load_rules(rules);
+	else
+		fprintf(stderr, "libcdlpreload: %s not set, "
+			"no rule applied\n", CDLP_ENV_RULES);
+
+	cdlp_shm_init();
+}
+
+__attribute__((destructor))
+static void cdlp_exit(void)
+{
+	/* Forked children share the statistics of their parent */
+	if (cdlp.shm && cdlp.shm_owner == getpid())
+		shm_unlink(cdlp.shm_name);
+}